@@ -0,0 +1,24 @@
+dnl * Linux io_uring, used via raw syscalls
+AC_DEFUN([DOVECOT_IO_URING], [
+  AC_CACHE_CHECK([whether we can use io_uring],i_cv_io_uring_works,[
+    AC_COMPILE_IFELSE([AC_LANG_PROGRAM([[
+      #include <linux/io_uring.h>
+      #include <sys/syscall.h>
+      #include <unistd.h>
+    ]], [[
+      struct io_uring_params params = { 0 };
+      struct io_uring_getevents_arg arg = { 0 };
+
+      (void)arg;
+      return syscall(__NR_io_uring_setup, 4, &params) < 0 ||
+        (params.features & IORING_FEAT_EXT_ARG) == 0;
+    ]])], [
+      i_cv_io_uring_works=yes
+    ], [
+      i_cv_io_uring_works=no
+    ])
+  ])
+  if test $i_cv_io_uring_works = yes; then
+    AC_DEFINE(HAVE_IO_URING,, [Define if you have Linux io_uring headers])
+  fi
+])
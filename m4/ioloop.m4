@@ -1,7 +1,18 @@
 dnl * I/O loop function
 AC_DEFUN([DOVECOT_IOLOOP], [
   have_ioloop=no
-  
+  have_ioloop_uring=no
+
+  if test "$ioloop" = "uring"; then
+    if test $i_cv_io_uring_works = no; then
+      AC_MSG_ERROR([uring ioloop requested but linux/io_uring.h is missing or too old])
+    fi
+    dnl * epoll is used as a fallback when io_uring is disabled at runtime
+    AC_DEFINE(IOLOOP_URING,, [Implement I/O loop with Linux io_uring])
+    have_ioloop_uring=yes
+    ioloop=epoll
+  fi
+
   if test "$ioloop" = "best" || test "$ioloop" = "epoll"; then
     AC_CACHE_CHECK([whether we can use epoll],i_cv_epoll_works,[
       AC_TRY_RUN([
@@ -26,6 +37,9 @@ AC_DEFUN([DOVECOT_IOLOOP], [
         AC_MSG_ERROR([epoll ioloop requested but epoll_create() is not available])
       fi
     fi
+    if test $have_ioloop_uring = yes; then
+      ioloop="uring (epoll fallback)"
+    fi
   fi
   
   if test "$ioloop" = "best" || test "$ioloop" = "kqueue"; then
@@ -109,6 +109,8 @@ dump_msg_hdr(struct istream *input, unsigned int hdr_size, uoff_t *msg_size_r)
 	if (memcmp(hdr.magic_pre, DBOX_MAGIC_PRE, sizeof(hdr.magic_pre)) != 0)
 		i_fatal("dbox wrong pre-magic at %"PRIuUOFF_T, input->v_offset);
 
+	if (hdr.type == DBOX_MESSAGE_TYPE_BODY_REF)
+		printf("msg.type = body-ref\n");
 	msg_size = dump_size(input, "msg.size",
 		t_strndup(hdr.message_size_hex, sizeof(hdr.message_size_hex)));
 
@@ -166,6 +168,9 @@ static void dump_msg_metadata(struct istream *input)
 		case DBOX_METADATA_ORIG_MAILBOX:
 			printf("msg.orig-mailbox = %s\n", line + 1);
 			break;
+		case DBOX_METADATA_BODY_REF:
+			printf("msg.body-ref = %s\n", line + 1);
+			break;
 
 		case DBOX_METADATA_OLDV1_EXPUNGED:
 		case DBOX_METADATA_OLDV1_FLAGS:
@@ -552,6 +552,10 @@ static void dump_cache(struct mail_cache_view *cache_view, unsigned int seq)
 		}
 
 		field = &cache_view->cache->fields[iter_field.field_idx].field;
+		if (mail_cache_lookup_iter_decompress(&iter, &iter_field) < 0) {
+			ret = -1;
+			break;
+		}
 		data = iter_field.data;
 		size = iter_field.size;
 
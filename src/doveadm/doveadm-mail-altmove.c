@@ -5,6 +5,7 @@
 #include "mail-index.h"
 #include "mail-storage.h"
 #include "mail-namespace.h"
+#include "index/dbox-common/dbox-tiering.h"
 #include "doveadm-mailbox-list-iter.h"
 #include "doveadm-mail-iter.h"
 #include "doveadm-mail.h"
@@ -12,8 +13,50 @@
 struct altmove_cmd_context {
 	struct doveadm_mail_cmd_context ctx;
 	bool reverse;
+	bool tiering;
 };
 
+static int
+cmd_altmove_box_tiering(struct doveadm_mail_cmd_context *ctx,
+			const struct mailbox_info *info,
+			struct mail_search_args *search_args)
+{
+	struct doveadm_mail_iter *iter;
+	struct mail *mail;
+	enum mail_error error;
+	int ret = 0;
+
+	if (doveadm_mail_iter_init(ctx, info, search_args,
+				   MAIL_FETCH_SAVE_DATE, NULL, 0, &iter) < 0)
+		return -1;
+
+	while (doveadm_mail_iter_next(iter, &mail)) {
+		switch (dbox_tiering_mail_move(mail)) {
+		case 1:
+			if (doveadm_debug) {
+				i_debug("altmove: box=%s uid=%u",
+					info->vname, mail->uid);
+			}
+			break;
+		case 0:
+			break;
+		default:
+			(void)mailbox_get_last_error(mail->box, &error);
+			if (error == MAIL_ERROR_EXPUNGED)
+				break;
+			i_error("altmove: box=%s uid=%u: %s",
+				info->vname, mail->uid,
+				mailbox_get_last_internal_error(mail->box, NULL));
+			doveadm_mail_failed_mailbox(ctx, mail->box);
+			ret = -1;
+			break;
+		}
+	}
+	if (doveadm_mail_iter_deinit_sync(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
 static int
 cmd_altmove_box(struct doveadm_mail_cmd_context *ctx,
 		const struct mailbox_info *info,
@@ -82,7 +125,12 @@ cmd_altmove_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 			prev_storage = ns_storage;
 			prev_ns = info->ns;
 		}
-		if (cmd_altmove_box(_ctx, info, _ctx->search_args, ctx->reverse) < 0)
+		if (ctx->tiering) {
+			if (cmd_altmove_box_tiering(_ctx, info,
+						    _ctx->search_args) < 0)
+				ret = -1;
+		} else if (cmd_altmove_box(_ctx, info, _ctx->search_args,
+					   ctx->reverse) < 0)
 			ret = -1;
 	} T_END;
 	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
@@ -115,12 +163,16 @@ cmd_altmove_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 	return ret;
 }
 
-static void cmd_altmove_init(struct doveadm_mail_cmd_context *ctx,
+static void cmd_altmove_init(struct doveadm_mail_cmd_context *_ctx,
 			     const char *const args[])
 {
+	struct altmove_cmd_context *ctx = (struct altmove_cmd_context *)_ctx;
+
 	if (args[0] == NULL)
 		doveadm_mail_help_name("altmove");
-	ctx->search_args = doveadm_mail_build_search_args(args);
+	if (ctx->reverse && ctx->tiering)
+		i_fatal_status(EX_USAGE, "altmove: -r and -t can't be used together");
+	_ctx->search_args = doveadm_mail_build_search_args(args);
 }
 
 static bool
@@ -132,6 +184,9 @@ cmd_mailbox_altmove_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
 	case 'r':
 		ctx->reverse = TRUE;
 		break;
+	case 't':
+		ctx->tiering = TRUE;
+		break;
 	default:
 		return FALSE;
 	}
@@ -143,7 +198,7 @@ static struct doveadm_mail_cmd_context *cmd_altmove_alloc(void)
 	struct altmove_cmd_context *ctx;
 
 	ctx = doveadm_mail_cmd_alloc(struct altmove_cmd_context);
-	ctx->ctx.getopt_args = "r";
+	ctx->ctx.getopt_args = "rt";
 	ctx->ctx.v.parse_arg = cmd_mailbox_altmove_parse_arg;
 	ctx->ctx.v.init = cmd_altmove_init;
 	ctx->ctx.v.run = cmd_altmove_run;
@@ -153,10 +208,11 @@ static struct doveadm_mail_cmd_context *cmd_altmove_alloc(void)
 struct doveadm_cmd_ver2 doveadm_cmd_altmove_ver2 = {
 	.name = "altmove",
 	.mail_cmd = cmd_altmove_alloc,
-	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-r] <search query>",
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-r | -t] <search query>",
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
 DOVEADM_CMD_PARAM('r', "reverse", CMD_PARAM_BOOL, 0)
+DOVEADM_CMD_PARAM('t', "tiering", CMD_PARAM_BOOL, 0)
 DOVEADM_CMD_PARAM('\0', "query", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 };
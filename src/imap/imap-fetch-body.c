@@ -1,6 +1,7 @@
 /* Copyright (c) 2002-2018 Dovecot authors, see the included COPYING file */
 
 #include "imap-common.h"
+#include "ioloop.h"
 #include "buffer.h"
 #include "str.h"
 #include "strescape.h"
@@ -98,6 +99,13 @@ static string_t *get_prefix(struct imap_fetch_state *state,
 	return str;
 }
 
+static void fetch_stream_input(struct imap_fetch_context *ctx)
+{
+	/* the asynchronous read finished - continue the command */
+	io_remove(&ctx->state.cur_input_io);
+	o_stream_set_flush_pending(ctx->client->output, TRUE);
+}
+
 static int fetch_stream_continue(struct imap_fetch_context *ctx)
 {
 	struct imap_fetch_state *state = &ctx->state;
@@ -105,6 +113,14 @@ static int fetch_stream_continue(struct imap_fetch_context *ctx)
 	uoff_t orig_input_offset = state->cur_input->v_offset;
 	enum ostream_send_istream_result res;
 
+	io_remove(&state->cur_input_io);
+	if (!state->cur_input_nonblocking &&
+	    i_stream_is_file_async(state->cur_input)) {
+		/* don't block the process while waiting for the disk */
+		i_stream_set_blocking(state->cur_input, FALSE);
+		state->cur_input_nonblocking = TRUE;
+	}
+
 	o_stream_set_max_buffer_size(ctx->client->output, 0);
 	res = o_stream_send_istream(ctx->client->output, state->cur_input);
 	o_stream_set_max_buffer_size(ctx->client->output, SIZE_MAX);
@@ -130,7 +146,10 @@ static int fetch_stream_continue(struct imap_fetch_context *ctx)
 		}
 		return 1;
 	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT:
-		i_unreached();
+		i_assert(state->cur_input_nonblocking);
+		state->cur_input_io = io_add_istream(state->cur_input,
+						     fetch_stream_input, ctx);
+		return 0;
 	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT:
 		return 0;
 	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT:
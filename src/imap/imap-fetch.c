@@ -3,6 +3,7 @@
 #include "imap-common.h"
 #include "array.h"
 #include "buffer.h"
+#include "ioloop.h"
 #include "istream.h"
 #include "ostream.h"
 #include "str.h"
@@ -436,6 +437,21 @@ static int imap_fetch_flush_buffer(struct imap_fetch_context *ctx)
 	return 0;
 }
 
+void imap_fetch_cur_input_unref(struct imap_fetch_context *ctx)
+{
+	struct imap_fetch_state *state = &ctx->state;
+
+	io_remove(&state->cur_input_io);
+	if (state->cur_input == NULL)
+		return;
+	if (state->cur_input_nonblocking) {
+		/* the mail's stream may still be used by others */
+		i_stream_set_blocking(state->cur_input, TRUE);
+		state->cur_input_nonblocking = FALSE;
+	}
+	i_stream_unref(&state->cur_input);
+}
+
 static int imap_fetch_send_nil_reply(struct imap_fetch_context *ctx)
 {
 	const struct imap_fetch_context_handler *handler;
@@ -516,8 +532,7 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 
 		state->cont_handler = NULL;
                 state->cur_handler++;
-		if (state->cur_input != NULL)
-			i_stream_unref(&state->cur_input);
+		imap_fetch_cur_input_unref(ctx);
 	}
 
 	handlers = array_get(&ctx->handlers, &count);
@@ -581,8 +596,7 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 			}
 
 			state->cont_handler = NULL;
-			if (state->cur_input != NULL)
-				i_stream_unref(&state->cur_input);
+			imap_fetch_cur_input_unref(ctx);
 		}
 
 		imap_fetch_fix_empty_reply(ctx);
@@ -666,7 +680,7 @@ int imap_fetch_end(struct imap_fetch_context *ctx)
 
 	str_free(&state->cur_str);
 
-	i_stream_unref(&state->cur_input);
+	imap_fetch_cur_input_unref(ctx);
 
 	if (state->search_ctx != NULL) {
 		if (mailbox_search_deinit(&state->search_ctx) < 0)
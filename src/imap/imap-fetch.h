@@ -58,6 +58,8 @@ struct imap_fetch_state {
 	string_t *cur_str;
 	size_t cur_str_prefix_size;
 	struct istream *cur_input;
+	/* waiting for an asynchronous read of cur_input to finish */
+	struct io *cur_input_io;
 	bool skip_cr;
 	int (*cont_handler)(struct imap_fetch_context *ctx);
 	uint64_t *cur_stats_sizep;
@@ -67,6 +69,8 @@ struct imap_fetch_state {
 	/* TRUE if the first FETCH parameter result hasn't yet been sent to
 	   the IMAP client. Note that this doesn't affect buffered content in
 	   cur_str until it gets flushed out. */
+	/* cur_input was switched to non-blocking mode by FETCH */
+	bool cur_input_nonblocking:1;
 	bool cur_first:1;
 	/* TRUE if the cur_str prefix has been flushed. More data may still
 	   be added to it. */
@@ -129,9 +133,12 @@ struct imap_fetch_context *
 imap_fetch_alloc(struct client *client, pool_t pool, const char *reason);
 void imap_fetch_free(struct imap_fetch_context **ctx);
 bool imap_fetch_init_handler(struct imap_fetch_init_context *init_ctx);
+
 void imap_fetch_init_nofail_handler(struct imap_fetch_context *ctx,
 				    bool (*init)(struct imap_fetch_init_context *));
 const struct imap_fetch_handler *imap_fetch_handler_lookup(const char *name);
+/* Stop waiting for cur_input and unreference it. */
+void imap_fetch_cur_input_unref(struct imap_fetch_context *ctx);
 
 void imap_fetch_begin(struct imap_fetch_context *ctx, struct mailbox *box,
 		      struct mail_search_args *search_args);
@@ -170,6 +170,21 @@ void indexer_queue_request_remove(struct indexer_queue *queue)
 	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
 }
 
+struct indexer_request *
+indexer_queue_request_remove_username(struct indexer_queue *queue,
+				      const char *username)
+{
+	struct indexer_request *request;
+
+	for (request = queue->head; request != NULL; request = request->next) {
+		if (strcmp(request->username, username) == 0) {
+			DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+			return request;
+		}
+	}
+	return NULL;
+}
+
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
 					     struct indexer_request *request,
 					     int percentage)
@@ -56,6 +56,12 @@ struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
 /* Remove the next request from the queue. You must call
    indexer_queue_request_finish() to free its memory. */
 void indexer_queue_request_remove(struct indexer_queue *queue);
+/* Remove the first request for the given username from the queue and return
+   it, or NULL if the user has no queued requests. You must call
+   indexer_queue_request_finish() to free its memory. */
+struct indexer_request *
+indexer_queue_request_remove_username(struct indexer_queue *queue,
+				      const char *username);
 /* Give a status update about how far the indexing is going on. */
 void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
@@ -52,7 +52,11 @@ static void queue_try_send_more(struct indexer_queue *queue)
 	while ((request = indexer_queue_request_peek(queue)) != NULL) {
 		conn = worker_pool_find_username_connection(worker_pool,
 							    request->username);
-		if (conn != NULL) {
+		if (conn != NULL && !worker_connection_is_busy(conn)) {
+			/* The worker has just finished a request for this
+			 * user. Reuse it, since it still has the user
+			 * initialized. */
+		} else if (conn != NULL) {
 			/* There is already a connection handling a request
 			 * for this user. Move the request to the back of the
 			 * queue and handle requests from other users.
@@ -94,8 +98,21 @@ worker_status_callback(int percentage, struct indexer_request *request)
 				     percentage == 100);
 }
 
-static void worker_avail_callback(void)
+static void worker_avail_callback(struct connection *conn)
 {
+	struct indexer_request *request;
+	const char *username;
+
+	if (conn != NULL) {
+		/* The worker finished a request and still has its user
+		   initialized. Prefer the same user's requests, even if
+		   they're not at the head of the queue. */
+		username = worker_connection_get_username(conn);
+		i_assert(username != NULL);
+		request = indexer_queue_request_remove_username(queue, username);
+		if (request != NULL)
+			worker_send_request(conn, request);
+	}
 	/* A new worker became available. Try to shrink the queue. */
 	queue_try_send_more(queue);
 }
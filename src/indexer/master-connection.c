@@ -31,6 +31,11 @@ struct master_connection {
 	struct connection conn;
 	struct mail_storage_service_ctx *storage_service;
 
+	/* The user is kept initialized between requests, since the indexer
+	   sends all of the user's queued mailboxes to the same connection. */
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+
 	bool version_received:1;
 };
 
@@ -242,15 +247,59 @@ index_mailbox(struct master_connection *conn, struct mail_user *user,
 	return ret;
 }
 
+static void master_connection_user_deinit(struct master_connection *conn)
+{
+	if (conn->user == NULL)
+		return;
+
+	/* refresh proctitle before a potentially long-running
+	   user unref */
+	indexer_worker_refresh_proctitle(conn->user->username, "(deinit)", 0, 0);
+	mail_user_deinit(&conn->user);
+	mail_storage_service_user_unref(&conn->service_user);
+	indexer_worker_refresh_proctitle(NULL, NULL, 0, 0);
+}
+
+static int
+master_connection_user_init(struct master_connection *conn,
+			    const char *username, const char *session_id)
+{
+	struct mail_storage_service_input input;
+	const char *error;
+
+	if (conn->user != NULL) {
+		if (strcmp(conn->user->username, username) == 0)
+			return 0;
+		master_connection_user_deinit(conn);
+	}
+
+	i_zero(&input);
+	input.module = "mail";
+	input.service = "indexer-worker";
+	input.username = username;
+	/* if session-id is given, use it as a prefix to a unique session ID.
+	   we can't use the session-id directly or stats process will complain
+	   about duplicates. (especially LMTP would use the same session-id for
+	   multiple users' indexing at the same time.) */
+	if (session_id[0] != '\0')
+		input.session_id_prefix = session_id;
+
+	if (mail_storage_service_lookup_next(conn->storage_service, &input,
+					     &conn->service_user, &conn->user,
+					     &error) <= 0) {
+		e_error(conn->conn.event, "User %s lookup failed: %s",
+			username, error);
+		return -1;
+	}
+	return 0;
+}
+
 static int
 master_connection_input_args(struct connection *_conn, const char *const *args)
 {
 	struct master_connection *conn =
 		container_of(_conn, struct master_connection, conn);
-	struct mail_storage_service_input input;
-	struct mail_storage_service_user *service_user;
-	struct mail_user *user;
-	const char *str, *error;
+	const char *str;
 	unsigned int max_recent_msgs;
 	int ret;
 
@@ -262,34 +311,18 @@ master_connection_input_args(struct connection *_conn, const char *const *args)
 		return -1;
 	}
 
-	i_zero(&input);
-	input.module = "mail";
-	input.service = "indexer-worker";
-	input.username = args[0];
-	/* if session-id is given, use it as a prefix to a unique session ID.
-	   we can't use the session-id directly or stats process will complain
-	   about duplicates. (especially LMTP would use the same session-id for
-	   multiple users' indexing at the same time.) */
-	if (args[2][0] != '\0')
-		input.session_id_prefix = args[2];
-
-	if (mail_storage_service_lookup_next(conn->storage_service, &input,
-					     &service_user, &user, &error) <= 0) {
-		e_error(conn->conn.event, "User %s lookup failed: %s", args[0], error);
+	if (master_connection_user_init(conn, args[0], args[2]) < 0)
 		ret = -1;
-	} else {
-		indexer_worker_refresh_proctitle(user->username, args[1], 0, 0);
+	else {
+		indexer_worker_refresh_proctitle(conn->user->username, args[1],
+						 0, 0);
 		struct event_reason *reason =
 			event_reason_begin("indexer:index_mailbox");
-		ret = index_mailbox(conn, user, args[1],
+		ret = index_mailbox(conn, conn->user, args[1],
 				    max_recent_msgs, args[4]);
 		event_reason_end(&reason);
-		/* refresh proctitle before a potentially long-running
-		   user unref */
-		indexer_worker_refresh_proctitle(user->username, "(deinit)", 0, 0);
-		mail_user_deinit(&user);
-		mail_storage_service_user_unref(&service_user);
-		indexer_worker_refresh_proctitle(NULL, NULL, 0, 0);
+		indexer_worker_refresh_proctitle(conn->user->username,
+						 "(idle)", 0, 0);
 	}
 
 	str = ret < 0 ? "-1\n" : "100\n";
@@ -299,6 +332,10 @@ master_connection_input_args(struct connection *_conn, const char *const *args)
 
 static void master_connection_destroy(struct connection *connection)
 {
+	struct master_connection *conn =
+		container_of(connection, struct master_connection, conn);
+
+	master_connection_user_deinit(conn);
 	connection_deinit(connection);
 	i_free(connection);
 	master_service_client_connection_destroyed(master_service);
@@ -0,0 +1,111 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "indexer-queue.h"
+#include "test-common.h"
+
+void indexer_refresh_proctitle(void)
+{
+}
+
+static void test_callback(int status ATTR_UNUSED, void *context ATTR_UNUSED)
+{
+}
+
+static void test_indexer_queue_remove_username(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue remove username");
+	queue = indexer_queue_init(test_callback);
+	indexer_queue_append(queue, TRUE, "user1", "INBOX", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "INBOX", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "Sent", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "Sent", NULL, 0, NULL);
+
+	/* user2's request is found, even though it's not at the head */
+	request = indexer_queue_request_remove_username(queue, "user2");
+	test_assert(request != NULL &&
+		    strcmp(request->username, "user2") == 0 &&
+		    strcmp(request->mailbox, "INBOX") == 0);
+	indexer_queue_request_work(request);
+	indexer_queue_request_finish(queue, &request, TRUE);
+
+	/* the rest of the queue keeps its order */
+	request = indexer_queue_request_peek(queue);
+	test_assert(request != NULL &&
+		    strcmp(request->username, "user1") == 0 &&
+		    strcmp(request->mailbox, "INBOX") == 0);
+
+	request = indexer_queue_request_remove_username(queue, "user2");
+	test_assert(request != NULL &&
+		    strcmp(request->mailbox, "Sent") == 0);
+	indexer_queue_request_work(request);
+	indexer_queue_request_finish(queue, &request, TRUE);
+
+	/* no more requests for user2 */
+	test_assert(indexer_queue_request_remove_username(queue, "user2") == NULL);
+	test_assert(indexer_queue_request_remove_username(queue, "user3") == NULL);
+	test_assert(indexer_queue_count(queue) == 2);
+
+	request = indexer_queue_request_remove_username(queue, "user1");
+	test_assert(request != NULL &&
+		    strcmp(request->mailbox, "INBOX") == 0);
+	indexer_queue_request_work(request);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	request = indexer_queue_request_peek(queue);
+	test_assert(request != NULL &&
+		    strcmp(request->mailbox, "Sent") == 0);
+
+	indexer_queue_cancel_all(queue);
+	test_assert(indexer_queue_is_empty(queue));
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_remove_username_working(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request, *request2;
+
+	test_begin("indexer queue remove username while working");
+	queue = indexer_queue_init(test_callback);
+	indexer_queue_append(queue, TRUE, "user1", "INBOX", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "Sent", NULL, 0, NULL);
+
+	request = indexer_queue_request_remove_username(queue, "user1");
+	test_assert(request != NULL);
+	indexer_queue_request_work(request);
+
+	/* a request for the mailbox being indexed isn't queued again */
+	indexer_queue_append(queue, TRUE, "user1", "INBOX", NULL, 0, NULL);
+	request2 = indexer_queue_request_remove_username(queue, "user1");
+	test_assert(request2 != NULL &&
+		    strcmp(request2->mailbox, "Sent") == 0);
+	test_assert(indexer_queue_request_remove_username(queue, "user1") == NULL);
+
+	indexer_queue_request_work(request2);
+	indexer_queue_request_finish(queue, &request2, TRUE);
+	/* the reindexed request goes back to the queue */
+	indexer_queue_request_finish(queue, &request, TRUE);
+	request = indexer_queue_request_remove_username(queue, "user1");
+	test_assert(request != NULL &&
+		    strcmp(request->mailbox, "INBOX") == 0);
+	indexer_queue_request_work(request);
+	indexer_queue_request_finish(queue, &request, TRUE);
+
+	test_assert(indexer_queue_count(queue) == 0);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_indexer_queue_remove_username,
+		test_indexer_queue_remove_username_working,
+		NULL
+	};
+	return test_run(test_functions);
+}
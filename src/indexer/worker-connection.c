@@ -52,7 +52,7 @@ void worker_connection_destroy(struct connection *conn)
 	i_free_and_null(worker->request_username);
 	connection_deinit(conn);
 
-	worker->avail_callback();
+	worker->avail_callback(NULL);
 	i_free(conn);
 }
 
@@ -95,8 +95,13 @@ worker_connection_input_args(struct connection *conn, const char *const *args)
 		ret = -1;
 
 	worker_connection_call_callback(worker, percentage);
+	if (worker->request == NULL && ret > 0) {
+		/* the worker still has the user initialized. give it the
+		   user's next queued request, if there is one. */
+		worker->avail_callback(conn);
+	}
 	if (worker->request == NULL) {
-		/* disconnect after each request */
+		/* disconnect, so the worker can be used for other users */
 		ret = -1;
 	}
 
@@ -108,6 +113,14 @@ bool worker_connection_is_connected(struct connection *conn)
 	return !conn->disconnected;
 }
 
+bool worker_connection_is_busy(struct connection *conn)
+{
+	struct worker_connection *worker =
+		container_of(conn, struct worker_connection, conn);
+
+	return worker->request != NULL;
+}
+
 unsigned int worker_connections_get_process_limit(void)
 {
 	return worker_last_process_limit;
@@ -120,6 +133,7 @@ void worker_connection_request(struct connection *conn,
 		container_of(conn, struct worker_connection, conn);
 
 	i_assert(worker_connection_is_connected(conn));
+	i_assert(!worker_connection_is_busy(conn));
 	i_assert(request->index || request->optimize);
 
 	if (worker->request_username == NULL)
@@ -3,10 +3,14 @@
 
 #include "indexer.h"
 
+struct connection;
 struct indexer_request;
 struct connection_list;
 
-typedef void worker_available_callback_t(void);
+/* Called when a worker slot becomes available. If conn is non-NULL, it's an
+   idle connection that still has its user initialized and can be given
+   another request for the same user. */
+typedef void worker_available_callback_t(struct connection *conn);
 
 struct connection *
 worker_connection_create(const char *socket_path,
@@ -20,17 +24,21 @@ struct connection_list *worker_connection_list_create(void);
 /* Returns TRUE if worker is connected to (not necessarily handshaked yet) */
 bool worker_connection_is_connected(struct connection *conn);
 
+/* Returns TRUE if worker is currently handling a request. */
+bool worker_connection_is_busy(struct connection *conn);
+
 /* Returns the last process_limit returned by a worker connection handshake.
    If no handshakes have been received yet, returns 0. */
 unsigned int worker_connections_get_process_limit(void);
 
 /* Send a new indexing request for username+mailbox. The status callback is
-   called as necessary. Requests can be queued, but only for the same
-   username. */
+   called as necessary. The connection must not be busy. After the request
+   is finished, the connection can be given more requests, but only for the
+   same username. The worker keeps the user initialized between them. */
 void worker_connection_request(struct connection *conn,
 			       struct indexer_request *request);
-/* Returns username of the currently pending requests,
-   or NULL if there are none. */
+/* Returns username of the requests handled by this connection,
+   or NULL if there haven't been any. */
 const char *worker_connection_get_username(struct connection *conn);
 
 #endif
@@ -55,6 +55,13 @@
 
    - When last_used becomes 60 days old (or 2*unaccessed_field_drop_secs) a
      TEMP caching decision is changed to NO.
+
+   If compression is enabled with mail_cache_set_compression(), the large
+   variable sized fields with YES decision are written compressed. These
+   stay in the cache file for a long time, so it's worth spending some CPU
+   on them. TEMP fields are soon dropped anyway, so they're written as-is.
+   If their decision is later changed to YES, they're compressed when the
+   cache is purged.
 */
 
 #include "lib.h"
@@ -92,6 +99,27 @@ mail_cache_update_last_used(struct mail_cache *cache, unsigned int field)
 		cache->field_header_write_pending = TRUE;
 }
 
+bool mail_cache_decision_want_compress(struct mail_cache *cache,
+				       unsigned int field, size_t size)
+{
+	const struct mail_cache_field *cache_field;
+	enum mail_cache_decision_type dec;
+
+	i_assert(field < cache->fields_count);
+
+	if (cache->compression.compress == NULL ||
+	    size < MAIL_CACHE_COMPRESS_MIN_SIZE)
+		return FALSE;
+
+	cache_field = &cache->fields[field].field;
+	if (cache_field->field_size != UINT_MAX) {
+		/* fixed size fields can't be compressed */
+		return FALSE;
+	}
+	dec = cache_field->decision & ENUM_NEGATE(MAIL_CACHE_DECISION_FORCED);
+	return dec == MAIL_CACHE_DECISION_YES;
+}
+
 void mail_cache_decision_state_update(struct mail_cache_view *view,
 				      uint32_t seq, unsigned int field)
 {
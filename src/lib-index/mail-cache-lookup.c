@@ -4,10 +4,17 @@
 #include "array.h"
 #include "buffer.h"
 #include "str.h"
+#include "sort.h"
+#include "mmap-util.h"
 #include "mail-cache-private.h"
 
+#include <fcntl.h>
 
 #define CACHE_PREFETCH IO_BLOCK_SIZE
+/* How many prev_offset links are followed by mail_cache_prefetch() */
+#define CACHE_PREFETCH_MAX_LEVELS 8
+/* Merge readahead ranges that are closer than this to each others */
+#define CACHE_PREFETCH_MERGE_GAP (CACHE_PREFETCH*4)
 
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r)
@@ -237,12 +244,14 @@ mail_cache_lookup_iter_next_record(struct mail_cache_lookup_iterate_ctx *ctx)
 
 static int
 mail_cache_lookup_rec_get_field(struct mail_cache_lookup_iterate_ctx *ctx,
-				unsigned int *field_idx_r)
+				unsigned int *field_idx_r, bool *compressed_r)
 {
 	struct mail_cache *cache = ctx->view->cache;
 	uint32_t file_field;
 
 	file_field = *((const uint32_t *)CONST_PTR_OFFSET(ctx->rec, ctx->pos));
+	*compressed_r = (file_field & MAIL_CACHE_FIELD_IDX_COMPRESSED) != 0;
+	file_field &= ~MAIL_CACHE_FIELD_IDX_COMPRESSED;
 	if (ctx->inmemory_field_idx) {
 		*field_idx_r = file_field;
 		return 0;
@@ -273,12 +282,14 @@ mail_cache_lookup_rec_get_field(struct mail_cache_lookup_iterate_ctx *ctx,
 	return 0;
 }
 
-int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
-				struct mail_cache_iterate_field *field_r)
+static int
+mail_cache_lookup_iter_next_field(struct mail_cache_lookup_iterate_ctx *ctx,
+				  struct mail_cache_iterate_field *field_r)
 {
 	struct mail_cache *cache = ctx->view->cache;
 	unsigned int field_idx;
 	unsigned int data_size;
+	bool compressed;
 	int ret;
 
 	i_assert(ctx->remap_counter == cache->remap_counter);
@@ -295,11 +306,17 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 	}
 
 	/* return the next field */
-	if (mail_cache_lookup_rec_get_field(ctx, &field_idx) < 0)
+	if (mail_cache_lookup_rec_get_field(ctx, &field_idx, &compressed) < 0)
 		return -1;
 	ctx->pos += sizeof(uint32_t);
 
 	data_size = cache->fields[field_idx].field.field_size;
+	if (compressed && data_size != UINT_MAX) {
+		mail_cache_set_corrupted(cache,
+			"fixed size field %s is compressed",
+			cache->fields[field_idx].field.name);
+		return -1;
+	}
 	if (data_size == UINT_MAX &&
 	    ctx->pos + sizeof(uint32_t) <= ctx->rec->size) {
 		/* variable size field. get its size from the file. */
@@ -318,16 +335,97 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 	field_r->data = CONST_PTR_OFFSET(ctx->rec, ctx->pos);
 	field_r->size = data_size;
 	field_r->offset = ctx->offset + ctx->pos;
+	field_r->compressed = compressed;
 
 	/* each record begins from 32bit aligned position */
 	ctx->pos += (data_size + sizeof(uint32_t)-1) & ~(sizeof(uint32_t)-1);
 	return 1;
 }
 
+int mail_cache_lookup_iter_decompress(struct mail_cache_lookup_iterate_ctx *ctx,
+				      struct mail_cache_iterate_field *field)
+{
+	struct mail_cache_view *view = ctx->view;
+	struct mail_cache *cache = view->cache;
+	const char *error;
+
+	if (!field->compressed)
+		return 0;
+	if (cache->compression.decompress == NULL) {
+		/* only with no_decompress=TRUE */
+		mail_cache_set_corrupted(cache,
+			"Can't decompress field %s: No decompressor set",
+			cache->fields[field->field_idx].field.name);
+		return -1;
+	}
+
+	if (view->decompress_buf == NULL)
+		view->decompress_buf = buffer_create_dynamic(default_pool, 1024);
+	else
+		buffer_set_used_size(view->decompress_buf, 0);
+
+	if (cache->compression.decompress(field->data, field->size,
+					  view->decompress_buf,
+					  cache->compression.context,
+					  &error) < 0) {
+		mail_cache_set_corrupted(cache,
+			"Failed to decompress field %s: %s",
+			cache->fields[field->field_idx].field.name, error);
+		return -1;
+	}
+	field->data = view->decompress_buf->data;
+	field->size = view->decompress_buf->used;
+	field->compressed = FALSE;
+	return 0;
+}
+
+int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
+				struct mail_cache_iterate_field *field_r)
+{
+	int ret;
+
+	while ((ret = mail_cache_lookup_iter_next_field(ctx, field_r)) > 0) {
+		if (!field_r->compressed || ctx->no_decompress ||
+		    ctx->view->cache->compression.decompress != NULL)
+			return 1;
+		/* we can't decompress the field - handle it as if it
+		   wasn't cached at all */
+	}
+	return ret;
+}
+
+void mail_cache_view_prefetch_reset(struct mail_cache_view *view)
+{
+	pool_unref(&view->prefetch_pool);
+	view->prefetch_seq1 = view->prefetch_seq2 = 0;
+}
+
+static const struct mail_cache_prefetch_field *
+mail_cache_prefetch_get(struct mail_cache_view *view, uint32_t seq,
+			unsigned int *count_r)
+{
+	const unsigned int *idx;
+
+	if (seq < view->prefetch_seq1 || seq > view->prefetch_seq2)
+		return NULL;
+	if (view->prefetch_log_file_head_seq != view->view->log_file_head_seq ||
+	    view->prefetch_log_file_head_offset !=
+	    view->view->log_file_head_offset) {
+		/* the view was synced - the sequences may have changed */
+		mail_cache_view_prefetch_reset(view);
+		return NULL;
+	}
+	idx = array_idx(&view->prefetch_mail_idx, seq - view->prefetch_seq1);
+	*count_r = idx[1] - idx[0];
+	return array_idx(&view->prefetch_fields, idx[0]);
+}
+
 static int mail_cache_seq(struct mail_cache_view *view, uint32_t seq)
 {
 	struct mail_cache_lookup_iterate_ctx iter;
 	struct mail_cache_iterate_field field;
+	const struct mail_cache_prefetch_field *pfields;
+	unsigned int i, count;
 	int ret;
 
 	view->cached_exists_value = (view->cached_exists_value + 1) & UINT8_MAX;
@@ -338,6 +436,16 @@ static int mail_cache_seq(struct mail_cache_view *view, uint32_t seq)
 	}
 	view->cached_exists_seq = seq;
 
+	pfields = mail_cache_prefetch_get(view, seq, &count);
+	if (pfields != NULL) {
+		for (i = 0; i < count; i++) {
+			buffer_write(view->cached_exists_buf,
+				     pfields[i].field_idx,
+				     &view->cached_exists_value, 1);
+		}
+		return 0;
+	}
+
 	mail_cache_lookup_iter_init(view, seq, &iter);
 	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 		buffer_write(view->cached_exists_buf, field.field_idx,
@@ -412,6 +520,50 @@ mail_cache_lookup_bitmask(struct mail_cache_lookup_iterate_ctx *iter,
 	return ret < 0 ? -1 : (found ? 1 : 0);
 }
 
+static bool
+mail_cache_prefetch_lookup_field(struct mail_cache_view *view,
+				 buffer_t *dest_buf, uint32_t seq,
+				 unsigned int field_idx)
+{
+	const struct mail_cache_field *field =
+		&view->cache->fields[field_idx].field;
+	const struct mail_cache_prefetch_field *pfields;
+	const unsigned char *src;
+	unsigned char *dest;
+	unsigned int i, j, count;
+	bool found = FALSE;
+
+	pfields = mail_cache_prefetch_get(view, seq, &count);
+	if (pfields == NULL)
+		return FALSE;
+
+	for (i = 0; i < count; i++) {
+		if (pfields[i].field_idx == field_idx)
+			break;
+	}
+	if (i == count || pfields[i].data == NULL)
+		return FALSE;
+
+	if (field->type != MAIL_CACHE_FIELD_BITMASK) {
+		buffer_append(dest_buf, pfields[i].data, pfields[i].size);
+		return TRUE;
+	}
+
+	/* merge the bits from all the records */
+	buffer_write_zero(dest_buf, 0, field->field_size);
+	for (; i < count; i++) {
+		if (pfields[i].field_idx != field_idx)
+			continue;
+		src = pfields[i].data;
+		dest = buffer_get_space_unsafe(dest_buf, 0, pfields[i].size);
+		for (j = 0; j < pfields[i].size; j++)
+			dest[j] |= src[j];
+		found = TRUE;
+	}
+	i_assert(found);
+	return TRUE;
+}
+
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx)
 {
@@ -424,6 +576,9 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	if (ret <= 0)
 		return ret;
 
+	if (mail_cache_prefetch_lookup_field(view, dest_buf, seq, field_idx))
+		return 1;
+
 	/* the field should exist */
 	mail_cache_lookup_iter_init(view, seq, &iter);
 	if (view->cache->fields[field_idx].field.type == MAIL_CACHE_FIELD_BITMASK) {
@@ -435,6 +590,9 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 		   they're all identical. */
 		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 			if (field.field_idx == field_idx) {
+				if (mail_cache_lookup_iter_decompress(&iter,
+								      &field) < 0)
+					return -1;
 				buffer_append(dest_buf, field.data, field.size);
 				break;
 			}
@@ -555,6 +713,10 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 		if (field.field_idx > max_field ||
 		    field_state[field.field_idx] != HDR_FIELD_STATE_WANT) {
 			/* a) don't want it, b) duplicate */
+		} else if (mail_cache_lookup_iter_decompress(&iter,
+							     &field) < 0) {
+			ret = -1;
+			break;
 		} else {
 			field_state[field.field_idx] = HDR_FIELD_STATE_SEEN;
 			header_lines_save(&ctx, &field);
@@ -619,6 +781,254 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 	return ret;
 }
 
+static bool
+mail_cache_prefetch_want(struct mail_cache *cache,
+			 const unsigned int field_idxs[],
+			 unsigned int fields_count)
+{
+	unsigned int i;
+
+	if (fields_count == 0)
+		return TRUE;
+	for (i = 0; i < fields_count; i++) {
+		if (field_idxs[i] < cache->fields_count &&
+		    cache->field_file_map[field_idxs[i]] != (uint32_t)-1)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+mail_cache_prefetch_range(struct mail_cache *cache, uoff_t start, uoff_t end)
+{
+	if (cache->mmap_base != NULL) {
+		/* the records beyond the mapped area get mapped later on
+		   anyway, so skip them here */
+		end = I_MIN(end, cache->mmap_length);
+		if (start >= end)
+			return;
+		start -= start % mmap_get_page_size();
+		if (madvise(PTR_OFFSET(cache->mmap_base, start), end - start,
+			    MADV_WILLNEED) < 0)
+			mail_cache_set_syscall_error(cache, "madvise()");
+		return;
+	}
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	if (cache->fd != -1) {
+		int ret = posix_fadvise(cache->fd, start, end - start,
+					POSIX_FADV_WILLNEED);
+		if (ret != 0) {
+			errno = ret;
+			mail_cache_set_syscall_error(cache, "posix_fadvise()");
+		}
+	}
+#endif
+}
+
+static void
+mail_cache_prefetch_offsets(struct mail_cache *cache,
+			    const ARRAY_TYPE(uint32_t) *offsets)
+{
+	const uint32_t *offsetp;
+	uoff_t start = 0, end = 0;
+
+	/* offsets are sorted - merge the nearby records into larger ranges
+	   to keep the number of syscalls low */
+	array_foreach(offsets, offsetp) {
+		if (end != 0 && *offsetp <= end + CACHE_PREFETCH_MERGE_GAP) {
+			end = I_MAX(end, (uoff_t)*offsetp + CACHE_PREFETCH);
+			continue;
+		}
+		if (end != 0)
+			mail_cache_prefetch_range(cache, start, end);
+		start = *offsetp;
+		end = start + CACHE_PREFETCH;
+	}
+	if (end != 0)
+		mail_cache_prefetch_range(cache, start, end);
+}
+
+static bool
+mail_cache_prefetch_field_wanted(struct mail_cache_view *view,
+				 unsigned int field_idx,
+				 const unsigned int field_idxs[],
+				 unsigned int fields_count)
+{
+	const struct mail_cache_prefetch_field *pfields;
+	unsigned int i, count, first_idx;
+
+	if (view->cache->fields[field_idx].field.type ==
+	    MAIL_CACHE_FIELD_HEADER) {
+		/* mail_cache_lookup_headers() doesn't use the prefetched
+		   fields */
+		return FALSE;
+	}
+	if (fields_count > 0) {
+		for (i = 0; i < fields_count; i++) {
+			if (field_idxs[i] == field_idx)
+				break;
+		}
+		if (i == fields_count)
+			return FALSE;
+	}
+	if (view->cache->fields[field_idx].field.type ==
+	    MAIL_CACHE_FIELD_BITMASK)
+		return TRUE;
+
+	/* the other fields are identical in all records, so keep only the
+	   first one */
+	first_idx = *array_back(&view->prefetch_mail_idx);
+	pfields = array_get(&view->prefetch_fields, &count);
+	for (i = first_idx; i < count; i++) {
+		if (pfields[i].field_idx == field_idx && pfields[i].data != NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+mail_cache_prefetch_decode(struct mail_cache_view *view,
+			   uint32_t seq1, uint32_t seq2,
+			   const unsigned int field_idxs[],
+			   unsigned int fields_count)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_prefetch_field *pfield;
+	unsigned int idx;
+	uint32_t seq;
+	int ret = 0;
+
+	view->prefetch_pool = pool_alloconly_create("mail cache prefetch",
+						    4096);
+	p_array_init(&view->prefetch_fields, view->prefetch_pool, 64);
+	p_array_init(&view->prefetch_mail_idx, view->prefetch_pool,
+		     seq2 - seq1 + 2);
+
+	for (seq = seq1; seq <= seq2 && ret == 0; seq++) {
+		idx = array_count(&view->prefetch_fields);
+		array_push_back(&view->prefetch_mail_idx, &idx);
+
+		mail_cache_lookup_iter_init(view, seq, &iter);
+		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+			pfield = array_append_space(&view->prefetch_fields);
+			pfield->field_idx = field.field_idx;
+			if (!mail_cache_prefetch_field_wanted(view,
+					field.field_idx, field_idxs,
+					fields_count))
+				continue;
+			if (mail_cache_lookup_iter_decompress(&iter,
+							      &field) < 0) {
+				ret = -1;
+				break;
+			}
+			pfield->data = p_memdup(view->prefetch_pool,
+						field.data, field.size);
+			pfield->size = field.size;
+		}
+	}
+	if (ret < 0) {
+		mail_cache_view_prefetch_reset(view);
+		return -1;
+	}
+	idx = array_count(&view->prefetch_fields);
+	array_push_back(&view->prefetch_mail_idx, &idx);
+
+	view->prefetch_seq1 = seq1;
+	view->prefetch_seq2 = seq2;
+	view->prefetch_log_file_head_seq = view->view->log_file_head_seq;
+	view->prefetch_log_file_head_offset = view->view->log_file_head_offset;
+	return 0;
+}
+
+static int
+mail_cache_prefetch_real(struct mail_cache_view *view,
+			 uint32_t seq1, uint32_t seq2)
+{
+	struct mail_cache *cache = view->cache;
+	ARRAY_TYPE(uint32_t) offsets, next_offsets, tmp;
+	const struct mail_cache_record *rec;
+	const uint32_t *offsetp;
+	uint32_t seq, offset;
+	unsigned int level;
+	int ret;
+
+	t_array_init(&offsets, seq2 - seq1 + 1);
+	t_array_init(&next_offsets, seq2 - seq1 + 1);
+	for (seq = seq1; seq <= seq2; seq++) {
+		ret = mail_cache_lookup_offset(cache, view->view, seq, &offset);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			array_push_back(&offsets, &offset);
+	}
+
+	for (level = 0; level < CACHE_PREFETCH_MAX_LEVELS; level++) {
+		/* the cache may have been reopened while looking up the
+		   offsets */
+		if (array_count(&offsets) == 0 ||
+		    MAIL_CACHE_IS_UNUSABLE(cache))
+			break;
+
+		array_sort(&offsets, uint32_cmp);
+		mail_cache_prefetch_offsets(cache, &offsets);
+
+		/* read the records in file order. the prev_offsets always
+		   point backwards in the file, which also protects against
+		   looping. */
+		array_clear(&next_offsets);
+		array_foreach(&offsets, offsetp) {
+			if (mail_cache_get_record(cache, *offsetp, &rec) < 0)
+				return -1;
+			if (rec->prev_offset != 0 &&
+			    rec->prev_offset < *offsetp)
+				array_push_back(&next_offsets, &rec->prev_offset);
+		}
+		tmp = offsets;
+		offsets = next_offsets;
+		next_offsets = tmp;
+	}
+	return 0;
+}
+
+int mail_cache_prefetch(struct mail_cache_view *view,
+			uint32_t seq1, uint32_t seq2,
+			const unsigned int field_idxs[],
+			unsigned int fields_count)
+{
+	struct mail_cache *cache = view->cache;
+	uint32_t messages_count;
+	int ret;
+
+	i_assert(seq1 > 0);
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (MAIL_CACHE_IS_UNUSABLE(cache) || cache->map_with_read)
+		return 0;
+	if (!mail_cache_prefetch_want(cache, field_idxs, fields_count))
+		return 0;
+
+	messages_count = mail_index_view_get_messages_count(view->view);
+	if (seq2 > messages_count)
+		seq2 = messages_count;
+	if (seq1 > seq2)
+		return 0;
+
+	mail_cache_view_prefetch_reset(view);
+	T_BEGIN {
+		ret = mail_cache_prefetch_real(view, seq1, seq2);
+	} T_END;
+	if (ret == 0) {
+		ret = mail_cache_prefetch_decode(view, seq1, seq2,
+						 field_idxs, fields_count);
+	}
+	/* mail_cache_field_exists() may have cached the old state */
+	view->cached_exists_seq = 0;
+	return ret;
+}
+
 static uint32_t
 mail_cache_get_highest_seq_with_cache(struct mail_cache_view *view,
 				      uint32_t below_seq, uint32_t *reset_id_r)
@@ -13,6 +13,12 @@
 
 #define MAIL_CACHE_MAX_WRITE_BUFFER (1024*256)
 
+/* Set to the field index in cache records when the field's data has been
+   compressed with mail_cache_compression.compress(). */
+#define MAIL_CACHE_FIELD_IDX_COMPRESSED 0x80000000U
+/* Don't try to compress field data smaller than this */
+#define MAIL_CACHE_COMPRESS_MIN_SIZE 256
+
 #define MAIL_CACHE_IS_UNUSABLE(cache) \
 	((cache)->hdr == NULL)
 
@@ -58,6 +64,17 @@ struct mail_cache_header {
 	uint32_t field_header_offset;
 };
 
+/* Header for the "cache-purge" index extension. The incremental purge
+   progress is kept only in the memory of the process doing it, so this is
+   used to notice when the purges keep getting restarted by new processes
+   without ever finishing. */
+struct mail_cache_purge_incr_header {
+	/* Cache file_seq that the incremental purges were started for */
+	uint32_t file_seq;
+	/* Number of incremental purges started for file_seq */
+	uint32_t start_count;
+};
+
 struct mail_cache_header_fields {
 	/* Offset to the updated version of this header. Use
 	   mail_index_offset_to_uint32() to decode it. */
@@ -101,7 +118,10 @@ struct mail_cache_header_fields {
 struct mail_cache_record {
 	uint32_t prev_offset;
 	uint32_t size; /* full record size, including this header */
-	/* array of { uint32_t field; [ uint32_t size; ] { .. } } */
+	/* array of { uint32_t field; [ uint32_t size; ] { .. } }
+	   If field has MAIL_CACHE_FIELD_IDX_COMPRESSED set, the data is
+	   compressed and the size is the compressed size. Only variable sized
+	   fields can be compressed. */
 };
 
 struct mail_cache_field_private {
@@ -126,6 +146,8 @@ struct mail_cache {
 	struct event *event;
 	/* Registered "cache" extension ID */
 	uint32_t ext_id;
+	/* Registered "cache-purge" extension ID */
+	uint32_t purge_ext_id;
 
 	char *filepath;
 	int fd;
@@ -195,6 +217,15 @@ struct mail_cache {
 	uint32_t need_purge_file_seq;
 	/* Human-readable reason for purging. Used for debugging and events. */
 	char *need_purge_reason;
+	/* Unfinished incremental purge, continued on the next index sync. */
+	struct mail_cache_purge_incr *purge_incr;
+
+	/* Set by mail_cache_set_compression(). decompress=NULL if compressed
+	   fields can't be read. */
+	struct mail_cache_compression compression;
+	/* Number of mail_cache_set_compression() calls not yet paired with
+	   mail_cache_unset_compression() */
+	unsigned int compression_refcount;
 
 	/* Cache has been opened (or it doesn't exist). */
 	bool opened:1;
@@ -236,6 +267,13 @@ struct mail_cache_missing_reason_cache {
 	uoff_t log_file_head_offset;
 };
 
+struct mail_cache_prefetch_field {
+	unsigned int field_idx;
+	/* NULL if the field exists, but its data wasn't wanted */
+	const void *data;
+	size_t size;
+};
+
 struct mail_cache_view {
 	struct mail_cache *cache;
 	struct mail_cache_view *prev, *next;
@@ -264,6 +302,20 @@ struct mail_cache_view {
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
 
+	/* Decompressed data of the last returned compressed field */
+	buffer_t *decompress_buf;
+
+	/* Fields decoded by mail_cache_prefetch() for messages
+	   prefetch_seq1..prefetch_seq2. The fields of seq begin at
+	   prefetch_fields[prefetch_mail_idx[seq - prefetch_seq1]]. They're
+	   valid only as long as the index view's log head hasn't changed. */
+	pool_t prefetch_pool;
+	ARRAY(struct mail_cache_prefetch_field) prefetch_fields;
+	ARRAY(unsigned int) prefetch_mail_idx;
+	uint32_t prefetch_seq1, prefetch_seq2;
+	uint32_t prefetch_log_file_head_seq;
+	uoff_t prefetch_log_file_head_offset;
+
 	/* mail_cache_view_update_cache_decisions() has been used to disable
 	   updating cache decisions. */
 	bool no_decision_updates:1;
@@ -279,6 +331,9 @@ struct mail_cache_iterate_field {
 	const void *data;
 	/* Offset to data in cache file */
 	uoff_t offset;
+	/* The data is still compressed. Use mail_cache_lookup_iter_decompress()
+	   to get the uncompressed data. */
+	bool compressed;
 };
 
 struct mail_cache_lookup_iterate_ctx {
@@ -324,6 +379,9 @@ struct mail_cache_lookup_iterate_ctx {
 	   This indicates that the rec points to uncommited transaction's
 	   in-memory buffer. */
 	bool inmemory_field_idx:1;
+	/* Return also the compressed fields that can't be decompressed,
+	   because no decompress() function is set. */
+	bool no_decompress:1;
 };
 
 /* Explicitly lock the cache file. Returns -1 if error / timed out,
@@ -359,13 +417,24 @@ uint32_t mail_cache_get_first_new_seq(struct mail_index_view *view);
 bool mail_cache_track_loops(struct mail_cache_loop_track *loop_track,
 			    uoff_t offset, uoff_t size);
 
+/* Forget the fields decoded by mail_cache_prefetch(). */
+void mail_cache_view_prefetch_reset(struct mail_cache_view *view);
+
 /* Iterate through a message's cached fields. */
 void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
 				 struct mail_cache_lookup_iterate_ctx *ctx_r);
 /* Returns 1 if field was returned, 0 if end of fields, or -1 if error.
-   Note that this may trigger re-reading and reallocating cache fields. */
+   Note that this may trigger re-reading and reallocating cache fields.
+   Compressed fields are returned with compressed=TRUE. They're decompressed
+   only by mail_cache_lookup_iter_decompress(), so that the fields the
+   caller isn't interested in don't need to be decompressed. */
 int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 				struct mail_cache_iterate_field *field_r);
+/* Decompress the field returned by mail_cache_lookup_iter_next(), if it's
+   compressed. The decompressed data is valid only until the next call.
+   Returns 0 if ok, -1 if the data is corrupted. */
+int mail_cache_lookup_iter_decompress(struct mail_cache_lookup_iterate_ctx *ctx,
+				      struct mail_cache_iterate_field *field);
 const struct mail_cache_record *
 mail_cache_transaction_lookup_rec(struct mail_cache_transaction_ctx *ctx,
 				  unsigned int seq,
@@ -391,6 +460,14 @@ int mail_cache_sync_reset_id(struct mail_cache *cache);
 void mail_cache_decision_state_update(struct mail_cache_view *view,
 				      uint32_t seq, unsigned int field);
 const char *mail_cache_decision_to_string(enum mail_cache_decision_type dec);
+/* Returns TRUE if field's data of the given size should be written
+   compressed. */
+bool mail_cache_decision_want_compress(struct mail_cache *cache,
+				       unsigned int field, size_t size);
+/* Compress field's data into dest, if it's wanted and useful. Returns TRUE
+   if dest contains the compressed data. */
+bool mail_cache_field_compress(struct mail_cache *cache, unsigned int field,
+			       const void *data, size_t size, buffer_t *dest);
 struct event_passthrough *
 mail_cache_decision_changed_event(struct mail_cache *cache, struct event *event,
 				  unsigned int field);
@@ -405,6 +482,9 @@ enum mail_cache_purge_drop_decision {
 	MAIL_CACHE_PURGE_DROP_DECISION_DROP,
 	MAIL_CACHE_PURGE_DROP_DECISION_TO_TEMP,
 };
+/* Free the unfinished incremental purge, if any. */
+void mail_cache_purge_incremental_free(struct mail_cache *cache);
+
 void mail_cache_purge_drop_init(struct mail_cache *cache,
 				const struct mail_index_header *hdr,
 				struct mail_cache_purge_drop_ctx *ctx_r);
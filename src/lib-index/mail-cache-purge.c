@@ -8,17 +8,27 @@
 #include "file-dotlock.h"
 #include "file-cache.h"
 #include "file-set-size.h"
+#include "hostpid.h"
 #include "mail-cache-private.h"
 
 #include <stdio.h>
+#include <signal.h>
+#include <dirent.h>
 #include <sys/stat.h>
 
+/* Do a full purge instead if this many incremental purges were started for
+   the same cache file without any of them finishing. */
+#define MAIL_CACHE_PURGE_INCREMENTAL_MAX_STARTS 3
+/* Unlink other hosts' incremental purge temp files after this many seconds
+   of not being written to. */
+#define MAIL_CACHE_PURGE_INCREMENTAL_STALE_SECS (60*60*24)
+
 struct mail_cache_copy_context {
 	struct mail_cache *cache;
 	struct event *event;
 	struct mail_cache_purge_drop_ctx drop_ctx;
 
-	buffer_t *buffer, *field_seen;
+	buffer_t *buffer, *field_seen, *compress_buf;
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
 
@@ -26,6 +36,8 @@ struct mail_cache_copy_context {
 	bool new_msg;
 };
 
+static void mail_cache_purge_incremental_abort(struct mail_cache *cache);
+
 static void
 mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 			 const struct mail_cache_iterate_field *field)
@@ -52,6 +64,8 @@ mail_cache_purge_field(struct mail_cache_copy_context *ctx,
 	enum mail_cache_decision_type dec;
 	uint32_t file_field_idx, size32;
 	uint8_t *field_seen;
+	const void *data = field->data;
+	size_t size = field->size;
 
 	file_field_idx = ctx->field_file_map[field->field_idx];
 	if (file_field_idx == (uint32_t)-1)
@@ -78,10 +92,20 @@ mail_cache_purge_field(struct mail_cache_copy_context *ctx,
 			return;
 	}
 
+	/* compressed fields are copied as-is. the others are compressed now
+	   if their decision has changed to YES since they were added. */
+	if (field->compressed)
+		file_field_idx |= MAIL_CACHE_FIELD_IDX_COMPRESSED;
+	else if (mail_cache_field_compress(ctx->cache, field->field_idx,
+					   data, size, ctx->compress_buf)) {
+		data = ctx->compress_buf->data;
+		size = ctx->compress_buf->used;
+		file_field_idx |= MAIL_CACHE_FIELD_IDX_COMPRESSED;
+	}
 	buffer_append(ctx->buffer, &file_field_idx, sizeof(file_field_idx));
 
 	if (cache_field->field_size == UINT_MAX) {
-		size32 = (uint32_t)field->size;
+		size32 = (uint32_t)size;
 		buffer_append(ctx->buffer, &size32, sizeof(size32));
 	}
 
@@ -91,9 +115,9 @@ mail_cache_purge_field(struct mail_cache_copy_context *ctx,
 
 		array_idx_set(&ctx->bitmask_pos, field->field_idx, &pos);
 	}
-	buffer_append(ctx->buffer, field->data, field->size);
-	if ((field->size & 3) != 0)
-		buffer_append_zero(ctx->buffer, 4 - (field->size & 3));
+	buffer_append(ctx->buffer, data, size);
+	if ((size & 3) != 0)
+		buffer_append_zero(ctx->buffer, 4 - (size & 3));
 }
 
 static uint32_t get_next_file_seq(struct mail_cache *cache)
@@ -198,6 +222,146 @@ mail_cache_purge_check_field(struct mail_cache_copy_context *ctx,
 	return priv->used;
 }
 
+static void
+mail_cache_copy_init(struct mail_cache_copy_context *ctx,
+		     struct mail_cache *cache, struct event *event,
+		     const struct mail_index_header *idx_hdr,
+		     unsigned int *used_fields_count_r)
+{
+	unsigned int i, used_fields_count;
+
+	i_zero(ctx);
+	ctx->cache = cache;
+	ctx->event = event;
+	ctx->buffer = buffer_create_dynamic(default_pool, 4096);
+	ctx->field_seen = buffer_create_dynamic(default_pool, 64);
+	ctx->compress_buf = buffer_create_dynamic(default_pool, 1024);
+	ctx->field_seen_value = 0;
+	ctx->field_file_map = i_new(uint32_t, cache->fields_count + 1);
+	i_array_init(&ctx->bitmask_pos, 32);
+
+	/* @UNSAFE: drop unused fields and create a field mapping for
+	   used fields */
+	mail_cache_purge_drop_init(cache, idx_hdr, &ctx->drop_ctx);
+
+	if (cache->file_fields_count == 0) {
+		/* creating the initial cache file. add all fields. */
+		for (i = 0; i < cache->fields_count; i++)
+			ctx->field_file_map[i] = i;
+		used_fields_count = i;
+	} else {
+		for (i = used_fields_count = 0; i < cache->fields_count; i++) {
+			if (!mail_cache_purge_check_field(ctx, i))
+				ctx->field_file_map[i] = (uint32_t)-1;
+			else
+				ctx->field_file_map[i] = used_fields_count++;
+		}
+	}
+	*used_fields_count_r = used_fields_count;
+}
+
+static void mail_cache_copy_deinit(struct mail_cache_copy_context *ctx)
+{
+	buffer_free(&ctx->buffer);
+	buffer_free(&ctx->field_seen);
+	buffer_free(&ctx->compress_buf);
+	array_free(&ctx->bitmask_pos);
+	i_free(ctx->field_file_map);
+}
+
+/* Write the mail's merged cache record to output. Returns the record's
+   offset, or 0 if nothing was written. */
+static uint32_t
+mail_cache_copy_mail(struct mail_cache_copy_context *ctx,
+		     struct mail_cache_view *cache_view, uint32_t seq,
+		     struct ostream *output)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_record cache_rec;
+	uint32_t ext_offset;
+
+	buffer_set_used_size(ctx->buffer, 0);
+
+	ctx->field_seen_value = (ctx->field_seen_value + 1) & UINT8_MAX;
+	if (ctx->field_seen_value == 0) {
+		memset(buffer_get_modifiable_data(ctx->field_seen, NULL),
+		       0, buffer_get_size(ctx->field_seen));
+		ctx->field_seen_value++;
+	}
+	array_clear(&ctx->bitmask_pos);
+
+	i_zero(&cache_rec);
+	buffer_append(ctx->buffer, &cache_rec, sizeof(cache_rec));
+
+	mail_cache_lookup_iter_init(cache_view, seq, &iter);
+	iter.no_decompress = TRUE;
+	while (mail_cache_lookup_iter_next(&iter, &field) > 0)
+		mail_cache_purge_field(ctx, &field);
+
+	if (ctx->buffer->used == sizeof(cache_rec) ||
+	    ctx->buffer->used > ctx->cache->index->optimization_set.cache.record_max_size) {
+		/* nothing cached */
+		return 0;
+	}
+
+	cache_rec.size = ctx->buffer->used;
+	ext_offset = output->offset;
+	buffer_write(ctx->buffer, 0, &cache_rec, sizeof(cache_rec));
+	o_stream_nsend(output, ctx->buffer->data, cache_rec.size);
+	return ext_offset;
+}
+
+static void
+mail_cache_copy_finish_header(struct mail_cache_copy_context *ctx,
+			      struct mail_cache_header *hdr,
+			      unsigned int used_fields_count,
+			      struct ostream *output)
+{
+	hdr->field_header_offset = mail_index_uint32_to_offset(output->offset);
+	mail_cache_purge_get_fields(ctx, used_fields_count);
+	o_stream_nsend(output, ctx->buffer->data, ctx->buffer->used);
+
+	hdr->backwards_compat_used_file_size = output->offset;
+	(void)o_stream_seek(output, 0);
+	o_stream_nsend(output, hdr, sizeof(*hdr));
+}
+
+static int
+mail_cache_copy_output_finish(struct mail_cache *cache, int fd,
+			      struct ostream **_output)
+{
+	struct ostream *output = *_output;
+
+	*_output = NULL;
+	if (o_stream_finish(output) < 0) {
+		mail_cache_set_syscall_error(cache, "write()");
+		o_stream_destroy(&output);
+		return -1;
+	}
+	o_stream_destroy(&output);
+
+	if (cache->index->set.fsync_mode == FSYNC_MODE_ALWAYS) {
+		if (fdatasync(fd) < 0) {
+			mail_cache_set_syscall_error(cache, "fdatasync()");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+mail_cache_copy_init_header(struct mail_cache *cache,
+			    struct mail_cache_header *hdr)
+{
+	i_zero(hdr);
+	hdr->major_version = MAIL_CACHE_MAJOR_VERSION;
+	hdr->minor_version = MAIL_CACHE_MINOR_VERSION;
+	hdr->compat_sizeof_uoff_t = sizeof(uoff_t);
+	hdr->indexid = cache->index->indexid;
+	hdr->file_seq = get_next_file_seq(cache);
+}
+
 static int
 mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		struct event *event, int fd, const char *reason,
@@ -205,16 +369,12 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		uint32_t *ext_first_seq_r, ARRAY_TYPE(uint32_t) *ext_offsets)
 {
         struct mail_cache_copy_context ctx;
-	struct mail_cache_lookup_iterate_ctx iter;
-	struct mail_cache_iterate_field field;
 	struct mail_index_view *view;
 	struct mail_cache_view *cache_view;
-	const struct mail_index_header *idx_hdr;
 	struct mail_cache_header hdr;
-	struct mail_cache_record cache_rec;
 	struct ostream *output;
 	uint32_t message_count, seq, first_new_seq, ext_offset;
-	unsigned int i, used_fields_count, orig_fields_count, record_count;
+	unsigned int used_fields_count, orig_fields_count, record_count;
 
 	i_assert(reason != NULL);
 
@@ -229,12 +389,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	cache_view = mail_cache_view_open(cache, view);
 	output = o_stream_create_fd_file(fd, 0, FALSE);
 
-	i_zero(&hdr);
-	hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
-	hdr.minor_version = MAIL_CACHE_MINOR_VERSION;
-	hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
-	hdr.indexid = cache->index->indexid;
-	hdr.file_seq = get_next_file_seq(cache);
+	mail_cache_copy_init_header(cache, &hdr);
 	o_stream_nsend(output, &hdr, sizeof(hdr));
 
 	event_add_str(event, "reason", reason);
@@ -242,34 +397,9 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	event_set_name(event, "mail_cache_purge_started");
 	e_debug(event, "Purging (new file_seq=%u): %s", hdr.file_seq, reason);
 
-	i_zero(&ctx);
-	ctx.cache = cache;
-	ctx.event = event;
-	ctx.buffer = buffer_create_dynamic(default_pool, 4096);
-	ctx.field_seen = buffer_create_dynamic(default_pool, 64);
-	ctx.field_seen_value = 0;
-	ctx.field_file_map = t_new(uint32_t, cache->fields_count + 1);
-	t_array_init(&ctx.bitmask_pos, 32);
-
-	/* @UNSAFE: drop unused fields and create a field mapping for
-	   used fields */
-	idx_hdr = mail_index_get_header(view);
-	mail_cache_purge_drop_init(cache, idx_hdr, &ctx.drop_ctx);
-
 	orig_fields_count = cache->fields_count;
-	if (cache->file_fields_count == 0) {
-		/* creating the initial cache file. add all fields. */
-		for (i = 0; i < orig_fields_count; i++)
-			ctx.field_file_map[i] = i;
-		used_fields_count = i;
-	} else {
-		for (i = used_fields_count = 0; i < orig_fields_count; i++) {
-			if (!mail_cache_purge_check_field(&ctx, i))
-				ctx.field_file_map[i] = (uint32_t)-1;
-			else
-				ctx.field_file_map[i] = used_fields_count++;
-		}
-	}
+	mail_cache_copy_init(&ctx, cache, event, mail_index_get_header(view),
+			     &used_fields_count);
 
 	/* get sequence of first message which doesn't need its temp fields
 	   removed. */
@@ -291,133 +421,61 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		}
 
 		ctx.new_msg = seq >= first_new_seq;
-		buffer_set_used_size(ctx.buffer, 0);
-
-		ctx.field_seen_value = (ctx.field_seen_value + 1) & UINT8_MAX;
-		if (ctx.field_seen_value == 0) {
-			memset(buffer_get_modifiable_data(ctx.field_seen, NULL),
-			       0, buffer_get_size(ctx.field_seen));
-			ctx.field_seen_value++;
-		}
-		array_clear(&ctx.bitmask_pos);
-
-		i_zero(&cache_rec);
-		buffer_append(ctx.buffer, &cache_rec, sizeof(cache_rec));
-
-		mail_cache_lookup_iter_init(cache_view, seq, &iter);
-		while (mail_cache_lookup_iter_next(&iter, &field) > 0)
-			mail_cache_purge_field(&ctx, &field);
-
-		if (ctx.buffer->used == sizeof(cache_rec) ||
-		    ctx.buffer->used > cache->index->optimization_set.cache.record_max_size) {
-			/* nothing cached */
-			ext_offset = 0;
-		} else {
+		ext_offset = mail_cache_copy_mail(&ctx, cache_view, seq,
+						  output);
+		if (ext_offset != 0) {
 			mail_index_lookup_uid(view, seq, max_uid_r);
-			cache_rec.size = ctx.buffer->used;
-			ext_offset = output->offset;
-			buffer_write(ctx.buffer, 0, &cache_rec,
-				     sizeof(cache_rec));
-			o_stream_nsend(output, ctx.buffer->data, cache_rec.size);
 			record_count++;
 		}
-
 		array_push_back(ext_offsets, &ext_offset);
 	}
 	i_assert(orig_fields_count == cache->fields_count);
 
 	hdr.record_count = record_count;
-	hdr.field_header_offset = mail_index_uint32_to_offset(output->offset);
-	mail_cache_purge_get_fields(&ctx, used_fields_count);
-	o_stream_nsend(output, ctx.buffer->data, ctx.buffer->used);
-
-	hdr.backwards_compat_used_file_size = output->offset;
-	buffer_free(&ctx.buffer);
-	buffer_free(&ctx.field_seen);
-
-	*file_size_r = output->offset;
-	(void)o_stream_seek(output, 0);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
+	mail_cache_copy_finish_header(&ctx, &hdr, used_fields_count, output);
+	*file_size_r = hdr.backwards_compat_used_file_size;
+	mail_cache_copy_deinit(&ctx);
 
 	mail_cache_view_close(&cache_view);
 	mail_index_view_close(&view);
 
-	if (o_stream_finish(output) < 0) {
-		mail_cache_set_syscall_error(cache, "write()");
-		o_stream_destroy(&output);
+	if (mail_cache_copy_output_finish(cache, fd, &output) < 0) {
 		array_free(ext_offsets);
 		return -1;
 	}
-	o_stream_destroy(&output);
-
-	if (cache->index->set.fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(fd) < 0) {
-			mail_cache_set_syscall_error(cache, "fdatasync()");
-			array_free(ext_offsets);
-			return -1;
-		}
-	}
 
 	*file_seq_r = hdr.file_seq;
 	return 0;
 }
 
+/* Replace the cache file with the new one in fd and update the cache
+   offsets in the transaction. */
 static int
-mail_cache_purge_write(struct mail_cache *cache,
-		       struct mail_index_transaction *trans,
-		       int fd, const char *temp_path, const char *
-		       reason, bool *unlock)
+mail_cache_purge_switch_file(struct mail_cache *cache,
+			     struct mail_index_transaction *trans,
+			     int fd, const char *temp_path, uint32_t file_seq,
+			     uint32_t ext_first_seq,
+			     const ARRAY_TYPE(uint32_t) *ext_offsets,
+			     bool *unlock)
 {
-	struct event *event;
 	struct stat st;
-	uint32_t prev_file_seq, file_seq, old_offset, max_uid, ext_first_seq;
-	ARRAY_TYPE(uint32_t) ext_offsets;
+	uint32_t old_offset;
 	const uint32_t *offsets;
-	uoff_t prev_file_size, file_size;
-	unsigned int i, count, prev_deleted_records;
-
-	if (cache->hdr == NULL) {
-		prev_file_seq = 0;
-		prev_file_size = 0;
-		prev_deleted_records = 0;
-	} else {
-		prev_file_seq = cache->hdr->file_seq;
-		prev_file_size = cache->last_stat_size;
-		prev_deleted_records = cache->hdr->deleted_record_count;
-	}
-	event = event_create(cache->event);
-	event_add_int(event, "prev_file_seq", prev_file_seq);
-	event_add_int(event, "prev_file_size", prev_file_size);
-	event_add_int(event, "prev_deleted_records", prev_deleted_records);
-
-	if (mail_cache_copy(cache, trans, event, fd, reason,
-			    &file_seq, &file_size, &max_uid,
-			    &ext_first_seq, &ext_offsets) < 0)
-		return -1;
+	unsigned int i, count;
 
 	if (fstat(fd, &st) < 0) {
 		mail_cache_set_syscall_error(cache, "fstat()");
-		array_free(&ext_offsets);
 		return -1;
 	}
 	if (rename(temp_path, cache->filepath) < 0) {
 		mail_cache_set_syscall_error(cache, "rename()");
-		array_free(&ext_offsets);
 		return -1;
 	}
 
-	event_add_int(event, "file_size", file_size);
-	event_add_int(event, "max_uid", max_uid);
-	event_set_name(event, "mail_cache_purge_finished");
-	e_debug(event, "Purging finished, file_seq changed %u -> %u, "
-		"size=%"PRIuUOFF_T" -> %"PRIuUOFF_T", max_uid=%u",
-		prev_file_seq, file_seq, prev_file_size, file_size, max_uid);
-	event_unref(&event);
-
 	/* once we're sure that the purging was successful,
 	   update the offsets */
 	mail_index_ext_reset(trans, cache->ext_id, file_seq, TRUE);
-	offsets = array_get(&ext_offsets, &count);
+	offsets = array_get(ext_offsets, &count);
 	for (i = 0; i < count; i++) {
 		if (offsets[i] != 0) {
 			mail_index_update_ext(trans, ext_first_seq + i,
@@ -425,7 +483,6 @@ mail_cache_purge_write(struct mail_cache *cache,
 					      &offsets[i], &old_offset);
 		}
 	}
-	array_free(&ext_offsets);
 
 	if (*unlock) {
 		mail_cache_unlock(cache);
@@ -441,6 +498,57 @@ mail_cache_purge_write(struct mail_cache *cache,
 	return 0;
 }
 
+static int
+mail_cache_purge_write(struct mail_cache *cache,
+		       struct mail_index_transaction *trans,
+		       int fd, const char *temp_path, const char *
+		       reason, bool *unlock)
+{
+	struct event *event;
+	uint32_t prev_file_seq, file_seq, max_uid, ext_first_seq;
+	ARRAY_TYPE(uint32_t) ext_offsets;
+	uoff_t prev_file_size, file_size;
+	unsigned int prev_deleted_records;
+	int ret;
+
+	if (cache->hdr == NULL) {
+		prev_file_seq = 0;
+		prev_file_size = 0;
+		prev_deleted_records = 0;
+	} else {
+		prev_file_seq = cache->hdr->file_seq;
+		prev_file_size = cache->last_stat_size;
+		prev_deleted_records = cache->hdr->deleted_record_count;
+	}
+	event = event_create(cache->event);
+	event_add_int(event, "prev_file_seq", prev_file_seq);
+	event_add_int(event, "prev_file_size", prev_file_size);
+	event_add_int(event, "prev_deleted_records", prev_deleted_records);
+
+	if (mail_cache_copy(cache, trans, event, fd, reason,
+			    &file_seq, &file_size, &max_uid,
+			    &ext_first_seq, &ext_offsets) < 0) {
+		event_unref(&event);
+		return -1;
+	}
+
+	ret = mail_cache_purge_switch_file(cache, trans, fd, temp_path,
+					   file_seq, ext_first_seq,
+					   &ext_offsets, unlock);
+	array_free(&ext_offsets);
+	if (ret == 0) {
+		event_add_int(event, "file_size", file_size);
+		event_add_int(event, "max_uid", max_uid);
+		event_set_name(event, "mail_cache_purge_finished");
+		e_debug(event, "Purging finished, file_seq changed %u -> %u, "
+			"size=%"PRIuUOFF_T" -> %"PRIuUOFF_T", max_uid=%u",
+			prev_file_seq, file_seq, prev_file_size, file_size,
+			max_uid);
+	}
+	event_unref(&event);
+	return ret;
+}
+
 static int
 mail_cache_purge_has_file_changed(struct mail_cache *cache,
 				  uint32_t purge_file_seq)
@@ -541,6 +649,9 @@ mail_cache_purge_full(struct mail_cache *cache,
 	i_assert(!cache->purging);
 	i_assert(cache->index->log_sync_locked);
 
+	/* a full purge replaces any unfinished incremental purge */
+	mail_cache_purge_incremental_abort(cache);
+
 	if (MAIL_INDEX_IS_IN_MEMORY(cache->index) || cache->index->readonly)
 		return 0;
 
@@ -631,6 +742,540 @@ int mail_cache_purge(struct mail_cache *cache, uint32_t purge_file_seq,
 	return ret;
 }
 
+struct mail_cache_purge_incr_rec {
+	uint32_t uid;
+	/* offset in the old cache file when the record was copied */
+	uint32_t old_offset;
+	/* offset in the new cache file, 0 if nothing was copied */
+	uint32_t new_offset;
+};
+
+struct mail_cache_purge_incr {
+	struct mail_cache_copy_context ctx;
+	struct event *event;
+	char *reason;
+
+	int fd;
+	char *temp_path;
+	struct ostream *output;
+	struct mail_cache_header hdr;
+
+	uint32_t old_file_seq;
+	unsigned int used_fields_count, orig_fields_count;
+	unsigned int steps;
+	/* Mails with UID >= first_new_uid keep their temp fields */
+	uint32_t first_new_uid;
+	/* Next UID to copy */
+	uint32_t next_uid;
+	ARRAY(struct mail_cache_purge_incr_rec) recs;
+};
+
+void mail_cache_purge_incremental_free(struct mail_cache *cache)
+{
+	struct mail_cache_purge_incr *incr = cache->purge_incr;
+
+	if (incr == NULL)
+		return;
+	cache->purge_incr = NULL;
+
+	if (incr->output != NULL) {
+		o_stream_abort(incr->output);
+		o_stream_destroy(&incr->output);
+	}
+	if (incr->fd != -1) {
+		i_close_fd(&incr->fd);
+		i_unlink(incr->temp_path);
+	}
+	mail_cache_copy_deinit(&incr->ctx);
+	array_free(&incr->recs);
+	event_unref(&incr->event);
+	i_free(incr->reason);
+	i_free(incr->temp_path);
+	i_free(incr);
+}
+
+static void mail_cache_purge_incremental_abort(struct mail_cache *cache)
+{
+	if (cache->purge_incr == NULL)
+		return;
+	mail_cache_purge_incremental_free(cache);
+
+	/* the field decisions may have been changed in memory already.
+	   reverse those changes by re-reading them from file. */
+	(void)mail_cache_header_fields_read(cache);
+}
+
+static bool
+mail_cache_purge_incremental_is_valid(struct mail_cache *cache)
+{
+	struct mail_cache_purge_incr *incr = cache->purge_incr;
+
+	/* If the cache file was replaced or new fields were registered, the
+	   already copied records can't be used anymore. */
+	return cache->hdr != NULL &&
+		cache->hdr->file_seq == incr->old_file_seq &&
+		cache->fields_count == incr->orig_fields_count;
+}
+
+static void
+mail_cache_purge_incremental_get_header(struct mail_cache *cache,
+					struct mail_index_view *view,
+					struct mail_cache_purge_incr_header *hdr_r)
+{
+	const void *data;
+	size_t size;
+
+	mail_index_get_header_ext(view, cache->purge_ext_id, &data, &size);
+	if (size >= sizeof(*hdr_r))
+		memcpy(hdr_r, data, sizeof(*hdr_r));
+	else
+		i_zero(hdr_r);
+	if (cache->hdr == NULL || hdr_r->file_seq != cache->hdr->file_seq) {
+		/* the cache file was purged since */
+		i_zero(hdr_r);
+	}
+}
+
+static bool
+mail_cache_purge_incremental_temp_is_stale(const char *path,
+					   const char *pidhost)
+{
+	const char *p, *hostname;
+	struct stat st;
+	pid_t pid;
+
+	/* <pid>.<hostname>.tmp */
+	p = strchr(pidhost, '.');
+	if (p == NULL || str_to_pid(t_strdup_until(pidhost, p), &pid) < 0)
+		return FALSE;
+	hostname = p + 1;
+	p = strrchr(hostname, '.');
+	if (p == NULL || strcmp(p, ".tmp") != 0)
+		return FALSE;
+	hostname = t_strdup_until(hostname, p);
+
+	if (strcmp(hostname, my_hostname) == 0) {
+		if (strcmp(dec2str(pid), my_pid) == 0)
+			return FALSE;
+		return kill(pid, 0) < 0 && errno == ESRCH;
+	}
+	/* can't check other hosts' processes */
+	if (stat(path, &st) < 0)
+		return FALSE;
+	return st.st_mtime < ioloop_time - MAIL_CACHE_PURGE_INCREMENTAL_STALE_SECS;
+}
+
+static void
+mail_cache_purge_incremental_unlink_stale(struct mail_cache *cache)
+{
+	const char *p, *dir, *prefix, *path;
+	struct dirent *d;
+	DIR *dirp;
+	size_t prefix_len;
+
+	/* Unlink the temp files left behind by incremental purges of
+	   processes that crashed. */
+	p = strrchr(cache->filepath, '/');
+	if (p == NULL) {
+		dir = ".";
+		prefix = t_strconcat(cache->filepath, ".", NULL);
+	} else {
+		dir = t_strdup_until(cache->filepath, p);
+		prefix = t_strconcat(p + 1, ".", NULL);
+	}
+	prefix_len = strlen(prefix);
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		e_error(cache->event, "opendir(%s) failed: %m", dir);
+		return;
+	}
+	while ((d = readdir(dirp)) != NULL) {
+		if (strncmp(d->d_name, prefix, prefix_len) != 0)
+			continue;
+		path = t_strconcat(dir, "/", d->d_name, NULL);
+		if (mail_cache_purge_incremental_temp_is_stale(path,
+						d->d_name + prefix_len)) {
+			e_debug(cache->event, "Unlinking stale incremental "
+				"purge temp file %s", path);
+			i_unlink_if_exists(path);
+		}
+	}
+	if (closedir(dirp) < 0)
+		e_error(cache->event, "closedir(%s) failed: %m", dir);
+}
+
+static int
+mail_cache_purge_incremental_start(struct mail_cache *cache,
+				   struct mail_index_view *view,
+				   struct mail_index_transaction *trans,
+				   const char *reason)
+{
+	struct mail_cache_purge_incr *incr;
+	struct mail_cache_purge_incr_header incr_hdr;
+	const char *temp_prefix, *temp_path;
+	uint32_t first_new_seq;
+	int fd;
+
+	/* purging isn't very efficient with small read()s */
+	if (cache->map_with_read) {
+		cache->map_with_read = FALSE;
+		if (cache->read_buf != NULL)
+			buffer_set_used_size(cache->read_buf, 0);
+		cache->hdr = NULL;
+		cache->mmap_length = 0;
+	}
+	if (mail_cache_map_all(cache) <= 0)
+		return -1;
+	if (mail_cache_header_fields_read(cache) < 0)
+		return -1;
+
+	T_BEGIN {
+		mail_cache_purge_incremental_unlink_stale(cache);
+	} T_END;
+
+	/* The temp file lives across multiple syncs, so it must not conflict
+	   with other processes' purges. */
+	temp_prefix = t_strdup_printf("%s.%s.%s", cache->filepath,
+				      my_pid, my_hostname);
+	fd = mail_index_create_tmp_file(cache->index, temp_prefix, &temp_path);
+	if (fd == -1)
+		return -1;
+
+	incr = i_new(struct mail_cache_purge_incr, 1);
+	incr->fd = fd;
+	incr->temp_path = i_strdup(temp_path);
+	incr->reason = i_strdup(reason);
+	incr->output = o_stream_create_fd_file(fd, 0, FALSE);
+	incr->old_file_seq = cache->hdr->file_seq;
+	incr->orig_fields_count = cache->fields_count;
+	i_array_init(&incr->recs, 128);
+	cache->purge_incr = incr;
+
+	/* remember that a purge was started, so that if this process doesn't
+	   finish it, the later processes know to do a full purge instead */
+	mail_cache_purge_incremental_get_header(cache, view, &incr_hdr);
+	incr_hdr.file_seq = incr->old_file_seq;
+	incr_hdr.start_count++;
+	mail_index_update_header_ext(trans, cache->purge_ext_id, 0,
+				     &incr_hdr, sizeof(incr_hdr));
+
+	mail_cache_copy_init_header(cache, &incr->hdr);
+	o_stream_nsend(incr->output, &incr->hdr, sizeof(incr->hdr));
+
+	incr->event = event_create(cache->event);
+	event_add_int(incr->event, "prev_file_seq", incr->old_file_seq);
+	event_add_int(incr->event, "prev_file_size", cache->last_stat_size);
+	event_add_int(incr->event, "prev_deleted_records",
+		      cache->hdr->deleted_record_count);
+	event_add_str(incr->event, "reason", reason);
+	event_add_int(incr->event, "file_seq", incr->hdr.file_seq);
+	event_add_str(incr->event, "incremental", "yes");
+	event_set_name(incr->event, "mail_cache_purge_started");
+	e_debug(incr->event, "Purging incrementally (new file_seq=%u): %s",
+		incr->hdr.file_seq, reason);
+
+	mail_cache_copy_init(&incr->ctx, cache, incr->event,
+			     mail_index_get_header(view),
+			     &incr->used_fields_count);
+
+	first_new_seq = mail_cache_get_first_new_seq(view);
+	if (first_new_seq > mail_index_view_get_messages_count(view))
+		incr->first_new_uid = mail_index_get_header(view)->next_uid;
+	else
+		mail_index_lookup_uid(view, first_new_seq, &incr->first_new_uid);
+	incr->next_uid = 1;
+	return 0;
+}
+
+static uint32_t
+mail_cache_purge_incremental_copy(struct mail_cache_purge_incr *incr,
+				  struct mail_cache_view *cache_view,
+				  uint32_t seq, uint32_t uid)
+{
+	incr->ctx.new_msg = uid >= incr->first_new_uid;
+	return mail_cache_copy_mail(&incr->ctx, cache_view, seq, incr->output);
+}
+
+/* Copy the next batch of records to the new cache file without locking the
+   cache. Returns 1 if all the existing mails have been copied, 0 if there is
+   more to do, -1 on error. */
+static int
+mail_cache_purge_incremental_step(struct mail_cache *cache,
+				  struct mail_index_view *view)
+{
+	const struct mail_index_cache_optimization_settings *set =
+		&cache->index->optimization_set.cache;
+	struct mail_cache_purge_incr *incr = cache->purge_incr;
+	struct mail_cache_purge_incr_rec *rec;
+	struct mail_cache_view *cache_view;
+	uint32_t seq, seq1, seq2, uid, reset_id;
+	uoff_t start_offset = incr->output->offset;
+	int ret = 0;
+
+	if (!mail_index_lookup_seq_range(view, incr->next_uid, (uint32_t)-1,
+					 &seq1, &seq2))
+		return 1;
+
+	cache->purging = TRUE;
+	cache_view = mail_cache_view_open(cache, view);
+	for (seq = seq1; seq <= seq2; ) {
+		mail_index_lookup_uid(view, seq, &uid);
+		rec = array_append_space(&incr->recs);
+		rec->uid = uid;
+		rec->old_offset = mail_cache_lookup_cur_offset(view, seq,
+							       &reset_id);
+		if (rec->old_offset != 0 && reset_id != incr->old_file_seq)
+			rec->old_offset = 0;
+		rec->new_offset = mail_cache_purge_incremental_copy(incr,
+						cache_view, seq, uid);
+		incr->next_uid = uid + 1;
+		seq++;
+
+		if (incr->output->offset - start_offset >=
+		    set->purge_incremental_step_size)
+			break;
+	}
+	mail_cache_view_close(&cache_view);
+	cache->purging = FALSE;
+
+	if (o_stream_flush(incr->output) < 0) {
+		mail_cache_set_syscall_error(cache, "write()");
+		return -1;
+	}
+	if (seq > seq2)
+		ret = 1;
+	incr->steps++;
+	e_debug(cache->event, "Incremental purge step %u copied %"PRIuUOFF_T
+		" bytes, next_uid=%u", incr->steps,
+		incr->output->offset - start_offset, incr->next_uid);
+	return ret;
+}
+
+static int
+mail_cache_purge_incremental_finish_locked(struct mail_cache *cache,
+					   struct mail_index_transaction *trans,
+					   bool *unlock)
+{
+	struct mail_cache_purge_incr *incr = cache->purge_incr;
+	const struct mail_cache_purge_incr_rec *recs;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	ARRAY_TYPE(uint32_t) ext_offsets;
+	uint32_t seq, message_count, uid, offset, reset_id, max_uid = 0;
+	unsigned int i, rec_count, record_count = 0, deleted_count = 0;
+	unsigned int recopied_count = 0;
+	uoff_t prev_file_size = cache->last_stat_size;
+	int ret;
+
+	view = mail_index_transaction_open_updated_view(trans);
+	cache_view = mail_cache_view_open(cache, view);
+	message_count = mail_index_view_get_messages_count(view);
+	i_array_init(&ext_offsets, message_count);
+
+	/* Use the already copied records for the mails whose cache offset
+	   hasn't changed since they were copied. Copy the rest again now -
+	   these are the newly saved mails and the mails that have had more
+	   fields cached since. */
+	recs = array_get(&incr->recs, &rec_count);
+	cache->purging = TRUE;
+	for (seq = 1, i = 0; seq <= message_count; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		for (; i < rec_count && recs[i].uid < uid; i++) {
+			/* expunged */
+			if (recs[i].new_offset != 0)
+				deleted_count++;
+		}
+		offset = mail_cache_lookup_cur_offset(view, seq, &reset_id);
+		if (offset != 0 && reset_id != incr->old_file_seq)
+			offset = 0;
+		if (i < rec_count && recs[i].uid == uid &&
+		    recs[i].old_offset == offset)
+			offset = recs[i].new_offset;
+		else {
+			if (i < rec_count && recs[i].uid == uid &&
+			    recs[i].new_offset != 0)
+				deleted_count++;
+			offset = mail_cache_purge_incremental_copy(incr,
+						cache_view, seq, uid);
+			recopied_count++;
+		}
+		if (i < rec_count && recs[i].uid == uid)
+			i++;
+		if (offset != 0) {
+			max_uid = uid;
+			record_count++;
+		}
+		array_push_back(&ext_offsets, &offset);
+	}
+	for (; i < rec_count; i++) {
+		if (recs[i].new_offset != 0)
+			deleted_count++;
+	}
+	cache->purging = FALSE;
+	i_assert(incr->orig_fields_count == cache->fields_count);
+
+	incr->hdr.record_count = record_count;
+	incr->hdr.deleted_record_count = deleted_count;
+	mail_cache_copy_finish_header(&incr->ctx, &incr->hdr,
+				      incr->used_fields_count, incr->output);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+
+	if (mail_cache_copy_output_finish(cache, incr->fd, &incr->output) < 0) {
+		array_free(&ext_offsets);
+		return -1;
+	}
+	ret = mail_cache_purge_switch_file(cache, trans, incr->fd,
+					   incr->temp_path, incr->hdr.file_seq,
+					   1, &ext_offsets, unlock);
+	array_free(&ext_offsets);
+	if (ret < 0)
+		return -1;
+	/* the fd is now owned by the cache */
+	incr->fd = -1;
+
+	event_add_int(incr->event, "file_size",
+		      incr->hdr.backwards_compat_used_file_size);
+	event_add_int(incr->event, "max_uid", max_uid);
+	event_add_int(incr->event, "steps", incr->steps);
+	event_add_int(incr->event, "recopied_records", recopied_count);
+	event_set_name(incr->event, "mail_cache_purge_finished");
+	e_debug(incr->event, "Incremental purging finished in %u steps, "
+		"file_seq changed %u -> %u, "
+		"size=%"PRIuUOFF_T" -> %u, max_uid=%u, recopied=%u",
+		incr->steps, incr->old_file_seq, incr->hdr.file_seq,
+		prev_file_size, incr->hdr.backwards_compat_used_file_size,
+		max_uid, recopied_count);
+	return 0;
+}
+
+static int
+mail_cache_purge_incremental_finish(struct mail_cache *cache,
+				    struct mail_index_transaction *trans)
+{
+	bool unlock = FALSE;
+	int ret;
+
+	switch (mail_cache_lock(cache)) {
+	case -1:
+		return -1;
+	case 0:
+		/* cache became broken or was deleted */
+		mail_cache_purge_incremental_abort(cache);
+		return 0;
+	default:
+		unlock = TRUE;
+	}
+	if (!mail_cache_purge_incremental_is_valid(cache)) {
+		mail_cache_unlock(cache);
+		mail_cache_purge_incremental_abort(cache);
+		return 0;
+	}
+	ret = mail_cache_purge_incremental_finish_locked(cache, trans, &unlock);
+	if (unlock)
+		mail_cache_unlock(cache);
+	i_assert(!cache->hdr_modified);
+	if (ret < 0) {
+		mail_cache_purge_incremental_abort(cache);
+		return -1;
+	}
+	mail_cache_purge_incremental_free(cache);
+
+	if (cache->file_cache != NULL)
+		file_cache_set_fd(cache->file_cache, cache->fd);
+	if (mail_cache_map_all(cache) <= 0)
+		return -1;
+	if (mail_cache_header_fields_read(cache) < 0)
+		return -1;
+	mail_cache_purge_later_reset(cache);
+	return 0;
+}
+
+static bool
+mail_cache_purge_want_incremental(struct mail_cache *cache,
+				  uint32_t purge_file_seq)
+{
+	const struct mail_index_cache_optimization_settings *set =
+		&cache->index->optimization_set.cache;
+
+	if (cache->purge_incr != NULL)
+		return TRUE;
+	if (MAIL_INDEX_IS_IN_MEMORY(cache->index) || cache->index->readonly)
+		return FALSE;
+	if (set->purge_incremental_min_size == 0 ||
+	    cache->last_stat_size < set->purge_incremental_min_size)
+		return FALSE;
+	return cache->hdr != NULL && cache->hdr->file_seq == purge_file_seq;
+}
+
+int mail_cache_purge_incremental(struct mail_cache *cache,
+				 uint32_t purge_file_seq, const char *reason)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	bool lock_log, full_purge = FALSE;
+	int ret;
+
+	if (!mail_cache_purge_want_incremental(cache, purge_file_seq))
+		return mail_cache_purge(cache, purge_file_seq, reason);
+
+	lock_log = !cache->index->log_sync_locked;
+	if (lock_log) {
+		uint32_t file_seq;
+		uoff_t file_offset;
+
+		if (mail_transaction_log_sync_lock(cache->index->log,
+						   "mail cache purge",
+						   &file_seq, &file_offset) < 0)
+			return -1;
+	}
+	/* make sure we see the latest changes in index */
+	ret = mail_index_refresh(cache->index);
+
+	view = mail_index_view_open(cache->index);
+	trans = mail_index_transaction_begin(view,
+		MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	if (ret < 0)
+		;
+	else if (cache->purge_incr == NULL) {
+		struct mail_cache_purge_incr_header incr_hdr;
+
+		mail_cache_purge_incremental_get_header(cache, view, &incr_hdr);
+		if (incr_hdr.start_count >=
+		    MAIL_CACHE_PURGE_INCREMENTAL_MAX_STARTS) {
+			/* the earlier processes never finished their
+			   incremental purges */
+			ret = mail_cache_purge_full(cache, trans,
+				purge_file_seq, t_strdup_printf(
+				"%s (%u incremental purges didn't finish)",
+				reason, incr_hdr.start_count));
+			full_purge = TRUE;
+		} else {
+			ret = mail_cache_purge_incremental_start(cache, view,
+								 trans, reason);
+		}
+	} else if (!mail_cache_purge_incremental_is_valid(cache)) {
+		/* somebody else already purged the cache */
+		mail_cache_purge_incremental_abort(cache);
+	}
+	if (ret == 0 && !full_purge && cache->purge_incr != NULL)
+		ret = mail_cache_purge_incremental_step(cache, view);
+	if (ret > 0)
+		ret = mail_cache_purge_incremental_finish(cache, trans);
+	if (ret < 0) {
+		mail_index_transaction_rollback(&trans);
+		mail_cache_purge_incremental_abort(cache);
+	} else if (mail_index_transaction_commit(&trans) < 0)
+		ret = -1;
+	mail_index_view_close(&view);
+	if (lock_log) {
+		mail_transaction_log_sync_unlock(cache->index->log,
+						 "mail cache purge");
+	}
+	return ret < 0 ? -1 : 0;
+}
+
 bool mail_cache_need_purge(struct mail_cache *cache, const char **reason_r)
 {
 	if (cache->need_purge_file_seq == 0)
@@ -39,6 +39,8 @@ struct mail_cache_transaction_ctx {
 	uint32_t first_new_seq;
 
 	buffer_t *cache_data;
+	/* Compressed data of the field being added */
+	buffer_t *compress_buf;
 	ARRAY(uint8_t) cache_field_idx_used;
 	ARRAY(struct mail_cache_transaction_rec) cache_data_seq;
 	ARRAY_TYPE(seq_range) cache_data_wanted_seqs;
@@ -181,6 +183,7 @@ void mail_cache_transaction_rollback(struct mail_cache_transaction_ctx **_ctx)
 
 	mail_index_view_close(&ctx->view->trans_view);
 	buffer_free(&ctx->cache_data);
+	buffer_free(&ctx->compress_buf);
 	if (array_is_created(&ctx->cache_data_seq))
 		array_free(&ctx->cache_data_seq);
 	if (array_is_created(&ctx->cache_data_wanted_seqs))
@@ -462,11 +465,14 @@ mail_cache_transaction_update_fields(struct mail_cache_transaction_ctx *ctx)
 			rec_end = CONST_PTR_OFFSET(p, rec->size);
 			p += sizeof(*rec);
 		}
-		/* replace field_idx */
+		/* replace field_idx, preserving the compression flag */
 		uint32_t *file_fieldp = (uint32_t *)p;
-		field_idx = *file_fieldp;
-		*file_fieldp = ctx->cache->field_file_map[field_idx];
-		i_assert(*file_fieldp != (uint32_t)-1);
+		uint32_t compressed_flag =
+			*file_fieldp & MAIL_CACHE_FIELD_IDX_COMPRESSED;
+		field_idx = *file_fieldp & ~MAIL_CACHE_FIELD_IDX_COMPRESSED;
+		i_assert(ctx->cache->field_file_map[field_idx] != (uint32_t)-1);
+		*file_fieldp = ctx->cache->field_file_map[field_idx] |
+			compressed_flag;
 		p += sizeof(field_idx);
 
 		/* Skip to next cache field. Next is <data size> if the field
@@ -778,7 +784,7 @@ mail_cache_transaction_refresh_decisions(struct mail_cache_transaction_ctx *ctx)
 void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 		    unsigned int field_idx, const void *data, size_t data_size)
 {
-	uint32_t data_size32;
+	uint32_t data_size32, rec_field_idx = field_idx;
 	unsigned int fixed_size;
 	size_t full_size, record_size;
 
@@ -801,6 +807,20 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 	fixed_size = ctx->cache->fields[field_idx].field.field_size;
 	i_assert(fixed_size == UINT_MAX || fixed_size == data_size);
 
+	if (ctx->cache->compression.compress != NULL) {
+		if (ctx->compress_buf == NULL) {
+			ctx->compress_buf =
+				buffer_create_dynamic(default_pool, 1024);
+		}
+		if (mail_cache_field_compress(ctx->cache, field_idx,
+					      data, data_size,
+					      ctx->compress_buf)) {
+			data = ctx->compress_buf->data;
+			data_size = ctx->compress_buf->used;
+			rec_field_idx |= MAIL_CACHE_FIELD_IDX_COMPRESSED;
+		}
+	}
+
 	data_size32 = (uint32_t)data_size;
 	full_size = sizeof(field_idx) + ((data_size + 3) & ~3U);
 	if (fixed_size == UINT_MAX)
@@ -817,6 +837,9 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 			ctx->view->trans_seq1 = seq;
 		if (seq > ctx->view->trans_seq2)
 			ctx->view->trans_seq2 = seq;
+		if (seq >= ctx->view->prefetch_seq1 &&
+		    seq <= ctx->view->prefetch_seq2)
+			mail_cache_view_prefetch_reset(ctx->view);
 	}
 
 	if (mail_cache_transaction_update_last_rec_size(ctx, &record_size) &&
@@ -867,7 +890,7 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 		}
 	}
 
-	buffer_append(ctx->cache_data, &field_idx, sizeof(field_idx));
+	buffer_append(ctx->cache_data, &rec_field_idx, sizeof(rec_field_idx));
 	if (fixed_size == UINT_MAX) {
 		buffer_append(ctx->cache_data, &data_size32,
 			      sizeof(data_size32));
@@ -597,6 +597,9 @@ mail_cache_open_or_create_path(struct mail_index *index, const char *path)
 					sizeof(uint32_t), sizeof(uint32_t));
 	mail_index_register_expunge_handler(index, cache->ext_id,
 					    mail_cache_expunge_handler);
+	cache->purge_ext_id =
+		mail_index_ext_register(index, "cache-purge",
+			sizeof(struct mail_cache_purge_incr_header), 0, 0);
 	return cache;
 }
 
@@ -619,6 +622,7 @@ void mail_cache_free(struct mail_cache **_cache)
 		file_cache_free(&cache->file_cache);
 
 	mail_index_unregister_expunge_handler(cache->index, cache->ext_id);
+	mail_cache_purge_incremental_free(cache);
 	mail_cache_file_close(cache);
 
 	buffer_free(&cache->read_buf);
@@ -633,6 +637,50 @@ void mail_cache_free(struct mail_cache **_cache)
 	i_free(cache);
 }
 
+static void mail_cache_compression_changed(struct mail_cache *cache)
+{
+	struct mail_cache_view *view;
+
+	/* the cached field existence may depend on whether the compressed
+	   fields can be read */
+	for (view = cache->views; view != NULL; view = view->next)
+		view->cached_exists_seq = 0;
+}
+
+void mail_cache_set_compression(struct mail_cache *cache,
+				const struct mail_cache_compression *compression)
+{
+	i_assert(compression != NULL);
+
+	cache->compression = *compression;
+	cache->compression_refcount++;
+	mail_cache_compression_changed(cache);
+}
+
+void mail_cache_unset_compression(struct mail_cache *cache)
+{
+	i_assert(cache->compression_refcount > 0);
+
+	if (--cache->compression_refcount > 0)
+		return;
+	i_zero(&cache->compression);
+	mail_cache_compression_changed(cache);
+}
+
+bool mail_cache_field_compress(struct mail_cache *cache, unsigned int field,
+			       const void *data, size_t size, buffer_t *dest)
+{
+	if (!mail_cache_decision_want_compress(cache, field, size))
+		return FALSE;
+
+	buffer_set_used_size(dest, 0);
+	if (cache->compression.compress(data, size, dest,
+					cache->compression.context) < 0)
+		return FALSE;
+	/* keep the data uncompressed unless it saves at least 1/8 */
+	return dest->used <= size - size/8;
+}
+
 static int mail_cache_lock_file(struct mail_cache *cache)
 {
 	unsigned int timeout_secs;
@@ -976,7 +1024,9 @@ void mail_cache_view_close(struct mail_cache_view **_view)
                 (void)mail_cache_header_fields_update(view->cache);
 
 	DLLIST_REMOVE(&view->cache->views, view);
+	mail_cache_view_prefetch_reset(view);
 	buffer_free(&view->cached_exists_buf);
+	buffer_free(&view->decompress_buf);
 	i_free(view);
 }
 
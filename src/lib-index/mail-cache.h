@@ -64,11 +64,44 @@ struct mail_cache_field {
 	time_t last_used;
 };
 
+struct mail_cache_compression {
+	/* Compress data and append it to dest. Returns 0 if ok, -1 if the
+	   data should be written uncompressed. NULL if only decompression is
+	   supported. */
+	int (*compress)(const void *data, size_t size, buffer_t *dest,
+			void *context);
+	/* Decompress data written by compress() and append it to dest.
+	   Returns 0 if ok, -1 if data is corrupted. */
+	int (*decompress)(const void *data, size_t size, buffer_t *dest,
+			  void *context, const char **error_r);
+	void *context;
+};
+
 struct mail_cache *mail_cache_open_or_create(struct mail_index *index);
 struct mail_cache *
 mail_cache_open_or_create_path(struct mail_index *index, const char *path);
 void mail_cache_free(struct mail_cache **cache);
 
+/* Set the functions used to compress and decompress the cached fields.
+   Without decompress() the compressed fields are treated as if they didn't
+   exist. The compression is decided per field by the caching decisions:
+   large variable sized fields with YES decision are compressed when they're
+   added or when the cache is purged.
+
+   Each call must be paired with mail_cache_unset_compression(). The cache
+   is shared by all the opened instances of the same mailbox, so the
+   compression stays set until all of them have unset it.
+
+   Enabling compression is a one-way upgrade: older versions without
+   compression support see the compressed fields as corruption and
+   recreate the cache file, losing all of its contents. Enable it only
+   after all the servers accessing the mailboxes support it. Processes
+   that set only decompress() can read, but not write, compressed
+   fields. */
+void mail_cache_set_compression(struct mail_cache *cache,
+				const struct mail_cache_compression *compression);
+void mail_cache_unset_compression(struct mail_cache *cache);
+
 /* Register fields. fields[].idx is updated to contain field index.
    If field already exists and its caching decision is NO, the decision is
    updated to the input field's decision. */
@@ -105,6 +138,16 @@ int mail_cache_purge_with_trans(struct mail_cache *cache,
 				uint32_t purge_file_seq, const char *reason);
 int mail_cache_purge(struct mail_cache *cache, uint32_t purge_file_seq,
 		     const char *reason);
+/* Like mail_cache_purge(), but if the cache file is at least
+   purge_incremental_min_size bytes, copy only up to
+   purge_incremental_step_size bytes of records to the new cache file per
+   call. The cache is locked only when the purge finishes, so that the
+   records that were changed since they were copied can be copied again.
+   Until then the purge stays pending and mail_cache_need_purge() returns
+   TRUE. The progress is lost if the process exits before the purge
+   finishes, so after a few such restarts the file is purged all at once. */
+int mail_cache_purge_incremental(struct mail_cache *cache,
+				 uint32_t purge_file_seq, const char *reason);
 /* Returns TRUE if there is at least something in the cache. */
 bool mail_cache_exists(struct mail_cache *cache);
 /* Open and read cache header. Returns 1 if ok, 0 if cache doesn't exist or it
@@ -177,6 +220,21 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      uint32_t seq, const unsigned int field_idxs[],
 			      unsigned int fields_count);
 
+/* Prefetch the cache records of messages seq1..seq2, which are going to be
+   accessed soon. The records are walked in file offset order and the kernel
+   is asked to read ahead the ranges containing them. Then the given non-header
+   fields (all if fields_count=0) are decoded and stored in the view, so the
+   following mail_cache_field_exists() and mail_cache_lookup_field() calls
+   for these messages don't need to walk the records again. The prefetched
+   fields are forgotten when the view is synced, when fields are added to
+   these messages, or at the next mail_cache_prefetch() call.
+   If fields_count > 0, nothing is done unless at least one of the fields
+   exists in the cache file. Returns 0 if ok, -1 if error. */
+int mail_cache_prefetch(struct mail_cache_view *view,
+			uint32_t seq1, uint32_t seq2,
+			const unsigned int field_idxs[],
+			unsigned int fields_count);
+
 /* "Error in index cache file %s: ...". */
 void mail_cache_set_corrupted(struct mail_cache *cache, const char *fmt, ...)
 	ATTR_FORMAT(2, 3) ATTR_COLD;
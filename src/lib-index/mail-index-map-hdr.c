@@ -243,6 +243,7 @@ static void mail_index_map_clear_recent_flags(struct mail_index_map *map)
 	struct mail_index_record *rec;
 	uint32_t seq;
 
+	mail_index_record_map_columns_free(map->rec_map);
 	for (seq = 1; seq <= map->hdr.messages_count; seq++) {
 		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
 		rec->flags &= ENUM_NEGATE(MAIL_RECENT);
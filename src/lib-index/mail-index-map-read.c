@@ -10,6 +10,10 @@
 #include "mail-transaction-log-private.h"
 #include "ioloop.h"
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
 static void mail_index_map_copy_hdr(struct mail_index_map *map,
 				    const struct mail_index_header *hdr)
 {
@@ -27,6 +31,39 @@ static void mail_index_map_copy_hdr(struct mail_index_map *map,
 	map->hdr.unused_old_recent_messages_count = 0;
 }
 
+static void *
+mail_index_mmap_reserved(struct mail_index *index, size_t file_size,
+			 size_t *reserved_size_r)
+{
+#ifdef MAP_ANONYMOUS
+	size_t reserve_size = I_MAX(file_size / 4,
+				    MAIL_INDEX_MMAP_MIN_RESERVE_SIZE);
+	void *base;
+
+	/* Reserve some anonymous memory after the file, so records can be
+	   appended without copying the whole mapping to memory. The reserved
+	   pages don't use any memory until they're written to. */
+	if (file_size <= SSIZE_T_MAX - reserve_size) {
+		base = mmap(NULL, file_size + reserve_size,
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED) {
+			if (mmap(base, file_size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_FIXED,
+				 index->fd, 0) != MAP_FAILED) {
+				*reserved_size_r = file_size + reserve_size;
+				return base;
+			}
+			if (munmap(base, file_size + reserve_size) < 0)
+				mail_index_set_syscall_error(index, "munmap()");
+		}
+	}
+#endif
+	*reserved_size_r = file_size;
+	return mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, index->fd, 0);
+}
+
 static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
@@ -44,8 +81,8 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 		return -1;
 	}
 
-	rec_map->mmap_base = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
-				  MAP_PRIVATE, index->fd, 0);
+	rec_map->mmap_base = mail_index_mmap_reserved(index, file_size,
+						      &rec_map->mmap_reserved_size);
 	if (rec_map->mmap_base == MAP_FAILED) {
 		rec_map->mmap_base = NULL;
 		if (ioloop_time != index->last_mmap_error_time) {
@@ -101,6 +138,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	buffer_append(map->hdr_copy_buf, rec_map->mmap_base, hdr->header_size);
 
 	rec_map->records = PTR_OFFSET(rec_map->mmap_base, map->hdr.header_size);
+	mail_index_record_map_columns_free(rec_map);
 	return 1;
 }
 
@@ -241,6 +279,7 @@ mail_index_try_read_map(struct mail_index_map *map,
 	map->rec_map->records =
 		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
 	map->rec_map->records_count = records_count;
+	mail_index_record_map_columns_free(map->rec_map);
 
 	mail_index_map_copy_hdr(map, hdr);
 	i_assert(map->hdr_copy_buf->used == map->hdr.header_size);
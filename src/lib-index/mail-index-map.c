@@ -4,9 +4,15 @@
 #include "array.h"
 #include "str-sanitize.h"
 #include "mmap-util.h"
+#include "llist.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 
+/* All the record maps in this process, for memory usage accounting */
+static struct mail_index_record_map *record_maps = NULL;
+static uint64_t record_map_copy_count = 0;
+static uoff_t record_map_copy_bytes = 0;
+
 void mail_index_map_init_extbufs(struct mail_index_map *map,
 				 unsigned int initial_count)
 {
@@ -266,6 +272,16 @@ struct mail_index_map *mail_index_map_alloc(struct mail_index *index)
 	return mail_index_map_clone(&tmp_map);
 }
 
+static void mail_index_record_map_munmap(struct mail_index_map *map,
+					 struct mail_index_record_map *rec_map)
+{
+	if (munmap(rec_map->mmap_base, rec_map->mmap_reserved_size) < 0)
+		mail_index_set_syscall_error(map->index, "munmap()");
+	rec_map->mmap_base = NULL;
+	rec_map->mmap_size = 0;
+	rec_map->mmap_reserved_size = 0;
+}
+
 static void mail_index_record_map_free(struct mail_index_map *map,
 				       struct mail_index_record_map *rec_map)
 {
@@ -274,13 +290,13 @@ static void mail_index_record_map_free(struct mail_index_map *map,
 		buffer_free(&rec_map->buffer);
 	} else if (rec_map->mmap_base != NULL) {
 		i_assert(rec_map->buffer == NULL);
-		if (munmap(rec_map->mmap_base, rec_map->mmap_size) < 0)
-			mail_index_set_syscall_error(map->index, "munmap()");
-		rec_map->mmap_base = NULL;
+		mail_index_record_map_munmap(map, rec_map);
 	}
+	DLLIST_REMOVE(&record_maps, rec_map);
 	array_free(&rec_map->maps);
 	if (rec_map->modseq != NULL)
 		mail_index_map_modseq_free(&rec_map->modseq);
+	mail_index_record_map_columns_free(rec_map);
 	i_free(rec_map);
 }
 
@@ -336,6 +352,9 @@ static void mail_index_map_copy_records(struct mail_index_record_map *dest,
 
 	dest->records = buffer_get_modifiable_data(dest->buffer, NULL);
 	dest->records_count = src->records_count;
+
+	record_map_copy_count++;
+	record_map_copy_bytes += size;
 }
 
 static void mail_index_map_copy_header(struct mail_index_map *dest,
@@ -373,6 +392,7 @@ mail_index_record_map_alloc(struct mail_index_map *map)
 	rec_map = i_new(struct mail_index_record_map, 1);
 	i_array_init(&rec_map->maps, 4);
 	array_push_back(&rec_map->maps, &map);
+	DLLIST_PREPEND(&record_maps, rec_map);
 	return rec_map;
 }
 
@@ -449,14 +469,26 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 		   so truncate them away. */
 		i_assert(new_map->records_count > map->hdr.messages_count);
 		new_map->records_count = map->hdr.messages_count;
+		if (new_map->columns != NULL) {
+			array_delete(&new_map->columns->uids,
+				     new_map->records_count,
+				     array_count(&new_map->columns->uids) -
+				     new_map->records_count);
+			array_delete(&new_map->columns->flags,
+				     new_map->records_count,
+				     array_count(&new_map->columns->flags) -
+				     new_map->records_count);
+		}
 		if (new_map->records_count == 0)
 			new_map->last_appended_uid = 0;
 		else {
 			rec = MAIL_INDEX_REC_AT_SEQ(map, new_map->records_count);
 			new_map->last_appended_uid = rec->uid;
 		}
-		buffer_set_used_size(new_map->buffer, new_map->records_count *
-				     map->hdr.record_size);
+		if (new_map->buffer != NULL) {
+			buffer_set_used_size(new_map->buffer,
+				new_map->records_count * map->hdr.record_size);
+		}
 	}
 }
 
@@ -488,10 +520,42 @@ void mail_index_map_move_to_memory(struct mail_index_map *map)
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
 	} else {
-		if (munmap(new_map->mmap_base, new_map->mmap_size) < 0)
-			mail_index_set_syscall_error(map->index, "munmap()");
-		new_map->mmap_base = NULL;
+		mail_index_record_map_munmap(map, new_map);
+	}
+}
+
+bool mail_index_map_mmap_can_append(struct mail_index_map *map,
+				    unsigned int count)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	size_t records_offset;
+
+	if (rec_map->mmap_base == NULL)
+		return FALSE;
+
+	records_offset = (const char *)rec_map->records -
+		(const char *)rec_map->mmap_base;
+	return records_offset + (size_t)(rec_map->records_count + count) *
+		map->hdr.record_size <= rec_map->mmap_reserved_size;
+}
+
+void mail_index_get_memory_usage(struct mail_index_memory_usage *usage_r)
+{
+	struct mail_index_record_map *rec_map;
+
+	i_zero(usage_r);
+	for (rec_map = record_maps; rec_map != NULL; rec_map = rec_map->next) {
+		usage_r->record_maps_count++;
+		if (rec_map->mmap_base != NULL) {
+			usage_r->mmap_bytes += rec_map->mmap_size;
+			usage_r->mmap_reserved_bytes +=
+				rec_map->mmap_reserved_size;
+		}
+		if (rec_map->buffer != NULL)
+			usage_r->private_bytes += buffer_get_size(rec_map->buffer);
 	}
+	usage_r->copy_count = record_map_copy_count;
+	usage_r->copy_bytes = record_map_copy_bytes;
 }
 
 bool mail_index_map_get_ext_idx(struct mail_index_map *map,
@@ -508,17 +572,34 @@ bool mail_index_map_get_ext_idx(struct mail_index_map *map,
 	return *idx_r != (uint32_t)-1;
 }
 
+static inline uint32_t
+mail_index_map_uid_at_idx(const struct mail_index_map *map,
+			  const uint32_t *uids, uint32_t idx)
+{
+	const struct mail_index_record *rec;
+
+	if (uids != NULL)
+		return uids[idx];
+	rec = CONST_PTR_OFFSET(map->rec_map->records,
+			       idx * map->hdr.record_size);
+	return rec->uid;
+}
+
 static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 				       uint32_t uid, uint32_t left_idx,
 				       int nearest_side)
 {
-	const struct mail_index_record *rec_base, *rec;
-	uint32_t idx, right_idx, record_size;
+	const struct mail_index_record_columns *columns =
+		map->rec_map->columns;
+	const uint32_t *uids = NULL;
+	uint32_t idx, right_idx, rec_uid;
 
 	i_assert(map->hdr.messages_count <= map->rec_map->records_count);
 
-	rec_base = map->rec_map->records;
-	record_size = map->hdr.record_size;
+	/* use the UID column if it has already been built. it's a lot more
+	   cache friendly than jumping through the records. */
+	if (columns != NULL)
+		uids = array_front(&columns->uids);
 
 	idx = left_idx;
 	right_idx = I_MIN(map->hdr.messages_count, uid);
@@ -527,25 +608,25 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	while (left_idx < right_idx) {
 		idx = (left_idx + right_idx) / 2;
 
-                rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
-		if (rec->uid < uid)
+		rec_uid = mail_index_map_uid_at_idx(map, uids, idx);
+		if (rec_uid < uid)
 			left_idx = idx+1;
-		else if (rec->uid > uid)
+		else if (rec_uid > uid)
 			right_idx = idx;
 		else
 			break;
 	}
 	i_assert(idx < map->hdr.messages_count);
 
-	rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
-	if (rec->uid != uid) {
+	rec_uid = mail_index_map_uid_at_idx(map, uids, idx);
+	if (rec_uid != uid) {
 		if (nearest_side > 0) {
 			/* we want uid or larger */
-			return rec->uid > uid ? idx+1 :
+			return rec_uid > uid ? idx+1 :
 				(idx == map->hdr.messages_count-1 ? 0 : idx+2);
 		} else {
 			/* we want uid or smaller */
-			return rec->uid < uid ? idx + 1 : idx;
+			return rec_uid < uid ? idx + 1 : idx;
 		}
 	}
 
@@ -593,3 +674,184 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 	}
 	i_assert(*last_seq_r >= *first_seq_r);
 }
+
+void mail_index_record_map_columns_free(struct mail_index_record_map *rec_map)
+{
+	if (rec_map->columns == NULL)
+		return;
+
+	array_free(&rec_map->columns->uids);
+	array_free(&rec_map->columns->flags);
+	i_free_and_null(rec_map->columns);
+}
+
+const struct mail_index_record_columns *
+mail_index_map_get_columns(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	struct mail_index_record_columns *columns = rec_map->columns;
+	const struct mail_index_record *rec;
+	uint32_t *uids;
+	uint8_t *flags;
+	unsigned int i;
+
+	if (columns != NULL) {
+		i_assert(array_count(&columns->uids) == rec_map->records_count);
+		return columns;
+	}
+	if (rec_map->records_count < MAIL_INDEX_RECORD_COLUMNS_MIN_COUNT)
+		return NULL;
+
+	columns = rec_map->columns = i_new(struct mail_index_record_columns, 1);
+	/* leave a bit of space to grow, like the records buffer does */
+	i_array_init(&columns->uids, rec_map->records_count +
+		     rec_map->records_count/100);
+	i_array_init(&columns->flags, rec_map->records_count +
+		     rec_map->records_count/100);
+	(void)array_idx_get_space(&columns->uids, rec_map->records_count - 1);
+	(void)array_idx_get_space(&columns->flags, rec_map->records_count - 1);
+	uids = array_front_modifiable(&columns->uids);
+	flags = array_front_modifiable(&columns->flags);
+	for (i = 0; i < rec_map->records_count; i++) {
+		rec = CONST_PTR_OFFSET(rec_map->records,
+				       i * map->hdr.record_size);
+		uids[i] = rec->uid;
+		flags[i] = rec->flags;
+	}
+	return columns;
+}
+
+void mail_index_record_map_columns_append(struct mail_index_record_map *rec_map,
+					  const struct mail_index_record *rec)
+{
+	struct mail_index_record_columns *columns = rec_map->columns;
+
+	if (columns == NULL)
+		return;
+
+	array_push_back(&columns->uids, &rec->uid);
+	array_push_back(&columns->flags, &rec->flags);
+	i_assert(array_count(&columns->uids) == rec_map->records_count);
+}
+
+void mail_index_record_map_columns_update_flags(struct mail_index_record_map *rec_map,
+						uint32_t seq, uint8_t flags)
+{
+	if (rec_map->columns != NULL)
+		array_idx_set(&rec_map->columns->flags, seq-1, &flags);
+}
+
+void mail_index_record_map_columns_update_flags_range(
+	struct mail_index_record_map *rec_map, uint32_t seq1, uint32_t seq2,
+	uint8_t flag_mask, uint8_t add_flags)
+{
+	uint8_t *flags;
+	unsigned int count;
+
+	if (rec_map->columns == NULL)
+		return;
+
+	flags = array_get_modifiable(&rec_map->columns->flags, &count);
+	i_assert(seq1 > 0 && seq2 <= count);
+	for (; seq1 <= seq2; seq1++)
+		flags[seq1-1] = (flags[seq1-1] & flag_mask) | add_flags;
+}
+
+void mail_index_record_map_columns_expunge(struct mail_index_record_map *rec_map,
+					   const ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_record_columns *columns = rec_map->columns;
+	const struct seq_range *range;
+	uint32_t *uids;
+	uint8_t *flags;
+	unsigned int src_idx = 0, dest_idx = 0, count;
+
+	if (columns == NULL)
+		return;
+
+	/* this follows the same logic as expunging the records */
+	uids = array_get_modifiable(&columns->uids, &count);
+	flags = array_front_modifiable(&columns->flags);
+	array_foreach(seqs, range) {
+		i_assert(range->seq1 - 1 >= src_idx);
+		i_assert(range->seq2 <= count);
+
+		if (src_idx != dest_idx) {
+			memmove(uids + dest_idx, uids + src_idx,
+				(range->seq1 - 1 - src_idx) * sizeof(*uids));
+			memmove(flags + dest_idx, flags + src_idx,
+				(range->seq1 - 1 - src_idx) * sizeof(*flags));
+		}
+		dest_idx += range->seq1 - 1 - src_idx;
+		src_idx = range->seq2;
+	}
+	if (src_idx != dest_idx) {
+		memmove(uids + dest_idx, uids + src_idx,
+			(count - src_idx) * sizeof(*uids));
+		memmove(flags + dest_idx, flags + src_idx,
+			(count - src_idx) * sizeof(*flags));
+	}
+	dest_idx += count - src_idx;
+	array_delete(&columns->uids, dest_idx, count - dest_idx);
+	array_delete(&columns->flags, dest_idx, count - dest_idx);
+}
+
+/* Number of flags checked at a time. There's no early exit within a block,
+   so the compiler can vectorize the loop. */
+#define MAIL_INDEX_FLAGS_SCAN_BLOCK_SIZE 32
+
+static uint32_t
+mail_index_columns_find_flags(const uint8_t *column, uint32_t idx,
+			      uint32_t end_idx, uint8_t flags,
+			      uint8_t flags_mask)
+{
+	unsigned int i;
+	uint8_t found;
+
+	while (end_idx - idx >= MAIL_INDEX_FLAGS_SCAN_BLOCK_SIZE) {
+		found = 0;
+		for (i = 0; i < MAIL_INDEX_FLAGS_SCAN_BLOCK_SIZE; i++)
+			found |= (column[idx + i] & flags_mask) == flags;
+		if (found != 0)
+			break;
+		idx += MAIL_INDEX_FLAGS_SCAN_BLOCK_SIZE;
+	}
+	for (; idx < end_idx; idx++) {
+		if ((column[idx] & flags_mask) == flags)
+			break;
+	}
+	return idx;
+}
+
+uint32_t mail_index_map_find_flags(struct mail_index_map *map,
+				   uint8_t flags, uint8_t flags_mask,
+				   uint32_t seq1, uint32_t seq2)
+{
+	const struct mail_index_record_columns *columns;
+	const struct mail_index_record *rec;
+	uint32_t seq;
+
+	i_assert(map->hdr.messages_count <= map->rec_map->records_count);
+
+	if (seq2 > map->hdr.messages_count)
+		seq2 = map->hdr.messages_count;
+	if (seq1 == 0)
+		seq1 = 1;
+	if (seq1 > seq2)
+		return 0;
+
+	columns = mail_index_map_get_columns(map);
+	if (columns != NULL) {
+		seq = mail_index_columns_find_flags(
+			array_front(&columns->flags), seq1 - 1, seq2,
+			flags, flags_mask) + 1;
+		return seq <= seq2 ? seq : 0;
+	}
+
+	for (seq = seq1; seq <= seq2; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		if ((rec->flags & flags_mask) == flags)
+			return seq;
+	}
+	return 0;
+}
@@ -15,6 +15,9 @@ struct mail_index_sync_map_ctx;
 
 /* How large index files to mmap() instead of reading to memory. */
 #define MAIL_INDEX_MMAP_MIN_SIZE (1024*64)
+/* Minimum amount of address space reserved after mmap()ed index for
+   appending new records. */
+#define MAIL_INDEX_MMAP_MIN_RESERVE_SIZE (1024*64)
 /* How many times to retry opening index files if read/fstat returns ESTALE.
    This happens with NFS when the file has been deleted (ie. index file was
    rewritten by another computer than us). */
@@ -113,11 +116,30 @@ struct mail_index_registered_ext {
 	mail_index_expunge_handler_t *expunge_handler;
 };
 
+/* Don't bother building record columns for maps smaller than this. */
+#define MAIL_INDEX_RECORD_COLUMNS_MIN_COUNT 256
+
+/* Dense copies of the records' UIDs and flags. Scanning through these is
+   much faster than walking through the full records, which can be large
+   because of extensions. Built lazily by mail_index_map_get_columns() and
+   kept up to date while syncing. */
+struct mail_index_record_columns {
+	ARRAY_TYPE(uint32_t) uids;
+	ARRAY(uint8_t) flags;
+};
+
 struct mail_index_record_map {
+	/* Linked list of all record maps in the process */
+	struct mail_index_record_map *prev, *next;
 	ARRAY(struct mail_index_map *) maps;
 
+	/* The index file is mmap()ed privately with copy-on-write, so its
+	   pages are shared with other processes until they're modified.
+	   mmap_size is the size of the file. mmap_reserved_size additionally
+	   includes anonymous memory reserved after the file, which allows
+	   appending records without copying the records to memory. */
 	void *mmap_base;
-	size_t mmap_size, mmap_used_size;
+	size_t mmap_size, mmap_used_size, mmap_reserved_size;
 
 	buffer_t *buffer;
 
@@ -125,6 +147,7 @@ struct mail_index_record_map {
 	unsigned int records_count;
 
 	struct mail_index_map_modseq *modseq;
+	struct mail_index_record_columns *columns;
 	uint32_t last_appended_uid;
 };
 
@@ -359,10 +382,40 @@ int mail_index_map(struct mail_index *index,
 void mail_index_unmap(struct mail_index_map **map);
 /* Clone a map. It still points to the original rec_map. */
 struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map);
-/* Make sure the map has its own private rec_map, cloning it if necessary. */
+/* Make sure the map has its own private rec_map, cloning it if necessary.
+   A rec_map that isn't shared with other maps is kept mmap()ed. */
 void mail_index_record_map_move_to_private(struct mail_index_map *map);
 /* If map points to mmap()ed index, copy it to the memory. */
 void mail_index_map_move_to_memory(struct mail_index_map *map);
+/* Returns TRUE if the mmap()ed map has space reserved for appending
+   the given number of records. */
+bool mail_index_map_mmap_can_append(struct mail_index_map *map,
+				    unsigned int count);
+
+/* Returns the map's record columns, building them if necessary. Returns NULL
+   if the map is too small for the columns to be useful. */
+const struct mail_index_record_columns *
+mail_index_map_get_columns(struct mail_index_map *map);
+/* Drop the record columns. This needs to be called whenever the records are
+   changed by something else than syncing. */
+void mail_index_record_map_columns_free(struct mail_index_record_map *rec_map);
+/* Keep the record columns in sync with the records. These are no-ops if the
+   columns haven't been built. */
+void mail_index_record_map_columns_append(struct mail_index_record_map *rec_map,
+					  const struct mail_index_record *rec);
+void mail_index_record_map_columns_update_flags(struct mail_index_record_map *rec_map,
+						uint32_t seq, uint8_t flags);
+/* Apply (flags & flag_mask) | add_flags to all the columns in seq1..seq2. */
+void mail_index_record_map_columns_update_flags_range(
+	struct mail_index_record_map *rec_map, uint32_t seq1, uint32_t seq2,
+	uint8_t flag_mask, uint8_t add_flags);
+void mail_index_record_map_columns_expunge(struct mail_index_record_map *rec_map,
+					   const ARRAY_TYPE(seq_range) *seqs);
+/* Returns the first sequence in seq1..seq2 where
+   (flags & flags_mask) == flags, or 0 if there are none. */
+uint32_t mail_index_map_find_flags(struct mail_index_map *map,
+				   uint8_t flags, uint8_t flags_mask,
+				   uint32_t seq1, uint32_t seq2);
 
 void mail_index_fchown(struct mail_index *index, int fd, const char *path);
 
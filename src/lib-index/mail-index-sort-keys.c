@@ -0,0 +1,484 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "ostream.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "mmap-util.h"
+#include "safe-mkstemp.h"
+#include "mail-index-private.h"
+#include "mail-index-sort-keys.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+/* Rewrite the file when the chain has this many appended blocks */
+#define SORT_KEYS_MAX_CHAIN_BLOCKS 8
+/* Rewrite the file when it has this many blocks in total, including the
+   blocks left behind by concurrent writers */
+#define SORT_KEYS_MAX_FILE_BLOCKS 32
+
+struct mail_index_sort_keys_block {
+	const unsigned char *data;
+	const struct mail_index_sort_keys_rec *recs;
+	uint32_t file_id, parent_file_id;
+	uint32_t count, size;
+};
+ARRAY_DEFINE_TYPE(mail_index_sort_keys_block,
+		  struct mail_index_sort_keys_block);
+
+struct mail_index_sort_keys {
+	struct mail_index *index;
+	char *path;
+
+	void *mmap_base;
+	buffer_t *buf;
+	const unsigned char *data;
+	size_t size;
+	ino_t ino;
+
+	/* offset after the last valid block */
+	size_t valid_end_offset;
+	unsigned int file_block_count;
+	/* chain of blocks, the latest first */
+	ARRAY_TYPE(mail_index_sort_keys_block) chain;
+	size_t chain_appended_size;
+	uint32_t file_id;
+};
+
+struct mail_index_sort_keys *
+mail_index_sort_keys_init(struct mail_index *index, const char *suffix)
+{
+	struct mail_index_sort_keys *keys;
+
+	i_assert(!MAIL_INDEX_IS_IN_MEMORY(index));
+
+	keys = i_new(struct mail_index_sort_keys, 1);
+	keys->index = index;
+	keys->path = i_strconcat(index->filepath, suffix, NULL);
+	i_array_init(&keys->chain, 8);
+	return keys;
+}
+
+static void
+mail_index_sort_keys_set_syscall_error(struct mail_index_sort_keys *keys,
+				       const char *function)
+{
+	i_assert(function != NULL);
+
+	if (ENOSPACE(errno)) {
+		keys->index->last_error.nodiskspace = TRUE;
+		if ((keys->index->flags &
+		     MAIL_INDEX_OPEN_FLAG_NEVER_IN_MEMORY) == 0)
+			return;
+	}
+
+	mail_index_set_error(keys->index,
+			     "%s failed with sort keys file %s: %m",
+			     function, keys->path);
+}
+
+static void mail_index_sort_keys_reset(struct mail_index_sort_keys *keys)
+{
+	if (keys->mmap_base != NULL) {
+		if (munmap(keys->mmap_base, keys->size) < 0)
+			mail_index_sort_keys_set_syscall_error(keys, "munmap()");
+		keys->mmap_base = NULL;
+	}
+	buffer_free(&keys->buf);
+	keys->data = NULL;
+	keys->size = 0;
+	keys->valid_end_offset = 0;
+	keys->file_block_count = 0;
+	keys->chain_appended_size = 0;
+	keys->file_id = 0;
+	array_clear(&keys->chain);
+}
+
+void mail_index_sort_keys_deinit(struct mail_index_sort_keys **_keys)
+{
+	struct mail_index_sort_keys *keys = *_keys;
+
+	*_keys = NULL;
+	mail_index_sort_keys_reset(keys);
+	array_free(&keys->chain);
+	i_free(keys->path);
+	i_free(keys);
+}
+
+static int
+mail_index_sort_keys_map(struct mail_index_sort_keys *keys, int fd)
+{
+	struct stat st;
+	int ret;
+
+	if (fstat(fd, &st) < 0) {
+		mail_index_sort_keys_set_syscall_error(keys, "fstat()");
+		return -1;
+	}
+	keys->ino = st.st_ino;
+	if (st.st_size < (off_t)sizeof(struct mail_index_sort_keys_header))
+		return 0;
+
+	keys->size = st.st_size;
+	if ((keys->index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0) {
+		keys->mmap_base = mmap_ro_file(fd, &keys->size);
+		if (keys->mmap_base == MAP_FAILED) {
+			keys->mmap_base = NULL;
+			keys->size = 0;
+			mail_index_sort_keys_set_syscall_error(keys, "mmap()");
+			return -1;
+		}
+		keys->data = keys->mmap_base;
+		return 1;
+	}
+
+	keys->buf = buffer_create_dynamic(default_pool, keys->size);
+	ret = read_full(fd, buffer_append_space_unsafe(keys->buf, keys->size),
+			keys->size);
+	if (ret <= 0) {
+		if (ret < 0)
+			mail_index_sort_keys_set_syscall_error(keys, "read()");
+		buffer_free(&keys->buf);
+		keys->size = 0;
+		return ret;
+	}
+	keys->data = keys->buf->data;
+	return 1;
+}
+
+static void
+mail_index_sort_keys_read_blocks(struct mail_index_sort_keys *keys,
+				 ARRAY_TYPE(mail_index_sort_keys_block) *blocks)
+{
+	struct mail_index_sort_keys_block_header bhdr;
+	struct mail_index_sort_keys_block *block;
+	size_t offset = sizeof(struct mail_index_sort_keys_header);
+
+	while (keys->size - offset >= sizeof(bhdr)) {
+		memcpy(&bhdr, keys->data + offset, sizeof(bhdr));
+		if (bhdr.size < sizeof(bhdr) || bhdr.size % 4 != 0 ||
+		    bhdr.size > keys->size - offset ||
+		    (bhdr.size - sizeof(bhdr)) /
+		    sizeof(struct mail_index_sort_keys_rec) < bhdr.count) {
+			/* partially written block */
+			break;
+		}
+
+		block = array_append_space(blocks);
+		block->data = keys->data + offset;
+		block->recs = CONST_PTR_OFFSET(block->data, sizeof(bhdr));
+		block->file_id = bhdr.file_id;
+		block->parent_file_id = bhdr.parent_file_id;
+		block->count = bhdr.count;
+		block->size = bhdr.size;
+		offset += bhdr.size;
+	}
+	keys->valid_end_offset = offset;
+	keys->file_block_count = array_count(blocks);
+}
+
+static bool
+mail_index_sort_keys_find_chain(struct mail_index_sort_keys *keys,
+				const ARRAY_TYPE(mail_index_sort_keys_block) *blocks,
+				uint32_t file_id)
+{
+	const struct mail_index_sort_keys_block *block;
+	unsigned int i, count;
+
+	block = array_get(blocks, &count);
+	while (file_id != 0) {
+		/* the file_ids are random, so there shouldn't be duplicates.
+		   if there are, prefer the latest. */
+		for (i = count; i > 0; i--) {
+			if (block[i-1].file_id == file_id)
+				break;
+		}
+		if (i == 0 || array_count(&keys->chain) >= count)
+			return FALSE;
+		array_push_back(&keys->chain, &block[i-1]);
+		if (block[i-1].parent_file_id != 0)
+			keys->chain_appended_size += block[i-1].size;
+		file_id = block[i-1].parent_file_id;
+	}
+	return TRUE;
+}
+
+int mail_index_sort_keys_read(struct mail_index_sort_keys *keys,
+			      struct mail_index_view *view, uint32_t file_id)
+{
+	ARRAY_TYPE(mail_index_sort_keys_block) blocks;
+	struct mail_index_sort_keys_header hdr;
+	int fd, ret;
+
+	mail_index_sort_keys_reset(keys);
+	if (file_id == 0)
+		return 0;
+
+	fd = open(keys->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		mail_index_sort_keys_set_syscall_error(keys, "open()");
+		return -1;
+	}
+	ret = mail_index_sort_keys_map(keys, fd);
+	if (close(fd) < 0)
+		mail_index_sort_keys_set_syscall_error(keys, "close()");
+	if (ret <= 0)
+		return ret;
+
+	memcpy(&hdr, keys->data, sizeof(hdr));
+	if (hdr.version != MAIL_INDEX_SORT_KEYS_VERSION ||
+	    hdr.uid_validity != mail_index_get_header(view)->uid_validity)
+		return 0;
+
+	t_array_init(&blocks, 16);
+	mail_index_sort_keys_read_blocks(keys, &blocks);
+	if (!mail_index_sort_keys_find_chain(keys, &blocks, file_id)) {
+		array_clear(&keys->chain);
+		keys->chain_appended_size = 0;
+		return 0;
+	}
+	keys->file_id = file_id;
+	return 1;
+}
+
+static const char *
+mail_index_sort_keys_block_lookup(const struct mail_index_sort_keys_block *block,
+				  uint32_t sort_id)
+{
+	const struct mail_index_sort_keys_rec *rec;
+	unsigned int idx, left_idx = 0, right_idx = block->count;
+	size_t recs_end;
+
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		rec = &block->recs[idx];
+		if (rec->sort_id < sort_id)
+			left_idx = idx + 1;
+		else if (rec->sort_id > sort_id)
+			right_idx = idx;
+		else {
+			recs_end = sizeof(struct mail_index_sort_keys_block_header) +
+				block->count * sizeof(*rec);
+			if (rec->str_offset < recs_end ||
+			    rec->str_offset >= block->size ||
+			    memchr(block->data + rec->str_offset, '\0',
+				   block->size - rec->str_offset) == NULL)
+				return NULL;
+			return (const char *)block->data + rec->str_offset;
+		}
+	}
+	return NULL;
+}
+
+const char *
+mail_index_sort_keys_lookup(struct mail_index_sort_keys *keys,
+			    uint32_t sort_id)
+{
+	const struct mail_index_sort_keys_block *block;
+	const char *str;
+
+	/* the latest block overrides its parents */
+	array_foreach(&keys->chain, block) {
+		str = mail_index_sort_keys_block_lookup(block, sort_id);
+		if (str != NULL)
+			return str;
+	}
+	return NULL;
+}
+
+bool mail_index_sort_keys_want_rewrite(struct mail_index_sort_keys *keys)
+{
+	const struct mail_index_sort_keys_block *root;
+
+	if (array_count(&keys->chain) == 0)
+		return TRUE;
+	if (array_count(&keys->chain) >= SORT_KEYS_MAX_CHAIN_BLOCKS ||
+	    keys->file_block_count >= SORT_KEYS_MAX_FILE_BLOCKS)
+		return TRUE;
+	/* rewrite when the appended blocks become larger than the initial
+	   block. they may contain a lot of keys that are no longer used. */
+	root = array_back(&keys->chain);
+	return keys->chain_appended_size > root->size;
+}
+
+static uint32_t mail_index_sort_keys_new_file_id(struct mail_index_sort_keys *keys)
+{
+	uint32_t file_id;
+
+	do {
+		file_id = i_rand_minmax(1, (uint32_t)-1);
+	} while (file_id == keys->file_id);
+	return file_id;
+}
+
+static int
+mail_index_sort_keys_build_block(struct mail_index_sort_keys *keys,
+				 buffer_t *buf, uint32_t file_id,
+				 uint32_t parent_file_id,
+				 const ARRAY_TYPE(mail_index_sort_key) *new_keys)
+{
+	struct mail_index_sort_keys_block_header bhdr;
+	struct mail_index_sort_keys_rec rec;
+	const struct mail_index_sort_key *key;
+	size_t block_offset = buf->used, rec_offset;
+	unsigned int i, count;
+
+	key = array_get(new_keys, &count);
+
+	i_zero(&bhdr);
+	bhdr.file_id = file_id;
+	bhdr.parent_file_id = parent_file_id;
+	bhdr.count = count;
+	buffer_append_zero(buf, sizeof(bhdr) + count * sizeof(rec));
+
+	rec_offset = block_offset + sizeof(bhdr);
+	for (i = 0; i < count; i++) {
+		i_assert(i == 0 || key[i-1].sort_id < key[i].sort_id);
+
+		rec.sort_id = key[i].sort_id;
+		rec.str_offset = buf->used - block_offset;
+		buffer_write(buf, rec_offset, &rec, sizeof(rec));
+		rec_offset += sizeof(rec);
+		buffer_append(buf, key[i].str, strlen(key[i].str) + 1);
+	}
+	if ((buf->used - block_offset) % 4 != 0)
+		buffer_append_zero(buf, 4 - (buf->used - block_offset) % 4);
+	if (buf->used - block_offset > (uint32_t)-1) {
+		mail_index_set_error(keys->index,
+				     "Sort keys file %s would become too large",
+				     keys->path);
+		return -1;
+	}
+	bhdr.size = buf->used - block_offset;
+	buffer_write(buf, block_offset, &bhdr, sizeof(bhdr));
+	return 0;
+}
+
+int mail_index_sort_keys_append(struct mail_index_sort_keys *keys,
+				const ARRAY_TYPE(mail_index_sort_key) *new_keys,
+				uint32_t *file_id_r)
+{
+	struct stat st;
+	buffer_t *buf;
+	uint32_t file_id;
+	int fd, ret = 1;
+
+	i_assert(array_count(&keys->chain) > 0);
+
+	fd = open(keys->path, O_WRONLY | O_APPEND);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		mail_index_sort_keys_set_syscall_error(keys, "open()");
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		mail_index_sort_keys_set_syscall_error(keys, "fstat()");
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_ino != keys->ino || (uoff_t)st.st_size != keys->size ||
+	    keys->valid_end_offset != keys->size) {
+		/* file was replaced or appended to, or it has a partially
+		   written block at the end. */
+		i_close_fd(&fd);
+		return 0;
+	}
+
+	file_id = mail_index_sort_keys_new_file_id(keys);
+	buf = buffer_create_dynamic(default_pool, 1024);
+	if (mail_index_sort_keys_build_block(keys, buf, file_id,
+					     keys->file_id, new_keys) < 0)
+		ret = -1;
+	else if (write_full(fd, buf->data, buf->used) < 0) {
+		mail_index_sort_keys_set_syscall_error(keys, "write()");
+		ret = -1;
+	} else if (keys->index->set.fsync_mode == FSYNC_MODE_ALWAYS &&
+		   fdatasync(fd) < 0) {
+		mail_index_sort_keys_set_syscall_error(keys, "fdatasync()");
+		ret = -1;
+	}
+	buffer_free(&buf);
+	if (close(fd) < 0) {
+		mail_index_sort_keys_set_syscall_error(keys, "close()");
+		ret = -1;
+	}
+	if (ret > 0)
+		*file_id_r = file_id;
+	return ret;
+}
+
+int mail_index_sort_keys_rewrite(struct mail_index_sort_keys *keys,
+				 struct mail_index_view *view,
+				 const ARRAY_TYPE(mail_index_sort_key) *all_keys,
+				 uint32_t *file_id_r)
+{
+	struct mail_index *index = keys->index;
+	struct mail_index_sort_keys_header hdr;
+	struct ostream *output;
+	buffer_t *buf;
+	string_t *str;
+	const char *temp_path;
+	uint32_t file_id;
+	int fd, ret = 0;
+
+	file_id = mail_index_sort_keys_new_file_id(keys);
+	buf = buffer_create_dynamic(default_pool, 1024);
+	i_zero(&hdr);
+	hdr.version = MAIL_INDEX_SORT_KEYS_VERSION;
+	hdr.uid_validity = mail_index_get_header(view)->uid_validity;
+	buffer_append(buf, &hdr, sizeof(hdr));
+	if (mail_index_sort_keys_build_block(keys, buf, file_id, 0,
+					     all_keys) < 0) {
+		buffer_free(&buf);
+		return -1;
+	}
+
+	str = t_str_new(256);
+	str_append(str, keys->path);
+	fd = safe_mkstemp_hostpid_group(str, index->set.mode, index->set.gid,
+					index->set.gid_origin);
+	temp_path = str_c(str);
+	if (fd == -1) {
+		mail_index_set_error(index, "safe_mkstemp_hostpid(%s) failed: %m",
+				     temp_path);
+		buffer_free(&buf);
+		return -1;
+	}
+
+	output = o_stream_create_fd(fd, 0);
+	o_stream_cork(output);
+	o_stream_nsend(output, buf->data, buf->used);
+	buffer_free(&buf);
+	if (o_stream_finish(output) < 0) {
+		mail_index_set_error(index, "write(%s) failed: %s",
+				     temp_path, o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	if (ret == 0 && index->set.fsync_mode == FSYNC_MODE_ALWAYS &&
+	    fdatasync(fd) < 0) {
+		mail_index_set_error(index, "fdatasync(%s) failed: %m",
+				     temp_path);
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		mail_index_set_error(index, "close(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (ret == 0 && rename(temp_path, keys->path) < 0) {
+		mail_index_set_error(index, "rename(%s, %s) failed: %m",
+				     temp_path, keys->path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink(temp_path);
+	else
+		*file_id_r = file_id;
+	return ret;
+}
@@ -0,0 +1,77 @@
+#ifndef MAIL_INDEX_SORT_KEYS_H
+#define MAIL_INDEX_SORT_KEYS_H
+
+/* Sort keys file maps string sort IDs (see index-sort-string.c) to their
+   sort strings, so that the sort IDs can be updated for new mails without
+   looking up the existing mails' strings from cache.
+
+   The file consists of blocks. Each block has a unique file_id and it adds
+   keys on top of its parent block. The keys are valid for the chain of blocks
+   that ends with the file_id that is stored in the sort extension's header.
+   Blocks of other chains are leftovers from concurrent writers. */
+
+struct mail_index;
+struct mail_index_view;
+
+struct mail_index_sort_keys_header {
+#define MAIL_INDEX_SORT_KEYS_VERSION 1
+	uint8_t version;
+	uint8_t unused[3];
+
+	uint32_t uid_validity;
+};
+
+struct mail_index_sort_keys_block_header {
+	uint32_t file_id;
+	/* 0 if this is the first block in the chain */
+	uint32_t parent_file_id;
+	/* Number of mail_index_sort_keys_rec following the header */
+	uint32_t count;
+	/* Size of the whole block, including the header and the strings */
+	uint32_t size;
+};
+
+struct mail_index_sort_keys_rec {
+	uint32_t sort_id;
+	/* Offset to the NUL-terminated string from the beginning of the
+	   block */
+	uint32_t str_offset;
+};
+
+struct mail_index_sort_key {
+	uint32_t sort_id;
+	const char *str;
+};
+ARRAY_DEFINE_TYPE(mail_index_sort_key, struct mail_index_sort_key);
+
+struct mail_index_sort_keys *
+mail_index_sort_keys_init(struct mail_index *index, const char *suffix);
+void mail_index_sort_keys_deinit(struct mail_index_sort_keys **keys);
+
+/* Read the keys for the chain ending with file_id. Returns 1 if found,
+   0 if not, -1 on error. The looked up strings stay valid until the keys
+   are read again or deinitialized. */
+int mail_index_sort_keys_read(struct mail_index_sort_keys *keys,
+			      struct mail_index_view *view, uint32_t file_id);
+/* Returns the sort string for the sort_id, or NULL if it's not known. */
+const char *
+mail_index_sort_keys_lookup(struct mail_index_sort_keys *keys,
+			    uint32_t sort_id);
+
+/* Returns TRUE if the keys should be written with
+   mail_index_sort_keys_rewrite() rather than appended. */
+bool mail_index_sort_keys_want_rewrite(struct mail_index_sort_keys *keys);
+/* Append new keys on top of the currently read keys. The keys must be
+   sorted by sort_id. Returns 1 if ok, 0 if the file had been changed and it
+   needs to be rewritten instead, -1 on error. */
+int mail_index_sort_keys_append(struct mail_index_sort_keys *keys,
+				const ARRAY_TYPE(mail_index_sort_key) *new_keys,
+				uint32_t *file_id_r);
+/* Replace the file with the given keys, sorted by sort_id.
+   Returns 0 if ok, -1 on error. */
+int mail_index_sort_keys_rewrite(struct mail_index_sort_keys *keys,
+				 struct mail_index_view *view,
+				 const ARRAY_TYPE(mail_index_sort_key) *all_keys,
+				 uint32_t *file_id_r);
+
+#endif
@@ -32,7 +32,15 @@ struct mail_index_strmap_view {
 
 	ARRAY_TYPE(mail_index_strmap_rec) recs;
 	ARRAY(uint32_t) recs_crc32;
-	struct hash2_table *hash;
+	/* Open-addressed hash table of recs indexes (+1), looked up with
+	   the recs_crc32. This avoids keeping another copy of each record in
+	   the hash table. */
+	uint32_t *hash;
+	/* Hash table size (power of 2), number of records in it, and number
+	   of used slots including the removed records */
+	unsigned int hash_size, hash_count, hash_used_count;
+	/* Number of records with unique strings, which aren't in the hash */
+	unsigned int unique_count;
 
 	mail_index_strmap_key_cmp_t *key_compare;
 	mail_index_strmap_rec_cmp_t *rec_compare;
@@ -72,11 +80,6 @@ struct mail_index_strmap_view_sync {
 	struct mail_index_strmap_view *view;
 };
 
-struct mail_index_strmap_hash_key {
-	const char *str;
-	uint32_t crc32;
-};
-
 /* number of bytes required to store one string idx */
 #define STRMAP_FILE_STRIDX_SIZE (sizeof(uint32_t)*2)
 
@@ -89,6 +92,11 @@ struct mail_index_strmap_hash_key {
 
 #define MAIL_INDEX_STRMAP_TIMEOUT_SECS 10
 
+/* hash table slot values. Other values are recs indexes + 1. */
+#define STRMAP_HASH_SLOT_UNUSED 0
+#define STRMAP_HASH_SLOT_REMOVED ((uint32_t)-1)
+#define STRMAP_HASH_MIN_SIZE 128
+
 static const struct dotlock_settings default_dotlock_settings = {
 	.timeout = MAIL_INDEX_STRMAP_TIMEOUT_SECS,
 	.stale_timeout = 30
@@ -161,21 +169,95 @@ void mail_index_strmap_deinit(struct mail_index_strmap **_strmap)
 	i_free(strmap);
 }
 
-static unsigned int mail_index_strmap_hash_key(const void *_key)
+static void
+mail_index_strmap_hash_insert_nogrow(struct mail_index_strmap_view *view,
+				     unsigned int rec_idx, uint32_t crc32)
 {
-	const struct mail_index_strmap_hash_key *key = _key;
+	unsigned int pos, mask = view->hash_size - 1;
+
+	i_assert(crc32 != 0);
 
-	return key->crc32;
+	for (pos = crc32 & mask; view->hash[pos] != STRMAP_HASH_SLOT_UNUSED;
+	     pos = (pos + 1) & mask) ;
+	view->hash[pos] = rec_idx + 1;
+	view->hash_count++;
+	view->hash_used_count++;
 }
 
-static bool
-mail_index_strmap_hash_cmp(const void *_key, const void *_value, void *context)
+static void mail_index_strmap_hash_resize(struct mail_index_strmap_view *view)
+{
+	const uint32_t *recs_crc32 = array_front(&view->recs_crc32);
+	uint32_t *old_hash = view->hash;
+	unsigned int i, old_size = view->hash_size;
+	unsigned int size = STRMAP_HASH_MIN_SIZE;
+
+	/* keep the table at most half full. the removed slots are dropped. */
+	while (size / 2 <= view->hash_count + 1)
+		size *= 2;
+	view->hash = i_new(uint32_t, size);
+	view->hash_size = size;
+	view->hash_count = 0;
+	view->hash_used_count = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old_hash[i] != STRMAP_HASH_SLOT_UNUSED &&
+		    old_hash[i] != STRMAP_HASH_SLOT_REMOVED) {
+			mail_index_strmap_hash_insert_nogrow(view,
+				old_hash[i] - 1, recs_crc32[old_hash[i] - 1]);
+		}
+	}
+	i_free(old_hash);
+}
+
+static void
+mail_index_strmap_hash_insert(struct mail_index_strmap_view *view,
+			      unsigned int rec_idx, uint32_t crc32)
 {
-	const struct mail_index_strmap_hash_key *key = _key;
-	const struct mail_index_strmap_rec *rec = _value;
-	struct mail_index_strmap_view *view = context;
+	if ((view->hash_used_count + 1) * 2 > view->hash_size)
+		mail_index_strmap_hash_resize(view);
+	mail_index_strmap_hash_insert_nogrow(view, rec_idx, crc32);
+}
 
-	return view->key_compare(key->str, rec, view->cb_context);
+static void mail_index_strmap_hash_clear(struct mail_index_strmap_view *view)
+{
+	memset(view->hash, 0, sizeof(view->hash[0]) * view->hash_size);
+	view->hash_count = 0;
+	view->hash_used_count = 0;
+	view->unique_count = 0;
+}
+
+/* Returns the next record with the given crc32, or NULL if there are no
+   more. *pos must be initialized to UINT_MAX. */
+static struct mail_index_strmap_rec *
+mail_index_strmap_hash_iterate(struct mail_index_strmap_view *view,
+			       uint32_t crc32, unsigned int *pos)
+{
+	const uint32_t *recs_crc32;
+	unsigned int count, mask = view->hash_size - 1;
+	uint32_t slot;
+
+	recs_crc32 = array_get(&view->recs_crc32, &count);
+
+	*pos = *pos == UINT_MAX ? (crc32 & mask) : ((*pos + 1) & mask);
+	for (;; *pos = (*pos + 1) & mask) {
+		slot = view->hash[*pos];
+		if (slot == STRMAP_HASH_SLOT_UNUSED)
+			return NULL;
+		i_assert(slot == STRMAP_HASH_SLOT_REMOVED || slot - 1 < count);
+		if (slot != STRMAP_HASH_SLOT_REMOVED &&
+		    recs_crc32[slot - 1] == crc32)
+			return array_idx_modifiable(&view->recs, slot - 1);
+	}
+}
+
+static void
+mail_index_strmap_hash_remove(struct mail_index_strmap_view *view,
+			      unsigned int pos)
+{
+	i_assert(view->hash[pos] != STRMAP_HASH_SLOT_UNUSED &&
+		 view->hash[pos] != STRMAP_HASH_SLOT_REMOVED);
+	view->hash[pos] = STRMAP_HASH_SLOT_REMOVED;
+	view->hash_count--;
 }
 
 struct mail_index_strmap_view *
@@ -185,8 +267,7 @@ mail_index_strmap_view_open(struct mail_index_strmap *strmap,
 			    mail_index_strmap_rec_cmp_t *rec_compare_cb,
 			    mail_index_strmap_remap_t *remap_cb,
 			    void *context,
-			    const ARRAY_TYPE(mail_index_strmap_rec) **recs_r,
-			    const struct hash2_table **hash_r)
+			    const ARRAY_TYPE(mail_index_strmap_rec) **recs_r)
 {
 	struct mail_index_strmap_view *view;
 
@@ -201,11 +282,9 @@ mail_index_strmap_view_open(struct mail_index_strmap *strmap,
 
 	i_array_init(&view->recs, 64);
 	i_array_init(&view->recs_crc32, 64);
-	view->hash = hash2_create(0, sizeof(struct mail_index_strmap_rec),
-				  mail_index_strmap_hash_key,
-				  mail_index_strmap_hash_cmp, view);
+	view->hash = i_new(uint32_t, STRMAP_HASH_MIN_SIZE);
+	view->hash_size = STRMAP_HASH_MIN_SIZE;
 	*recs_r = &view->recs;
-	*hash_r = view->hash;
 	return view;
 }
 
@@ -216,7 +295,7 @@ void mail_index_strmap_view_close(struct mail_index_strmap_view **_view)
 	*_view = NULL;
 	array_free(&view->recs);
 	array_free(&view->recs_crc32);
-	hash2_destroy(&view->hash);
+	i_free(view->hash);
 	i_free(view);
 }
 
@@ -230,7 +309,7 @@ static void mail_index_strmap_view_reset(struct mail_index_strmap_view *view)
 	view->remap_cb(NULL, 0, 0, view->cb_context);
 	array_clear(&view->recs);
 	array_clear(&view->recs_crc32);
-	hash2_clear(view->hash);
+	mail_index_strmap_hash_clear(view);
 
 	view->last_added_uid = 0;
 	view->lost_expunged_uid = 0;
@@ -611,14 +690,14 @@ strmap_read_block_deinit(struct mail_index_strmap_read_context *ctx, int ret,
 static bool
 strmap_view_sync_handle_conflict(struct mail_index_strmap_read_context *ctx,
 				 const struct mail_index_strmap_rec *hash_rec,
-				 struct hash2_iter *iter)
+				 unsigned int hash_pos)
 {
 	uint32_t seq;
 
 	/* hopefully it's a message that has since been expunged */
 	if (!mail_index_lookup_seq(ctx->view->view, hash_rec->uid, &seq)) {
 		/* message is no longer in our view. remove it completely. */
-		hash2_remove_iter(ctx->view->hash, iter);
+		mail_index_strmap_hash_remove(ctx->view, hash_pos);
 		return TRUE;
 	}
 	if (mail_index_is_expunged(ctx->view->view, seq)) {
@@ -638,7 +717,7 @@ strmap_view_sync_block_check_conflicts(struct mail_index_strmap_read_context *ct
 				       uint32_t crc32)
 {
 	struct mail_index_strmap_rec *hash_rec;
-	struct hash2_iter iter;
+	unsigned int hash_pos = UINT_MAX;
 
 	if (crc32 == 0) {
 		/* unique string - there are no conflicts */
@@ -655,12 +734,12 @@ strmap_view_sync_block_check_conflicts(struct mail_index_strmap_read_context *ct
 
 	if we detect such a conflict, we can't continue using the
 	strmap index until X has been expunged. */
-	i_zero(&iter);
-	while ((hash_rec = hash2_iterate(ctx->view->hash,
-					 crc32, &iter)) != NULL &&
+	while ((hash_rec = mail_index_strmap_hash_iterate(ctx->view, crc32,
+							  &hash_pos)) != NULL &&
 	       hash_rec->str_idx != ctx->rec.str_idx) {
 		/* CRC32 matches, but string index doesn't */
-		if (!strmap_view_sync_handle_conflict(ctx, hash_rec, &iter)) {
+		if (!strmap_view_sync_handle_conflict(ctx, hash_rec,
+						      hash_pos)) {
 			ctx->lost_expunged_uid = hash_rec->uid;
 			return -1;
 		}
@@ -671,7 +750,6 @@ strmap_view_sync_block_check_conflicts(struct mail_index_strmap_read_context *ct
 static int
 mail_index_strmap_view_sync_block(struct mail_index_strmap_read_context *ctx)
 {
-	struct mail_index_strmap_rec *hash_rec;
 	uint32_t crc32, prev_uid = 0;
 	int ret;
 
@@ -691,13 +769,15 @@ mail_index_strmap_view_sync_block(struct mail_index_strmap_read_context *ctx)
 		}
 		ctx->view->last_added_uid = ctx->rec.uid;
 
-		/* add the record to records array */
+		/* add the record to records array and its index to hash */
 		array_push_back(&ctx->view->recs, &ctx->rec);
 		array_push_back(&ctx->view->recs_crc32, &crc32);
-
-		/* add a separate copy of the record to hash */
-		hash_rec = hash2_insert_hash(ctx->view->hash, crc32);
-		memcpy(hash_rec, &ctx->rec, sizeof(*hash_rec));
+		if (crc32 != 0) {
+			mail_index_strmap_hash_insert(ctx->view,
+				array_count(&ctx->view->recs) - 1, crc32);
+		} else {
+			ctx->view->unique_count++;
+		}
 	}
 	return strmap_read_block_deinit(ctx, ret, TRUE);
 }
@@ -755,18 +835,20 @@ void mail_index_strmap_view_sync_add(struct mail_index_strmap_view_sync *sync,
 				     const char *key)
 {
 	struct mail_index_strmap_view *view = sync->view;
-	struct mail_index_strmap_rec *rec, *old_rec;
-	struct mail_index_strmap_hash_key hash_key;
-	uint32_t str_idx;
+	struct mail_index_strmap_rec rec, *old_rec;
+	unsigned int hash_pos = UINT_MAX;
+	uint32_t crc32, str_idx;
 
 	i_assert(uid > view->last_added_uid ||
 		 (uid == view->last_added_uid &&
 		  ref_index > view->last_ref_index));
 
-	hash_key.str = key;
-	hash_key.crc32 = crc32_str_nonzero(key);
-
-	old_rec = hash2_lookup(view->hash, &hash_key);
+	crc32 = crc32_str_nonzero(key);
+	while ((old_rec = mail_index_strmap_hash_iterate(view, crc32,
+							 &hash_pos)) != NULL) {
+		if (view->key_compare(key, old_rec, view->cb_context))
+			break;
+	}
 	if (old_rec != NULL) {
 		/* The string already exists, use the same unique idx */
 		str_idx = old_rec->str_idx;
@@ -776,12 +858,13 @@ void mail_index_strmap_view_sync_add(struct mail_index_strmap_view_sync *sync,
 	}
 	i_assert(str_idx != 0);
 
-	rec = hash2_insert(view->hash, &hash_key);
-	rec->uid = uid;
-	rec->ref_index = ref_index;
-	rec->str_idx = str_idx;
-	array_push_back(&view->recs, rec);
-	array_push_back(&view->recs_crc32, &hash_key.crc32);
+	i_zero(&rec);
+	rec.uid = uid;
+	rec.ref_index = ref_index;
+	rec.str_idx = str_idx;
+	array_push_back(&view->recs, &rec);
+	array_push_back(&view->recs_crc32, &crc32);
+	mail_index_strmap_hash_insert(view, array_count(&view->recs) - 1, crc32);
 
 	view->last_added_uid = uid;
 	view->last_ref_index = ref_index;
@@ -803,6 +886,7 @@ void mail_index_strmap_view_sync_add_unique(struct mail_index_strmap_view_sync *
 	rec.str_idx = view->next_str_idx++;
 	array_push_back(&view->recs, &rec);
 	array_append_zero(&view->recs_crc32);
+	view->unique_count++;
 
 	view->last_added_uid = uid;
 	view->last_ref_index = ref_index;
@@ -819,7 +903,7 @@ mail_index_strmap_zero_terminate(struct mail_index_strmap_view *view)
 static void mail_index_strmap_view_renumber(struct mail_index_strmap_view *view)
 {
 	struct mail_index_strmap_read_context ctx;
-	struct mail_index_strmap_rec *recs, *hash_rec;
+	struct mail_index_strmap_rec *recs;
 	uint32_t prev_uid, str_idx, *recs_crc32, *renumber_map;
 	unsigned int i, dest, count, count2;
 	int ret;
@@ -872,11 +956,14 @@ static void mail_index_strmap_view_renumber(struct mail_index_strmap_view *view)
 
 	/* renumber the indexes in-place and recreate the hash */
 	recs = array_get_modifiable(&view->recs, &count);
-	hash2_clear(view->hash);
+	recs_crc32 = array_get_modifiable(&view->recs_crc32, &count2);
+	mail_index_strmap_hash_clear(view);
 	for (i = 0; i < count; i++) {
 		recs[i].str_idx = renumber_map[recs[i].str_idx];
-		hash_rec = hash2_insert_hash(view->hash, recs_crc32[i]);
-		memcpy(hash_rec, &recs[i], sizeof(*hash_rec));
+		if (recs_crc32[i] != 0)
+			mail_index_strmap_hash_insert(view, i, recs_crc32[i]);
+		else
+			view->unique_count++;
 	}
 
 	/* update the new next_str_idx only after remapping */
@@ -1191,7 +1278,7 @@ static int mail_index_strmap_write(struct mail_index_strmap_view *view)
 	/* FIXME: this renumbering doesn't work well when running for a long
 	   time since records aren't removed from hash often enough */
 	if (STRIDX_MUST_RENUMBER(view->next_str_idx - 1,
-				 hash2_count(view->hash))) {
+				 view->hash_count + view->unique_count)) {
 		mail_index_strmap_view_renumber(view);
 		if (!MAIL_INDEX_IS_IN_MEMORY(view->strmap->index)) {
 			if (mail_index_strmap_recreate(view) < 0) {
@@ -71,7 +71,7 @@ static void mail_index_sync_replace_map(struct mail_index_sync_map_ctx *ctx,
 }
 
 static struct mail_index_map *
-mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+mail_index_sync_get_private_map(struct mail_index_sync_map_ctx *ctx)
 {
 	struct mail_index_map *map = ctx->view->map;
 
@@ -82,6 +82,13 @@ mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
 		mail_index_sync_replace_map(ctx, map);
 		i_assert(ctx->view->map == map);
 	}
+	return map;
+}
+
+static struct mail_index_map *
+mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+{
+	struct mail_index_map *map = mail_index_sync_get_private_map(ctx);
 
 	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(ctx->view->map)) {
 		/* map points to mmap()ed area, copy it into memory. */
@@ -103,6 +110,34 @@ mail_index_sync_get_atomic_map(struct mail_index_sync_map_ctx *ctx)
 	return ctx->view->map;
 }
 
+static struct mail_index_map *
+mail_index_sync_get_private_rec_map(struct mail_index_sync_map_ctx *ctx)
+{
+	/* Same as mail_index_sync_get_atomic_map(), except an mmap()ed
+	   rec_map is modified directly. The mapping is private
+	   copy-on-write, so only the modified pages stop being shared with
+	   other processes. */
+	(void)mail_index_sync_get_private_map(ctx);
+	mail_index_record_map_move_to_private(ctx->view->map);
+	mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
+	return ctx->view->map;
+}
+
+static struct mail_index_map *
+mail_index_sync_get_append_map(struct mail_index_sync_map_ctx *ctx)
+{
+	struct mail_index_map *map = mail_index_sync_get_private_map(ctx);
+
+	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(map) &&
+	    !mail_index_map_mmap_can_append(map, 1)) {
+		/* no more space reserved after the mmap()ed area.
+		   copy it into memory. */
+		mail_index_map_move_to_memory(map);
+		mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
+	}
+	return map;
+}
+
 static int
 mail_index_header_update_counts(struct mail_index_header *hdr,
 				uint8_t old_flags, uint8_t new_flags,
@@ -250,8 +285,8 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 	if (count == 0)
 		return;
 
-	/* Get a private in-memory rec_map, which we can modify. */
-	map = mail_index_sync_get_atomic_map(ctx);
+	/* Get a private rec_map, which we can modify. */
+	map = mail_index_sync_get_private_rec_map(ctx);
 
 	/* call the expunge handlers first */
 	if (sync_expunge_handlers_init(ctx)) {
@@ -300,6 +335,7 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 			MAIL_INDEX_REC_AT_SEQ(map, prev_seq2+1),
 			final_move_count * map->hdr.record_size);
 	}
+	mail_index_record_map_columns_expunge(map->rec_map, seqs);
 }
 
 static void *sync_append_record(struct mail_index_map *map)
@@ -308,6 +344,11 @@ static void *sync_append_record(struct mail_index_map *map)
 	void *ret;
 
 	append_pos = map->rec_map->records_count * map->hdr.record_size;
+	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(map)) {
+		/* the space was reserved by mail_index_mmap() */
+		i_assert(mail_index_map_mmap_can_append(map, 1));
+		return PTR_OFFSET(map->rec_map->records, append_pos);
+	}
 	ret = buffer_get_space_unsafe(map->rec_map->buffer, append_pos,
 				      map->hdr.record_size);
 	map->rec_map->records =
@@ -392,9 +433,9 @@ static int sync_append(const struct mail_index_record *rec,
 	}
 
 	/* We'll need to append a new record. If map currently points to
-	   mmap()ed index, it first needs to be moved to memory since we can't
-	   write past the mmap()ed memory area. */
-	map = mail_index_sync_move_to_private_memory(ctx);
+	   mmap()ed index, the record is written to the space reserved after
+	   the mmap()ed file. Only if that's full the map is moved to memory. */
+	map = mail_index_sync_get_append_map(ctx);
 
 	if (rec->uid <= map->rec_map->last_appended_uid) {
 		i_assert(map->hdr.messages_count < map->rec_map->records_count);
@@ -414,6 +455,7 @@ static int sync_append(const struct mail_index_record *rec,
 		map->rec_map->records_count++;
 		map->rec_map->last_appended_uid = rec->uid;
 		new_flags = rec->flags;
+		mail_index_record_map_columns_append(map->rec_map, rec);
 
 		mail_index_modseq_append(ctx->modseq_ctx,
 					 map->rec_map->records_count);
@@ -431,6 +473,114 @@ static int sync_append(const struct mail_index_record *rec,
 	return 1;
 }
 
+static int
+mail_index_header_update_counts_range(struct mail_index_header *hdr,
+				      const struct mail_transaction_flag_update *u,
+				      unsigned int seen_changes,
+				      unsigned int deleted_changes,
+				      const char **error_r)
+{
+	/* all the records in the range get the same flag changes, so the
+	   counters move only to one direction */
+	if (seen_changes == 0)
+		;
+	else if ((u->add_flags & MAIL_SEEN) != 0) {
+		if (hdr->seen_messages_count + seen_changes >
+		    hdr->messages_count) {
+			*error_r = "Seen counter wrong";
+			return -1;
+		}
+		hdr->seen_messages_count += seen_changes;
+		if (hdr->seen_messages_count == hdr->messages_count)
+			hdr->first_unseen_uid_lowwater = hdr->next_uid;
+	} else {
+		if (hdr->seen_messages_count < seen_changes) {
+			*error_r = "Seen counter wrong";
+			return -1;
+		}
+		hdr->seen_messages_count -= seen_changes;
+	}
+
+	if (deleted_changes == 0)
+		;
+	else if ((u->add_flags & MAIL_DELETED) != 0) {
+		hdr->deleted_messages_count += deleted_changes;
+		if (hdr->deleted_messages_count > hdr->messages_count) {
+			*error_r = "Deleted counter wrong";
+			return -1;
+		}
+	} else {
+		if (hdr->deleted_messages_count < deleted_changes ||
+		    hdr->deleted_messages_count > hdr->messages_count) {
+			*error_r = "Deleted counter wrong";
+			return -1;
+		}
+		hdr->deleted_messages_count -= deleted_changes;
+		if (hdr->deleted_messages_count == 0)
+			hdr->first_deleted_uid_lowwater = hdr->next_uid;
+	}
+	return 0;
+}
+
+static bool
+sync_flag_update_range_counts(struct mail_index_sync_map_ctx *ctx,
+			      const struct mail_transaction_flag_update *u,
+			      uint32_t seq1, uint32_t seq2)
+{
+	struct mail_index_map *map = ctx->view->map;
+	struct mail_index_map *const *maps;
+	struct mail_index_record *rec;
+	uint8_t flag_mask, old_flags, new_flags, changes;
+	uint32_t seq, first_unseen_uid = 0, first_deleted_uid = 0;
+	unsigned int i, count, seen_changes = 0, deleted_changes = 0;
+	const char *error;
+
+	/* the counters can be updated once for the whole range only if the
+	   range is visible in all the maps */
+	rec = MAIL_INDEX_REC_AT_SEQ(map, seq2);
+	maps = array_get(&map->rec_map->maps, &count);
+	for (i = 0; i < count; i++) {
+		if (rec->uid >= maps[i]->hdr.next_uid)
+			return FALSE;
+	}
+
+	flag_mask = (unsigned char)~u->remove_flags;
+	for (seq = seq1; seq <= seq2; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		old_flags = rec->flags;
+		new_flags = (old_flags & flag_mask) | u->add_flags;
+		rec->flags = new_flags;
+
+		changes = old_flags ^ new_flags;
+		if ((changes & MAIL_SEEN) != 0)
+			seen_changes++;
+		if ((changes & MAIL_DELETED) != 0)
+			deleted_changes++;
+		if ((new_flags & MAIL_SEEN) == 0 && first_unseen_uid == 0)
+			first_unseen_uid = rec->uid;
+		if ((new_flags & MAIL_DELETED) != 0 && first_deleted_uid == 0)
+			first_deleted_uid = rec->uid;
+	}
+	mail_index_record_map_columns_update_flags_range(map->rec_map,
+		seq1, seq2, flag_mask, u->add_flags);
+
+	for (i = 0; i < count; i++) {
+		if (first_unseen_uid != 0 &&
+		    first_unseen_uid < maps[i]->hdr.first_unseen_uid_lowwater)
+			maps[i]->hdr.first_unseen_uid_lowwater = first_unseen_uid;
+		if (first_deleted_uid != 0 &&
+		    first_deleted_uid < maps[i]->hdr.first_deleted_uid_lowwater)
+			maps[i]->hdr.first_deleted_uid_lowwater = first_deleted_uid;
+
+		if (mail_index_header_update_counts_range(&maps[i]->hdr, u,
+							  seen_changes,
+							  deleted_changes,
+							  &error) < 0)
+			mail_index_sync_set_corrupted(ctx, "%s", error);
+	}
+	return TRUE;
+}
+
 static int sync_flag_update(const struct mail_transaction_flag_update *u,
 			    struct mail_index_sync_map_ctx *ctx)
 {
@@ -461,12 +611,19 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
 			rec->flags = (rec->flags & flag_mask) | u->add_flags;
 		}
-	} else {
+		mail_index_record_map_columns_update_flags_range(
+			view->map->rec_map, seq1, seq2,
+			flag_mask, u->add_flags);
+	} else if (!sync_flag_update_range_counts(ctx, u, seq1, seq2)) {
+		/* some of the maps don't see the whole range yet. update the
+		   counters one record at a time. */
 		for (seq = seq1; seq <= seq2; seq++) {
 			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
 
 			old_flags = rec->flags;
 			rec->flags = (rec->flags & flag_mask) | u->add_flags;
+			mail_index_record_map_columns_update_flags(
+				view->map->rec_map, seq, rec->flags);
 
 			mail_index_header_update_lowwaters(ctx, rec->uid,
 							   rec->flags);
@@ -944,9 +944,8 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 	   of updating whether cache needs to be purged. */
 	if (ret == 0 && mail_cache_need_purge(index->cache, &reason) &&
 	    !mail_cache_transactions_have_changes(index->cache)) {
-		if (mail_cache_purge(index->cache,
-				     index->cache->need_purge_file_seq,
-				     reason) < 0) {
+		if (mail_cache_purge_incremental(index->cache,
+				index->cache->need_purge_file_seq, reason) < 0) {
 			/* can't really do anything if it fails */
 		}
 		/* Make sure the newly committed cache record offsets are
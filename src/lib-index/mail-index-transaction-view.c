@@ -228,9 +228,48 @@ static void tview_lookup_seq_range(struct mail_index_view *view,
 	i_assert(seq >= tview->t->first_new_seq);
 }
 
+static uint32_t
+tview_lookup_first_updated(struct mail_index_view *view,
+			   enum mail_flags flags, uint8_t flags_mask,
+			   uint32_t seq1, uint32_t seq2)
+{
+	struct mail_index_view_transaction *tview =
+		(struct mail_index_view_transaction *)view;
+	struct mail_index_transaction *t = tview->t;
+	const struct mail_index_record *rec;
+	struct mail_index_map *map;
+	uint32_t seq;
+
+	if (t->min_flagupdate_seq == 0 || seq2 < t->min_flagupdate_seq ||
+	    seq1 > t->max_flagupdate_seq) {
+		/* no flag updates within the range */
+		tview->super->lookup_first(view, flags, flags_mask,
+					   seq1, seq2, &seq);
+		return seq;
+	}
+
+	if (seq1 < t->min_flagupdate_seq) {
+		tview->super->lookup_first(view, flags, flags_mask,
+					   seq1, t->min_flagupdate_seq - 1, &seq);
+		if (seq != 0)
+			return seq;
+		seq1 = t->min_flagupdate_seq;
+	}
+	/* check the mails that may have flag updates one by one */
+	for (seq = seq1; seq <= I_MIN(seq2, t->max_flagupdate_seq); seq++) {
+		rec = tview_lookup_full(view, seq, &map, NULL);
+		if ((rec->flags & flags_mask) == (uint8_t)flags)
+			return seq;
+	}
+	if (seq > seq2)
+		return 0;
+	tview->super->lookup_first(view, flags, flags_mask, seq, seq2, &seq);
+	return seq;
+}
+
 static void tview_lookup_first(struct mail_index_view *view,
 			       enum mail_flags flags, uint8_t flags_mask,
-			       uint32_t *seq_r)
+			       uint32_t seq1, uint32_t seq2, uint32_t *seq_r)
 {
 	struct mail_index_view_transaction *tview =
 		(struct mail_index_view_transaction *)view;
@@ -238,19 +277,29 @@ static void tview_lookup_first(struct mail_index_view *view,
 	unsigned int append_count;
 	uint32_t seq, message_count;
 
-	if (!tview->t->reset) {
-		tview->super->lookup_first(view, flags, flags_mask, seq_r);
+	if (!tview->t->reset && seq1 < tview->t->first_new_seq) {
+		*seq_r = tview_lookup_first_updated(view, flags, flags_mask,
+				seq1, I_MIN(seq2, tview->t->first_new_seq - 1));
 		if (*seq_r != 0)
 			return;
 	} else {
 		*seq_r = 0;
 	}
+	if (tview->t->last_new_seq == 0) {
+		/* no appends */
+		return;
+	}
 
 	rec = array_get(&tview->t->appends, &append_count);
 	seq = tview->t->first_new_seq;
 	message_count = tview->t->last_new_seq;
 	i_assert(append_count == message_count - seq + 1);
 
+	if (seq < seq1) {
+		rec += seq1 - seq;
+		seq = seq1;
+	}
+	message_count = I_MIN(message_count, seq2);
 	for (; seq <= message_count; seq++, rec++) {
 		if ((rec->flags & flags_mask) == (uint8_t)flags) {
 			*seq_r = seq;
@@ -25,7 +25,7 @@ struct mail_index_view_vfuncs {
 				 uint32_t *first_seq_r, uint32_t *last_seq_r);
 	void (*lookup_first)(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
-			     uint32_t *seq_r);
+			     uint32_t seq1, uint32_t seq2, uint32_t *seq_r);
 	void (*lookup_keywords)(struct mail_index_view *view, uint32_t seq,
 				ARRAY_TYPE(keyword_indexes) *keyword_idx);
 	void (*lookup_ext_full)(struct mail_index_view *view, uint32_t seq,
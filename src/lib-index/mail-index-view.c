@@ -250,37 +250,46 @@ static void view_lookup_seq_range(struct mail_index_view *view,
 
 static void view_lookup_first(struct mail_index_view *view,
 			      enum mail_flags flags, uint8_t flags_mask,
-			      uint32_t *seq_r)
+			      uint32_t seq1, uint32_t seq2, uint32_t *seq_r)
 {
 #define LOW_UPDATE(x) \
 	STMT_START { if ((x) > low_uid) low_uid = x; } STMT_END
 	const struct mail_index_header *hdr = &view->map->hdr;
 	const struct mail_index_record *rec;
-	uint32_t seq, seq2, low_uid = 1;
+	struct mail_index_map *map;
+	uint32_t seq, low_seq2, low_uid = 1;
 
 	*seq_r = 0;
 
+	if (view->map != view->index->map) {
+		/* the head mapping may have newer flags. check the records
+		   the same way as mail_index_lookup() does. */
+		seq2 = I_MIN(seq2, hdr->messages_count);
+		for (seq = seq1; seq <= seq2; seq++) {
+			rec = view_lookup_full(view, seq, &map, NULL);
+			if ((rec->flags & flags_mask) == (uint8_t)flags) {
+				*seq_r = seq;
+				break;
+			}
+		}
+		return;
+	}
+
 	if ((flags_mask & MAIL_SEEN) != 0 && (flags & MAIL_SEEN) == 0)
 		LOW_UPDATE(hdr->first_unseen_uid_lowwater);
 	if ((flags_mask & MAIL_DELETED) != 0 && (flags & MAIL_DELETED) != 0)
 		LOW_UPDATE(hdr->first_deleted_uid_lowwater);
 
-	if (low_uid == 1)
-		seq = 1;
-	else {
+	if (low_uid != 1) {
 		if (!mail_index_lookup_seq_range(view, low_uid, hdr->next_uid,
-						 &seq, &seq2))
+						 &seq, &low_seq2))
 			return;
+		if (seq1 < seq)
+			seq1 = seq;
 	}
 
-	i_assert(hdr->messages_count <= view->map->rec_map->records_count);
-	for (; seq <= hdr->messages_count; seq++) {
-		rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
-		if ((rec->flags & flags_mask) == (uint8_t)flags) {
-			*seq_r = seq;
-			break;
-		}
-	}
+	*seq_r = mail_index_map_find_flags(view->map, flags, flags_mask,
+					   seq1, seq2);
 }
 
 static void
@@ -521,7 +530,23 @@ void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r)
 {
-	view->v.lookup_first(view, flags, flags_mask, seq_r);
+	mail_index_lookup_first_range(view, flags, flags_mask, 1,
+				      mail_index_view_get_messages_count(view),
+				      seq_r);
+}
+
+void mail_index_lookup_first_range(struct mail_index_view *view,
+				   enum mail_flags flags, uint8_t flags_mask,
+				   uint32_t seq1, uint32_t seq2,
+				   uint32_t *seq_r)
+{
+	i_assert(seq1 > 0);
+
+	if (seq1 > seq2) {
+		*seq_r = 0;
+		return;
+	}
+	view->v.lookup_first(view, flags, flags_mask, seq1, seq2, seq_r);
 }
 
 void mail_index_lookup_ext(struct mail_index_view *view, uint32_t seq,
@@ -53,6 +53,8 @@ static const struct mail_index_optimization_settings default_optimization_set =
 		.purge_delete_percentage = 20,
 		.purge_continued_percentage = 200,
 		.purge_header_continue_count = 4,
+		.purge_incremental_min_size = 16 * 1024 * 1024,
+		.purge_incremental_step_size = 1024 * 1024,
 	},
 };
 
@@ -206,6 +208,8 @@ void mail_index_set_optimization_settings(struct mail_index *index,
 		dest->log.min_age_secs = set->log.min_age_secs;
 	if (set->log.log2_max_age_secs != 0)
 		dest->log.log2_max_age_secs = set->log.log2_max_age_secs;
+	if (set->log.group_commit)
+		dest->log.group_commit = set->log.group_commit;
 
 	/* cache */
 	if (set->cache.unaccessed_field_drop_secs != 0)
@@ -224,6 +228,12 @@ void mail_index_set_optimization_settings(struct mail_index *index,
 	if (set->cache.purge_header_continue_count != 0)
 		dest->cache.purge_header_continue_count =
 			set->cache.purge_header_continue_count;
+	/* 0 disables incremental purging, so it can't mean "unchanged" */
+	dest->cache.purge_incremental_min_size =
+		set->cache.purge_incremental_min_size;
+	if (set->cache.purge_incremental_step_size != 0)
+		dest->cache.purge_incremental_step_size =
+			set->cache.purge_incremental_step_size;
 	if (set->cache.record_max_size != 0)
 		dest->cache.record_max_size = set->cache.record_max_size;
 }
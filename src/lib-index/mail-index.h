@@ -323,6 +323,11 @@ struct mail_index_log_optimization_settings {
 	/* Delete .log.2 when it's older than log2_stale_secs. Don't be too
 	   eager, because older files are useful for QRESYNC and dsync. */
 	unsigned int log2_max_age_secs;
+
+	/* Unlock the log before fdatasync()ing the appended transaction, so
+	   that concurrent writers don't wait for each others' fsyncs and a
+	   single fdatasync() can cover multiple writers' transactions. */
+	bool group_commit;
 };
 
 struct mail_index_cache_optimization_settings {
@@ -344,6 +349,29 @@ struct mail_index_cache_optimization_settings {
 	/* Purge the file when we need to follow more than n next_offsets to
 	   find the latest cache header. */
 	unsigned int purge_header_continue_count;
+	/* Purge files at least this large incrementally during index syncs
+	   instead of rewriting them all at once. Unlike with the other
+	   settings, 0 isn't ignored - it disables incremental purging. */
+	uoff_t purge_incremental_min_size;
+	/* Copy about this many bytes of records per incremental purge step */
+	uoff_t purge_incremental_step_size;
+};
+
+struct mail_index_memory_usage {
+	/* Number of record maps */
+	unsigned int record_maps_count;
+	/* Size of the mmap()ed index files */
+	uoff_t mmap_bytes;
+	/* Size of the mmap()ed address space, including the space reserved
+	   for appending records */
+	uoff_t mmap_reserved_bytes;
+	/* Size of the records copied to private memory */
+	uoff_t private_bytes;
+
+	/* Number of times records have been copied to private memory and
+	   the total number of bytes copied */
+	uint64_t copy_count;
+	uoff_t copy_bytes;
 };
 
 struct mail_index_optimization_settings {
@@ -401,6 +429,10 @@ int mail_index_unlink(struct mail_index *index);
 
 /* Returns TRUE if index is currently in memory. */
 bool mail_index_is_in_memory(struct mail_index *index);
+/* Get the memory usage of all the index record maps in this process.
+   mmap()ed maps are copy-on-write, so their unmodified pages are shared
+   with the other processes accessing the same index. */
+void mail_index_get_memory_usage(struct mail_index_memory_usage *usage_r);
 /* Move the index into memory. Returns 0 if ok, -1 if error occurred. */
 int mail_index_move_to_memory(struct mail_index *index);
 
@@ -618,6 +650,13 @@ bool mail_index_lookup_seq(struct mail_index_view *view,
 void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+/* Like mail_index_lookup_first(), but look only within seq1..seq2. This is
+   fast enough to be used for skipping over non-matching mails while
+   iterating through a large mailbox. */
+void mail_index_lookup_first_range(struct mail_index_view *view,
+				   enum mail_flags flags, uint8_t flags_mask,
+				   uint32_t seq1, uint32_t seq2,
+				   uint32_t *seq_r);
 
 /* Append a new record to index. */
 void mail_index_append(struct mail_index_transaction *t, uint32_t uid,
@@ -2,10 +2,13 @@
 
 #include "lib.h"
 #include "array.h"
+#include "time-util.h"
 #include "write-full.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
+#include <sys/stat.h>
+
 void mail_transaction_log_append_add(struct mail_transaction_log_append_ctx *ctx,
 				     enum mail_transaction_type type,
 				     const void *data, size_t size)
@@ -91,7 +94,13 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 	if ((ctx->want_fsync &&
 	     file->log->index->set.fsync_mode != FSYNC_MODE_NEVER) ||
 	    file->log->index->set.fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(file->fd) < 0) {
+		if (file->log->index->optimization_set.log.group_commit &&
+		    !file->log->index->log_sync_locked) {
+			/* fdatasync() after the log is unlocked */
+			ctx->group_commit_fsync = TRUE;
+			ctx->group_commit_offset = file->sync_offset;
+			ctx->group_commit_size = ctx->output->used;
+		} else if (fdatasync(file->fd) < 0) {
 			mail_index_file_set_syscall_error(ctx->log->index,
 							  file->filepath,
 							  "fdatasync()");
@@ -214,6 +223,57 @@ mail_transaction_log_append_locked(struct mail_transaction_log_append_ctx *ctx)
 	return 0;
 }
 
+static void
+log_group_commit_fsync(struct mail_transaction_log_append_ctx *ctx)
+{
+	struct mail_transaction_log_file *file = ctx->log->head;
+	struct mail_index *index = ctx->log->index;
+	struct timeval start_time, end_time;
+	struct stat st;
+	uoff_t group_size;
+	bool failed = FALSE;
+
+	/* Everything appended to the log by now is synced by our
+	   fdatasync(), including the transactions written by other
+	   processes after ours. */
+	if (fstat(file->fd, &st) < 0) {
+		mail_index_file_set_syscall_error(index, file->filepath,
+						  "fstat()");
+		st.st_size = 0;
+	}
+	group_size = (uoff_t)st.st_size > ctx->group_commit_offset ?
+		(uoff_t)st.st_size - ctx->group_commit_offset :
+		ctx->group_commit_size;
+
+	i_gettimeofday(&start_time);
+	if (fdatasync(file->fd) < 0) {
+		/* The log is already unlocked, so the transaction can't be
+		   removed from it anymore. It's visible to others, so the
+		   commit itself has succeeded, but it may not be durable.
+		   Continue with in-memory indexes, like when fdatasync()
+		   fails while the log is locked. */
+		mail_index_file_set_syscall_error(index, file->filepath,
+						  "fdatasync()");
+		failed = TRUE;
+	}
+	i_gettimeofday(&end_time);
+
+	struct event_passthrough *e = event_create_passthrough(index->event)->
+		set_name("mail_index_log_group_commit_finished")->
+		add_int("bytes", ctx->group_commit_size)->
+		add_int("group_bytes", group_size)->
+		add_int("fsync_usecs",
+			timeval_diff_usecs(&end_time, &start_time));
+	if (failed)
+		e->add_str("error", "fdatasync() failed");
+	e_debug(e->event(), "Group commit synced %"PRIuUOFF_T" bytes "
+		"(%zu bytes from this transaction)",
+		group_size, ctx->group_commit_size);
+
+	if (failed)
+		(void)mail_index_move_to_memory(index);
+}
+
 int mail_transaction_log_append_begin(struct mail_index *index,
 				      enum mail_transaction_type flags,
 				      struct mail_transaction_log_append_ctx **ctx_r)
@@ -249,6 +309,8 @@ int mail_transaction_log_append_commit(struct mail_transaction_log_append_ctx **
 	ret = mail_transaction_log_append_locked(ctx);
 	if (!index->log_sync_locked)
 		mail_transaction_log_file_unlock(index->log->head, "appending");
+	if (ret == 0 && ctx->group_commit_fsync)
+		log_group_commit_fsync(ctx);
 
 	buffer_free(&ctx->output);
 	i_free(ctx);
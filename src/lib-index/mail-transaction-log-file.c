@@ -116,6 +116,7 @@ void mail_transaction_log_file_free(struct mail_transaction_log_file **_file)
 		file->log->head = NULL;
 
 	buffer_free(&file->buffer);
+	array_free(&file->modseq_checkpoints);
 
 	if (file->mmap_base != NULL) {
 		if (munmap(file->mmap_base, file->mmap_size) < 0)
@@ -1181,6 +1182,7 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file,
 		mail_transaction_log_file_set_corrupted(file, "%s", *reason_r);
 		/* fix the sync_offset to avoid crashes later on */
 		file->sync_offset = file->buffer_offset + size;
+		mail_transaction_log_file_clear_modseq_checkpoints(file);
 		return 0;
 	}
 	while (file->sync_offset - file->buffer_offset + sizeof(*hdr) <= size) {
@@ -1209,6 +1211,8 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file,
 		}
 
 		file->sync_offset += trans_size;
+		mail_transaction_log_file_add_modseq_checkpoint(file,
+			file->sync_offset, file->sync_highest_modseq);
 	}
 
 	if (file->mmap_base != NULL && !file->locked) {
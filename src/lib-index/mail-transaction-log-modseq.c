@@ -1,6 +1,7 @@
 /* Copyright (c) 2003-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
@@ -73,6 +74,107 @@ modseq_cache_get_modseq(struct mail_transaction_log_file *file, uint64_t modseq)
 	return &file->modseq_cache[best];
 }
 
+static unsigned int
+modseq_checkpoint_find_offset(struct mail_transaction_log_file *file,
+			      uoff_t offset)
+{
+	const struct modseq_cache *checkpoints;
+	unsigned int idx, left_idx, right_idx, count;
+
+	/* find the first checkpoint with offset >= the wanted offset */
+	checkpoints = array_get(&file->modseq_checkpoints, &count);
+	left_idx = 0; right_idx = count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (checkpoints[idx].offset < offset)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	return left_idx;
+}
+
+static const struct modseq_cache *
+modseq_checkpoint_get_offset(struct mail_transaction_log_file *file,
+			     uoff_t offset)
+{
+	const struct modseq_cache *checkpoints;
+	unsigned int idx, count;
+
+	if (!array_is_created(&file->modseq_checkpoints))
+		return NULL;
+
+	/* return the checkpoint with the highest offset <= offset */
+	checkpoints = array_get(&file->modseq_checkpoints, &count);
+	idx = modseq_checkpoint_find_offset(file, offset);
+	if (idx < count && checkpoints[idx].offset == offset)
+		return &checkpoints[idx];
+	return idx == 0 ? NULL : &checkpoints[idx-1];
+}
+
+static const struct modseq_cache *
+modseq_checkpoint_get_modseq(struct mail_transaction_log_file *file,
+			     uint64_t modseq)
+{
+	const struct modseq_cache *checkpoints;
+	unsigned int idx, left_idx, right_idx, count;
+
+	if (!array_is_created(&file->modseq_checkpoints))
+		return NULL;
+
+	/* Return the checkpoint with the highest modseq < modseq. Multiple
+	   offsets can have the same modseq, so scanning forward from here
+	   finds the lowest offset where the modseq is reached. */
+	checkpoints = array_get(&file->modseq_checkpoints, &count);
+	left_idx = 0; right_idx = count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (checkpoints[idx].highest_modseq < modseq)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	return left_idx == 0 ? NULL : &checkpoints[left_idx-1];
+}
+
+void mail_transaction_log_file_add_modseq_checkpoint(
+		struct mail_transaction_log_file *file,
+		uoff_t offset, uint64_t highest_modseq)
+{
+	const struct modseq_cache *checkpoints;
+	struct modseq_cache checkpoint;
+	unsigned int idx, count;
+
+	if (!array_is_created(&file->modseq_checkpoints))
+		i_array_init(&file->modseq_checkpoints, 32);
+
+	checkpoints = array_get(&file->modseq_checkpoints, &count);
+	if (count > 0 &&
+	    offset >= checkpoints[count-1].offset +
+		      LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL) {
+		/* the common case: reading the log forward */
+		idx = count;
+	} else {
+		idx = modseq_checkpoint_find_offset(file, offset);
+		if (idx > 0 && offset < checkpoints[idx-1].offset +
+		    LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL)
+			return;
+		if (idx < count && checkpoints[idx].offset <
+		    offset + LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL)
+			return;
+	}
+	checkpoint.offset = offset;
+	checkpoint.highest_modseq = highest_modseq;
+	array_insert(&file->modseq_checkpoints, idx, &checkpoint, 1);
+}
+
+void mail_transaction_log_file_clear_modseq_checkpoints(
+		struct mail_transaction_log_file *file)
+{
+	if (array_is_created(&file->modseq_checkpoints))
+		array_clear(&file->modseq_checkpoints);
+}
+
 static int
 log_get_synced_record(struct mail_transaction_log_file *file, uoff_t *offset,
 		      const struct mail_transaction_header **hdr_r,
@@ -107,7 +209,7 @@ int mail_transaction_log_file_get_highest_modseq_at(
 		const char **error_r)
 {
 	const struct mail_transaction_header *hdr;
-	struct modseq_cache *cache;
+	const struct modseq_cache *cache, *checkpoint;
 	uoff_t cur_offset;
 	uint64_t cur_modseq;
 	const char *reason;
@@ -121,6 +223,10 @@ int mail_transaction_log_file_get_highest_modseq_at(
 	}
 
 	cache = modseq_cache_get_offset(file, offset);
+	checkpoint = modseq_checkpoint_get_offset(file, offset);
+	if (checkpoint != NULL &&
+	    (cache == NULL || checkpoint->offset > cache->offset))
+		cache = checkpoint;
 	if (cache == NULL) {
 		/* nothing usable in cache - scan from beginning */
 		cur_offset = file->hdr.hdr_size;
@@ -151,6 +257,8 @@ int mail_transaction_log_file_get_highest_modseq_at(
 			return 0;
 		mail_transaction_update_modseq(hdr, hdr + 1, &cur_modseq,
 			MAIL_TRANSACTION_LOG_HDR_VERSION(&file->hdr));
+		mail_transaction_log_file_add_modseq_checkpoint(file,
+			cur_offset, cur_modseq);
 	}
 
 	/* @UNSAFE: cache the value */
@@ -201,6 +309,8 @@ get_modseq_next_offset_at(struct mail_transaction_log_file *file,
 		}
 		mail_transaction_update_modseq(hdr, hdr + 1, cur_modseq,
 			MAIL_TRANSACTION_LOG_HDR_VERSION(&file->hdr));
+		mail_transaction_log_file_add_modseq_checkpoint(file,
+			*cur_offset, *cur_modseq);
 		if (*cur_modseq >= modseq)
 			break;
 	}
@@ -211,7 +321,7 @@ int mail_transaction_log_file_get_modseq_next_offset(
 		struct mail_transaction_log_file *file,
 		uint64_t modseq, uoff_t *next_offset_r)
 {
-	struct modseq_cache *cache;
+	const struct modseq_cache *cache, *checkpoint;
 	uoff_t cur_offset;
 	uint64_t cur_modseq;
 	int ret;
@@ -226,6 +336,11 @@ int mail_transaction_log_file_get_modseq_next_offset(
 	}
 
 	cache = modseq_cache_get_modseq(file, modseq);
+	checkpoint = modseq_checkpoint_get_modseq(file, modseq);
+	if (checkpoint != NULL &&
+	    (cache == NULL || (cache->highest_modseq != modseq &&
+			       checkpoint->offset > cache->offset)))
+		cache = checkpoint;
 	if (cache == NULL) {
 		/* nothing usable in cache - scan from beginning */
 		cur_offset = file->hdr.hdr_size;
@@ -270,6 +385,7 @@ int mail_transaction_log_file_get_modseq_next_offset(
 		}
 		/* clear cache, since it's unreliable */
 		memset(file->modseq_cache, 0, sizeof(file->modseq_cache));
+		mail_transaction_log_file_clear_modseq_checkpoints(file);
 	}
 
 	/* @UNSAFE: cache the value */
@@ -14,6 +14,8 @@ struct dotlock_settings;
 #define MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) ((file)->fd == -1)
 
 #define LOG_FILE_MODSEQ_CACHE_SIZE 10
+/* Remember the highest modseq at least every n bytes of the log file */
+#define LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL 4096
 
 struct modseq_cache {
 	uoff_t offset;
@@ -85,6 +87,11 @@ struct mail_transaction_log_file {
 	   so it doesn't always have to start from the beginning of the log
 	   file to find the wanted modseq. */
 	struct modseq_cache modseq_cache[LOG_FILE_MODSEQ_CACHE_SIZE];
+	/* Sparse list of modseq checkpoints sorted by offset, added whenever
+	   records are read while tracking modseqs. Both the offsets and the
+	   modseqs are increasing, so they can be binary searched to avoid
+	   scanning the log file from the beginning. */
+	ARRAY(struct modseq_cache) modseq_checkpoints;
 
 	/* Lock for the log file fd. If dotlocking is used, this is NULL and
 	   mail_transaction_log.dotlock is used instead. */
@@ -195,5 +202,12 @@ int mail_transaction_log_file_get_highest_modseq_at(
 int mail_transaction_log_file_get_modseq_next_offset(
 		struct mail_transaction_log_file *file,
 		uint64_t modseq, uoff_t *next_offset_r);
+/* Remember that the highest modseq at the given offset (which must be at a
+   record boundary) is highest_modseq. */
+void mail_transaction_log_file_add_modseq_checkpoint(
+		struct mail_transaction_log_file *file,
+		uoff_t offset, uint64_t highest_modseq);
+void mail_transaction_log_file_clear_modseq_checkpoints(
+		struct mail_transaction_log_file *file);
 
 #endif
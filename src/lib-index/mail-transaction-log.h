@@ -357,6 +357,10 @@ struct mail_transaction_log_append_ctx {
 	uint64_t new_highest_modseq;
 	/* Number of transaction records added so far. */
 	unsigned int transaction_count;
+	/* With group_commit, the offset and size of the written transaction
+	   that still needs to be fdatasync()ed after unlocking the log. */
+	uoff_t group_commit_offset;
+	size_t group_commit_size;
 
 	/* Copied from mail_index_transaction.sync_transaction */
 	bool index_sync_transaction:1;
@@ -369,6 +373,9 @@ struct mail_transaction_log_append_ctx {
 	bool sync_includes_this:1;
 	/* fdatasync() after writing the transaction. */
 	bool want_fsync:1;
+	/* The written transaction is fdatasync()ed only after the log is
+	   unlocked. */
+	bool group_commit_fsync:1;
 };
 
 #define LOG_IS_BEFORE(seq1, offset1, seq2, offset2) \
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "str.h"
 #include "array.h"
+#include "hostpid.h"
 #include "test-common.h"
 #include "test-mail-cache.h"
 
@@ -919,6 +920,171 @@ static void test_mail_cache_purge_bitmask(void)
 }
 
 
+static void test_mail_cache_purge_incremental(void)
+{
+	struct mail_index_optimization_settings optimization_set = {
+		.cache = {
+			.purge_incremental_min_size = 1,
+			.purge_incremental_step_size = 1,
+		},
+	};
+	struct test_mail_cache_ctx ctx;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	char value[30];
+	unsigned int i, steps;
+	uint32_t seq;
+
+	test_begin("mail cache purge incremental");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_index_set_optimization_settings(ctx.index, &optimization_set);
+
+	for (seq = 1; seq <= 10; seq++) {
+		i_snprintf(value, sizeof(value), "foo%u", seq);
+		test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, value);
+	}
+
+	/* the first step copies only the first mail */
+	test_assert(mail_cache_purge_incremental(ctx.cache,
+			ctx.cache->hdr->file_seq, "test") == 0);
+	test_assert(ctx.cache->purge_incr != NULL);
+	test_assert(test_mail_cache_get_purge_count(&ctx) == 0);
+
+	/* change the cache for an already copied mail, expunge one mail and
+	   add a new mail while the purge is still unfinished */
+	test_mail_cache_add_field(&ctx, 1, ctx.cache_field2.idx, "bar1");
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	mail_index_expunge(trans, 3);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_mail_cache_index_sync(&ctx);
+	test_mail_cache_view_sync(&ctx);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo11");
+
+	for (steps = 1; ctx.cache->purge_incr != NULL && steps < 100; steps++) {
+		test_assert(mail_cache_purge_incremental(ctx.cache,
+				ctx.cache->hdr->file_seq, "test") == 0);
+	}
+	test_assert(ctx.cache->purge_incr == NULL);
+	test_assert(steps > 2);
+	test_assert(test_mail_cache_get_purge_count(&ctx) == 1);
+
+	test_mail_cache_view_sync(&ctx);
+	test_assert(mail_index_view_get_messages_count(ctx.view) == 10);
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(cache_equals(cache_view, 1, ctx.cache_field.idx, "foo1"));
+	test_assert(cache_equals(cache_view, 1, ctx.cache_field2.idx, "bar1"));
+	test_assert(cache_equals(cache_view, 2, ctx.cache_field.idx, "foo2"));
+	for (i = 3; i <= 10; i++) {
+		i_snprintf(value, sizeof(value), "foo%u", i + 1);
+		test_assert_idx(cache_equals(cache_view, i,
+					     ctx.cache_field.idx, value), i);
+	}
+	mail_cache_view_close(&cache_view);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+
+static void test_mail_cache_purge_incremental_restarts(void)
+{
+	struct mail_index_optimization_settings optimization_set = {
+		.cache = {
+			.purge_incremental_min_size = 1,
+			.purge_incremental_step_size = 1,
+		},
+	};
+	struct test_mail_cache_ctx ctx;
+	const char *stale_path, *other_host_path;
+	char value[30];
+	unsigned int i;
+	uint32_t seq;
+	int fd;
+
+	test_begin("mail cache purge incremental restarts");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_index_set_optimization_settings(ctx.index, &optimization_set);
+
+	for (seq = 1; seq <= 10; seq++) {
+		i_snprintf(value, sizeof(value), "foo%u", seq);
+		test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, value);
+	}
+
+	/* temp files left behind by a crashed process on this host and by
+	   a process on another host */
+	stale_path = t_strdup_printf("%s.999999999.%s.tmp",
+				     ctx.cache->filepath, my_hostname);
+	other_host_path = t_strdup_printf("%s.1.other-%s.tmp",
+					  ctx.cache->filepath, my_hostname);
+	fd = creat(stale_path, 0600);
+	test_assert(fd != -1);
+	i_close_fd(&fd);
+	fd = creat(other_host_path, 0600);
+	test_assert(fd != -1);
+	i_close_fd(&fd);
+
+	/* processes keep starting incremental purges and then exiting
+	   without finishing them */
+	for (i = 0; i < 3; i++) {
+		test_assert_idx(mail_cache_purge_incremental(ctx.cache,
+				ctx.cache->hdr->file_seq, "test") == 0, i);
+		test_assert_idx(ctx.cache->purge_incr != NULL, i);
+		test_assert_idx(test_mail_cache_get_purge_count(&ctx) == 0, i);
+		mail_cache_purge_incremental_free(ctx.cache);
+	}
+	test_assert(access(stale_path, F_OK) < 0 && errno == ENOENT);
+	test_assert(access(other_host_path, F_OK) == 0);
+
+	/* the next one gives up and purges the whole file at once */
+	test_assert(mail_cache_purge_incremental(ctx.cache,
+			ctx.cache->hdr->file_seq, "test") == 0);
+	test_assert(ctx.cache->purge_incr == NULL);
+	test_assert(test_mail_cache_get_purge_count(&ctx) == 1);
+
+	/* incremental purging works again for the new file */
+	test_assert(mail_cache_purge_incremental(ctx.cache,
+			ctx.cache->hdr->file_seq, "test") == 0);
+	test_assert(ctx.cache->purge_incr != NULL);
+	test_assert(test_mail_cache_get_purge_count(&ctx) == 1);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+static void test_mail_cache_purge_incremental_disabled(void)
+{
+	struct mail_index_optimization_settings optimization_set = {
+		.cache = {
+			.purge_incremental_min_size = 0,
+			.purge_incremental_step_size = 1,
+		},
+	};
+	struct test_mail_cache_ctx ctx;
+	char value[30];
+	uint32_t seq;
+
+	test_begin("mail cache purge incremental disabled");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_index_set_optimization_settings(ctx.index, &optimization_set);
+
+	for (seq = 1; seq <= 10; seq++) {
+		i_snprintf(value, sizeof(value), "foo%u", seq);
+		test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, value);
+	}
+
+	test_assert(mail_cache_purge_incremental(ctx.cache,
+			ctx.cache->hdr->file_seq, "test") == 0);
+	test_assert(ctx.cache->purge_incr == NULL);
+	test_assert(test_mail_cache_get_purge_count(&ctx) == 1);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+
 static void
 test_mail_cache_update_need_purge_continued_records_int(bool big_min_size)
 {
@@ -1066,6 +1232,9 @@ int main(void)
 		test_mail_cache_purge_field_changes4,
 		test_mail_cache_purge_already_done,
 		test_mail_cache_purge_bitmask,
+		test_mail_cache_purge_incremental,
+		test_mail_cache_purge_incremental_restarts,
+		test_mail_cache_purge_incremental_disabled,
 		test_mail_cache_update_need_purge_continued_records,
 		test_mail_cache_update_need_purge_continued_records2,
 		test_mail_cache_update_need_purge_deleted_records,
@@ -745,6 +745,364 @@ static void test_mail_cache_size_corruption(void)
 	test_end();
 }
 
+static void test_mail_cache_prefetch(void)
+{
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	unsigned int seq, field_idx;
+	string_t *str = t_str_new(32);
+
+	test_begin("mail cache prefetch");
+
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+
+	/* nothing cached yet */
+	test_assert(mail_cache_prefetch(cache_view, 1, 10, NULL, 0) == 0);
+
+	for (seq = 1; seq <= 10; seq++) {
+		test_mail_cache_add_mail(&ctx, ctx.cache_field.idx,
+					 t_strdup_printf("foo%u", seq));
+	}
+	/* add a second record for every other mail, so the prev_offsets are
+	   followed too */
+	for (seq = 1; seq <= 10; seq += 2) {
+		test_mail_cache_add_field(&ctx, seq, ctx.cache_field2.idx,
+					  t_strdup_printf("bar%u", seq));
+	}
+	test_mail_cache_view_sync(&ctx);
+
+	test_assert(mail_cache_prefetch(cache_view, 1, 10, NULL, 0) == 0);
+	/* seq2 beyond the messages count is fine */
+	test_assert(mail_cache_prefetch(cache_view, 5, 100, NULL, 0) == 0);
+	test_assert(mail_cache_prefetch(cache_view, 11, 100, NULL, 0) == 0);
+	/* field that doesn't exist in the cache file */
+	field_idx = ctx.cache_field3.idx;
+	test_assert(mail_cache_prefetch(cache_view, 1, 10, &field_idx, 1) == 0);
+	field_idx = ctx.cache_field2.idx;
+	test_assert(mail_cache_prefetch(cache_view, 1, 10, &field_idx, 1) == 0);
+
+	/* lookups still work normally */
+	for (seq = 1; seq <= 10; seq++) {
+		str_truncate(str, 0);
+		test_assert(mail_cache_lookup_field(cache_view, str, seq,
+						    ctx.cache_field.idx) == 1);
+		test_assert_strcmp(str_c(str), t_strdup_printf("foo%u", seq));
+		str_truncate(str, 0);
+		test_assert(mail_cache_lookup_field(cache_view, str, seq,
+				ctx.cache_field2.idx) == (seq % 2 == 1 ? 1 : 0));
+		if (seq % 2 == 1) {
+			test_assert_strcmp(str_c(str),
+					   t_strdup_printf("bar%u", seq));
+		}
+	}
+
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+static void test_mail_cache_prefetch_decoded(void)
+{
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	unsigned int seq, field_idxs[2];
+	string_t *str = t_str_new(32);
+
+	test_begin("mail cache prefetch decoded fields");
+
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	for (seq = 1; seq <= 10; seq++) {
+		test_mail_cache_add_mail(&ctx, ctx.cache_field.idx,
+					 t_strdup_printf("foo%u", seq));
+	}
+	for (seq = 1; seq <= 10; seq += 2) {
+		test_mail_cache_add_field(&ctx, seq, ctx.cache_field2.idx,
+					  t_strdup_printf("bar%u", seq));
+	}
+	test_mail_cache_view_sync(&ctx);
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	field_idxs[0] = ctx.cache_field.idx;
+	field_idxs[1] = ctx.cache_field2.idx;
+	test_assert(mail_cache_prefetch(cache_view, 3, 8, field_idxs, 2) == 0);
+	test_assert(cache_view->prefetch_seq1 == 3 &&
+		    cache_view->prefetch_seq2 == 8);
+
+	/* the lookups are answered from the prefetched fields */
+	for (seq = 1; seq <= 10; seq++) {
+		test_assert_idx(mail_cache_field_exists(cache_view, seq,
+				ctx.cache_field2.idx) == (int)(seq % 2), seq);
+		str_truncate(str, 0);
+		test_assert_idx(mail_cache_lookup_field(cache_view, str, seq,
+				ctx.cache_field.idx) == 1, seq);
+		test_assert_strcmp(str_c(str), t_strdup_printf("foo%u", seq));
+		str_truncate(str, 0);
+		test_assert_idx(mail_cache_lookup_field(cache_view, str, seq,
+				ctx.cache_field2.idx) == (int)(seq % 2), seq);
+		if (seq % 2 == 1) {
+			test_assert_strcmp(str_c(str),
+					   t_strdup_printf("bar%u", seq));
+		}
+	}
+	test_assert(cache_view->prefetch_seq2 == 8);
+
+	/* adding a field to a prefetched mail forgets the prefetched
+	   fields, so the uncommitted field is found */
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, 4, ctx.cache_field2.idx, "new4", 4);
+	test_assert(cache_view->prefetch_seq2 == 0);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 4,
+					    ctx.cache_field2.idx) == 1);
+	test_assert_strcmp(str_c(str), "new4");
+	mail_index_transaction_rollback(&trans);
+
+	/* syncing the view forgets the prefetched fields */
+	test_assert(mail_cache_prefetch(cache_view, 1, 10, field_idxs, 2) == 0);
+	test_mail_cache_add_field(&ctx, 6, ctx.cache_field2.idx, "bar6");
+	test_mail_cache_view_sync(&ctx);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 6,
+					    ctx.cache_field2.idx) == 1);
+	test_assert_strcmp(str_c(str), "bar6");
+	test_assert(cache_view->prefetch_seq2 == 0);
+
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+static int
+test_rle_compress(const void *data, size_t size, buffer_t *dest,
+		  void *context ATTR_UNUSED)
+{
+	const unsigned char *p = data;
+	size_t i, n;
+
+	for (i = 0; i < size; i += n) {
+		for (n = 1; i + n < size && n < UINT8_MAX; n++) {
+			if (p[i + n] != p[i])
+				break;
+		}
+		buffer_append_c(dest, (unsigned char)n);
+		buffer_append_c(dest, p[i]);
+	}
+	return 0;
+}
+
+static int
+test_rle_decompress(const void *data, size_t size, buffer_t *dest,
+		    void *context ATTR_UNUSED, const char **error_r)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	if (size % 2 != 0) {
+		*error_r = "odd size";
+		return -1;
+	}
+	for (i = 0; i < size; i += 2) {
+		if (p[i] == 0) {
+			*error_r = "zero count";
+			return -1;
+		}
+		memset(buffer_append_space_unsafe(dest, p[i]), p[i+1], p[i]);
+	}
+	return 0;
+}
+
+static const struct mail_cache_compression test_rle_compression = {
+	.compress = test_rle_compress,
+	.decompress = test_rle_decompress,
+};
+
+static unsigned int test_decompress_count = 0;
+
+static int
+test_rle_decompress_counted(const void *data, size_t size, buffer_t *dest,
+			    void *context, const char **error_r)
+{
+	test_decompress_count++;
+	return test_rle_decompress(data, size, dest, context, error_r);
+}
+
+static const struct mail_cache_compression test_rle_counted_compression = {
+	.compress = test_rle_compress,
+	.decompress = test_rle_decompress_counted,
+};
+
+static bool
+test_mail_cache_field_is_compressed(struct test_mail_cache_ctx *ctx,
+				    struct mail_cache_view *cache_view,
+				    uint32_t seq, unsigned int field_idx)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	bool compressed = FALSE;
+
+	mail_cache_lookup_iter_init(cache_view, seq, &iter);
+	iter.no_decompress = TRUE;
+	while (mail_cache_lookup_iter_next(&iter, &field) > 0) {
+		if (field.field_idx == field_idx)
+			compressed = field.compressed;
+	}
+	test_assert(ctx->cache->hdr != NULL);
+	return compressed;
+}
+
+static void test_mail_cache_compression(void)
+{
+	const struct mail_cache_compression decompress_only = {
+		.decompress = test_rle_decompress,
+	};
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	string_t *str = t_str_new(1024);
+	char blob[1001];
+
+	test_begin("mail cache compression");
+	memset(blob, 'x', sizeof(blob) - 1);
+	blob[sizeof(blob) - 1] = '\0';
+
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_cache_set_compression(ctx.cache, &test_rle_compression);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, blob);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "short");
+	test_mail_cache_add_field(&ctx, 1, ctx.cache_field2.idx, "bar");
+	test_mail_cache_view_sync(&ctx);
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+
+	/* only the large field was compressed */
+	test_assert(test_mail_cache_field_is_compressed(&ctx, cache_view, 1,
+							ctx.cache_field.idx));
+	test_assert(!test_mail_cache_field_is_compressed(&ctx, cache_view, 1,
+							 ctx.cache_field2.idx));
+	test_assert(!test_mail_cache_field_is_compressed(&ctx, cache_view, 2,
+							 ctx.cache_field.idx));
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), blob);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 2,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), "short");
+
+	/* compressed fields can't be seen without decompression */
+	mail_cache_unset_compression(ctx.cache);
+	test_assert(mail_cache_field_exists(cache_view, 1,
+					    ctx.cache_field.idx) == 0);
+	test_assert(mail_cache_field_exists(cache_view, 1,
+					    ctx.cache_field2.idx) == 1);
+
+	/* purging preserves the compressed data */
+	test_assert(mail_cache_purge(ctx.cache, (uint32_t)-1, "test") == 0);
+	mail_cache_set_compression(ctx.cache, &decompress_only);
+	test_assert(test_mail_cache_field_is_compressed(&ctx, cache_view, 1,
+							ctx.cache_field.idx));
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), blob);
+
+	/* purging compresses the uncompressed large fields */
+	mail_cache_unset_compression(ctx.cache);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, blob);
+	test_assert(!test_mail_cache_field_is_compressed(&ctx, cache_view, 3,
+							 ctx.cache_field.idx));
+	mail_cache_set_compression(ctx.cache, &test_rle_compression);
+	test_assert(mail_cache_purge(ctx.cache, (uint32_t)-1, "test") == 0);
+	test_assert(test_mail_cache_field_is_compressed(&ctx, cache_view, 3,
+							ctx.cache_field.idx));
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 3,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), blob);
+
+	/* compressed fields in uncommitted transactions are found */
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, 2, ctx.cache_field2.idx,
+		       blob, strlen(blob));
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 2,
+					    ctx.cache_field2.idx) == 1);
+	test_assert_strcmp(str_c(str), blob);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_mail_cache_view_sync(&ctx);
+	test_assert(test_mail_cache_field_is_compressed(&ctx, cache_view, 2,
+							ctx.cache_field2.idx));
+
+	mail_cache_unset_compression(ctx.cache);
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+static void test_mail_cache_compression_lookups(void)
+{
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	string_t *str = t_str_new(1024);
+	char blob[1001], blob2[1001];
+
+	test_begin("mail cache compression lookups");
+	memset(blob, 'x', sizeof(blob) - 1);
+	blob[sizeof(blob) - 1] = '\0';
+	memset(blob2, 'y', sizeof(blob2) - 1);
+	blob2[sizeof(blob2) - 1] = '\0';
+
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_cache_set_compression(ctx.cache, &test_rle_counted_compression);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, blob);
+	test_mail_cache_add_field(&ctx, 1, ctx.cache_field2.idx, blob2);
+	test_mail_cache_view_sync(&ctx);
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(test_mail_cache_field_is_compressed(&ctx, cache_view, 1,
+							ctx.cache_field.idx));
+	test_assert(test_mail_cache_field_is_compressed(&ctx, cache_view, 1,
+							ctx.cache_field2.idx));
+
+	/* checking the existence doesn't decompress anything */
+	test_decompress_count = 0;
+	test_assert(mail_cache_field_exists(cache_view, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert(mail_cache_field_exists(cache_view, 1,
+					    ctx.cache_field2.idx) == 1);
+	test_assert(test_decompress_count == 0);
+
+	/* only the looked up field is decompressed */
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field2.idx) == 1);
+	test_assert_strcmp(str_c(str), blob2);
+	test_assert(test_decompress_count == 1);
+
+	/* the compression stays set until all its users have unset it */
+	mail_cache_set_compression(ctx.cache, &test_rle_counted_compression);
+	mail_cache_unset_compression(ctx.cache);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), blob);
+	test_assert(test_decompress_count == 2);
+	mail_cache_unset_compression(ctx.cache);
+	test_assert(mail_cache_field_exists(cache_view, 1,
+					    ctx.cache_field.idx) == 0);
+
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -758,6 +1116,10 @@ int main(void)
 		test_mail_cache_lookup_decisions2,
 		test_mail_cache_in_memory,
 		test_mail_cache_size_corruption,
+		test_mail_cache_prefetch,
+		test_mail_cache_prefetch_decoded,
+		test_mail_cache_compression,
+		test_mail_cache_compression_lookups,
 		NULL
 	};
 	return test_run(test_functions);
@@ -47,10 +47,74 @@ static void test_mail_index_map_lookup_seq_range(void)
 	test_end();
 }
 
+static void test_mail_index_map_columns(void)
+{
+	struct mail_index_record_map rec_map;
+	struct mail_index_map map;
+	const struct mail_index_record_columns *columns;
+	struct mail_index_record *rec;
+	ARRAY_TYPE(seq_range) seqs;
+	uint32_t seq, count = 1000;
+	unsigned int i;
+
+	test_begin("mail index map columns");
+	i_zero(&map);
+	i_zero(&rec_map);
+	map.rec_map = &rec_map;
+	map.hdr.messages_count = count;
+	map.hdr.record_size = sizeof(struct mail_index_record) + 12;
+	rec_map.records_count = count;
+	rec_map.records = i_malloc(map.hdr.record_size * count);
+	for (seq = 1; seq <= count; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(&map, seq);
+		rec->uid = seq*2;
+		rec->flags = seq % 10 == 0 ? MAIL_FLAGGED : 0;
+	}
+	map.hdr.next_uid = count*2 + 1;
+
+	columns = mail_index_map_get_columns(&map);
+	test_assert(columns != NULL && array_count(&columns->uids) == count);
+	test_assert(mail_index_map_find_flags(&map, MAIL_FLAGGED, MAIL_FLAGGED,
+					      1, count) == 10);
+	test_assert(mail_index_map_find_flags(&map, MAIL_FLAGGED, MAIL_FLAGGED,
+					      11, count) == 20);
+	test_assert(mail_index_map_find_flags(&map, MAIL_FLAGGED, MAIL_FLAGGED,
+					      991, 999) == 0);
+	test_assert(mail_index_map_find_flags(&map, MAIL_SEEN, MAIL_SEEN,
+					      1, count) == 0);
+
+	mail_index_record_map_columns_update_flags(&rec_map, 500, MAIL_SEEN);
+	test_assert(mail_index_map_find_flags(&map, MAIL_SEEN, MAIL_SEEN,
+					      1, count) == 500);
+
+	/* expunge 1, 100..199, 998..1000 */
+	t_array_init(&seqs, 4);
+	seq_range_array_add(&seqs, 1);
+	seq_range_array_add_range(&seqs, 100, 199);
+	seq_range_array_add_range(&seqs, 998, 1000);
+	mail_index_record_map_columns_expunge(&rec_map, &seqs);
+	count -= 1 + 100 + 3;
+	test_assert(array_count(&columns->uids) == count);
+	test_assert(array_count(&columns->flags) == count);
+	for (i = 0; i < count; i++) {
+		seq = i + 2;
+		if (seq >= 100)
+			seq += 100;
+		test_assert_idx(*array_idx(&columns->uids, i) == seq*2, i);
+	}
+	test_assert(*array_idx(&columns->flags, 500-1-101) == MAIL_SEEN);
+
+	mail_index_record_map_columns_free(&rec_map);
+	test_assert(rec_map.columns == NULL);
+	i_free(rec_map.records);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_index_map_lookup_seq_range,
+		test_mail_index_map_columns,
 		NULL
 	};
 	return test_run(test_functions);
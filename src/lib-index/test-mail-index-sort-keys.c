@@ -0,0 +1,163 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "test-mail-index.h"
+#include "mail-index-sort-keys.h"
+
+#include <fcntl.h>
+
+#define TEST_SORT_KEYS_SUFFIX ".sort-s"
+
+static void
+test_keys_add(ARRAY_TYPE(mail_index_sort_key) *arr, uint32_t sort_id,
+	      const char *str)
+{
+	struct mail_index_sort_key *key = array_append_space(arr);
+
+	key->sort_id = sort_id;
+	key->str = str;
+}
+
+static bool
+test_keys_lookup_equals(struct mail_index_sort_keys *keys, uint32_t sort_id,
+			const char *expected)
+{
+	const char *str = mail_index_sort_keys_lookup(keys, sort_id);
+
+	return null_strcmp(str, expected) == 0;
+}
+
+static void test_mail_index_sort_keys(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_sort_keys *keys;
+	ARRAY_TYPE(mail_index_sort_key) arr;
+	uint32_t file_id1, file_id2, file_id3;
+	const char *path;
+	int fd;
+
+	test_begin("mail index sort keys");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+	keys = mail_index_sort_keys_init(index, TEST_SORT_KEYS_SUFFIX);
+	t_array_init(&arr, 8);
+
+	/* nothing written yet */
+	test_assert(mail_index_sort_keys_read(keys, view, 0) == 0);
+	test_assert(mail_index_sort_keys_read(keys, view, 123) == 0);
+	test_assert(mail_index_sort_keys_want_rewrite(keys));
+	test_assert(mail_index_sort_keys_lookup(keys, 10) == NULL);
+
+	test_keys_add(&arr, 10, "aaa");
+	test_keys_add(&arr, 20, "bbb");
+	test_assert(mail_index_sort_keys_rewrite(keys, view, &arr,
+						 &file_id1) == 0);
+	test_assert(mail_index_sort_keys_read(keys, view, file_id1) == 1);
+	test_assert(!mail_index_sort_keys_want_rewrite(keys));
+	test_assert(test_keys_lookup_equals(keys, 10, "aaa"));
+	test_assert(test_keys_lookup_equals(keys, 20, "bbb"));
+	test_assert(test_keys_lookup_equals(keys, 15, NULL));
+
+	/* append on top of the first block. the new block overrides the
+	   old sort_id=20 */
+	array_clear(&arr);
+	test_keys_add(&arr, 15, "aab");
+	test_keys_add(&arr, 20, "bbc");
+	test_assert(mail_index_sort_keys_append(keys, &arr, &file_id2) == 1);
+	test_assert(mail_index_sort_keys_read(keys, view, file_id2) == 1);
+	test_assert(test_keys_lookup_equals(keys, 10, "aaa"));
+	test_assert(test_keys_lookup_equals(keys, 15, "aab"));
+	test_assert(test_keys_lookup_equals(keys, 20, "bbc"));
+
+	/* the old chain is still readable */
+	test_assert(mail_index_sort_keys_read(keys, view, file_id1) == 1);
+	test_assert(test_keys_lookup_equals(keys, 15, NULL));
+	test_assert(test_keys_lookup_equals(keys, 20, "bbb"));
+
+	/* a concurrent writer appended - append must fail until reread */
+	path = t_strconcat(index->filepath, TEST_SORT_KEYS_SUFFIX, NULL);
+	fd = open(path, O_WRONLY | O_APPEND);
+	test_assert(fd != -1);
+	test_assert(write_full(fd, "\0\0\0\0\0", 5) == 0);
+	array_clear(&arr);
+	test_keys_add(&arr, 30, "ccc");
+	test_assert(mail_index_sort_keys_append(keys, &arr, &file_id3) == 0);
+
+	/* the partially written block is ignored by reading, but appending
+	   requires rewriting */
+	test_assert(mail_index_sort_keys_read(keys, view, file_id2) == 1);
+	test_assert(test_keys_lookup_equals(keys, 20, "bbc"));
+	test_assert(mail_index_sort_keys_append(keys, &arr, &file_id3) == 0);
+	i_close_fd(&fd);
+
+	/* rewrite */
+	test_assert(mail_index_sort_keys_rewrite(keys, view, &arr,
+						 &file_id3) == 0);
+	test_assert(mail_index_sort_keys_read(keys, view, file_id2) == 0);
+	test_assert(mail_index_sort_keys_read(keys, view, file_id3) == 1);
+	test_assert(test_keys_lookup_equals(keys, 10, NULL));
+	test_assert(test_keys_lookup_equals(keys, 30, "ccc"));
+
+	mail_index_sort_keys_deinit(&keys);
+	mail_index_view_close(&view);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static void test_mail_index_sort_keys_chain_limit(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_sort_keys *keys;
+	ARRAY_TYPE(mail_index_sort_key) arr;
+	uint32_t file_id, i;
+	unsigned int appends = 0;
+
+	test_begin("mail index sort keys chain limit");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+	keys = mail_index_sort_keys_init(index, TEST_SORT_KEYS_SUFFIX);
+	t_array_init(&arr, 8);
+
+	for (i = 1; i <= 100; i++)
+		test_keys_add(&arr, i * 100, t_strdup_printf("key%03u", i));
+	test_assert(mail_index_sort_keys_rewrite(keys, view, &arr,
+						 &file_id) == 0);
+	test_assert(mail_index_sort_keys_read(keys, view, file_id) == 1);
+
+	/* keep appending until a rewrite is wanted */
+	for (i = 1; i < 100 && !mail_index_sort_keys_want_rewrite(keys); i++) {
+		array_clear(&arr);
+		test_keys_add(&arr, i * 100 + 50,
+			      t_strdup_printf("key%03u+", i));
+		test_assert(mail_index_sort_keys_append(keys, &arr,
+							&file_id) == 1);
+		test_assert(mail_index_sort_keys_read(keys, view, file_id) == 1);
+		appends++;
+	}
+	test_assert(appends > 0 && appends < 100);
+	/* all the keys are still found */
+	test_assert(test_keys_lookup_equals(keys, 100, "key001"));
+	test_assert(test_keys_lookup_equals(keys, 150, "key001+"));
+	test_assert(test_keys_lookup_equals(keys, appends * 100 + 50,
+		t_strdup_printf("key%03u+", appends)));
+
+	mail_index_sort_keys_deinit(&keys);
+	mail_index_view_close(&view);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_index_sort_keys,
+		test_mail_index_sort_keys_chain_limit,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,165 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "test-common.h"
+#include "test-mail-index.h"
+#include "mail-index-strmap.h"
+
+#define TEST_STRMAP_SUFFIX ".thread"
+#define TEST_STRMAP_MSG_COUNT 1000
+
+static const char *test_strmap_get_key(uint32_t uid, uint32_t ref_index)
+{
+	switch (ref_index) {
+	case 0:
+		return t_strdup_printf("<%u@example.com>", uid);
+	case 2:
+		return t_strdup_printf("<%u@example.com>", uid - 1);
+	case 3:
+		return t_strdup_printf("<%u@example.com>", uid / 2);
+	default:
+		i_unreached();
+	}
+}
+
+static bool
+test_strmap_key_cmp(const char *key, const struct mail_index_strmap_rec *rec,
+		    void *context ATTR_UNUSED)
+{
+	return strcmp(key, test_strmap_get_key(rec->uid, rec->ref_index)) == 0;
+}
+
+static int
+test_strmap_rec_cmp(const struct mail_index_strmap_rec *rec1,
+		    const struct mail_index_strmap_rec *rec2,
+		    void *context ATTR_UNUSED)
+{
+	return strcmp(test_strmap_get_key(rec1->uid, rec1->ref_index),
+		      test_strmap_get_key(rec2->uid, rec2->ref_index)) == 0 ?
+		1 : 0;
+}
+
+static void
+test_strmap_remap(const uint32_t *idx_map ATTR_UNUSED,
+		  unsigned int old_count ATTR_UNUSED,
+		  unsigned int new_count ATTR_UNUSED,
+		  void *context ATTR_UNUSED)
+{
+}
+
+static struct mail_index_strmap_view *
+test_strmap_view_open(struct mail_index_strmap *strmap,
+		      struct mail_index_view *view,
+		      const ARRAY_TYPE(mail_index_strmap_rec) **recs_r)
+{
+	return mail_index_strmap_view_open(strmap, view,
+					   test_strmap_key_cmp,
+					   test_strmap_rec_cmp,
+					   test_strmap_remap, NULL, recs_r);
+}
+
+static void test_strmap_append_mails(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 123456;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uid = 1; uid <= TEST_STRMAP_MSG_COUNT; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static void
+test_strmap_check_recs(const ARRAY_TYPE(mail_index_strmap_rec) *recs)
+{
+	const struct mail_index_strmap_rec *rec;
+	ARRAY(uint32_t) msgid_str_idx;
+	uint32_t str_idx;
+
+	/* each message has a unique Message-ID, and the references point to
+	   the earlier messages' Message-IDs */
+	t_array_init(&msgid_str_idx, TEST_STRMAP_MSG_COUNT + 1);
+	array_foreach(recs, rec) {
+		if (rec->ref_index == 0) {
+			array_idx_set(&msgid_str_idx, rec->uid, &rec->str_idx);
+			continue;
+		}
+		str_idx = *array_idx(&msgid_str_idx, rec->ref_index == 2 ?
+				     rec->uid - 1 : rec->uid / 2);
+		test_assert_idx(rec->str_idx == str_idx, rec->uid);
+	}
+	test_assert(array_count(&msgid_str_idx) == TEST_STRMAP_MSG_COUNT + 1);
+}
+
+static void test_mail_index_strmap(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_strmap *strmap, *strmap2;
+	struct mail_index_strmap_view *sview, *sview2;
+	struct mail_index_strmap_view_sync *sync;
+	const ARRAY_TYPE(mail_index_strmap_rec) *recs, *recs2;
+	uint32_t uid, last_uid;
+
+	test_begin("mail index strmap");
+	index = test_mail_index_init();
+	test_strmap_append_mails(index);
+	view = mail_index_view_open(index);
+
+	strmap = mail_index_strmap_init(index, TEST_STRMAP_SUFFIX);
+	sview = test_strmap_view_open(strmap, view, &recs);
+	sync = mail_index_strmap_view_sync_init(sview, &last_uid);
+	test_assert(last_uid == 0);
+	for (uid = 1; uid <= TEST_STRMAP_MSG_COUNT; uid++) {
+		mail_index_strmap_view_sync_add(sync, uid, 0,
+						test_strmap_get_key(uid, 0));
+		if (uid == 1)
+			continue;
+		mail_index_strmap_view_sync_add(sync, uid, 2,
+						test_strmap_get_key(uid, 2));
+		mail_index_strmap_view_sync_add(sync, uid, 3,
+						test_strmap_get_key(uid, 3));
+	}
+	mail_index_strmap_view_sync_commit(&sync);
+	test_assert(array_count(recs) == TEST_STRMAP_MSG_COUNT * 3 - 2);
+	test_assert(mail_index_strmap_view_get_highest_idx(sview) ==
+		    TEST_STRMAP_MSG_COUNT);
+	test_strmap_check_recs(recs);
+
+	/* read the written file with another strmap */
+	strmap2 = mail_index_strmap_init(index, TEST_STRMAP_SUFFIX);
+	sview2 = test_strmap_view_open(strmap2, view, &recs2);
+	sync = mail_index_strmap_view_sync_init(sview2, &last_uid);
+	test_assert(last_uid == TEST_STRMAP_MSG_COUNT);
+	mail_index_strmap_view_sync_commit(&sync);
+	test_assert(array_count(recs2) == array_count(recs));
+	test_assert(memcmp(array_front(recs2), array_front(recs),
+			   array_count(recs) * sizeof(*array_front(recs))) == 0);
+	test_assert(mail_index_strmap_view_get_highest_idx(sview2) ==
+		    TEST_STRMAP_MSG_COUNT);
+
+	mail_index_strmap_view_close(&sview2);
+	mail_index_strmap_deinit(&strmap2);
+	mail_index_strmap_view_close(&sview);
+	mail_index_strmap_deinit(&strmap);
+	mail_index_view_close(&view);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_index_strmap,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -158,11 +158,512 @@ static void test_mail_index_new_extension(void)
 	test_end();
 }
 
+static void test_mail_index_columns_check(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	const struct mail_index_record_columns *columns;
+	const struct mail_index_record *rec;
+	static const struct {
+		enum mail_flags flags;
+		uint8_t flags_mask;
+	} tests[] = {
+		{ MAIL_SEEN, MAIL_SEEN },
+		{ 0, MAIL_SEEN },
+		{ MAIL_FLAGGED, MAIL_FLAGGED },
+		{ MAIL_SEEN | MAIL_FLAGGED, MAIL_SEEN | MAIL_FLAGGED },
+		{ MAIL_DELETED, MAIL_DELETED | MAIL_SEEN },
+		{ MAIL_ANSWERED, MAIL_ANSWERED },
+	};
+	uint32_t seq, seq1, found_seq, count;
+	unsigned int i;
+
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	count = mail_index_view_get_messages_count(view);
+
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		for (seq1 = 1; seq1 <= count; seq1 += 37) {
+			mail_index_lookup_first_range(view, tests[i].flags,
+						      tests[i].flags_mask,
+						      seq1, count - 5,
+						      &found_seq);
+			for (seq = seq1; seq <= count - 5; seq++) {
+				rec = mail_index_lookup(view, seq);
+				if ((rec->flags & tests[i].flags_mask) ==
+				    tests[i].flags)
+					break;
+			}
+			if (seq > count - 5)
+				seq = 0;
+			test_assert_idx(found_seq == seq, i);
+		}
+	}
+
+	/* the columns must match the records */
+	columns = index->map->rec_map->columns;
+	test_assert(columns != NULL);
+	if (columns != NULL) {
+		test_assert(array_count(&columns->uids) ==
+			    index->map->rec_map->records_count);
+		test_assert(array_count(&columns->flags) ==
+			    index->map->rec_map->records_count);
+		for (seq = 1; seq <= index->map->hdr.messages_count; seq++) {
+			rec = MAIL_INDEX_REC_AT_SEQ(index->map, seq);
+			test_assert_idx(*array_idx(&columns->uids, seq-1) ==
+					rec->uid, seq);
+			test_assert_idx(*array_idx(&columns->flags, seq-1) ==
+					rec->flags, seq);
+		}
+	}
+	mail_index_view_close(&view);
+}
+
+static void test_mail_index_columns(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view, *tview;
+	struct mail_index_transaction *trans;
+	enum mail_flags flags;
+	uint32_t seq, uid, found_seq, uid_validity = 123456;
+
+	test_begin("mail index columns");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uid = 1; uid <= 1000; uid++) {
+		mail_index_append(trans, uid, &seq);
+		flags = 0;
+		if (uid % 3 == 0)
+			flags |= MAIL_SEEN;
+		if (uid % 200 == 0)
+			flags |= MAIL_FLAGGED;
+		if (uid > 900)
+			flags |= MAIL_DELETED;
+		mail_index_update_flags(trans, seq, MODIFY_REPLACE, flags);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_columns_check(index);
+
+	/* flag updates */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= 1000; seq += 7)
+		mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_ANSWERED);
+	for (seq = 300; seq <= 600; seq++)
+		mail_index_update_flags(trans, seq, MODIFY_REMOVE, MAIL_SEEN);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_columns_check(index);
+
+	/* expunges */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= 1000; seq += 11)
+		mail_index_expunge(trans, seq);
+	for (seq = 500; seq <= 700; seq++)
+		mail_index_expunge(trans, seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_columns_check(index);
+
+	/* more appends */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (uid = 1001; uid <= 1100; uid++) {
+		mail_index_append(trans, uid, &seq);
+		if (uid % 2 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_REPLACE,
+						MAIL_FLAGGED);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_columns_check(index);
+
+	/* uncommitted changes are seen by the transaction view */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_flags(trans, 50, MODIFY_ADD, MAIL_DRAFT);
+	mail_index_append(trans, 1101, &seq);
+	mail_index_update_flags(trans, seq, MODIFY_REPLACE, MAIL_DRAFT);
+	tview = mail_index_transaction_open_updated_view(trans);
+	mail_index_lookup_first_range(tview, MAIL_DRAFT, MAIL_DRAFT, 1,
+				      seq, &found_seq);
+	test_assert(found_seq == 50);
+	mail_index_lookup_first_range(tview, MAIL_DRAFT, MAIL_DRAFT, 51,
+				      seq, &found_seq);
+	test_assert(found_seq == seq);
+	mail_index_view_close(&tview);
+	mail_index_transaction_rollback(&trans);
+	mail_index_view_close(&view);
+
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static void
+test_mail_index_mmap_append(struct mail_index *index, uint32_t uid1,
+			    uint32_t uid2)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (uid = uid1; uid <= uid2; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static void test_mail_index_mmap_cow(void)
+{
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_memory_usage usage, usage2;
+	uint32_t seq, uid, file_seq, uid_validity = 123456;
+	uoff_t file_offset;
+
+	test_begin("mail index mmap copy-on-write");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+
+	/* write an index file large enough to be mmap()ed */
+	test_mail_index_mmap_append(index, 1, 10000);
+	test_assert(mail_transaction_log_sync_lock(index->log, "test",
+						   &file_seq, &file_offset) == 0);
+	mail_index_write(index, FALSE, "test");
+	mail_transaction_log_sync_unlock(index->log, "test");
+
+	index2 = test_mail_index_open();
+	test_assert(!MAIL_INDEX_MAP_IS_IN_MEMORY(index2->map));
+	test_assert(index2->map->rec_map->mmap_reserved_size >=
+		    index2->map->rec_map->mmap_size +
+		    MAIL_INDEX_MMAP_MIN_RESERVE_SIZE);
+	mail_index_get_memory_usage(&usage);
+	test_assert(usage.mmap_bytes >= index2->map->rec_map->mmap_size);
+
+	/* appends and expunges are synced into the mmap()ed map without
+	   copying it */
+	test_mail_index_mmap_append(index, 10001, 10100);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= 10100; seq += 10)
+		mail_index_expunge(trans, seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+
+	mail_index_get_memory_usage(&usage);
+	test_assert(mail_index_refresh(index2) == 0);
+	mail_index_get_memory_usage(&usage2);
+	test_assert(!MAIL_INDEX_MAP_IS_IN_MEMORY(index2->map));
+	test_assert(usage2.copy_count == usage.copy_count);
+
+	view = mail_index_view_open(index2);
+	test_assert(mail_index_view_get_messages_count(view) == 10100 - 1010);
+	mail_index_lookup_uid(view, 1, &uid);
+	test_assert(uid == 2);
+	mail_index_lookup_uid(view, 9, &uid);
+	test_assert(uid == 10);
+	mail_index_lookup_uid(view, 10, &uid);
+	test_assert(uid == 12);
+	mail_index_lookup_uid(view, 10100 - 1010, &uid);
+	test_assert(uid == 10100);
+	mail_index_view_close(&view);
+
+	/* once the reserved space is used up, the map is copied to memory */
+	test_mail_index_mmap_append(index, 10101, 20100);
+	test_assert(mail_index_refresh(index2) == 0);
+	mail_index_get_memory_usage(&usage2);
+	test_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(index2->map));
+	test_assert(usage2.copy_count == usage.copy_count + 1);
+	test_assert(index2->map->hdr.messages_count == 20100 - 1010);
+
+	test_mail_index_close(&index2);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static uoff_t test_mail_index_log_size(struct mail_index *index)
+{
+	test_assert(mail_index_refresh(index) == 0);
+	return index->log->head->sync_offset;
+}
+
+static void test_mail_index_mass_flag_updates(void)
+{
+#define TEST_MASS_MESSAGES_COUNT 20000
+#define TEST_MASS_RANGES_COUNT 10
+#define TEST_MASS_RANGE_MAX_SIZE 64
+	const char *keyword_names[] = { "foo", NULL };
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_keywords *keywords;
+	uint32_t seq, uid, uid_validity = 123456;
+	uoff_t offset;
+
+	test_begin("mail index mass flag updates");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_mmap_append(index, 1, TEST_MASS_MESSAGES_COUNT);
+
+	/* the other index syncs the changes from the log */
+	index2 = test_mail_index_open();
+
+	/* mark everything except every 2000th message seen one message at a
+	   time. the log grows by the number of ranges, not messages. */
+	offset = test_mail_index_log_size(index);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= TEST_MASS_MESSAGES_COUNT; seq++) {
+		if (seq % (TEST_MASS_MESSAGES_COUNT /
+			   TEST_MASS_RANGES_COUNT) != 0) {
+			mail_index_update_flags(trans, seq, MODIFY_ADD,
+						MAIL_SEEN | MAIL_DELETED);
+		}
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_assert(test_mail_index_log_size(index) - offset <
+		    TEST_MASS_RANGES_COUNT * TEST_MASS_RANGE_MAX_SIZE);
+
+	test_assert(mail_index_refresh(index2) == 0);
+	test_assert(index2->map->hdr.seen_messages_count ==
+		    TEST_MASS_MESSAGES_COUNT - TEST_MASS_RANGES_COUNT);
+	test_assert(index2->map->hdr.deleted_messages_count ==
+		    TEST_MASS_MESSAGES_COUNT - TEST_MASS_RANGES_COUNT);
+	test_assert(index2->map->hdr.first_deleted_uid_lowwater <= 1);
+
+	/* mark the rest seen and undelete everything */
+	offset = test_mail_index_log_size(index);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = TEST_MASS_MESSAGES_COUNT / TEST_MASS_RANGES_COUNT;
+	     seq <= TEST_MASS_MESSAGES_COUNT;
+	     seq += TEST_MASS_MESSAGES_COUNT / TEST_MASS_RANGES_COUNT)
+		mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+	mail_index_update_flags_range(trans, 1, TEST_MASS_MESSAGES_COUNT,
+				      MODIFY_REMOVE, MAIL_DELETED);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_assert(test_mail_index_log_size(index) - offset <
+		    (TEST_MASS_RANGES_COUNT + 1) * TEST_MASS_RANGE_MAX_SIZE);
+
+	test_assert(mail_index_refresh(index2) == 0);
+	test_assert(index2->map->hdr.seen_messages_count ==
+		    TEST_MASS_MESSAGES_COUNT);
+	test_assert(index2->map->hdr.first_unseen_uid_lowwater ==
+		    TEST_MASS_MESSAGES_COUNT + 1);
+	test_assert(index2->map->hdr.deleted_messages_count == 0);
+	test_assert(index2->map->hdr.first_deleted_uid_lowwater ==
+		    TEST_MASS_MESSAGES_COUNT + 1);
+
+	/* unseen again from the middle - the lowwater drops to the first
+	   unseen message */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 5001; seq <= TEST_MASS_MESSAGES_COUNT; seq++)
+		mail_index_update_flags(trans, seq, MODIFY_REMOVE, MAIL_SEEN);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+
+	test_assert(mail_index_refresh(index2) == 0);
+	test_assert(index2->map->hdr.seen_messages_count == 5000);
+	test_assert(index2->map->hdr.first_unseen_uid_lowwater == 5001);
+
+	/* keyword updates are merged into ranges as well */
+	offset = test_mail_index_log_size(index);
+	view = mail_index_view_open(index);
+	keywords = mail_index_keywords_create(index, keyword_names);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= TEST_MASS_MESSAGES_COUNT; seq++) {
+		if (seq % (TEST_MASS_MESSAGES_COUNT /
+			   TEST_MASS_RANGES_COUNT) != 0) {
+			mail_index_update_keywords(trans, seq, MODIFY_ADD,
+						   keywords);
+		}
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_keywords_unref(&keywords);
+	mail_index_view_close(&view);
+	test_assert(test_mail_index_log_size(index) - offset <
+		    TEST_MASS_RANGES_COUNT * TEST_MASS_RANGE_MAX_SIZE);
+
+	/* the record flags are consistent with the counters */
+	test_assert(mail_index_refresh(index2) == 0);
+	view = mail_index_view_open(index2);
+	for (seq = 1, uid = 0; seq <= TEST_MASS_MESSAGES_COUNT; seq++) {
+		if ((mail_index_lookup(view, seq)->flags & MAIL_SEEN) != 0)
+			uid++;
+	}
+	test_assert(uid == index2->map->hdr.seen_messages_count);
+	mail_index_view_close(&view);
+
+	test_mail_index_close(&index2);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static void test_mail_index_check_counters(struct mail_index *index)
+{
+	const struct mail_index_header *hdr;
+	struct mail_index_view *view;
+	const struct mail_index_record *rec;
+	uint32_t seq, count, seen = 0, deleted = 0;
+	uint32_t first_unseen_uid = 0, first_deleted_uid = 0;
+
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	hdr = mail_index_get_header(view);
+	count = mail_index_view_get_messages_count(view);
+	for (seq = 1; seq <= count; seq++) {
+		rec = mail_index_lookup(view, seq);
+		if ((rec->flags & MAIL_SEEN) != 0)
+			seen++;
+		else if (first_unseen_uid == 0)
+			first_unseen_uid = rec->uid;
+		if ((rec->flags & MAIL_DELETED) != 0) {
+			deleted++;
+			if (first_deleted_uid == 0)
+				first_deleted_uid = rec->uid;
+		}
+	}
+	test_assert(hdr->seen_messages_count == seen);
+	test_assert(hdr->deleted_messages_count == deleted);
+	/* the lowwaters may be lower than necessary, but never higher */
+	if (first_unseen_uid == 0)
+		test_assert(hdr->first_unseen_uid_lowwater == hdr->next_uid);
+	else
+		test_assert(hdr->first_unseen_uid_lowwater <= first_unseen_uid);
+	if (first_deleted_uid == 0)
+		test_assert(hdr->first_deleted_uid_lowwater == hdr->next_uid);
+	else {
+		test_assert(hdr->first_deleted_uid_lowwater <=
+			    first_deleted_uid);
+	}
+	mail_index_view_close(&view);
+}
+
+static void test_mail_index_flag_range_counters(void)
+{
+#define TEST_RANGE_MESSAGES_COUNT 1000
+	static const struct {
+		uint32_t seq1, seq2;
+		enum modify_type modify_type;
+		enum mail_flags flags;
+	} updates[] = {
+		{ 100, 600, MODIFY_ADD, MAIL_SEEN },
+		{ 300, 400, MODIFY_REMOVE, MAIL_SEEN },
+		{ 1, TEST_RANGE_MESSAGES_COUNT, MODIFY_ADD, MAIL_DELETED },
+		{ 500, TEST_RANGE_MESSAGES_COUNT, MODIFY_REMOVE,
+		  MAIL_DELETED | MAIL_FLAGGED },
+		{ 700, 800, MODIFY_REPLACE, MAIL_SEEN | MAIL_ANSWERED },
+		{ 1, 250, MODIFY_REPLACE, MAIL_DELETED },
+		{ 1, TEST_RANGE_MESSAGES_COUNT, MODIFY_ADD, MAIL_SEEN },
+		{ 1, TEST_RANGE_MESSAGES_COUNT, MODIFY_REMOVE, MAIL_DELETED },
+		{ 2, TEST_RANGE_MESSAGES_COUNT - 1, MODIFY_REMOVE, MAIL_SEEN },
+	};
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 123456;
+	enum mail_flags flags;
+	unsigned int i;
+
+	test_begin("mail index flag range counters");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_mmap_append(index, 1, TEST_RANGE_MESSAGES_COUNT);
+
+	/* the other index applies the ranges while syncing from the log */
+	index2 = test_mail_index_open();
+
+	/* begin with mixed flags, so each range contains records whose
+	   flags do and don't change */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= TEST_RANGE_MESSAGES_COUNT; seq++) {
+		flags = 0;
+		if (seq % 3 == 0)
+			flags |= MAIL_SEEN;
+		if (seq % 5 < 2)
+			flags |= MAIL_DELETED;
+		if (seq % 7 == 0)
+			flags |= MAIL_FLAGGED;
+		mail_index_update_flags(trans, seq, MODIFY_REPLACE, flags);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_check_counters(index2);
+
+	for (i = 0; i < N_ELEMENTS(updates); i++) {
+		view = mail_index_view_open(index);
+		trans = mail_index_transaction_begin(view,
+				MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+		mail_index_update_flags_range(trans, updates[i].seq1,
+					      updates[i].seq2,
+					      updates[i].modify_type,
+					      updates[i].flags);
+		test_assert(mail_index_transaction_commit(&trans) == 0);
+		mail_index_view_close(&view);
+		test_mail_index_check_counters(index2);
+	}
+	test_assert(index2->map->hdr.seen_messages_count == 2);
+	test_assert(index2->map->hdr.deleted_messages_count == 0);
+
+	test_mail_index_close(&index2);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_index_rotate,
 		test_mail_index_new_extension,
+		test_mail_index_columns,
+		test_mail_index_mmap_cow,
+		test_mail_index_mass_flag_updates,
+		test_mail_index_flag_range_counters,
 		NULL
 	};
 	return test_run(test_functions);
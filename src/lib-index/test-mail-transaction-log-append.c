@@ -3,12 +3,18 @@
 #include "lib.h"
 #include "buffer.h"
 #include "test-common.h"
+#include "lib-event-private.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
 
 static bool log_lock_failure = FALSE;
+static unsigned int log_unlock_count = 0;
+static unsigned int move_to_memory_count = 0;
+static unsigned int group_commit_unlock_count = 0;
+static intmax_t group_commit_bytes = 0;
 
 void mail_index_file_set_syscall_error(struct mail_index *index ATTR_UNUSED,
 				       const char *filepath ATTR_UNUSED,
@@ -23,7 +29,10 @@ int mail_transaction_log_lock_head(struct mail_transaction_log *log ATTR_UNUSED,
 }
 
 void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file ATTR_UNUSED,
-				      const char *lock_reason ATTR_UNUSED) {}
+				      const char *lock_reason ATTR_UNUSED)
+{
+	log_unlock_count++;
+}
 
 void mail_transaction_update_modseq(const struct mail_transaction_header *hdr,
 				    const void *data ATTR_UNUSED,
@@ -36,6 +45,7 @@ void mail_transaction_update_modseq(const struct mail_transaction_header *hdr,
 
 int mail_index_move_to_memory(struct mail_index *index ATTR_UNUSED)
 {
+	move_to_memory_count++;
 	return -1;
 }
 
@@ -116,6 +126,100 @@ static void test_append_sync_offset(struct mail_transaction_log *log)
 	test_end();
 }
 
+static bool
+test_group_commit_event_callback(struct event *event,
+				 enum event_callback_type type,
+				 struct failure_context *ctx ATTR_UNUSED,
+				 const char *fmt ATTR_UNUSED,
+				 va_list args ATTR_UNUSED)
+{
+	const struct event_field *field;
+
+	if (type != EVENT_CALLBACK_TYPE_SEND ||
+	    null_strcmp(event->sending_name,
+			"mail_index_log_group_commit_finished") != 0)
+		return TRUE;
+
+	group_commit_unlock_count = log_unlock_count;
+	field = event_find_field_nonrecursive(event, "bytes");
+	if (field != NULL &&
+	    field->value_type == EVENT_FIELD_VALUE_TYPE_INTMAX)
+		group_commit_bytes = field->value.intmax;
+	return TRUE;
+}
+
+static void test_append_group_commit(struct mail_transaction_log *log, int fd)
+{
+	static unsigned int buf[] = { 0x12345678 };
+	struct mail_transaction_log_file *file = log->head;
+	struct mail_transaction_log_append_ctx *ctx;
+	struct stat st;
+	int fds[2];
+
+	test_begin("transaction log append: group commit");
+	log->index->event = event_create(NULL);
+	event_set_forced_debug(log->index->event, TRUE);
+	log->index->set.fsync_mode = FSYNC_MODE_ALWAYS;
+	log->index->optimization_set.log.group_commit = TRUE;
+	event_register_callback(test_group_commit_event_callback);
+
+	/* log files are always opened with O_APPEND */
+	if (fcntl(fd, F_SETFL, O_APPEND) < 0)
+		i_fatal("fcntl(O_APPEND) failed: %m");
+	file->log = log;
+	file->fd = fd;
+	file->last_size = file->sync_offset;
+	log_unlock_count = 0;
+	test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+	mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+					&buf[0], sizeof(buf[0]));
+	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+
+	/* the fsync happened only after the log was unlocked */
+	test_assert(log_unlock_count == 1);
+	test_assert(group_commit_unlock_count == 1);
+	test_assert(group_commit_bytes ==
+		    sizeof(struct mail_transaction_header) + sizeof(buf[0]));
+	if (fstat(fd, &st) < 0) i_fatal("fstat() failed: %m");
+	test_assert((uoff_t)st.st_size == file->sync_offset);
+
+	/* while the log is sync-locked the fsync is done immediately */
+	log->index->log_sync_locked = TRUE;
+	group_commit_unlock_count = 0;
+	test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+	mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+					&buf[0], sizeof(buf[0]));
+	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+	test_assert(log_unlock_count == 1);
+	test_assert(group_commit_unlock_count == 0);
+	log->index->log_sync_locked = FALSE;
+
+	/* fdatasync() failing after the unlock doesn't fail the already
+	   visible commit, but the index is moved to memory */
+	if (pipe(fds) < 0)
+		i_fatal("pipe() failed: %m");
+	file->fd = fds[1];
+	log_unlock_count = 0;
+	group_commit_unlock_count = 0;
+	move_to_memory_count = 0;
+	test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+	mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+					&buf[0], sizeof(buf[0]));
+	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+	test_assert(log_unlock_count == 1);
+	test_assert(group_commit_unlock_count == 1);
+	test_assert(move_to_memory_count == 1);
+	i_close_fd(&fds[0]);
+	i_close_fd(&fds[1]);
+
+	event_unregister_callback(test_group_commit_event_callback);
+	event_unref(&log->index->event);
+	log->index->set.fsync_mode = FSYNC_MODE_OPTIMIZED;
+	log->index->optimization_set.log.group_commit = FALSE;
+	file->fd = -1;
+	test_end();
+}
+
 static void test_mail_transaction_log_append(void)
 {
 	struct mail_transaction_log *log;
@@ -159,6 +263,8 @@ static void test_mail_transaction_log_append(void)
 	file->fd = -1;
 	test_end();
 
+	test_append_group_commit(log, fd);
+
 	buffer_free(&log->head->buffer);
 	i_free(log->head);
 	i_free(log->index);
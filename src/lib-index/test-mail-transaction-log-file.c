@@ -1,6 +1,7 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "ioloop.h"
 #include "test-common.h"
 #include "mail-index-private.h"
@@ -374,6 +375,70 @@ static void test_mail_transaction_log_file_modseq_offsets(void)
 	test_end();
 }
 
+static void test_mail_transaction_log_file_modseq_checkpoints(void)
+{
+	test_begin("mail_transaction_log_file modseq checkpoints");
+
+	struct mail_index *index = test_mail_index_open();
+	struct mail_transaction_log_file *file = index->log->head;
+	const struct modseq_cache *checkpoints;
+	unsigned int i, count;
+
+	const unsigned int max_modseq = 1000;
+	uoff_t modseq_next_offset[max_modseq+1];
+
+	modseq_next_offset[1] = sizeof(struct mail_transaction_log_header);
+	for (uint64_t modseq = 2; modseq <= max_modseq; modseq++) {
+		uint32_t seq;
+
+		struct mail_index_view *view = mail_index_view_open(index);
+		struct mail_index_transaction *trans =
+			mail_index_transaction_begin(view, 0);
+		mail_index_append(trans, modseq, &seq);
+		test_assert(mail_index_transaction_commit(&trans) == 0);
+		modseq_next_offset[modseq] = file->sync_offset;
+		mail_index_view_close(&view);
+	}
+
+	/* looking up the highest modseq scans the whole file once and adds
+	   the checkpoints */
+	uint64_t modseq, modseq_at;
+	uoff_t next_offset;
+	const char *error;
+	test_assert(mail_transaction_log_file_get_highest_modseq_at(
+		file, modseq_next_offset[max_modseq-1], &modseq_at, &error) == 1);
+	test_assert(modseq_at == max_modseq-1);
+	test_assert(array_is_created(&file->modseq_checkpoints));
+	checkpoints = array_get(&file->modseq_checkpoints, &count);
+	test_assert(count >= file->sync_offset /
+		    LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL / 2);
+	for (i = 1; i < count; i++) {
+		test_assert(checkpoints[i].offset >= checkpoints[i-1].offset +
+			    LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL);
+		test_assert(checkpoints[i].highest_modseq >=
+			    checkpoints[i-1].highest_modseq);
+	}
+
+	/* all lookups are now done via the checkpoints */
+	for (i = 0; i < 1000; i++) {
+		memset(file->modseq_cache, 0, sizeof(file->modseq_cache));
+		modseq = i_rand_minmax(1, max_modseq - 1);
+		test_assert(mail_transaction_log_file_get_modseq_next_offset(
+			file, modseq, &next_offset) == 0);
+		test_assert(next_offset == modseq_next_offset[modseq]);
+
+		memset(file->modseq_cache, 0, sizeof(file->modseq_cache));
+		test_assert(mail_transaction_log_file_get_highest_modseq_at(
+			file, modseq_next_offset[modseq], &modseq_at, &error) == 1);
+		test_assert(modseq_at == modseq);
+	}
+	test_assert(array_count(&file->modseq_checkpoints) == count);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	test_end();
+}
+
 static void
 test_mail_transaction_log_file_get_modseq_next_offset_inconsistency(void)
 {
@@ -410,6 +475,7 @@ int main(void)
 	static void (*const test_functions[])(void) = {
 		test_mail_transaction_update_modseq,
 		test_mail_transaction_log_file_modseq_offsets,
+		test_mail_transaction_log_file_modseq_checkpoints,
 		test_mail_transaction_log_file_get_modseq_next_offset_inconsistency,
 		NULL
 	};
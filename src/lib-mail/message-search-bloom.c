@@ -0,0 +1,291 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "rfc822-parser.h"
+#include "message-parser.h"
+#include "message-decoder.h"
+#include "message-search-bloom.h"
+
+#include <ctype.h>
+
+#define MESSAGE_SEARCH_BLOOM_VERSION 1
+/* The bloom is built with the max size and then folded in half as long as
+   it doesn't get too full. */
+#define MESSAGE_SEARCH_BLOOM_MAX_SIZE 2048
+#define MESSAGE_SEARCH_BLOOM_MIN_SIZE 16
+/* Number of bits set for each trigram */
+#define MESSAGE_SEARCH_BLOOM_HASH_COUNT 3
+
+struct message_search_bloom_context {
+	unsigned char bitmap[MESSAGE_SEARCH_BLOOM_MAX_SIZE];
+
+	/* the last two bytes of the current word */
+	unsigned char word[2];
+	unsigned int word_len;
+
+	struct message_decoder_context *decoder;
+	struct message_part *prev_part;
+	bool content_type_text;
+};
+
+static inline bool bloom_is_word_char(unsigned char c)
+{
+	/* UTF-8 sequences are always part of words */
+	return c >= 0x80 || i_isalnum(c);
+}
+
+static inline uint32_t bloom_trigram_hash(unsigned char c1, unsigned char c2,
+					  unsigned char c3)
+{
+	uint32_t h = c1 | (c2 << 8) | ((uint32_t)c3 << 16);
+
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Call callback for each bit position (modulo bits_mask+1) of each trigram
+   in data. Returns FALSE if the callback did. */
+static bool
+bloom_foreach_bit(unsigned char word[2], unsigned int *word_len,
+		  const unsigned char *data, size_t size, uint32_t bits_mask,
+		  bool (*callback)(void *context, uint32_t bit), void *context)
+{
+	uint32_t h, h2;
+	unsigned int i;
+	size_t pos;
+
+	for (pos = 0; pos < size; pos++) {
+		if (!bloom_is_word_char(data[pos])) {
+			*word_len = 0;
+			continue;
+		}
+		if (*word_len == 2) {
+			h = bloom_trigram_hash(word[0], word[1], data[pos]);
+			h2 = ((h >> 17) | (h << 15)) | 1;
+			for (i = 0; i < MESSAGE_SEARCH_BLOOM_HASH_COUNT; i++) {
+				if (!callback(context,
+					      (h + i * h2) & bits_mask))
+					return FALSE;
+			}
+			word[0] = word[1];
+			word[1] = data[pos];
+		} else {
+			word[(*word_len)++] = data[pos];
+		}
+	}
+	return TRUE;
+}
+
+static bool bloom_set_bit(void *context, uint32_t bit)
+{
+	unsigned char *bitmap = context;
+
+	bitmap[bit / 8] |= 1 << (bit % 8);
+	return TRUE;
+}
+
+static void
+bloom_add(struct message_search_bloom_context *ctx,
+	  const void *data, size_t size)
+{
+	(void)bloom_foreach_bit(ctx->word, &ctx->word_len, data, size,
+				MESSAGE_SEARCH_BLOOM_MAX_SIZE * 8 - 1,
+				bloom_set_bit, ctx->bitmap);
+}
+
+static void
+parse_content_type(struct message_search_bloom_context *ctx,
+		   struct message_header_line *hdr)
+{
+	struct rfc822_parser_context parser;
+	string_t *content_type;
+
+	rfc822_parser_init(&parser, hdr->full_value, hdr->full_value_len, NULL);
+	rfc822_skip_lwsp(&parser);
+
+	content_type = t_str_new(64);
+	(void)rfc822_parse_content_type(&parser, content_type);
+	ctx->content_type_text =
+		strncasecmp(str_c(content_type), "text/", 5) == 0 ||
+		strncasecmp(str_c(content_type), "message/", 8) == 0;
+	rfc822_parser_deinit(&parser);
+}
+
+void message_search_bloom_more(struct message_search_bloom_context *ctx,
+			       struct message_block *raw_block)
+{
+	static const unsigned char crlf[2] = { '\r', '\n' };
+	struct message_header_line *hdr = raw_block->hdr;
+	struct message_block block;
+
+	/* this follows the same logic as message_search_more_get_decoded() */
+	if (raw_block->part != ctx->prev_part) {
+		ctx->content_type_text = TRUE;
+		ctx->prev_part = raw_block->part;
+		if (hdr == NULL)
+			ctx->content_type_text = FALSE;
+	}
+	if (hdr != NULL) {
+		if (hdr->name_len == 12 &&
+		    strcasecmp(hdr->name, "Content-Type") == 0) {
+			if (hdr->continues)
+				hdr->use_full_value = TRUE;
+			else T_BEGIN {
+				parse_content_type(ctx, hdr);
+			} T_END;
+		}
+	} else if (!ctx->content_type_text) {
+		return;
+	}
+
+	if (!message_decoder_decode_next_block(ctx->decoder, raw_block, &block))
+		return;
+
+	if (block.hdr != NULL) {
+		bloom_add(ctx, block.hdr->name, block.hdr->name_len);
+		bloom_add(ctx, block.hdr->middle, block.hdr->middle_len);
+		bloom_add(ctx, block.hdr->full_value,
+			  block.hdr->full_value_len);
+		if (!block.hdr->no_newline)
+			bloom_add(ctx, crlf, sizeof(crlf));
+	} else {
+		bloom_add(ctx, block.data, block.size);
+	}
+}
+
+static unsigned int bitmap_count_bits(const unsigned char *bitmap, size_t size)
+{
+	unsigned int count = 0;
+	unsigned char c;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		for (c = bitmap[i]; c != 0; c &= c - 1)
+			count++;
+	}
+	return count;
+}
+
+static void
+bloom_write(struct message_search_bloom_context *ctx, buffer_t *dest)
+{
+	unsigned char folded[MESSAGE_SEARCH_BLOOM_MAX_SIZE/2];
+	size_t i, size = MESSAGE_SEARCH_BLOOM_MAX_SIZE;
+
+	/* Fold the bitmap in half as long as at most 1/4 of the bits end up
+	   being set. Since the bit positions are taken modulo the bitmap
+	   size, the folded bitmap is the same as if it was built with the
+	   smaller size in the first place. */
+	while (size > MESSAGE_SEARCH_BLOOM_MIN_SIZE) {
+		for (i = 0; i < size/2; i++)
+			folded[i] = ctx->bitmap[i] | ctx->bitmap[i + size/2];
+		if (bitmap_count_bits(folded, size/2) * 4 > size/2 * 8)
+			break;
+		size /= 2;
+		memcpy(ctx->bitmap, folded, size);
+	}
+	buffer_append_c(dest, MESSAGE_SEARCH_BLOOM_VERSION);
+	buffer_append(dest, ctx->bitmap, size);
+}
+
+struct message_search_bloom_context *
+message_search_bloom_init(normalizer_func_t *normalizer)
+{
+	struct message_search_bloom_context *ctx;
+
+	ctx = i_new(struct message_search_bloom_context, 1);
+	ctx->decoder = message_decoder_init(normalizer, 0);
+	return ctx;
+}
+
+void message_search_bloom_deinit(struct message_search_bloom_context **_ctx,
+				 buffer_t *dest)
+{
+	struct message_search_bloom_context *ctx = *_ctx;
+
+	if (ctx == NULL)
+		return;
+	*_ctx = NULL;
+
+	if (dest != NULL)
+		bloom_write(ctx, dest);
+	message_decoder_deinit(&ctx->decoder);
+	i_free(ctx);
+}
+
+int message_search_bloom_build(struct istream *input,
+			       normalizer_func_t *normalizer, buffer_t *dest)
+{
+	const struct message_parser_settings parser_set = {
+		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE,
+	};
+	struct message_search_bloom_context *ctx;
+	struct message_parser_ctx *parser;
+	struct message_block raw_block;
+	struct message_part *parts;
+	int ret;
+
+	ctx = message_search_bloom_init(normalizer);
+	parser = message_parser_init(pool_datastack_create(), input,
+				     &parser_set);
+	while ((ret = message_parser_parse_next_block(parser, &raw_block)) > 0)
+		message_search_bloom_more(ctx, &raw_block);
+	i_assert(ret != 0);
+	message_parser_deinit(&parser, &parts);
+
+	message_search_bloom_deinit(&ctx,
+		input->stream_errno == 0 ? dest : NULL);
+	return input->stream_errno == 0 ? 0 : -1;
+}
+
+struct bloom_check_context {
+	const unsigned char *bitmap;
+	bool found;
+};
+
+static bool bloom_check_bit(void *context, uint32_t bit)
+{
+	struct bloom_check_context *ctx = context;
+
+	if ((ctx->bitmap[bit / 8] & (1 << (bit % 8))) == 0) {
+		ctx->found = FALSE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool message_search_bloom_may_contain(const unsigned char *bloom,
+				      size_t bloom_size,
+				      const char *normalized_key_utf8)
+{
+	struct bloom_check_context ctx;
+	unsigned char word[2];
+	unsigned int word_len = 0;
+
+	if (bloom_size < 1 + MESSAGE_SEARCH_BLOOM_MIN_SIZE ||
+	    bloom_size > 1 + MESSAGE_SEARCH_BLOOM_MAX_SIZE ||
+	    bloom[0] != MESSAGE_SEARCH_BLOOM_VERSION ||
+	    !bits_is_power_of_two(bloom_size - 1)) {
+		/* unknown format */
+		return TRUE;
+	}
+
+	i_zero(&ctx);
+	ctx.bitmap = bloom + 1;
+	ctx.found = TRUE;
+	(void)bloom_foreach_bit(word, &word_len,
+				(const unsigned char *)normalized_key_utf8,
+				strlen(normalized_key_utf8),
+				(bloom_size - 1) * 8 - 1,
+				bloom_check_bit, &ctx);
+	return ctx.found;
+}
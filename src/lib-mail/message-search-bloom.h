@@ -0,0 +1,45 @@
+#ifndef MESSAGE_SEARCH_BLOOM_H
+#define MESSAGE_SEARCH_BLOOM_H
+
+#include "unichar.h"
+
+struct message_block;
+
+/* A search bloom is a small bloom filter of the trigrams found from the
+   message's decoded and normalized text. It can be used to find out that
+   message_search_msg() can't find a key from the message without having to
+   read it. Trigrams never cross characters that are ASCII but not
+   alphanumeric, so keys can be checked even though they may begin or end in
+   the middle of a word.
+
+   The bloom begins with a version byte, followed by a bitmap whose size is a
+   power of two. */
+
+/* Start building a search bloom. The normalizer must be the same one that
+   is used for the searches. */
+struct message_search_bloom_context *
+message_search_bloom_init(normalizer_func_t *normalizer);
+/* Add the next block returned by message_parser_parse_next_block() to the
+   bloom. All the blocks must be added, including the body blocks, so the
+   parser must not be using MESSAGE_PARSER_FLAG_SKIP_BODY_BLOCK. */
+void message_search_bloom_more(struct message_search_bloom_context *ctx,
+			       struct message_block *raw_block);
+/* Finish building the bloom and write it to dest. If dest is NULL, the
+   bloom is just freed. */
+void message_search_bloom_deinit(struct message_search_bloom_context **ctx,
+				 buffer_t *dest);
+
+/* Build a search bloom of the message in input and write it to dest.
+   The normalizer must be the same one that is used for the searches.
+   Returns 0 if ok, -1 if I/O error. */
+int message_search_bloom_build(struct istream *input,
+			       normalizer_func_t *normalizer, buffer_t *dest);
+
+/* Returns FALSE if the normalized key definitely doesn't exist in the
+   message that the bloom was built from. Returns TRUE if it might exist,
+   including when the bloom is in an unknown format. */
+bool message_search_bloom_may_contain(const unsigned char *bloom,
+				      size_t bloom_size,
+				      const char *normalized_key_utf8);
+
+#endif
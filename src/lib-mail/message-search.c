@@ -14,6 +14,7 @@ struct message_search_context {
 	enum message_search_flags flags;
 	normalizer_func_t *normalizer;
 
+	char *key;
 	struct str_find_context *str_find_ctx;
 	struct message_part *prev_part;
 
@@ -32,6 +33,7 @@ message_search_init(const char *normalized_key_utf8,
 
 	ctx = i_new(struct message_search_context, 1);
 	ctx->flags = flags;
+	ctx->key = i_strdup(normalized_key_utf8);
 	ctx->decoder = message_decoder_init(normalizer, 0);
 	ctx->str_find_ctx = str_find_init(default_pool, normalized_key_utf8);
 	return ctx;
@@ -44,9 +46,15 @@ void message_search_deinit(struct message_search_context **_ctx)
 	*_ctx = NULL;
 	str_find_deinit(&ctx->str_find_ctx);
 	message_decoder_deinit(&ctx->decoder);
+	i_free(ctx->key);
 	i_free(ctx);
 }
 
+const char *message_search_get_normalized_key(struct message_search_context *ctx)
+{
+	return ctx->key;
+}
+
 static void parse_content_type(struct message_search_context *ctx,
 			       struct message_header_line *hdr)
 {
@@ -16,6 +16,8 @@ message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags);
 void message_search_deinit(struct message_search_context **ctx);
+/* Returns the normalized key given to message_search_init() */
+const char *message_search_get_normalized_key(struct message_search_context *ctx);
 
 /* Returns TRUE if key is found from input buffer, FALSE if not. */
 bool message_search_more(struct message_search_context *ctx,
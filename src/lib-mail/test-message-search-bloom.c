@@ -0,0 +1,246 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "unichar.h"
+#include "message-parser.h"
+#include "message-search.h"
+#include "message-search-bloom.h"
+#include "test-common.h"
+
+#define TEST_MESSAGE \
+"From: Sender Name <sender@example.com>\n" \
+"Subject: =?UTF-8?B?SGVsbG8sIFdvcmxk?=\n" \
+"MIME-Version: 1.0\n" \
+"Content-Type: multipart/mixed; boundary=1\n" \
+"\n--1\n" \
+"Content-Type: text/plain; charset=utf-8\n" \
+"Content-Transfer-Encoding: quoted-printable\n" \
+"\n" \
+"The quick brown fox jumps over the lazy dog. hyv=C3=A4=C3=A4 p=C3=A4iv=C3=A4=C3=A4" \
+"\n--1\n" \
+"Content-Type: application/octet-stream\n" \
+"Content-Transfer-Encoding: base64\n" \
+"\n" \
+"YmluYXJ5YXR0YWNobWVudA==" \
+"\n--1--\n"
+
+static void test_build_bloom(const char *message, buffer_t *bloom)
+{
+	struct istream *input;
+
+	input = test_istream_create(message);
+	test_assert(message_search_bloom_build(input,
+			uni_utf8_to_decomposed_titlecase, bloom) == 0);
+	i_stream_unref(&input);
+}
+
+static bool test_bloom_may_contain(const buffer_t *bloom, const char *key)
+{
+	string_t *normalized = t_str_new(64);
+
+	if (uni_utf8_to_decomposed_titlecase(key, strlen(key), normalized) < 0)
+		i_unreached();
+	return message_search_bloom_may_contain(bloom->data, bloom->used,
+						str_c(normalized));
+}
+
+static bool test_search_found(const char *message, const char *key)
+{
+	struct message_search_context *ctx;
+	struct istream *input;
+	string_t *normalized = t_str_new(64);
+	const char *error;
+	int ret;
+
+	if (uni_utf8_to_decomposed_titlecase(key, strlen(key), normalized) < 0)
+		i_unreached();
+	ctx = message_search_init(str_c(normalized),
+				  uni_utf8_to_decomposed_titlecase, 0);
+	input = test_istream_create(message);
+	ret = message_search_msg(ctx, input, NULL, &error);
+	test_assert(ret >= 0);
+	i_stream_unref(&input);
+	message_search_deinit(&ctx);
+	return ret > 0;
+}
+
+static void test_message_search_bloom(void)
+{
+	static const struct {
+		const char *key;
+		bool expect_may_contain;
+	} tests[] = {
+		{ "quick", TRUE },
+		{ "QUICK BROWN", TRUE },
+		{ "ick bro", TRUE },
+		{ "x jumps ov", TRUE },
+		{ "hello, world", TRUE },
+		{ "sender@example", TRUE },
+		{ "p\xC3\xA4iv\xC3\xA4", TRUE },
+		/* too short to be checked */
+		{ "zz", TRUE },
+		{ "a;z", TRUE },
+
+		{ "slow", FALSE },
+		{ "quack", FALSE },
+		{ "yellow", FALSE },
+		/* non-text parts aren't searched */
+		{ "binaryattachment", FALSE },
+	};
+	buffer_t *bloom;
+	unsigned int i;
+
+	test_begin("message search bloom");
+	bloom = buffer_create_dynamic(default_pool, 256);
+	test_build_bloom(TEST_MESSAGE, bloom);
+	test_assert(bloom->used > 1 && bloom->used <= 1 + 2048);
+
+	for (i = 0; i < N_ELEMENTS(tests); i++) T_BEGIN {
+		test_assert_idx(test_bloom_may_contain(bloom, tests[i].key) ==
+				tests[i].expect_may_contain, i);
+		if (!tests[i].expect_may_contain) {
+			test_assert_idx(!test_search_found(TEST_MESSAGE,
+							   tests[i].key), i);
+		}
+	} T_END;
+	buffer_free(&bloom);
+	test_end();
+}
+
+static void test_message_search_bloom_substrings(void)
+{
+	const char *text = TEST_MESSAGE;
+	size_t len = strlen(text);
+	buffer_t *bloom;
+	unsigned int i, start, key_len;
+	const char *key;
+
+	test_begin("message search bloom substrings");
+	bloom = buffer_create_dynamic(default_pool, 256);
+	test_build_bloom(TEST_MESSAGE, bloom);
+
+	/* anything that message_search_msg() finds must be in the bloom */
+	for (i = 0; i < 2000; i++) T_BEGIN {
+		start = i_rand_limit(len);
+		key_len = 1 + i_rand_limit(I_MIN(len - start, 12));
+		key = t_strndup(text + start, key_len);
+		if (uni_utf8_str_is_valid(key) &&
+		    test_search_found(TEST_MESSAGE, key))
+			test_assert_idx(test_bloom_may_contain(bloom, key), i);
+	} T_END;
+	buffer_free(&bloom);
+	test_end();
+}
+
+static void test_message_search_bloom_large(void)
+{
+	string_t *message = t_str_new(1024*64);
+	buffer_t *bloom;
+	unsigned int i, false_positives = 0;
+
+	test_begin("message search bloom large");
+	str_append(message, "Subject: words\n\n");
+	for (i = 0; i < 4000; i++)
+		str_printfa(message, "w%ux ", i);
+
+	bloom = buffer_create_dynamic(default_pool, 256);
+	test_build_bloom(str_c(message), bloom);
+	test_assert(bloom->used == 1 + 2048);
+	for (i = 0; i < 4000; i++) T_BEGIN {
+		test_assert_idx(test_bloom_may_contain(bloom,
+				t_strdup_printf("w%ux", i)), i);
+	} T_END;
+	for (i = 0; i < 1000; i++) T_BEGIN {
+		if (test_bloom_may_contain(bloom, t_strdup_printf("q%uq", i)))
+			false_positives++;
+	} T_END;
+	/* the bloom gets quite full, but it's still useful */
+	test_assert(false_positives < 500);
+	buffer_free(&bloom);
+	test_end();
+}
+
+static void
+test_build_bloom_parser(const char *message, struct message_part *parts,
+			struct message_part **parts_r, buffer_t *bloom)
+{
+	/* same settings as used by lib-storage when it parses mails */
+	const struct message_parser_settings parser_set = {
+		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP |
+			MESSAGE_HEADER_PARSER_FLAG_DROP_CR,
+	};
+	struct message_search_bloom_context *ctx;
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct istream *input;
+	const char *error;
+	int ret;
+
+	input = test_istream_create(message);
+	ctx = message_search_bloom_init(uni_utf8_to_decomposed_titlecase);
+	if (parts == NULL) {
+		parser = message_parser_init(pool_datastack_create(), input,
+					     &parser_set);
+	} else {
+		parser = message_parser_init_from_parts(parts, input,
+							&parser_set);
+	}
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0)
+		message_search_bloom_more(ctx, &block);
+	test_assert(ret < 0 && input->stream_errno == 0);
+	test_assert(message_parser_deinit_from_parts(&parser, parts_r,
+						     &error) == 0);
+	message_search_bloom_deinit(&ctx, bloom);
+	i_stream_unref(&input);
+}
+
+static void test_message_search_bloom_parser(void)
+{
+	string_t *crlf_message = t_str_new(512);
+	buffer_t *bloom, *bloom2;
+	struct message_part *parts;
+	const char *p;
+
+	test_begin("message search bloom from parser");
+	for (p = TEST_MESSAGE; *p != '\0'; p++) {
+		if (*p == '\n')
+			str_append_c(crlf_message, '\r');
+		str_append_c(crlf_message, *p);
+	}
+	bloom = buffer_create_dynamic(default_pool, 256);
+	bloom2 = buffer_create_dynamic(default_pool, 256);
+	test_build_bloom(TEST_MESSAGE, bloom);
+
+	/* lib-storage's parser settings give the same bloom */
+	test_build_bloom_parser(TEST_MESSAGE, NULL, &parts, bloom2);
+	test_assert(buffer_cmp(bloom, bloom2));
+
+	/* so does parsing with the cached message parts */
+	buffer_set_used_size(bloom2, 0);
+	test_build_bloom_parser(TEST_MESSAGE, parts, &parts, bloom2);
+	test_assert(buffer_cmp(bloom, bloom2));
+
+	/* CRs are dropped */
+	buffer_set_used_size(bloom2, 0);
+	test_build_bloom_parser(str_c(crlf_message), NULL, &parts, bloom2);
+	test_assert(buffer_cmp(bloom, bloom2));
+
+	buffer_free(&bloom);
+	buffer_free(&bloom2);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_message_search_bloom,
+		test_message_search_bloom_substrings,
+		test_message_search_bloom_large,
+		test_message_search_bloom_parser,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -35,7 +35,8 @@ dbox_file_match_pre_magic(struct istream *input,
 	hdr = (const void *)data;
 	if (memcmp(hdr->magic_pre, DBOX_MAGIC_PRE, strlen(DBOX_MAGIC_PRE)) != 0)
 		return 0;
-	if (hdr->type != DBOX_MESSAGE_TYPE_NORMAL)
+	if (hdr->type != DBOX_MESSAGE_TYPE_NORMAL &&
+	    hdr->type != DBOX_MESSAGE_TYPE_BODY_REF)
 		return 0;
 	if (hdr->space1 != ' ' || hdr->space2 != ' ')
 		return 0;
@@ -97,6 +98,7 @@ dbox_file_match_post_magic(struct istream *input, bool input_full,
 		case DBOX_METADATA_PHYSICAL_SIZE:
 		case DBOX_METADATA_VIRTUAL_SIZE:
 		case DBOX_METADATA_EXT_REF:
+		case DBOX_METADATA_BODY_REF:
 		case DBOX_METADATA_OLDV1_EXPUNGED:
 		case DBOX_METADATA_OLDV1_FLAGS:
 		case DBOX_METADATA_OLDV1_SAVE_TIME:
@@ -317,7 +319,7 @@ dbox_file_fix_write_stream(struct dbox_file *file, uoff_t start_offset,
 {
 	struct dbox_message_header msg_hdr;
 	uoff_t offset, msg_size, hdr_offset, body_offset;
-	bool pre, write_header, have_guid;
+	bool pre, write_header, have_guid, body_ref;
 	struct message_size body;
 	bool has_nuls;
 	struct istream *body_input;
@@ -345,7 +347,8 @@ dbox_file_fix_write_stream(struct dbox_file *file, uoff_t start_offset,
 			   over this data. */
 			i_stream_skip(file->input, msg_size);
 			hdr_offset = file->input->v_offset;
-			ret = dbox_file_read_mail_header(file, &msg_size);
+			ret = dbox_file_read_mail_header(file, &msg_size,
+							 &body_ref);
 			if (ret <= 0) {
 				if (ret < 0)
 					return -1;
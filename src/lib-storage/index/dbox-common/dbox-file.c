@@ -13,6 +13,7 @@
 #include "mkdir-parents.h"
 #include "eacces-error.h"
 #include "str.h"
+#include "index-storage.h"
 #include "dbox-storage.h"
 #include "dbox-file.h"
 
@@ -221,7 +222,8 @@ static int dbox_file_open_full(struct dbox_file *file, bool try_altpath,
 	/* we're manually checking at dbox_file_close() if we need to close the
 	   fd or not. */
 	fd = file->fd;
-	file->input = i_stream_create_fd_autoclose(&fd, DBOX_READ_BLOCK_SIZE);
+	file->input = index_storage_create_file_istream(&file->storage->storage,
+							&fd, DBOX_READ_BLOCK_SIZE);
 	i_stream_set_name(file->input, file->cur_path);
 	i_stream_set_init_buffer_size(file->input, DBOX_READ_BLOCK_SIZE);
 	return dbox_file_read_header(file);
@@ -348,7 +350,8 @@ void dbox_file_unlock(struct dbox_file *file)
 		i_stream_sync(file->input);
 }
 
-int dbox_file_read_mail_header(struct dbox_file *file, uoff_t *physical_size_r)
+int dbox_file_read_mail_header(struct dbox_file *file, uoff_t *physical_size_r,
+			       bool *body_ref_r)
 {
 	struct dbox_message_header hdr;
 	const unsigned char *data;
@@ -382,12 +385,14 @@ int dbox_file_read_mail_header(struct dbox_file *file, uoff_t *physical_size_r)
 
 	*physical_size_r = hex2dec(hdr.message_size_hex,
 				   sizeof(hdr.message_size_hex));
+	*body_ref_r = hdr.type == DBOX_MESSAGE_TYPE_BODY_REF;
 	return 1;
 }
 
 int dbox_file_seek(struct dbox_file *file, uoff_t offset)
 {
 	uoff_t size;
+	bool body_ref;
 	int ret;
 
 	i_assert(file->input != NULL);
@@ -397,11 +402,12 @@ int dbox_file_seek(struct dbox_file *file, uoff_t offset)
 
 	if (offset != file->cur_offset) {
 		i_stream_seek(file->input, offset);
-		ret = dbox_file_read_mail_header(file, &size);
+		ret = dbox_file_read_mail_header(file, &size, &body_ref);
 		if (ret <= 0)
 			return ret;
 		file->cur_offset = offset;
 		file->cur_physical_size = size;
+		file->cur_body_ref = body_ref;
 	}
 	i_stream_seek(file->input, offset + file->msg_header_size);
 	return 1;
@@ -584,6 +590,36 @@ void dbox_file_append_checkpoint(struct dbox_file_append_context *ctx)
 	ctx->last_checkpoint_offset = ctx->output->offset;
 }
 
+int dbox_file_append_rewind(struct dbox_file_append_context *ctx)
+{
+	return dbox_file_append_truncate(ctx, ctx->last_checkpoint_offset);
+}
+
+int dbox_file_append_truncate(struct dbox_file_append_context *ctx,
+			      uoff_t offset)
+{
+	i_assert(offset >= ctx->last_checkpoint_offset);
+
+	if (offset == ctx->output->offset)
+		return 0;
+
+	if (o_stream_flush(ctx->output) < 0) {
+		dbox_file_set_syscall_error(ctx->file, "write()");
+		return -1;
+	}
+	if (ftruncate(ctx->file->fd, offset) < 0) {
+		dbox_file_set_syscall_error(ctx->file, "ftruncate()");
+		return -1;
+	}
+	if (o_stream_seek(ctx->output, offset) < 0) {
+		dbox_file_set_syscall_error(ctx->file, "lseek()");
+		return -1;
+	}
+	if (ctx->last_flush_offset > offset)
+		ctx->last_flush_offset = offset;
+	return 0;
+}
+
 int dbox_file_get_append_stream(struct dbox_file_append_context *ctx,
 				struct ostream **output_r)
 {
@@ -64,6 +64,10 @@ enum dbox_metadata_key {
 	   When rebuild finds a message whose mailbox is unknown, it's
 	   placed to this mailbox. */
 	DBOX_METADATA_ORIG_MAILBOX	= 'B',
+	/* Body of a DBOX_MESSAGE_TYPE_BODY_REF message. Format is:
+	   <map uid> <offset> <size> in hex. The body is <size> bytes at
+	   <offset> within the referenced message. */
+	DBOX_METADATA_BODY_REF		= 'D',
 
 	/* metadata used by old Dovecot versions */
 	DBOX_METADATA_OLDV1_EXPUNGED	= 'E',
@@ -75,7 +79,10 @@ enum dbox_metadata_key {
 
 enum dbox_message_type {
 	/* Normal message */
-	DBOX_MESSAGE_TYPE_NORMAL	= 'N'
+	DBOX_MESSAGE_TYPE_NORMAL	= 'N',
+	/* Message containing only the header. The body is shared with
+	   another message, see DBOX_METADATA_BODY_REF. */
+	DBOX_MESSAGE_TYPE_BODY_REF	= 'R'
 };
 
 struct dbox_message_header {
@@ -114,6 +121,8 @@ struct dbox_file {
 
 	uoff_t cur_offset;
 	uoff_t cur_physical_size;
+	/* the current message is DBOX_MESSAGE_TYPE_BODY_REF */
+	bool cur_body_ref;
 
 	/* Metadata for the currently seeked metadata block. */
 	pool_t metadata_pool;
@@ -177,6 +186,13 @@ int dbox_file_get_append_stream(struct dbox_file_append_context *ctx,
 /* Call after message has been fully saved. If this isn't done, the writes
    since the last checkpoint are truncated. */
 void dbox_file_append_checkpoint(struct dbox_file_append_context *ctx);
+/* Truncate the writes since the last checkpoint immediately, so that more
+   mails can still be appended to the file. Returns 0 if ok, -1 if error. */
+int dbox_file_append_rewind(struct dbox_file_append_context *ctx);
+/* Truncate the file to the given offset, which must be after the last
+   checkpoint. Returns 0 if ok, -1 if error. */
+int dbox_file_append_truncate(struct dbox_file_append_context *ctx,
+			      uoff_t offset);
 /* Flush output buffer. */
 int dbox_file_append_flush(struct dbox_file_append_context *ctx);
 
@@ -212,7 +228,8 @@ void dbox_file_set_corrupted(struct dbox_file *file, const char *reason, ...)
 const char *dbox_generate_tmp_filename(void);
 void dbox_file_free(struct dbox_file *file);
 int dbox_file_header_write(struct dbox_file *file, struct ostream *output);
-int dbox_file_read_mail_header(struct dbox_file *file, uoff_t *physical_size_r);
+int dbox_file_read_mail_header(struct dbox_file *file, uoff_t *physical_size_r,
+			       bool *body_ref_r);
 int dbox_file_metadata_skip_header(struct dbox_file *file);
 
 #endif
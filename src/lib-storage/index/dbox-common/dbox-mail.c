@@ -10,6 +10,7 @@
 #include "dbox-storage.h"
 #include "dbox-file.h"
 #include "dbox-mail.h"
+#include "dbox-tiering.h"
 
 
 struct mail *
@@ -273,6 +274,13 @@ get_mail_stream(struct dbox_mail *mail, uoff_t offset,
 	}
 
 	*stream_r = i_stream_create_limit(file->input, file->cur_physical_size);
+	if (file->cur_body_ref) {
+		if (file->storage->v.file_get_body_ref_stream == NULL)
+			return 0;
+		if ((ret = file->storage->v.file_get_body_ref_stream(file,
+							stream_r)) <= 0)
+			return ret;
+	}
 	if (pmail->v.istream_opened != NULL) {
 		if (pmail->v.istream_opened(&pmail->mail, stream_r) < 0)
 			return -1;
@@ -311,6 +319,7 @@ int dbox_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED,
 		}
 		data->stream = input;
 		index_mail_set_read_buffer_size(_mail, input);
+		dbox_tiering_mail_accessed(_mail);
 	}
 
 	return index_mail_init_stream(&mail->imail, hdr_size, body_size,
@@ -126,7 +126,7 @@ void dbox_save_end(struct dbox_save_context *ctx)
 void dbox_save_write_metadata(struct mail_save_context *_ctx,
 			      struct ostream *output, uoff_t output_msg_size,
 			      const char *orig_mailbox_name,
-			      guid_128_t guid_128)
+			      const char *body_ref, guid_128_t guid_128)
 {
 	struct dbox_save_context *ctx = DBOX_SAVECTX(_ctx);
 	struct mail_save_data *mdata = &ctx->ctx.data;
@@ -142,10 +142,10 @@ void dbox_save_write_metadata(struct mail_save_context *_ctx,
 
 	str = t_str_new(256);
 	if (output_msg_size != ctx->input->v_offset) {
-		/* a plugin changed the data written to disk, so the
-		   "message size" dbox header doesn't contain the actual
-		   "physical" message size. we need to save it as a
-		   separate metadata header. */
+		/* a plugin changed the data written to disk or only the
+		   header was written, so the "message size" dbox header
+		   doesn't contain the actual "physical" message size. we
+		   need to save it as a separate metadata header. */
 		str_printfa(str, "%c%llx\n", DBOX_METADATA_PHYSICAL_SIZE,
 			    (unsigned long long)ctx->input->v_offset);
 	}
@@ -190,6 +190,10 @@ void dbox_save_write_metadata(struct mail_save_context *_ctx,
 			    orig_mailbox_name);
 	}
 
+	if (body_ref != NULL) {
+		str_printfa(str, "%c%s\n", DBOX_METADATA_BODY_REF,
+			    body_ref);
+	}
 	dbox_attachment_save_write_metadata(_ctx, str);
 
 	str_append_c(str, '\n');
@@ -26,10 +26,13 @@ void dbox_save_begin(struct dbox_save_context *ctx, struct istream *input);
 int dbox_save_continue(struct mail_save_context *_ctx);
 void dbox_save_end(struct dbox_save_context *ctx);
 
+/* body_ref is the DBOX_METADATA_BODY_REF value when only the message's
+   header was written to output. */
 void dbox_save_write_metadata(struct mail_save_context *ctx,
 			      struct ostream *output, uoff_t output_msg_size,
 			      const char *orig_mailbox_name,
-			      guid_128_t guid_128_r) ATTR_NULL(4);
+			      const char *body_ref,
+			      guid_128_t guid_128_r) ATTR_NULL(4, 5);
 
 void dbox_save_add_to_index(struct dbox_save_context *ctx);
 
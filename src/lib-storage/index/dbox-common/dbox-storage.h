@@ -41,6 +41,13 @@ struct dbox_storage_vfuncs {
 	/* open the mail and return its file/offset */
 	int (*mail_open)(struct dbox_mail *mail, uoff_t *offset_r,
 			 struct dbox_file **file_r);
+	/* check whether the mail is in alt storage without opening it */
+	int (*mail_is_in_alt)(struct dbox_mail *mail, bool *in_alt_r);
+	/* the file's current message is DBOX_MESSAGE_TYPE_BODY_REF. append
+	   the referenced body to its stream. Returns 1 if ok, 0 if the
+	   reference is broken, -1 if error. NULL if not supported. */
+	int (*file_get_body_ref_stream)(struct dbox_file *file,
+					struct istream **stream);
 	/* create/update mailbox indexes */
 	int (*mailbox_create_indexes)(struct mailbox *box,
 				      const struct mailbox_update *update,
@@ -0,0 +1,358 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "file-lock.h"
+#include "mailbox-list-iter.h"
+#include "mailbox-list-private.h"
+#include "mail-namespace.h"
+#include "mail-user.h"
+#include "index-storage.h"
+#include "dbox-storage.h"
+#include "dbox-mail.h"
+#include "dbox-tiering.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#define DBOX_TIERING_EXT_NAME "dbox-tiering"
+#define DBOX_TIERING_LOCK_FNAME "dovecot.alt-tiering.lock"
+/* The file's mtime is the last time the user's mails were tiered */
+#define DBOX_TIERING_STAMP_FNAME "dovecot.alt-tiering"
+#define DBOX_TIERING_BATCH_SIZE 1000
+/* Update the mail's last_access at most this often. This also means that
+   access_count counts the number of separate periods the mail was
+   accessed in, rather than the number of times it was opened. */
+#define DBOX_TIERING_ACCESS_RESOLUTION_SECS (60*60)
+
+struct dbox_tiering_record {
+	uint32_t last_access;
+	uint16_t access_count;
+	uint16_t unused;
+};
+
+static bool
+dbox_tiering_is_enabled_storage(struct mail_storage *storage,
+				struct mailbox_list *list)
+{
+	return storage->set->mail_alt_tiering_cold_age != 0 &&
+		list->set.alt_dir != NULL &&
+		(strcmp(storage->name, "sdbox") == 0 ||
+		 strcmp(storage->name, "mdbox") == 0);
+}
+
+static bool dbox_tiering_is_enabled(struct mailbox *box)
+{
+	return dbox_tiering_is_enabled_storage(box->storage, box->list);
+}
+
+static uint32_t dbox_tiering_get_ext_id(struct mailbox *box)
+{
+	return mail_index_ext_register(box->index, DBOX_TIERING_EXT_NAME,
+				       0,
+				       sizeof(struct dbox_tiering_record),
+				       sizeof(uint32_t));
+}
+
+static void
+dbox_tiering_lookup_rec(struct mail_index_view *view, uint32_t seq,
+			uint32_t ext_id, struct dbox_tiering_record *rec_r)
+{
+	const void *data;
+	bool expunged;
+
+	mail_index_lookup_ext(view, seq, ext_id, &data, &expunged);
+	if (data == NULL)
+		i_zero(rec_r);
+	else
+		memcpy(rec_r, data, sizeof(*rec_r));
+}
+
+void dbox_tiering_mail_accessed(struct mail *mail)
+{
+	struct dbox_tiering_record rec;
+	uint32_t ext_id;
+
+	if (!dbox_tiering_is_enabled(mail->box) || mail->saving ||
+	    mailbox_is_readonly(mail->box))
+		return;
+
+	ext_id = dbox_tiering_get_ext_id(mail->box);
+	dbox_tiering_lookup_rec(mail->transaction->view, mail->seq,
+				ext_id, &rec);
+	if ((time_t)rec.last_access + DBOX_TIERING_ACCESS_RESOLUTION_SECS >
+	    ioloop_time && (time_t)rec.last_access <= ioloop_time)
+		return;
+
+	rec.last_access = ioloop_time;
+	if (rec.access_count < (uint16_t)-1)
+		rec.access_count++;
+	mail_index_update_ext(mail->transaction->itrans, mail->seq,
+			      ext_id, &rec, NULL);
+}
+
+int dbox_tiering_mail_move(struct mail *mail)
+{
+	const struct mail_storage_settings *set = mail->box->storage->set;
+	struct dbox_storage *storage = DBOX_STORAGE(mail->box->storage);
+	struct dbox_tiering_record rec;
+	enum modify_type modify_type;
+	uint32_t ext_id;
+	time_t save_date, cold_stamp;
+	bool in_alt;
+
+	if (!dbox_tiering_is_enabled(mail->box))
+		return 0;
+
+	ext_id = dbox_tiering_get_ext_id(mail->box);
+	dbox_tiering_lookup_rec(mail->transaction->view, mail->seq,
+				ext_id, &rec);
+	if (storage->v.mail_is_in_alt(DBOX_MAIL(mail), &in_alt) < 0)
+		return -1;
+
+	if (!in_alt) {
+		if ((unsigned int)ioloop_time < set->mail_alt_tiering_cold_age)
+			return 0;
+		cold_stamp = ioloop_time - set->mail_alt_tiering_cold_age;
+		if (mail_get_save_date(mail, &save_date) < 0)
+			return -1;
+		if (I_MAX(save_date, (time_t)rec.last_access) > cold_stamp)
+			return 0;
+		modify_type = MODIFY_ADD;
+	} else {
+		if (set->mail_alt_tiering_hot_access_count == 0 ||
+		    rec.access_count < set->mail_alt_tiering_hot_access_count)
+			return 0;
+		modify_type = MODIFY_REMOVE;
+	}
+	mail_update_flags(mail, modify_type,
+			  (enum mail_flags)MAIL_INDEX_MAIL_FLAG_BACKEND);
+	/* start counting the accesses again in the new location */
+	rec.access_count = 0;
+	mail_index_update_ext(mail->transaction->itrans, mail->seq,
+			      ext_id, &rec, NULL);
+	return 1;
+}
+
+/* returns -1 on error, 0 when done, and 1 when there is more to do */
+static int
+dbox_tiering_mailbox_batch(struct mailbox *box, uint32_t *seq,
+			   unsigned int *moved_count)
+{
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+	uint32_t messages_count, last_seq;
+	int ret = 0;
+
+	messages_count = mail_index_view_get_messages_count(box->view);
+	last_seq = I_MIN(messages_count, *seq + DBOX_TIERING_BATCH_SIZE - 1);
+
+	t = mailbox_transaction_begin(box, 0, "alt tiering");
+	mail = mail_alloc(t, MAIL_FETCH_SAVE_DATE, NULL);
+	for (; *seq <= last_seq; (*seq)++) {
+		mail_set_seq(mail, *seq);
+		switch (dbox_tiering_mail_move(mail)) {
+		case 1:
+			(*moved_count)++;
+			break;
+		case 0:
+			break;
+		default:
+			if (mailbox_get_last_mail_error(box) !=
+			    MAIL_ERROR_EXPUNGED)
+				ret = -1;
+			break;
+		}
+		if (ret < 0)
+			break;
+	}
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&t) < 0)
+		ret = -1;
+	if (ret < 0)
+		return -1;
+	return *seq <= messages_count ? 1 : 0;
+}
+
+static int dbox_tiering_mailbox(struct mailbox *box, unsigned int *moved_count)
+{
+	unsigned int box_moved_count = 0;
+	uint32_t seq = 1;
+	int ret;
+
+	if (mailbox_sync(box, MAILBOX_SYNC_FLAG_FAST) < 0)
+		return -1;
+	do {
+		ret = dbox_tiering_mailbox_batch(box, &seq, &box_moved_count);
+	} while (ret > 0);
+
+	/* sdbox moves the files while syncing. mdbox only queues the moves
+	   for purging. */
+	if (box_moved_count > 0 && mailbox_sync(box, 0) < 0)
+		ret = -1;
+	*moved_count += box_moved_count;
+	return ret;
+}
+
+static int
+dbox_tiering_namespace(struct mail_namespace *ns, unsigned int *moved_count)
+{
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	int ret = 0;
+
+	iter = mailbox_list_iter_init(ns->list, "*",
+				      MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+				      MAILBOX_LIST_ITER_SKIP_ALIASES |
+				      MAILBOX_LIST_ITER_RETURN_NO_FLAGS);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) T_BEGIN {
+		if ((info->flags & (MAILBOX_NOSELECT |
+				    MAILBOX_NONEXISTENT)) == 0) {
+			box = mailbox_alloc(ns->list, info->vname,
+					    MAILBOX_FLAG_IGNORE_ACLS);
+			if (dbox_tiering_mailbox(box, moved_count) < 0) {
+				e_error(box->event, "alt tiering failed: %s",
+					mailbox_get_last_internal_error(box, NULL));
+				ret = -1;
+			}
+			mailbox_free(&box);
+		}
+	} T_END;
+	if (mailbox_list_iter_deinit(&iter) < 0) {
+		e_error(ns->user->event,
+			"alt tiering: Failed to iterate mailboxes: %s",
+			mailbox_list_get_last_internal_error(ns->list, NULL));
+		ret = -1;
+	}
+	return ret;
+}
+
+static bool
+dbox_tiering_user_want_run(struct mail_user *user, const char **stamp_path_r)
+{
+	const struct mail_storage_settings *set =
+		mail_user_set_get_storage_set(user);
+	struct mail_namespace *ns;
+	struct stat st;
+	const char *home;
+
+	for (ns = user->namespaces; ns != NULL; ns = ns->next) {
+		if (ns->alias_for == NULL &&
+		    dbox_tiering_is_enabled_storage(
+				mail_namespace_get_default_storage(ns),
+				ns->list))
+			break;
+	}
+	if (ns == NULL)
+		return FALSE;
+
+	if (mail_user_get_home(user, &home) <= 0)
+		return FALSE;
+	*stamp_path_r = t_strdup_printf("%s/"DBOX_TIERING_STAMP_FNAME, home);
+	if (stat(*stamp_path_r, &st) < 0) {
+		if (errno != ENOENT) {
+			e_error(user->event, "stat(%s) failed: %m",
+				*stamp_path_r);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	return st.st_mtime + (time_t)set->mail_alt_tiering_interval <=
+		ioloop_time || st.st_mtime > ioloop_time;
+}
+
+static void dbox_tiering_user_update_stamp(struct mail_user *user,
+					   const char *path)
+{
+	struct utimbuf ut;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	if (fd == -1) {
+		e_error(user->event, "open(%s) failed: %m", path);
+		return;
+	}
+	i_close_fd(&fd);
+
+	ut.actime = ut.modtime = ioloop_time;
+	if (utime(path, &ut) < 0)
+		e_error(user->event, "utime(%s) failed: %m", path);
+}
+
+static bool
+dbox_tiering_storage_find(const ARRAY_TYPE(mail_storage) *storages,
+			  struct mail_storage *storage)
+{
+	struct mail_storage *cur;
+
+	array_foreach_elem(storages, cur) {
+		if (cur == storage)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+unsigned int dbox_tiering_user(struct mail_user *user)
+{
+	ARRAY_TYPE(mail_storage) purge_storages;
+	struct mail_storage *storage;
+	struct mail_namespace *ns;
+	struct file_lock *lock = NULL;
+	const char *stamp_path, *error;
+	unsigned int moved_count = 0, ns_moved_count;
+	struct event_reason *reason;
+	int ret;
+
+	if (!dbox_tiering_user_want_run(user, &stamp_path))
+		return 0;
+
+	/* another process may already be doing this */
+	ret = mail_user_lock_file_create(user, DBOX_TIERING_LOCK_FNAME,
+					 0, &lock, &error);
+	if (ret <= 0) {
+		if (ret < 0) {
+			e_error(user->event,
+				"alt tiering: Couldn't create %s lock: %s",
+				DBOX_TIERING_LOCK_FNAME, error);
+		}
+		return 0;
+	}
+	/* update the stamp first, so a failing mailbox doesn't cause the
+	   whole work to be retried after every session */
+	dbox_tiering_user_update_stamp(user, stamp_path);
+
+	reason = event_reason_begin("storage:alt_tiering");
+	t_array_init(&purge_storages, 4);
+	for (ns = user->namespaces; ns != NULL; ns = ns->next) {
+		storage = mail_namespace_get_default_storage(ns);
+		if (ns->alias_for != NULL ||
+		    !dbox_tiering_is_enabled_storage(storage, ns->list))
+			continue;
+
+		ns_moved_count = 0;
+		(void)dbox_tiering_namespace(ns, &ns_moved_count);
+		if (ns_moved_count > 0 &&
+		    strcmp(storage->name, "mdbox") == 0 &&
+		    !dbox_tiering_storage_find(&purge_storages, storage))
+			array_push_back(&purge_storages, &storage);
+		moved_count += ns_moved_count;
+	}
+	/* mdbox moves the mails while purging */
+	array_foreach_elem(&purge_storages, storage) {
+		if (mail_storage_purge(storage) < 0) {
+			e_error(user->event, "alt tiering: Purging failed: %s",
+				mail_storage_get_last_internal_error(storage,
+								     NULL));
+		}
+	}
+	event_reason_end(&reason);
+	file_lock_free(&lock);
+
+	e_debug(user->event, "alt tiering: Requested moving %u mails",
+		moved_count);
+	return moved_count;
+}
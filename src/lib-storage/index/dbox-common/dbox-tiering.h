@@ -0,0 +1,26 @@
+#ifndef DBOX_TIERING_H
+#define DBOX_TIERING_H
+
+struct mail;
+struct mail_user;
+
+/* Remember that the mail's body was accessed. Used for deciding whether
+   the mail should be moved between primary and alt storage. */
+void dbox_tiering_mail_accessed(struct mail *mail);
+
+/* Request moving the mail to alt storage if it hasn't been saved or accessed
+   within mail_alt_tiering_cold_age, or back to primary storage if it has been
+   accessed often enough. The move is requested the same way as with
+   doveadm altmove, so it's done only when the mailbox is synced (sdbox) or
+   the storage is purged (mdbox). Returns 1 if a move was requested, 0 if not
+   (including when the mailbox isn't dbox or tiering isn't enabled), -1 on
+   error. */
+int dbox_tiering_mail_move(struct mail *mail);
+
+/* Call dbox_tiering_mail_move() for all the mails in all the user's dbox
+   mailboxes that have tiering enabled, and do the requested moves. This is
+   done at most once per mail_alt_tiering_interval. Returns the number of
+   mails that were moved. */
+unsigned int dbox_tiering_user(struct mail_user *user);
+
+#endif
@@ -312,6 +312,8 @@ struct dbox_storage_vfuncs mdbox_deleted_dbox_storage_vfuncs = {
 	mdbox_file_unrefed,
 	mdbox_file_create_fd,
 	mdbox_mail_open,
+	mdbox_mail_is_in_alt,
+	mdbox_file_get_body_ref_stream,
 	mdbox_deleted_mailbox_create_indexes,
 	mdbox_get_attachment_path_suffix,
 	mdbox_set_mailbox_corrupted,
@@ -7,6 +7,7 @@
 #include "hex-binary.h"
 #include "hostpid.h"
 #include "istream.h"
+#include "istream-concat.h"
 #include "ostream.h"
 #include "file-lock.h"
 #include "file-set-size.h"
@@ -347,3 +348,120 @@ int mdbox_file_create_fd(struct dbox_file *file, const char *path, bool parents)
 	}
 	return fd;
 }
+
+bool mdbox_file_parse_body_ref(const char *value, struct mdbox_body_ref *ref_r)
+{
+	const char *const *args = t_strsplit(value, " ");
+	uint64_t offset, size;
+
+	if (str_array_length(args) < 3 ||
+	    str_to_uint32_hex(args[0], &ref_r->map_uid) < 0 ||
+	    str_to_uint64_hex(args[1], &offset) < 0 ||
+	    str_to_uint64_hex(args[2], &size) < 0 ||
+	    ref_r->map_uid == 0 || offset > UOFF_T_MAX - size)
+		return FALSE;
+	ref_r->offset = offset;
+	ref_r->size = size;
+	return TRUE;
+}
+
+static void mdbox_file_body_ref_stream_destroyed(struct dbox_file *file)
+{
+	dbox_file_unref(&file);
+}
+
+static int
+mdbox_file_open_body(struct mdbox_storage *storage, uint32_t map_uid,
+		     struct dbox_file **file_r)
+{
+	struct dbox_file *file;
+	uint32_t file_id, prev_file_id = 0;
+	uoff_t offset;
+	bool deleted;
+	int ret;
+
+	for (;;) {
+		if ((ret = mdbox_map_lookup(storage->map, map_uid,
+					    &file_id, &offset)) <= 0)
+			return ret;
+
+		file = mdbox_file_init(storage, file_id);
+		if ((ret = dbox_file_open(file, &deleted)) <= 0) {
+			dbox_file_unref(&file);
+			return ret;
+		}
+		if (!deleted)
+			break;
+		/* the message was just moved to another file */
+		dbox_file_unref(&file);
+		if (file_id == prev_file_id)
+			return 0;
+		prev_file_id = file_id;
+		if (mdbox_map_refresh(storage->map) < 0)
+			return -1;
+	}
+	if ((ret = dbox_file_seek(file, offset)) <= 0) {
+		dbox_file_unref(&file);
+		return ret;
+	}
+	*file_r = file;
+	return 1;
+}
+
+int mdbox_file_get_body_ref_stream(struct dbox_file *file,
+				   struct istream **stream)
+{
+	struct mdbox_file *mfile = (struct mdbox_file *)file;
+	struct dbox_file *body_file;
+	struct istream *inputs[3];
+	struct mdbox_body_ref ref;
+	const char *value;
+	uoff_t offset = file->cur_offset, body_start;
+	int ret;
+
+	if ((ret = dbox_file_metadata_read(file)) <= 0)
+		return ret;
+	i_stream_seek(file->input, file->cur_offset + file->msg_header_size);
+
+	value = dbox_file_metadata_get(file, DBOX_METADATA_BODY_REF);
+	if (value == NULL || !mdbox_file_parse_body_ref(value, &ref)) {
+		dbox_file_set_corrupted(file, "Invalid body-ref metadata: %s",
+					value == NULL ? "(missing)" : value);
+		return 0;
+	}
+
+	if ((ret = mdbox_file_open_body(mfile->storage, ref.map_uid,
+					&body_file)) <= 0) {
+		if (ret == 0) {
+			dbox_file_set_corrupted(file,
+				"Referred body map_uid=%u is lost",
+				ref.map_uid);
+		}
+		return ret;
+	}
+	if (ref.offset + ref.size > body_file->cur_physical_size) {
+		dbox_file_set_corrupted(file,
+			"Referred body map_uid=%u is too small "
+			"(%"PRIuUOFF_T" < %"PRIuUOFF_T")", ref.map_uid,
+			body_file->cur_physical_size, ref.offset + ref.size);
+		dbox_file_unref(&body_file);
+		return 0;
+	}
+
+	body_start = body_file->cur_offset + body_file->msg_header_size +
+		ref.offset;
+	inputs[0] = *stream;
+	inputs[1] = i_stream_create_range(body_file->input, body_start,
+					  ref.size);
+	inputs[2] = NULL;
+	/* the body's file must stay open while its stream is used */
+	i_stream_add_destroy_callback(inputs[1],
+				      mdbox_file_body_ref_stream_destroyed,
+				      body_file);
+	*stream = i_stream_create_concat(inputs);
+	i_stream_unref(&inputs[0]);
+	i_stream_unref(&inputs[1]);
+
+	/* the body may be in the same file. seek back to this message. */
+	return dbox_file_seek(file, offset);
+}
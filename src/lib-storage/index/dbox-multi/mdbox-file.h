@@ -11,6 +11,12 @@ struct mdbox_file {
 	time_t close_time;
 };
 
+/* DBOX_METADATA_BODY_REF */
+struct mdbox_body_ref {
+	uint32_t map_uid;
+	uoff_t offset, size;
+};
+
 struct dbox_file *
 mdbox_file_init(struct mdbox_storage *storage, uint32_t file_id);
 struct dbox_file *
@@ -23,6 +29,11 @@ void mdbox_file_unrefed(struct dbox_file *file);
 int mdbox_file_create_fd(struct dbox_file *file, const char *path,
 			 bool parents);
 
+/* Parse DBOX_METADATA_BODY_REF value. Returns FALSE if it's invalid. */
+bool mdbox_file_parse_body_ref(const char *value, struct mdbox_body_ref *ref_r);
+int mdbox_file_get_body_ref_stream(struct dbox_file *file,
+				   struct istream **stream);
+
 void mdbox_files_free(struct mdbox_storage *storage);
 void mdbox_files_sync_input(struct mdbox_storage *storage);
 
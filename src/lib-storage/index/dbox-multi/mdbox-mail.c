@@ -144,6 +144,53 @@ int mdbox_mail_open(struct dbox_mail *mail, uoff_t *offset_r,
 	return 0;
 }
 
+int mdbox_mail_is_in_alt(struct dbox_mail *mail, bool *in_alt_r)
+{
+	struct mail *_mail = &mail->imail.mail.mail;
+	struct mdbox_mailbox *mbox = MDBOX_MAILBOX(_mail->box);
+	struct mdbox_storage *storage = mbox->storage;
+	struct stat st;
+	const char *path;
+	uint32_t map_uid, file_id;
+	uoff_t offset;
+	int ret;
+
+	if (storage->alt_storage_dir == NULL) {
+		*in_alt_r = FALSE;
+		return 0;
+	}
+	if (mdbox_mail_lookup(mbox, _mail->transaction->view, _mail->seq,
+			      &map_uid) < 0)
+		return -1;
+	if ((ret = mdbox_map_lookup(storage->map, map_uid,
+				    &file_id, &offset)) <= 0) {
+		if (ret == 0)
+			dbox_mail_set_expunged(mail, map_uid);
+		return -1;
+	}
+
+	/* files are never moved between the storages. purging copies the
+	   mails to new files instead. so the result can be cached. */
+	if (file_id != storage->alt_check_file_id) {
+		path = t_strdup_printf("%s/"MDBOX_MAIL_FILE_FORMAT,
+				       storage->storage_dir, file_id);
+		if (stat(path, &st) == 0)
+			storage->alt_check_in_alt = FALSE;
+		else if (errno == ENOENT) {
+			/* it's in alt storage, or it was just purged and
+			   the mail was moved to a new file */
+			storage->alt_check_in_alt = TRUE;
+		} else {
+			mailbox_set_critical(_mail->box,
+				"stat(%s) failed: %m", path);
+			return -1;
+		}
+		storage->alt_check_file_id = file_id;
+	}
+	*in_alt_r = storage->alt_check_in_alt;
+	return 0;
+}
+
 static int mdbox_mail_get_save_date(struct mail *mail, time_t *date_r)
 {
 	struct mdbox_mailbox *mbox = MDBOX_MAILBOX(mail->transaction->box);
@@ -17,16 +17,26 @@ struct mdbox_map {
 	struct mail_index *index;
 	struct mail_index_view *view;
 
-	uint32_t map_ext_id, ref_ext_id;
+	uint32_t map_ext_id, ref_ext_id, dedup_ext_id;
 
 	struct mailbox_list *root_list;
 
+	/* digest => map_uid for the newest scanned messages */
+	pool_t dedup_pool;
+	HASH_TABLE(uint8_t *, void *) dedup_hash;
+	uint32_t dedup_uid_validity, dedup_next_uid;
+	/* number of digests allocated from dedup_pool */
+	unsigned int dedup_count;
+
 	bool verify_existing_file_ids:1;
 };
 
 struct mdbox_map_append {
 	struct dbox_file_append_context *file_append;
 	uoff_t offset, size;
+
+	struct mdbox_map_dedup_record dedup;
+	bool have_dedup;
 };
 
 struct mdbox_map_append_context {
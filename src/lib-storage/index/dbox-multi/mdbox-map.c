@@ -18,6 +18,16 @@
 #define DBOX_FORCE_PURGE_MIN_BYTES (1024*1024*10)
 #define DBOX_FORCE_PURGE_MIN_RATIO 0.5
 
+/* Search at most this many of the newest map records for duplicates.
+   Duplicates are mostly created by mass mailings, which arrive close
+   to each others. */
+#define MDBOX_MAP_DEDUP_MAX_SCAN_COUNT 10000
+/* When this many digests have been added to the dedup hash, forget them and
+   start again from the newest MDBOX_MAP_DEDUP_MAX_SCAN_COUNT records. */
+#define MDBOX_MAP_DEDUP_MAX_HASH_COUNT (MDBOX_MAP_DEDUP_MAX_SCAN_COUNT*2)
+/* Leave room for other copies before reaching the refcount limit */
+#define MDBOX_MAP_DEDUP_MAX_REFCOUNT 16384
+
 #define MAP_STORAGE(map) (&(map)->storage->storage.storage)
 
 struct mdbox_map_transaction_context {
@@ -74,6 +84,9 @@ mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
 				sizeof(uint32_t));
 	map->ref_ext_id = mail_index_ext_register(map->index, "ref", 0,
 				sizeof(uint16_t), sizeof(uint16_t));
+	map->dedup_ext_id = mail_index_ext_register(map->index, "dedup", 0,
+				sizeof(struct mdbox_map_dedup_record),
+				sizeof(uint32_t));
 	return map;
 }
 
@@ -83,6 +96,9 @@ void mdbox_map_deinit(struct mdbox_map **_map)
 
 	*_map = NULL;
 
+	if (hash_table_is_created(map->dedup_hash))
+		hash_table_destroy(&map->dedup_hash);
+	pool_unref(&map->dedup_pool);
 	if (map->view != NULL) {
 		mail_index_view_close(&map->view);
 		mail_index_close(map->index);
@@ -467,6 +483,131 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 	return 0;
 }
 
+static unsigned int mdbox_map_dedup_hash(const uint8_t *digest)
+{
+	uint32_t hash;
+
+	/* the digest is already evenly distributed */
+	memcpy(&hash, digest, sizeof(hash));
+	return hash;
+}
+
+static int mdbox_map_dedup_cmp(const uint8_t *digest1, const uint8_t *digest2)
+{
+	return memcmp(digest1, digest2, MDBOX_MAP_DEDUP_DIGEST_SIZE);
+}
+
+static void mdbox_map_dedup_clear(struct mdbox_map *map)
+{
+	hash_table_clear(map->dedup_hash, FALSE);
+	p_clear(map->dedup_pool);
+	map->dedup_count = 0;
+	map->dedup_next_uid = 0;
+}
+
+static void mdbox_map_dedup_scan(struct mdbox_map *map)
+{
+	static const uint8_t no_digest[MDBOX_MAP_DEDUP_DIGEST_SIZE] = { 0, };
+	const struct mail_index_header *hdr;
+	const void *data;
+	uint32_t seq, seq1, seq2, map_uid;
+	uint8_t *digest;
+	void *value;
+
+	hdr = mail_index_get_header(map->view);
+	if (!hash_table_is_created(map->dedup_hash)) {
+		map->dedup_pool = pool_alloconly_create("mdbox map dedup",
+							 1024*16);
+		hash_table_create(&map->dedup_hash, map->dedup_pool, 0,
+				  mdbox_map_dedup_hash, mdbox_map_dedup_cmp);
+	} else if (map->dedup_uid_validity != hdr->uid_validity) {
+		/* map was recreated */
+		mdbox_map_dedup_clear(map);
+	}
+	map->dedup_uid_validity = hdr->uid_validity;
+
+	if (!mail_index_lookup_seq_range(map->view,
+					 I_MAX(map->dedup_next_uid, 1),
+					 (uint32_t)-1, &seq1, &seq2))
+		return;
+	if (map->dedup_count + (seq2 - seq1 + 1) >
+	    MDBOX_MAP_DEDUP_MAX_HASH_COUNT) {
+		/* only the newest messages are looked up. forget the older
+		   ones, so the hash doesn't keep growing. */
+		mdbox_map_dedup_clear(map);
+		seq1 = 1;
+	}
+	if (seq2 - seq1 + 1 > MDBOX_MAP_DEDUP_MAX_SCAN_COUNT)
+		seq1 = seq2 - MDBOX_MAP_DEDUP_MAX_SCAN_COUNT + 1;
+
+	for (seq = seq1; seq <= seq2; seq++) {
+		mail_index_lookup_ext(map->view, seq, map->dedup_ext_id,
+				      &data, NULL);
+		if (data == NULL ||
+		    memcmp(data, no_digest, sizeof(no_digest)) == 0)
+			continue;
+
+		mail_index_lookup_uid(map->view, seq, &map_uid);
+		if (hash_table_lookup_full(map->dedup_hash,
+					   (const uint8_t *)data,
+					   &digest, &value)) {
+			hash_table_update(map->dedup_hash, digest,
+					  POINTER_CAST(map_uid));
+			continue;
+		}
+		digest = p_malloc(map->dedup_pool, MDBOX_MAP_DEDUP_DIGEST_SIZE);
+		memcpy(digest, data, MDBOX_MAP_DEDUP_DIGEST_SIZE);
+		hash_table_insert(map->dedup_hash, digest,
+				  POINTER_CAST(map_uid));
+		map->dedup_count++;
+	}
+	map->dedup_next_uid = hdr->next_uid;
+}
+
+int mdbox_map_dedup_lookup(struct mdbox_map *map,
+			   const uint8_t digest[MDBOX_MAP_DEDUP_DIGEST_SIZE],
+			   uint32_t *map_uid_r, uint32_t *body_offset_r)
+{
+	struct mdbox_map_mail_index_record rec;
+	const struct mdbox_map_dedup_record *dedup;
+	const void *data;
+	uint8_t *orig_digest;
+	void *value;
+	uint32_t seq, map_uid;
+	uint16_t refcount;
+	int ret;
+
+	if (mdbox_map_open_or_create(map) < 0 ||
+	    mdbox_map_refresh(map) < 0)
+		return -1;
+	mdbox_map_dedup_scan(map);
+
+	if (!hash_table_lookup_full(map->dedup_hash, digest,
+				    &orig_digest, &value))
+		return 0;
+	map_uid = POINTER_CAST_TO(value, uint32_t);
+
+	if ((ret = mdbox_map_get_seq(map, map_uid, &seq)) > 0)
+		ret = mdbox_map_lookup_seq_full(map, seq, &rec, &refcount);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 || refcount == 0) {
+		/* expunged or about to be purged */
+		hash_table_remove(map->dedup_hash, orig_digest);
+		return 0;
+	}
+	if (refcount >= MDBOX_MAP_DEDUP_MAX_REFCOUNT)
+		return 0;
+
+	mail_index_lookup_ext(map->view, seq, map->dedup_ext_id, &data, NULL);
+	if (data == NULL)
+		return 0;
+	dedup = data;
+	*map_uid_r = map_uid;
+	*body_offset_r = dedup->body_offset;
+	return 1;
+}
+
 struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map)
 {
 	struct mdbox_map_atomic_context *atomic;
@@ -1177,14 +1318,52 @@ void mdbox_map_append_finish(struct mdbox_map_append_context *ctx)
 	mdbox_map_append_close_if_unneeded(ctx->map, last->file_append);
 }
 
+void mdbox_map_append_set_dedup(struct mdbox_map_append_context *ctx,
+				const struct mdbox_map_dedup_record *dedup)
+{
+	struct mdbox_map_append *last;
+
+	last = array_back_modifiable(&ctx->appends);
+	last->dedup = *dedup;
+	last->have_dedup = TRUE;
+}
+
 void mdbox_map_append_abort(struct mdbox_map_append_context *ctx)
 {
 	struct mdbox_map_append *appends;
-	unsigned int count;
+	struct dbox_file_append_context *file_append, **file_appends;
+	struct dbox_file **files, *file;
+	unsigned int i, count;
 
 	appends = array_get_modifiable(&ctx->appends, &count);
 	i_assert(count > 0 && appends[count-1].size == (uint32_t)-1);
+	file_append = appends[count-1].file_append;
+	for (i = 0; i < count-1; i++) {
+		if (appends[i].file_append == file_append)
+			break;
+	}
 	array_delete(&ctx->appends, count-1, 1);
+	if (i < count-1) {
+		/* drop only this mail's data, so more mails can still be
+		   appended to the file. if this fails, the data is truncated
+		   when the append is committed. */
+		(void)dbox_file_append_rewind(file_append);
+		return;
+	}
+
+	/* the file was opened only for this mail. roll it back now, so a
+	   new file isn't left empty and an existing file isn't rewritten. */
+	file_appends = array_get_modifiable(&ctx->file_appends, &count);
+	i_assert(count > 0 && file_appends[count-1] == file_append);
+	dbox_file_append_rollback(&file_appends[count-1]);
+	array_delete(&ctx->file_appends, count-1, 1);
+
+	files = array_get_modifiable(&ctx->files, &count);
+	i_assert(count > 0);
+	file = files[count-1];
+	array_delete(&ctx->files, count-1, 1);
+	dbox_file_unlock(file);
+	dbox_file_unref(&file);
 }
 
 static int
@@ -1315,6 +1494,11 @@ int mdbox_map_append_assign_map_uids(struct mdbox_map_append_context *ctx,
 				      &rec, NULL);
 		mail_index_update_ext(ctx->trans, seq, ctx->map->ref_ext_id,
 				      &ref16, NULL);
+		if (appends[i].have_dedup) {
+			mail_index_update_ext(ctx->trans, seq,
+					      ctx->map->dedup_ext_id,
+					      &appends[i].dedup, NULL);
+		}
 	}
 
 	/* assign map UIDs for appended records */
@@ -7,6 +7,9 @@ struct dbox_file_append_context;
 struct mdbox_map_append_context;
 struct mdbox_storage;
 
+/* Size of the message body digest used for deduplication (SHA256) */
+#define MDBOX_MAP_DEDUP_DIGEST_SIZE 32
+
 enum mdbox_map_append_flags {
 	DBOX_MAP_APPEND_FLAG_ALT	= 0x01
 };
@@ -23,6 +26,12 @@ struct mdbox_map_mail_index_record {
 	uint32_t size; /* including pre/post metadata */
 };
 
+struct mdbox_map_dedup_record {
+	uint8_t digest[MDBOX_MAP_DEDUP_DIGEST_SIZE];
+	/* where the body begins within the message */
+	uint32_t body_offset;
+};
+
 struct mdbox_map_file_msg {
 	uint32_t map_uid;
 	uint32_t offset;
@@ -103,6 +112,13 @@ int mdbox_map_update_refcounts(struct mdbox_map_transaction_context *ctx,
 			       const ARRAY_TYPE(uint32_t) *map_uids, int diff);
 int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id);
 
+/* Find the newest message whose body has the given digest and that is still
+   referenced. Only the most recently appended messages are searched. Returns
+   1 if found, 0 if not, -1 if error. */
+int mdbox_map_dedup_lookup(struct mdbox_map *map,
+			   const uint8_t digest[MDBOX_MAP_DEDUP_DIGEST_SIZE],
+			   uint32_t *map_uid_r, uint32_t *body_offset_r);
+
 /* Return all files containing messages with zero refcount. */
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 				 ARRAY_TYPE(seq_range) *file_ids_r);
@@ -118,7 +134,13 @@ int mdbox_map_append_next(struct mdbox_map_append_context *ctx, uoff_t mail_size
 			  struct ostream **output_r);
 /* Finished saving the last mail. Saves the message size. */
 void mdbox_map_append_finish(struct mdbox_map_append_context *ctx);
-/* Abort saving the last mail. */
+/* Set the body digest of the last mail, so later saves can share its
+   body. */
+void mdbox_map_append_set_dedup(struct mdbox_map_append_context *ctx,
+				const struct mdbox_map_dedup_record *dedup);
+/* Abort saving the last mail. Its data is truncated from the file, or if the
+   file isn't used by the other mails in this append context, the file is
+   rolled back and released. */
 void mdbox_map_append_abort(struct mdbox_map_append_context *ctx);
 /* Assign map UIDs to all appended msgs to multi-files. */
 int mdbox_map_append_assign_map_uids(struct mdbox_map_append_context *ctx,
@@ -1,7 +1,10 @@
 /* Copyright (c) 2007-2018 Dovecot authors, see the included COPYING file */
 
+#define _GNU_SOURCE /* for copy_file_range() */
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
+#include "time-util.h"
 #include "istream.h"
 #include "ostream.h"
 #include "str.h"
@@ -14,6 +17,15 @@
 #include "mdbox-sync.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Start reading this many of the following files into page cache while
+   purging the current one. */
+#define MDBOX_PURGE_PREFETCH_FILES 4
+/* When throttling, don't wait for shorter times than this. The purging is
+   done in batches that last at least this long. */
+#define MDBOX_PURGE_THROTTLE_MIN_MSECS 10
 
 /*
    Altmoving works like:
@@ -48,6 +60,21 @@ struct mdbox_purge_context {
 
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_append_context *append_ctx;
+
+	struct event *event;
+	struct timeval start_time;
+	/* for throttling */
+	struct ioloop *ioloop;
+	uoff_t copied_bytes;
+	unsigned int io_count;
+	/* totals for the mdbox_purge_finished event */
+	uoff_t freed_bytes;
+	unsigned int purged_files_count;
+
+	/* purged mails released references to shared bodies, which may now
+	   be purgeable */
+	bool body_refs_released:1;
+	bool no_copy_file_range:1;
 };
 
 static int mdbox_map_file_msg_offset_cmp(const struct mdbox_map_file_msg *m1,
@@ -128,8 +155,10 @@ mdbox_file_metadata_copy(struct dbox_file *file, struct ostream *output)
 
 static int
 mdbox_metadata_get_extrefs(struct dbox_file *file, pool_t ext_refs_pool,
-			   ARRAY_TYPE(mail_attachment_extref) *extrefs)
+			   ARRAY_TYPE(mail_attachment_extref) *extrefs,
+			   ARRAY_TYPE(uint32_t) *body_map_uids)
 {
+	struct mdbox_body_ref body_ref;
 	struct dbox_metadata_header meta_hdr;
 	const char *line;
 	size_t buf_size;
@@ -154,6 +183,14 @@ mdbox_metadata_get_extrefs(struct dbox_file *file, pool_t ext_refs_pool,
 					  file->cur_path, line);
 			}
 		} T_END;
+		if (*line == DBOX_METADATA_BODY_REF) T_BEGIN {
+			if (mdbox_file_parse_body_ref(line+1, &body_ref))
+				array_push_back(body_map_uids, &body_ref.map_uid);
+			else {
+				i_warning("%s: Ignoring corrupted body-ref: %s",
+					  file->cur_path, line);
+			}
+		} T_END;
 	}
 	i_stream_set_max_buffer_size(file->input, buf_size);
 
@@ -171,15 +208,108 @@ mdbox_purge_want_altpath(struct mdbox_purge_context *ctx,
 	enum mdbox_msg_action action;
 	void *value;
 
-	if (dbox_file_is_in_alt(file))
-		return TRUE;
+	if (ctx->have_altmoves) {
+		value = hash_table_lookup(ctx->altmoves, POINTER_CAST(map_uid));
+		action = POINTER_CAST_TO(value, enum mdbox_msg_action);
+		switch (action) {
+		case MDBOX_MSG_ACTION_MOVE_TO_ALT:
+			return TRUE;
+		case MDBOX_MSG_ACTION_MOVE_FROM_ALT:
+			return FALSE;
+		}
+	}
+	/* keep the mail in the same storage */
+	return dbox_file_is_in_alt(file);
+}
+
+static void
+mdbox_purge_copy_file_range(struct mdbox_purge_context *ctx ATTR_UNUSED,
+			    struct istream *input ATTR_UNUSED,
+			    struct ostream *output ATTR_UNUSED)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	uoff_t size;
+	loff_t in_offset, out_offset;
+	int in_fd, out_fd;
+	ssize_t ret;
+
+	/* Copy as much as possible within the kernel. This allows e.g.
+	   reflinks and server-side copies. Whatever is left is sent using the
+	   streams, which also handles all the errors. */
+	if (ctx->no_copy_file_range)
+		return;
+	in_fd = i_stream_get_fd(input);
+	out_fd = o_stream_get_fd(output);
+	if (in_fd == -1 || out_fd == -1)
+		return;
+	if (i_stream_get_size(input, TRUE, &size) <= 0)
+		return;
+	/* the data is written directly to the fd, so anything still
+	   buffered in the ostream would end up after it. */
+	if (o_stream_flush(output) <= 0)
+		return;
+	i_assert(o_stream_get_buffer_used_size(output) == 0);
+
+	in_offset = i_stream_get_absolute_offset(input);
+	/* file ostream's offset is the file offset */
+	out_offset = output->offset;
+	while (input->v_offset < size) {
+		ret = copy_file_range(in_fd, &in_offset, out_fd, &out_offset,
+				      size - input->v_offset, 0);
+		if (ret <= 0) {
+			if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+					errno == EINVAL || errno == EOPNOTSUPP))
+				ctx->no_copy_file_range = TRUE;
+			break;
+		}
+		i_stream_seek(input, input->v_offset + ret);
+	}
+	/* the buffer is still empty, so this only updates the offset */
+	i_assert(o_stream_get_buffer_used_size(output) == 0);
+	if (o_stream_seek(output, out_offset) < 0)
+		i_unreached();
+#endif
+}
+
+static void mdbox_purge_throttle(struct mdbox_purge_context *ctx)
+{
+	const struct mdbox_settings *set = ctx->storage->set;
+	struct ioloop *prev_ioloop = current_ioloop;
+	struct timeout *to;
+	struct timeval now;
+	long long elapsed_usecs, wanted_usecs = 0, usecs;
 
-	if (!ctx->have_altmoves)
-		return FALSE;
+	if (set->mdbox_purge_max_bytes_per_sec > 0) {
+		uoff_t max = set->mdbox_purge_max_bytes_per_sec;
 
-	value = hash_table_lookup(ctx->altmoves, POINTER_CAST(map_uid));
-	action = POINTER_CAST_TO(value, enum mdbox_msg_action);
-	return action == MDBOX_MSG_ACTION_MOVE_TO_ALT;
+		wanted_usecs = (ctx->copied_bytes / max) * 1000000 +
+			(ctx->copied_bytes % max) * 1000000 / max;
+	}
+	if (set->mdbox_purge_max_iops > 0) {
+		usecs = (long long)ctx->io_count * 1000000 /
+			set->mdbox_purge_max_iops;
+		wanted_usecs = I_MAX(wanted_usecs, usecs);
+	}
+	if (wanted_usecs == 0)
+		return;
+
+	i_gettimeofday(&now);
+	elapsed_usecs = timeval_diff_usecs(&now, &ctx->start_time);
+	if (wanted_usecs - elapsed_usecs < MDBOX_PURGE_THROTTLE_MIN_MSECS*1000)
+		return;
+
+	/* Wait in our own ioloop. The caller's ioloop may have callbacks that
+	   aren't safe to run in the middle of purging, but e.g. signals are
+	   still handled while waiting. */
+	if (ctx->ioloop == NULL)
+		ctx->ioloop = io_loop_create();
+	else
+		io_loop_set_current(ctx->ioloop);
+	to = timeout_add_short((wanted_usecs - elapsed_usecs + 999) / 1000,
+			       io_loop_stop, ctx->ioloop);
+	io_loop_run(ctx->ioloop);
+	timeout_remove(&to);
+	io_loop_set_current(prev_ioloop);
 }
 
 static int
@@ -206,6 +336,7 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	i_assert(file != out_file_append->file);
 
 	input = i_stream_create_limit(file->input, msg_size);
+	mdbox_purge_copy_file_range(ctx, input, output);
 	o_stream_nsend_istream(output, input);
 	if (o_stream_flush(output) < 0) {
 		mail_storage_set_critical(&file->storage->storage,
@@ -220,6 +351,7 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		dbox_file_set_corrupted(file, "truncated message at EOF");
 		ret = 0;
 	} else {
+		ctx->copied_bytes += msg_size;
 		ret = 1;
 	}
 	i_stream_unref(&input);
@@ -286,6 +418,30 @@ mdbox_purge_attachments(struct mdbox_purge_context *ctx,
 	return ret;
 }
 
+static int
+mdbox_purge_body_refs(struct mdbox_purge_context *ctx,
+		      const ARRAY_TYPE(uint32_t) *body_map_uids)
+{
+	struct mdbox_map_atomic_context *atomic;
+	struct mdbox_map_transaction_context *trans;
+	int ret;
+
+	if (array_count(body_map_uids) == 0)
+		return 0;
+
+	atomic = mdbox_map_atomic_begin(ctx->storage->map);
+	trans = mdbox_map_transaction_begin(atomic, TRUE);
+	ret = mdbox_map_update_refcounts(trans, body_map_uids, -1);
+	if (ret == 0)
+		ret = mdbox_map_transaction_commit(trans, "purging body refs");
+	mdbox_map_transaction_free(&trans);
+	if (mdbox_map_atomic_finish(&atomic) < 0)
+		ret = -1;
+	if (ret == 0)
+		ctx->body_refs_released = TRUE;
+	return ret;
+}
+
 static int
 mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		 uint32_t file_id)
@@ -297,9 +453,10 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	ARRAY_TYPE(seq_range) expunged_map_uids;
 	ARRAY_TYPE(uint32_t) copied_map_uids;
 	ARRAY_TYPE(mail_attachment_extref) ext_refs;
+	ARRAY_TYPE(uint32_t) body_map_uids;
 	pool_t ext_refs_pool;
 	unsigned int i, count;
-	uoff_t offset;
+	uoff_t offset, orig_copied_bytes = ctx->copied_bytes;
 	int ret;
 
 	i_assert(ctx->atomic == NULL);
@@ -336,6 +493,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	ctx->atomic = mdbox_map_atomic_begin(ctx->storage->map);
 	msgs = array_get(&msgs_arr, &count);
 	i_array_init(&ext_refs, 32);
+	i_array_init(&body_map_uids, 8);
 	i_array_init(&copied_map_uids, I_MIN(count, 1));
 	i_array_init(&expunged_map_uids, I_MIN(count, 1));
 	offset = file->file_header_size;
@@ -360,7 +518,8 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 				      file->cur_physical_size);
 			/* skip metadata */
 			ret = mdbox_metadata_get_extrefs(file, ext_refs_pool,
-							 &ext_refs);
+							 &ext_refs,
+							 &body_map_uids);
 			if (ret <= 0)
 				break;
 			seq_range_array_add(&expunged_map_uids,
@@ -374,6 +533,8 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 			array_push_back(&copied_map_uids, &msgs[i].map_uid);
 		}
 		offset = file->input->v_offset;
+		ctx->io_count++;
+		mdbox_purge_throttle(ctx);
 	}
 	if (offset != (uoff_t)st.st_size && ret > 0) {
 		/* file has more messages than what map tells us */
@@ -428,9 +589,35 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	} else {
 		dbox_file_unlock(file);
 	}
+	if (ret > 0) {
+		uoff_t copied_bytes = ctx->copied_bytes - orig_copied_bytes;
+		uoff_t freed_bytes = (uoff_t)st.st_size <= copied_bytes ? 0 :
+			st.st_size - copied_bytes;
+
+		ctx->freed_bytes += freed_bytes;
+		ctx->purged_files_count++;
+		e_debug(event_create_passthrough(ctx->event)->
+			set_name("mdbox_purge_file_finished")->
+			add_int("file_id", file_id)->
+			add_int("file_size", st.st_size)->
+			add_int("copied_messages", array_count(&copied_map_uids))->
+			add_int("copied_bytes", copied_bytes)->
+			add_int("expunged_messages",
+				seq_range_count(&expunged_map_uids))->
+			add_int("freed_bytes", freed_bytes)->event(),
+			"Purged file m.%u: Copied %u messages (%"PRIuUOFF_T
+			" bytes), freed %"PRIuUOFF_T" bytes", file_id,
+			array_count(&copied_map_uids), copied_bytes,
+			freed_bytes);
+	}
 	array_free(&copied_map_uids);
 	array_free(&expunged_map_uids);
 
+	/* the expunged mails no longer use the bodies they referred to */
+	if (ret > 0 && mdbox_purge_body_refs(ctx, &body_map_uids) < 0)
+		ret = -1;
+	array_free(&body_map_uids);
+
 	(void)mdbox_purge_attachments(ctx, &ext_refs);
 	array_free(&ext_refs);
 	pool_unref(&ext_refs_pool);
@@ -476,6 +663,9 @@ mdbox_purge_alloc(struct mdbox_storage *storage)
 	i_array_init(&ctx->primary_file_ids, 64);
 	i_array_init(&ctx->purge_file_ids, 64);
 	hash_table_create_direct(&ctx->altmoves, pool, 0);
+	ctx->event = event_create(storage->storage.storage.event);
+	event_set_append_log_prefix(ctx->event, "purge: ");
+	i_gettimeofday(&ctx->start_time);
 	return ctx;
 }
 
@@ -485,7 +675,15 @@ static void mdbox_purge_free(struct mdbox_purge_context **_ctx)
 
 	*_ctx = NULL;
 
+	if (ctx->ioloop != NULL) {
+		struct ioloop *prev_ioloop = current_ioloop;
+
+		io_loop_set_current(ctx->ioloop);
+		io_loop_destroy(&ctx->ioloop);
+		io_loop_set_current(prev_ioloop);
+	}
 	hash_table_destroy(&ctx->altmoves);
+	event_unref(&ctx->event);
 	array_free(&ctx->primary_file_ids);
 	array_free(&ctx->purge_file_ids);
 	pool_unref(&ctx->pool);
@@ -643,32 +841,76 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 	return ret;
 }
 
-int mdbox_purge(struct mail_storage *_storage)
+static void
+mdbox_purge_prefetch_file(struct mdbox_purge_context *ctx ATTR_UNUSED,
+			  uint32_t file_id ATTR_UNUSED)
 {
-	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
-	struct mdbox_purge_context *ctx;
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
 	struct dbox_file *file;
-	struct seq_range_iter iter;
-	unsigned int i = 0;
-	uint32_t file_id;
 	bool deleted;
 	int ret;
 
-	ctx = mdbox_purge_alloc(storage);
-	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
-	if (storage->alt_storage_dir != NULL) {
-		if (mdbox_purge_get_primary_files(ctx) < 0)
-			ret = -1;
-		else {
-			/* add files that can be altmoved */
-			if (mdbox_altmove_add_files(ctx) < 0)
-				ret = -1;
+	/* the file is usually left to the open files cache, so purging it
+	   doesn't even need to reopen it. */
+	file = mdbox_file_init(ctx->storage, file_id);
+	if (dbox_file_open(file, &deleted) > 0 && !deleted) {
+		/* posix_fadvise() returns the error instead of setting
+		   errno */
+		ret = posix_fadvise(file->fd, 0, 0, POSIX_FADV_WILLNEED);
+		if (ret != 0) {
+			errno = ret;
+			e_error(ctx->event, "posix_fadvise(%s) failed: %m",
+				file->cur_path);
 		}
 	}
+	dbox_file_unref(&file);
+#endif
+}
+
+static void
+mdbox_purge_finished(struct mdbox_purge_context *ctx, unsigned int files_count)
+{
+	struct timeval now;
+
+	i_gettimeofday(&now);
+	e_debug(event_create_passthrough(ctx->event)->
+		set_name("mdbox_purge_finished")->
+		add_int("files", files_count)->
+		add_int("purged_files", ctx->purged_files_count)->
+		add_int("copied_bytes", ctx->copied_bytes)->
+		add_int("freed_bytes", ctx->freed_bytes)->
+		add_int("duration_usecs",
+			timeval_diff_usecs(&now, &ctx->start_time))->event(),
+		"Purged %u/%u files: Copied %"PRIuUOFF_T" bytes, "
+		"freed %"PRIuUOFF_T" bytes", ctx->purged_files_count,
+		files_count, ctx->copied_bytes, ctx->freed_bytes);
+}
+
+static int mdbox_purge_files(struct mdbox_purge_context *ctx)
+{
+	struct mdbox_storage *storage = ctx->storage;
+	struct dbox_file *file;
+	struct seq_range_iter iter, prefetch_iter;
+	unsigned int i = 0, prefetch_i = 0;
+	uint32_t file_id, prefetch_file_id;
+	bool deleted;
+	int ret = 0;
 
 	seq_range_array_iter_init(&iter, &ctx->purge_file_ids); i = 0;
+	seq_range_array_iter_init(&prefetch_iter, &ctx->purge_file_ids);
 	while (ret == 0 &&
 	       seq_range_array_iter_nth(&iter, i++, &file_id)) T_BEGIN {
+		/* keep reading the next files while purging this one */
+		if (prefetch_i < i)
+			prefetch_i = i;
+		while (prefetch_i < i + MDBOX_PURGE_PREFETCH_FILES &&
+		       seq_range_array_iter_nth(&prefetch_iter, prefetch_i,
+						&prefetch_file_id)) {
+			mdbox_purge_prefetch_file(ctx, prefetch_file_id);
+			prefetch_i++;
+		}
+
 		file = mdbox_file_init(storage, file_id);
 		if (dbox_file_open(file, &deleted) > 0 && !deleted) {
 			if (mdbox_file_purge(ctx, file, file_id) < 0)
@@ -678,9 +920,56 @@ int mdbox_purge(struct mail_storage *_storage)
 				ret = -1;
 		}
 		dbox_file_unref(&file);
+		ctx->io_count++;
+		mdbox_purge_throttle(ctx);
 	} T_END;
+	return ret;
+}
+
+int mdbox_purge(struct mail_storage *_storage)
+{
+	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
+	struct mdbox_purge_context *ctx;
+	unsigned int files_count;
+	int ret;
+
+	ctx = mdbox_purge_alloc(storage);
+	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
+	if (storage->alt_storage_dir != NULL) {
+		if (mdbox_purge_get_primary_files(ctx) < 0)
+			ret = -1;
+		else {
+			/* add files that can be altmoved */
+			if (mdbox_altmove_add_files(ctx) < 0)
+				ret = -1;
+		}
+	}
+
+	if (ret == 0)
+		ret = mdbox_purge_files(ctx);
+	files_count = seq_range_count(&ctx->purge_file_ids);
+	while (ret == 0 && ctx->body_refs_released) {
+		/* purge the shared bodies that are no longer referred to */
+		ctx->body_refs_released = FALSE;
+		array_clear(&ctx->purge_file_ids);
+		ret = mdbox_map_get_zero_ref_files(storage->map,
+						   &ctx->purge_file_ids);
+		if (ret == 0)
+			ret = mdbox_purge_files(ctx);
+		files_count += seq_range_count(&ctx->purge_file_ids);
+	}
+	mdbox_purge_finished(ctx, files_count);
 	mdbox_purge_free(&ctx);
 
+	if (ret == 0) {
+		/* the requested altmoves are done now. don't redo them if the
+		   storage is purged again. */
+		if (array_is_created(&storage->move_to_alt_map_uids))
+			array_free(&storage->move_to_alt_map_uids);
+		if (array_is_created(&storage->move_from_alt_map_uids))
+			array_free(&storage->move_from_alt_map_uids);
+	}
+
 	if (storage->corrupted) {
 		/* purging found corrupted files */
 		(void)mdbox_storage_rebuild(storage);
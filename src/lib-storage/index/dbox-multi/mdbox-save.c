@@ -6,8 +6,10 @@
 #include "hex-binary.h"
 #include "hex-dec.h"
 #include "str.h"
+#include "sha2.h"
 #include "istream.h"
 #include "istream-crlf.h"
+#include "istream-hash.h"
 #include "ostream.h"
 #include "write-full.h"
 #include "index-mail.h"
@@ -20,6 +22,14 @@
 #include "mdbox-sync.h"
 
 
+struct mdbox_body_hash_context {
+	struct sha256_ctx sha256;
+	/* size of the header, including the empty line */
+	uoff_t hdr_size;
+	bool hdr_lf:1;
+	bool in_body:1;
+};
+
 struct dbox_save_mail {
 	struct dbox_file_append_context *file_append;
 	uint32_t seq;
@@ -38,6 +48,10 @@ struct mdbox_save_context {
 	struct dbox_file_append_context *cur_file_append;
 	struct mdbox_map_append_context *append_ctx;
 
+	/* hashes the current mail's body for deduplication */
+	struct istream *hash_input;
+	struct mdbox_body_hash_context body_hash;
+
 	ARRAY_TYPE(uint32_t) copy_map_uids;
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_transaction_context *map_trans;
@@ -47,6 +61,56 @@ struct mdbox_save_context {
 
 #define MDBOX_SAVECTX(s)	container_of(DBOX_SAVECTX(s), struct mdbox_save_context, ctx)
 
+static void mdbox_body_hash_init(void *context)
+{
+	struct mdbox_body_hash_context *ctx = context;
+
+	i_zero(ctx);
+	sha256_init(&ctx->sha256);
+	/* a message may begin with the empty line */
+	ctx->hdr_lf = TRUE;
+}
+
+static void
+mdbox_body_hash_loop(void *context, const void *data, size_t size)
+{
+	struct mdbox_body_hash_context *ctx = context;
+	const unsigned char *p = data;
+	size_t i;
+
+	/* the input has LFs as linefeeds. the header ends at the first
+	   empty line. */
+	for (i = 0; i < size && !ctx->in_body; i++) {
+		if (p[i] != '\n')
+			ctx->hdr_lf = FALSE;
+		else if (ctx->hdr_lf)
+			ctx->in_body = TRUE;
+		else
+			ctx->hdr_lf = TRUE;
+	}
+	ctx->hdr_size += i;
+	if (i < size)
+		sha256_loop(&ctx->sha256, p + i, size - i);
+}
+
+static void mdbox_body_hash_result(void *context, unsigned char *digest_r)
+{
+	struct mdbox_body_hash_context *ctx = context;
+
+	sha256_result(&ctx->sha256, digest_r);
+}
+
+static const struct hash_method mdbox_body_hash_method = {
+	.name = "mdbox-body-sha256",
+	.block_size = SHA256_BLOCK_SIZE,
+	.context_size = sizeof(struct mdbox_body_hash_context),
+	.digest_size = SHA256_RESULTLEN,
+
+	.init = mdbox_body_hash_init,
+	.loop = mdbox_body_hash_loop,
+	.result = mdbox_body_hash_result,
+};
+
 static struct dbox_file *
 mdbox_copy_file_get_file(struct mailbox_transaction_context *t,
 			 uint32_t seq, uoff_t *offset_r)
@@ -126,6 +190,49 @@ mdbox_save_alloc(struct mailbox_transaction_context *t)
 	return t->save_ctx;
 }
 
+/* Returns the body reference for the mail if its body could be shared with
+   an identical existing body, NULL if the mail is saved normally. */
+static const char *mdbox_save_try_dedup(struct mdbox_save_context *ctx,
+					struct dbox_save_mail *mail,
+					uoff_t message_size)
+{
+	struct mdbox_body_hash_context *hash = &ctx->body_hash;
+	struct mdbox_map_dedup_record dedup;
+	uint32_t map_uid, body_offset;
+	uoff_t body_size;
+
+	i_assert(sizeof(dedup.digest) == SHA256_RESULTLEN);
+
+	if (!ctx->hash_input->eof || ctx->hash_input->stream_errno != 0 ||
+	    !hash->in_body || hash->hdr_size > (uint32_t)-1 ||
+	    hash->hdr_size >= message_size)
+		return NULL;
+	body_size = message_size - hash->hdr_size;
+	mdbox_body_hash_result(hash, dedup.digest);
+
+	/* lookup failures only prevent deduplicating this mail */
+	if (mdbox_map_dedup_lookup(ctx->mbox->storage->map, dedup.digest,
+				   &map_uid, &body_offset) <= 0) {
+		dedup.body_offset = hash->hdr_size;
+		mdbox_map_append_set_dedup(ctx->append_ctx, &dedup);
+		return NULL;
+	}
+
+	/* the whole mail was already written. keep only its header and
+	   refer to the existing body. */
+	if (dbox_file_append_truncate(mail->file_append, mail->append_offset +
+				      mail->file_append->file->msg_header_size +
+				      hash->hdr_size) < 0) {
+		ctx->ctx.failed = TRUE;
+		return NULL;
+	}
+	if (!array_is_created(&ctx->copy_map_uids))
+		i_array_init(&ctx->copy_map_uids, 32);
+	array_push_back(&ctx->copy_map_uids, &map_uid);
+	return t_strdup_printf("%x %x %llx", map_uid, body_offset,
+			       (unsigned long long)body_size);
+}
+
 int mdbox_save_begin(struct mail_save_context *_ctx, struct istream *input)
 {
 	struct mdbox_save_context *ctx = MDBOX_SAVECTX(_ctx);
@@ -152,6 +259,17 @@ int mdbox_save_begin(struct mail_save_context *_ctx, struct istream *input)
 
 	ctx->cur_file = ctx->cur_file_append->file;
 	dbox_save_begin(&ctx->ctx, input);
+	if (ctx->mbox->storage->set->mdbox_dedup &&
+	    ctx->ctx.ctx.data.attach == NULL) {
+		/* hash the data as it's written to the file, so the body's
+		   offset is known */
+		mdbox_body_hash_init(&ctx->body_hash);
+		ctx->hash_input = i_stream_create_hash(ctx->ctx.input,
+			&mdbox_body_hash_method, &ctx->body_hash);
+		i_stream_unref(&ctx->ctx.input);
+		ctx->ctx.input = ctx->hash_input;
+		i_stream_ref(ctx->hash_input);
+	}
 
 	save_mail = array_append_space(&ctx->mails);
 	save_mail->file_append = ctx->cur_file_append;
@@ -165,6 +283,7 @@ static int mdbox_save_mail_write_metadata(struct mdbox_save_context *ctx,
 {
 	struct dbox_file *file = mail->file_append->file;
 	struct dbox_message_header dbox_msg_hdr;
+	const char *body_ref = NULL;
 	uoff_t message_size;
 	guid_128_t guid_128;
 
@@ -172,15 +291,27 @@ static int mdbox_save_mail_write_metadata(struct mdbox_save_context *ctx,
 
 	message_size = ctx->ctx.dbox_output->offset -
 		mail->append_offset - mail->file_append->file->msg_header_size;
+	if (ctx->hash_input != NULL) {
+		body_ref = mdbox_save_try_dedup(ctx, mail, message_size);
+		if (ctx->ctx.failed)
+			return -1;
+		if (body_ref != NULL) {
+			message_size = ctx->ctx.dbox_output->offset -
+				mail->append_offset - file->msg_header_size;
+		}
+	}
 
 	dbox_save_write_metadata(&ctx->ctx.ctx, ctx->ctx.dbox_output,
-				 message_size, ctx->mbox->box.name, guid_128);
+				 message_size, ctx->mbox->box.name, body_ref,
+				 guid_128);
 	/* save the 128bit GUID to index so if the map index gets corrupted
 	   we can still find the message */
 	mail_index_update_ext(ctx->ctx.trans, ctx->ctx.seq,
 			      ctx->mbox->guid_ext_id, guid_128, NULL);
 
 	dbox_msg_header_fill(&dbox_msg_hdr, message_size);
+	if (body_ref != NULL)
+		dbox_msg_hdr.type = DBOX_MESSAGE_TYPE_BODY_REF;
 	if (o_stream_pwrite(ctx->ctx.dbox_output, &dbox_msg_hdr,
 			    sizeof(dbox_msg_hdr), mail->append_offset) < 0) {
 		dbox_file_set_syscall_error(file, "pwrite()");
@@ -200,6 +331,10 @@ static int mdbox_save_finish_write(struct mail_save_context *_ctx)
 	if (ctx->ctx.dbox_output == NULL)
 		return -1;
 
+	/* plugins (e.g. compression) may change the written data, so the
+	   body isn't found from the file as it was hashed */
+	if (ctx->ctx.ctx.data.output != ctx->ctx.dbox_output)
+		i_stream_unref(&ctx->hash_input);
 	dbox_save_end(&ctx->ctx);
 
 	mail = array_back_modifiable(&ctx->mails);
@@ -210,11 +345,12 @@ static int mdbox_save_finish_write(struct mail_save_context *_ctx)
 			mdbox_map_append_finish(ctx->append_ctx);
 	} T_END;
 
-	if (mail->file_append->file->input != NULL) {
+	if (ctx->cur_file != NULL && ctx->cur_file->input != NULL) {
 		/* if we try to read the saved mail before unlocking file,
 		   make sure the input stream doesn't have stale data */
-		i_stream_sync(mail->file_append->file->input);
+		i_stream_sync(ctx->cur_file->input);
 	}
+	i_stream_unref(&ctx->hash_input);
 	i_stream_unref(&ctx->ctx.input);
 
 	if (ctx->ctx.failed) {
@@ -5,6 +5,9 @@ struct mdbox_settings {
 	bool mdbox_preallocate_space;
 	uoff_t mdbox_rotate_size;
 	unsigned int mdbox_rotate_interval;
+	uoff_t mdbox_purge_max_bytes_per_sec;
+	unsigned int mdbox_purge_max_iops;
+	bool mdbox_dedup;
 };
 
 const struct setting_parser_info *mdbox_get_setting_parser_info(void);
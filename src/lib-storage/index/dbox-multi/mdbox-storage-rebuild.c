@@ -30,6 +30,8 @@ struct mdbox_rebuild_msg {
 	uint32_t rec_size;
 	uoff_t mail_size;
 	uint32_t map_uid;
+	/* map_uid of the shared body this message refers to */
+	uint32_t body_map_uid;
 
 	uint16_t refcount;
 	bool seen_zero_ref_in_map:1;
@@ -142,9 +144,10 @@ static void rebuild_scan_metadata(struct mdbox_storage_rebuild_context *ctx,
 static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
 			      struct dbox_file *file, uint32_t file_id)
 {
-	const char *guid;
+	const char *guid, *body_ref_value;
 	uint8_t *guid_p;
 	struct mdbox_rebuild_msg *rec, *old_rec;
+	struct mdbox_body_ref body_ref;
 	uoff_t offset, prev_offset;
 	bool last, first, fixed = FALSE;
 	int ret;
@@ -199,6 +202,11 @@ static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
 		rec->mail_size = dbox_file_get_plaintext_size(file);
 		mail_generate_guid_128_hash(guid, rec->guid_128);
 		i_assert(!guid_128_is_empty(rec->guid_128));
+		body_ref_value = dbox_file_metadata_get(file,
+							DBOX_METADATA_BODY_REF);
+		if (body_ref_value != NULL &&
+		    mdbox_file_parse_body_ref(body_ref_value, &body_ref))
+			rec->body_map_uid = body_ref.map_uid;
 		array_push_back(&ctx->msgs, &rec);
 
 		guid_p = rec->guid_128;
@@ -772,6 +780,30 @@ static int rebuild_restore_msg(struct mdbox_storage_rebuild_context *ctx,
 	return 0;
 }
 
+static void rebuild_add_body_refs(struct mdbox_storage_rebuild_context *ctx)
+{
+	struct mdbox_rebuild_msg *const *msgs, *body_msg;
+	unsigned int i, count;
+
+	/* messages that share another message's body keep it referenced
+	   until they're purged, even if they're already expunged */
+	msgs = array_get(&ctx->msgs, &count);
+	for (i = 0; i < count; i++) {
+		if (msgs[i]->body_map_uid == 0)
+			continue;
+
+		body_msg = rebuild_lookup_map_uid(ctx, msgs[i]->body_map_uid);
+		if (body_msg == NULL) {
+			i_error("mdbox %s: m.%u:%u refers to a lost body "
+				"map_uid=%u", ctx->storage->storage_dir,
+				msgs[i]->file_id, msgs[i]->offset,
+				msgs[i]->body_map_uid);
+		} else if (body_msg->refcount < REBUILD_MAX_REFCOUNT) {
+			body_msg->refcount++;
+		}
+	}
+}
+
 static int rebuild_handle_zero_refs(struct mdbox_storage_rebuild_context *ctx)
 {
 	struct mdbox_rebuild_msg **msgs;
@@ -848,6 +880,7 @@ static int rebuild_finish(struct mdbox_storage_rebuild_context *ctx)
 
 	i_assert(ctx->default_list != NULL);
 
+	rebuild_add_body_refs(ctx);
 	if (rebuild_handle_zero_refs(ctx) < 0)
 		return -1;
 	rebuild_update_refcounts(ctx);
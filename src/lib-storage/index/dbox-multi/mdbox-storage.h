@@ -40,6 +40,10 @@ struct mdbox_storage {
 	   has changed from this value) */
 	uint32_t corrupted_rebuild_count;
 
+	/* the result of the last mdbox_mail_is_in_alt() file lookup */
+	uint32_t alt_check_file_id;
+	bool alt_check_in_alt;
+
 	bool corrupted:1;
 	bool rebuilding_storage:1;
 	bool preallocate_space:1;
@@ -72,6 +76,7 @@ extern struct mail_vfuncs mdbox_mail_vfuncs;
 
 int mdbox_mail_open(struct dbox_mail *mail, uoff_t *offset_r,
 		    struct dbox_file **file_r);
+int mdbox_mail_is_in_alt(struct dbox_mail *mail, bool *in_alt_r);
 
 /* Get map_uid for wanted message. */
 int mdbox_mail_lookup(struct mdbox_mailbox *mbox, struct mail_index_view *view,
@@ -143,6 +143,17 @@ int sdbox_mail_open(struct dbox_mail *mail, uoff_t *offset_r,
 	return 0;
 }
 
+int sdbox_mail_is_in_alt(struct dbox_mail *mail, bool *in_alt_r)
+{
+	struct mail *_mail = &mail->imail.mail.mail;
+
+	/* the alt flag in the index is kept up to date by syncing */
+	*in_alt_r = (mail_index_lookup(_mail->transaction->view,
+				       _mail->seq)->flags &
+		     DBOX_INDEX_FLAG_ALT) != 0;
+	return 0;
+}
+
 struct mail_vfuncs sdbox_mail_vfuncs = {
 	dbox_mail_close,
 	index_mail_free,
@@ -527,6 +527,8 @@ struct dbox_storage_vfuncs sdbox_dbox_storage_vfuncs = {
 	sdbox_file_free,
 	sdbox_file_create_fd,
 	sdbox_mail_open,
+	sdbox_mail_is_in_alt,
+	NULL,
 	sdbox_mailbox_create_indexes,
 	sdbox_get_attachment_path_suffix,
 	sdbox_set_mailbox_corrupted,
@@ -40,6 +40,7 @@ extern struct mail_vfuncs sdbox_mail_vfuncs;
 
 int sdbox_mail_open(struct dbox_mail *mail, uoff_t *offset_r,
 		    struct dbox_file **file_r);
+int sdbox_mail_is_in_alt(struct dbox_mail *mail, bool *in_alt_r);
 
 int sdbox_read_header(struct sdbox_mailbox *mbox,
 		      struct sdbox_index_header *hdr, bool log_error,
@@ -9,6 +9,7 @@
 #include "message-part-data.h"
 #include "message-parser.h"
 #include "message-header-decode.h"
+#include "message-search-bloom.h"
 #include "istream-tee.h"
 #include "istream-header-filter.h"
 #include "imap-envelope.h"
@@ -21,6 +22,11 @@ static const struct message_parser_settings msg_parser_set = {
 		MESSAGE_HEADER_PARSER_FLAG_DROP_CR,
 	.flags = MESSAGE_PARSER_FLAG_SKIP_BODY_BLOCK,
 };
+/* the search bloom needs the body blocks */
+static const struct message_parser_settings msg_parser_bloom_set = {
+	.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP |
+		MESSAGE_HEADER_PARSER_FLAG_DROP_CR,
+};
 
 static void index_mail_filter_stream_destroy(struct index_mail *mail);
 
@@ -372,6 +378,13 @@ index_mail_parse_part_header_cb(struct message_part *part,
 				struct index_mail *mail)
 {
 	index_mail_parse_header(part, hdr, mail);
+	if (mail->data.search_bloom != NULL) {
+		struct message_block block = {
+			.part = part,
+			.hdr = hdr,
+		};
+		message_search_bloom_more(mail->data.search_bloom, &block);
+	}
 }
 
 static void
@@ -408,13 +421,15 @@ index_mail_cache_parse_init(struct mail *_mail, struct istream *input)
 	mail->data.parser_input = input;
 	mail->data.parser_ctx =
 		message_parser_init(mail->mail.data_pool, input,
-				    &msg_parser_set);
+				    index_mail_search_bloom_init(mail) ?
+				    &msg_parser_bloom_set : &msg_parser_set);
 	i_stream_unref(&input);
 	return input2;
 }
 
 static void index_mail_init_parser(struct index_mail *mail)
 {
+	const struct message_parser_settings *parser_set = &msg_parser_set;
 	struct index_mail_data *data = &mail->data;
 	struct message_part *parts;
 	const char *error;
@@ -433,18 +448,25 @@ static void index_mail_init_parser(struct index_mail *mail)
 		}
 	}
 
+	/* build the search bloom if the whole message is going to be
+	   parsed anyway */
+	message_search_bloom_deinit(&data->search_bloom, NULL);
+	if ((data->access_part & PARSE_BODY) != 0 &&
+	    index_mail_search_bloom_init(mail))
+		parser_set = &msg_parser_bloom_set;
+
 	/* make sure parsing starts from the beginning of the stream */
 	i_stream_seek(mail->data.stream, 0);
 	if (data->parts == NULL) {
 		data->parser_input = data->stream;
 		data->parser_ctx = message_parser_init(mail->mail.data_pool,
 						       data->stream,
-						       &msg_parser_set);
+						       parser_set);
 	} else {
 		data->parser_ctx =
 			message_parser_init_from_parts(data->parts,
 						       data->stream,
-						       &msg_parser_set);
+						       parser_set);
 	}
 }
 
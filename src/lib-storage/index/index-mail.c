@@ -12,6 +12,7 @@
 #include "message-part-data.h"
 #include "message-part-serialize.h"
 #include "message-parser.h"
+#include "message-search-bloom.h"
 #include "message-snippet.h"
 #include "imap-bodystructure.h"
 #include "imap-envelope.h"
@@ -63,6 +64,8 @@ struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "binary.parts",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
 	{ .name = "body.snippet",
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	{ .name = "search.bloom",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
 	/* FIXME: for now need to update get_metadata_precache_fields() in
 	   index-status.c when adding more fields. those fields should probably
@@ -942,6 +945,10 @@ bool index_mail_want_cache(struct index_mail *mail, enum index_cache_field field
 	case MAIL_CACHE_BODY_SNIPPET:
 		fetch_field = MAIL_FETCH_BODY_SNIPPET;
 		break;
+	case MAIL_CACHE_SEARCH_BLOOM:
+		/* never explicitly fetched */
+		fetch_field = 0;
+		break;
 	default:
 		i_unreached();
 	}
@@ -979,6 +986,34 @@ static void index_mail_save_finish_make_snippet(struct index_mail *mail)
 	}
 }
 
+bool index_mail_search_bloom_init(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+
+	i_assert(mail->data.search_bloom == NULL);
+
+	if (!index_mail_want_cache(mail, MAIL_CACHE_SEARCH_BLOOM))
+		return FALSE;
+	mail->data.search_bloom = message_search_bloom_init(
+		_mail->box->storage->user->default_normalizer);
+	return TRUE;
+}
+
+static void index_mail_body_parsed_cache_search_bloom(struct index_mail *mail)
+{
+	buffer_t *bloom;
+
+	if (mail->data.search_bloom == NULL)
+		return;
+
+	T_BEGIN {
+		bloom = t_buffer_create(256);
+		message_search_bloom_deinit(&mail->data.search_bloom, bloom);
+		index_mail_cache_add(mail, MAIL_CACHE_SEARCH_BLOOM,
+				     bloom->data, bloom->used);
+	} T_END;
+}
+
 static void index_mail_cache_sizes(struct index_mail *mail)
 {
 	struct mail *_mail = &mail->mail.mail;
@@ -1199,6 +1234,10 @@ index_mail_parse_body_finish(struct index_mail *mail,
 		}
 		i_stream_unref(&parser_input);
 	}
+	if (ret <= 0 || mail->data.no_caching) {
+		/* the bloom may be incomplete */
+		message_search_bloom_deinit(&mail->data.search_bloom, NULL);
+	}
 	if (ret <= 0) {
 		if (ret == 0) {
 			i_assert(error != NULL);
@@ -1237,6 +1276,7 @@ index_mail_parse_body_finish(struct index_mail *mail,
 	index_mail_body_parsed_cache_bodystructure(mail, field);
 	index_mail_cache_sizes(mail);
 	index_mail_cache_dates(mail);
+	index_mail_body_parsed_cache_search_bloom(mail);
 	if (mail_set->parsed_mail_attachment_detection_add_flags &&
 	    !mail_has_attachment_keywords(&mail->mail.mail))
 		index_mail_try_set_attachment_keywords(mail);
@@ -1299,6 +1339,25 @@ void index_mail_stream_log_failure_for(struct index_mail *mail,
 		mail->mail.get_stream_reason);
 }
 
+static void index_mail_parse_body_search_bloom(struct index_mail *mail)
+{
+	struct index_mail_data *data = &mail->data;
+	struct message_block block;
+	int ret;
+
+	/* same as message_parser_parse_body(), but add also the body blocks
+	   to the search bloom */
+	while ((ret = message_parser_parse_next_block(data->parser_ctx,
+						      &block)) > 0) {
+		if (block.size == 0 && data->save_bodystructure_body) {
+			parse_bodystructure_part_header(block.part, block.hdr,
+							mail->mail.data_pool);
+		}
+		message_search_bloom_more(data->search_bloom, &block);
+	}
+	i_assert(ret != 0);
+}
+
 static int index_mail_parse_body(struct index_mail *mail,
 				 enum index_cache_field field)
 {
@@ -1311,7 +1370,11 @@ static int index_mail_parse_body(struct index_mail *mail,
 	old_offset = data->stream->v_offset;
 	i_stream_seek(data->stream, data->hdr_size.physical_size);
 
-	if (data->save_bodystructure_body) {
+	if (data->search_bloom != NULL) {
+		i_assert(!data->save_bodystructure_body ||
+			 data->parsed_bodystructure_header);
+		index_mail_parse_body_search_bloom(mail);
+	} else if (data->save_bodystructure_body) {
 		/* bodystructure header is parsed, we want the body's mime
 		   headers too */
 		i_assert(data->parsed_bodystructure_header);
@@ -1323,6 +1386,8 @@ static int index_mail_parse_body(struct index_mail *mail,
 			*null_message_part_header_callback, NULL);
 	}
 	ret = index_mail_stream_check_failure(mail);
+	if (ret < 0)
+		message_search_bloom_deinit(&data->search_bloom, NULL);
 	if (index_mail_parse_body_finish(mail, field, TRUE) < 0)
 		ret = -1;
 
@@ -1796,6 +1861,7 @@ static void index_mail_close_streams_full(struct index_mail *mail, bool closing)
 	struct message_part *parts;
 	const char *error;
 
+	message_search_bloom_deinit(&data->search_bloom, NULL);
 	if (data->parser_ctx != NULL) {
 		if (message_parser_deinit_from_parts(&data->parser_ctx, &parts, &error) < 0)
 			index_mail_set_message_parts_corrupted(&mail->mail.mail, error);
@@ -2296,6 +2362,9 @@ void index_mail_cache_parse_continue(struct mail *_mail)
 
 	while (message_parser_parse_next_block(mail->data.parser_ctx,
 					       &block) > 0) {
+		if (mail->data.search_bloom != NULL)
+			message_search_bloom_more(mail->data.search_bloom,
+						  &block);
 		if (block.size != 0)
 			continue;
 
@@ -2465,11 +2534,14 @@ static void index_mail_parse(struct mail *mail, bool parse_body)
 	struct index_mail *imail = INDEX_MAIL(mail);
 
 	imail->data.access_part |= PARSE_HDR;
+	if (parse_body) {
+		/* set this already before parsing the header, so the
+		   search bloom gets built from the same parsing */
+		imail->data.access_part |= PARSE_BODY;
+	}
 	if (index_mail_parse_headers(imail, NULL, "precache") == 0) {
-		if (parse_body) {
-			imail->data.access_part |= PARSE_BODY;
+		if (parse_body)
 			(void)index_mail_parse_body(imail, 0);
-		}
 	}
 }
 
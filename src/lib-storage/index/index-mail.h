@@ -24,6 +24,7 @@ enum index_cache_field {
 	MAIL_CACHE_MESSAGE_PARTS,
 	MAIL_CACHE_BINARY_PARTS,
 	MAIL_CACHE_BODY_SNIPPET,
+	MAIL_CACHE_SEARCH_BLOOM,
 
 	MAIL_INDEX_CACHE_FIELD_COUNT
 };
@@ -104,6 +105,8 @@ struct index_mail_data {
 	struct message_size hdr_size, body_size;
 	struct istream *parser_input;
 	struct message_parser_ctx *parser_ctx;
+	/* search bloom being built while parsing the whole message */
+	struct message_search_bloom_context *search_bloom;
 	int parsing_count;
 	ARRAY_TYPE(keywords) keywords;
 	ARRAY_TYPE(keyword_indexes) keyword_indexes;
@@ -199,6 +202,9 @@ int index_mail_parse_headers(struct index_mail *mail,
 			     const char *reason)
 	ATTR_NULL(2);
 void index_mail_parse_header_deinit(struct index_mail *mail);
+/* Start building the search bloom while the message is parsed, if it's
+   wanted in cache. Returns TRUE if started. */
+bool index_mail_search_bloom_init(struct index_mail *mail);
 /* Same as index_mail_parse_headers(), but assume that the stream is
    already opened. */
 int index_mail_parse_headers_internal(struct index_mail *mail,
@@ -19,10 +19,20 @@ struct index_search_context {
 	struct mailbox_header_lookup_ctx *extra_wanted_headers;
 
 	uint32_t seq1, seq2;
+	/* Mails can match only if (flags & skip_flags_mask) == skip_flags */
+	enum mail_flags skip_flags;
+	uint8_t skip_flags_mask;
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
 
+	buffer_t *bloom_buf;
+
+	/* Cache fields that are prefetched for the wanted fields/headers */
+	ARRAY(unsigned int) cache_prefetch_fields;
+	/* Mails before this sequence have already been prefetched */
+	uint32_t cache_prefetch_seq;
+
 	struct timeval search_start_time, last_notify;
 	struct timeval last_nonblock_timeval;
 	unsigned long long cost, next_time_check_cost;
@@ -32,6 +42,7 @@ struct index_search_context {
 	bool have_seqsets:1;
 	bool have_index_args:1;
 	bool have_mailbox_args:1;
+	bool have_bloom_args:1;
 	bool have_nonmatch_always:1;
 };
 
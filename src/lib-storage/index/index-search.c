@@ -12,6 +12,7 @@
 #include "message-address.h"
 #include "message-date.h"
 #include "message-search.h"
+#include "message-search-bloom.h"
 #include "message-parser.h"
 #include "mail-index-modseq.h"
 #include "index-storage.h"
@@ -37,6 +38,32 @@
 #define SEARCH_INITIAL_MAX_COST 30000
 #define SEARCH_RECALC_MIN_USECS 50000
 
+/* Number of mails whose cache records are prefetched at once */
+#define SEARCH_CACHE_PREFETCH_COUNT 256
+
+static const struct {
+	enum mail_fetch_field fetch_field;
+	enum index_cache_field cache_field;
+} search_cache_prefetch_map[] = {
+	{ MAIL_FETCH_MESSAGE_PARTS, MAIL_CACHE_MESSAGE_PARTS },
+	/* looked up by index_mail_update_access_parts_pre() */
+	{ MAIL_FETCH_NUL_STATE, MAIL_CACHE_FLAGS },
+	{ MAIL_FETCH_IMAP_BODY, MAIL_CACHE_FLAGS },
+	{ MAIL_FETCH_IMAP_BODYSTRUCTURE, MAIL_CACHE_FLAGS },
+	{ MAIL_FETCH_DATE, MAIL_CACHE_SENT_DATE },
+	{ MAIL_FETCH_RECEIVED_DATE, MAIL_CACHE_RECEIVED_DATE },
+	{ MAIL_FETCH_SAVE_DATE, MAIL_CACHE_SAVE_DATE },
+	{ MAIL_FETCH_PHYSICAL_SIZE, MAIL_CACHE_PHYSICAL_FULL_SIZE },
+	{ MAIL_FETCH_VIRTUAL_SIZE, MAIL_CACHE_VIRTUAL_FULL_SIZE },
+	{ MAIL_FETCH_IMAP_BODY, MAIL_CACHE_IMAP_BODY },
+	{ MAIL_FETCH_IMAP_BODYSTRUCTURE, MAIL_CACHE_IMAP_BODYSTRUCTURE },
+	{ MAIL_FETCH_IMAP_ENVELOPE, MAIL_CACHE_IMAP_ENVELOPE },
+	{ MAIL_FETCH_UIDL_BACKEND, MAIL_CACHE_POP3_UIDL },
+	{ MAIL_FETCH_GUID, MAIL_CACHE_GUID },
+	{ MAIL_FETCH_POP3_ORDER, MAIL_CACHE_POP3_ORDER },
+	{ MAIL_FETCH_BODY_SNIPPET, MAIL_CACHE_BODY_SNIPPET },
+};
+
 struct search_header_context {
         struct index_search_context *index_ctx;
         struct index_mail *imail;
@@ -52,6 +79,12 @@ struct search_header_context {
 	bool threading:1;
 };
 
+struct search_bloom_context {
+	struct index_search_context *index_ctx;
+	const unsigned char *bloom;
+	size_t bloom_size;
+};
+
 struct search_body_context {
         struct index_search_context *index_ctx;
 	struct istream *input;
@@ -131,6 +164,13 @@ static void search_init_arg(struct mail_search_arg *arg,
 	case SEARCH_MAILBOX_GLOB:
 		ctx->have_mailbox_args = TRUE;
 		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+	case SEARCH_BODY:
+	case SEARCH_TEXT:
+		if (arg->value.str[0] != '\0')
+			ctx->have_bloom_args = TRUE;
+		break;
 	case SEARCH_ALL:
 		if (!arg->match_not)
 			arg->match_always = TRUE;
@@ -725,6 +765,73 @@ static void search_body(struct mail_search_arg *arg,
 	ARG_SET_RESULT(arg, ret);
 }
 
+static void search_bloom_arg(struct mail_search_arg *arg,
+			     struct search_bloom_context *ctx)
+{
+	struct message_search_context *msg_search_ctx;
+
+	switch (arg->type) {
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+	case SEARCH_BODY:
+	case SEARCH_TEXT:
+		/* SEARCH_HEADER_ADDRESS isn't checked, because the address
+		   is rewritten before searching. */
+		break;
+	default:
+		return;
+	}
+	if (arg->value.str[0] == '\0')
+		return;
+
+	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
+	if (msg_search_ctx == NULL)
+		return;
+
+	if (!message_search_bloom_may_contain(ctx->bloom, ctx->bloom_size,
+			message_search_get_normalized_key(msg_search_ctx)))
+		ARG_SET_RESULT(arg, 0);
+}
+
+/* Returns >0 = matched, 0 = not matched, -1 = unknown */
+static int search_arg_match_bloom(struct mail_search_arg *args,
+				  struct index_search_context *ctx)
+{
+	struct search_bloom_context bloom_ctx;
+	struct index_mail *imail;
+	struct mail *real_mail;
+	enum mail_cache_decision_type decision;
+	unsigned int field_idx;
+
+	if (!ctx->have_bloom_args)
+		return -1;
+	if (mail_get_backend_mail(ctx->cur_mail, &real_mail) < 0)
+		return -1;
+	imail = INDEX_MAIL(real_mail);
+
+	/* Search blooms are used only if they're explicitly configured
+	   to be cached. Don't look them up otherwise, since that would
+	   change the caching decision. */
+	field_idx = imail->ibox->cache_fields[MAIL_CACHE_SEARCH_BLOOM].idx;
+	decision = mail_cache_field_get_decision(real_mail->box->cache,
+						 field_idx);
+	if ((decision & ENUM_NEGATE(MAIL_CACHE_DECISION_FORCED)) ==
+	    MAIL_CACHE_DECISION_NO)
+		return -1;
+
+	if (ctx->bloom_buf == NULL)
+		ctx->bloom_buf = buffer_create_dynamic(default_pool, 256);
+	buffer_set_used_size(ctx->bloom_buf, 0);
+	if (index_mail_cache_lookup_field(imail, ctx->bloom_buf, field_idx) <= 0)
+		return -1;
+
+	i_zero(&bloom_ctx);
+	bloom_ctx.index_ctx = ctx;
+	bloom_ctx.bloom = ctx->bloom_buf->data;
+	bloom_ctx.bloom_size = ctx->bloom_buf->used;
+	return mail_search_args_foreach(args, search_bloom_arg, &bloom_ctx);
+}
+
 static int search_arg_match_text(struct mail_search_arg *args,
 				 struct index_search_context *ctx)
 {
@@ -1094,6 +1201,34 @@ static bool search_limit_by_hdr(struct index_search_context *ctx,
 	return *seq1 <= *seq2;
 }
 
+static void search_get_skip_flags(struct index_search_context *ctx,
+				  struct mail_search_arg *args)
+{
+	enum mail_flags flags, pvt_flags_mask;
+
+	/* private flags aren't in the main view and \Recent flags aren't
+	   in the index at all */
+	pvt_flags_mask = ctx->box->view_pvt == NULL ? 0 :
+		mailbox_get_private_flags_mask(ctx->box);
+
+	/* Only the root level args are ANDed together */
+	for (; args != NULL; args = args->next) {
+		if (args->type != SEARCH_FLAGS)
+			continue;
+
+		flags = args->value.flags & ENUM_NEGATE(MAIL_RECENT);
+		flags &= ENUM_NEGATE(pvt_flags_mask);
+		if (!args->match_not) {
+			ctx->skip_flags |= flags;
+			ctx->skip_flags_mask |= flags;
+		} else if (flags == args->value.flags &&
+			   flags != 0 && (flags & (flags - 1)) == 0) {
+			/* NOT with a single flag */
+			ctx->skip_flags_mask |= flags;
+		}
+	}
+}
+
 static void search_get_seqset(struct index_search_context *ctx,
 			      unsigned int messages_count,
 			      struct mail_search_arg *args)
@@ -1127,7 +1262,9 @@ static void search_get_seqset(struct index_search_context *ctx,
 		/* no matches */
 		ctx->seq1 = 1;
 		ctx->seq2 = 0;
+		return;
 	}
+	search_get_skip_flags(ctx, args);
 }
 
 static int search_build_subthread(struct mail_thread_iterate_context *iter,
@@ -1280,6 +1417,28 @@ wanted_sort_fields_get(struct mailbox *box,
 	}
 }
 
+static void search_init_cache_prefetch(struct index_search_context *ctx)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(ctx->box);
+	struct mailbox_header_lookup_ctx *headers =
+		ctx->mail_ctx.wanted_headers;
+	unsigned int i;
+
+	i_array_init(&ctx->cache_prefetch_fields, 8);
+	for (i = 0; i < N_ELEMENTS(search_cache_prefetch_map); i++) {
+		if ((ctx->mail_ctx.wanted_fields &
+		     search_cache_prefetch_map[i].fetch_field) == 0)
+			continue;
+		array_push_back(&ctx->cache_prefetch_fields,
+			&ibox->cache_fields[search_cache_prefetch_map[i].cache_field].idx);
+	}
+	if (headers != NULL) {
+		array_append(&ctx->cache_prefetch_fields,
+			     headers->idx, headers->count);
+	}
+	ctx->cache_prefetch_seq = ctx->seq1;
+}
+
 struct mail_search_context *
 index_storage_search_init(struct mailbox_transaction_context *t,
 			  struct mail_search_args *args,
@@ -1332,6 +1491,7 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 
 	search_get_seqset(ctx, status.messages, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
+	search_init_cache_prefetch(ctx);
 
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
@@ -1387,6 +1547,8 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 	if (ctx->failed)
 		mail_storage_last_error_pop(ctx->box->storage);
 	array_free(&ctx->mail_ctx.mails);
+	array_free(&ctx->cache_prefetch_fields);
+	buffer_free(&ctx->bloom_buf);
 	i_free(ctx);
 	return ret;
 }
@@ -1408,6 +1570,8 @@ static int search_match_once(struct index_search_context *ctx)
 
 	ret = mail_search_args_foreach(ctx->mail_ctx.args->args,
 				       search_cached_arg, ctx);
+	if (ret < 0)
+		ret = search_arg_match_bloom(ctx->mail_ctx.args->args, ctx);
 	if (ret < 0)
 		ret = search_arg_match_text(ctx->mail_ctx.args->args, ctx);
 	if (ret < 0)
@@ -1649,6 +1813,29 @@ int index_storage_search_next_match_mail(struct mail_search_context *_ctx,
 	return 0;
 }
 
+static void search_cache_prefetch(struct index_search_context *ctx,
+				  uint32_t seq)
+{
+	const unsigned int *fields;
+	unsigned int count;
+	uint32_t seq2;
+
+	if (seq < ctx->cache_prefetch_seq)
+		return;
+
+	/* walk the cache records of the following mails in file order and
+	   decode the wanted fields. the index_mail lookups for these mails
+	   then get the fields from the cache view. */
+	fields = array_get(&ctx->cache_prefetch_fields, &count);
+	if (count == 0)
+		return;
+	seq2 = ctx->seq2 - seq < SEARCH_CACHE_PREFETCH_COUNT ?
+		ctx->seq2 : seq + SEARCH_CACHE_PREFETCH_COUNT - 1;
+	(void)mail_cache_prefetch(ctx->mail_ctx.transaction->cache_view,
+				  seq, seq2, fields, count);
+	ctx->cache_prefetch_seq = seq2 + 1;
+}
+
 static int search_more_with_mail(struct index_search_context *ctx,
 				 struct mail *mail)
 {
@@ -1672,6 +1859,7 @@ static int search_more_with_mail(struct index_search_context *ctx,
 	cost1 = search_get_cost(mail->transaction);
 	ret = -1;
 	while (box->v.search_next_update_seq(_ctx)) {
+		search_cache_prefetch(ctx, _ctx->seq);
 		mail_set_seq(mail, _ctx->seq);
 
 		ret = box->v.search_next_match_mail(_ctx, mail);
@@ -1867,7 +2055,7 @@ bool index_storage_search_next_nonblock(struct mail_search_context *_ctx,
 bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 {
         struct index_search_context *ctx = (struct index_search_context *)_ctx;
-	uint32_t uid;
+	uint32_t uid, seq;
 	int ret;
 
 	if (_ctx->seq == 0) {
@@ -1885,6 +2073,20 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 
 	ret = 0;
 	while (_ctx->seq <= ctx->seq2) {
+		if (ctx->skip_flags_mask != 0) {
+			/* skip quickly over the mails whose flags can't
+			   match. this is much faster than checking the
+			   search args for each mail separately. */
+			mail_index_lookup_first_range(ctx->view,
+				ctx->skip_flags, ctx->skip_flags_mask,
+				_ctx->seq, ctx->seq2, &seq);
+			if (seq == 0) {
+				_ctx->seq = ctx->seq2 + 1;
+				break;
+			}
+			_ctx->seq = seq;
+		}
+
 		/* check if the sequence matches */
 		ret = mail_search_args_foreach(ctx->mail_ctx.args->args,
 					       search_seqset_arg, ctx);
@@ -7,10 +7,15 @@
    gets ID 2^31. If we then add two mails which are sorted before the first
    one, they get IDs 2^31/3 and 2^31/3*2. Once we run out of the available
    space between IDs, more space is made by renumbering some IDs.
+
+   The sort strings of the sort IDs are also written to a sort keys file
+   (see mail-index-sort-keys.h), so that adding sort IDs for new mails
+   doesn't require looking up the existing mails' sort strings.
 */
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "mail-index-sort-keys.h"
 #include "index-storage.h"
 #include "index-sort-private.h"
 
@@ -24,13 +29,23 @@ struct mail_sort_node {
 };
 ARRAY_DEFINE_TYPE(mail_sort_node, struct mail_sort_node);
 
+struct sort_string_ext_hdr {
+	/* The sort keys file's block ID containing the sort strings for
+	   keys_reset_id. */
+	uint32_t keys_file_id;
+	uint32_t keys_reset_id;
+};
+
 struct sort_string_context {
 	struct mail_search_sort_program *program;
 	const char *primary_sort_name;
 
 	ARRAY_TYPE(mail_sort_node) zero_nodes, nonzero_nodes, sorted_nodes;
 	const char **sort_strings;
+	/* sort_strings[seq] was looked up from keys */
+	bool *sort_string_from_keys;
 	pool_t sort_string_pool;
+	struct mail_index_sort_keys *keys;
 	unsigned int first_missing_sort_id_idx;
 
 	uint32_t ext_id, last_seq, highest_reset_id, prev_seq;
@@ -84,7 +99,8 @@ void index_sort_list_init_string(struct mail_search_sort_program *program)
 	ctx->reverse = (program->sort_program[0] & MAIL_SORT_FLAG_REVERSE) != 0;
 	ctx->program = program;
 	ctx->primary_sort_name = name;
-	ctx->ext_id = mail_index_ext_register(program->t->box->index, name, 0,
+	ctx->ext_id = mail_index_ext_register(program->t->box->index, name,
+					      sizeof(struct sort_string_ext_hdr),
 					      sizeof(uint32_t),
 					      sizeof(uint32_t));
 	i_array_init(&ctx->zero_nodes, 128);
@@ -274,6 +290,8 @@ static void index_sort_zeroes(struct sort_string_context *ctx)
 	   memory, it makes error handling easier and probably also helps
 	   CPU caching. */
 	ctx->sort_strings = i_new(const char *, ctx->last_seq + 1);
+	i_free(ctx->sort_string_from_keys);
+	ctx->sort_string_from_keys = i_new(bool, ctx->last_seq + 1);
 	ctx->sort_string_pool = pool =
 		pool_alloconly_create("sort strings", 1024*64);
 	str = str_new(default_pool, 512);
@@ -371,6 +389,15 @@ index_sort_get_string(struct sort_string_context *ctx,
 		return FALSE;
 	}
 
+	if (ctx->sort_strings[seq] == NULL && ctx->keys != NULL &&
+	    node->sort_id != 0 && !node->sort_id_changed) {
+		/* the sort ID hasn't changed since it was read from index */
+		ctx->sort_strings[seq] =
+			mail_index_sort_keys_lookup(ctx->keys, node->sort_id);
+		if (ctx->sort_strings[seq] != NULL)
+			ctx->sort_string_from_keys[seq] = TRUE;
+	}
+
 	if (ctx->sort_strings[seq] == NULL) T_BEGIN {
 		string_t *str;
 		const char *result;
@@ -738,6 +765,130 @@ index_sort_add_sort_ids(struct sort_string_context *ctx, const char **reason_r)
 	return 0;
 }
 
+static void index_sort_open_keys(struct sort_string_context *ctx)
+{
+	struct mailbox *box = ctx->program->t->box;
+	struct sort_string_ext_hdr hdr;
+	const void *data;
+	size_t size;
+
+	if (mail_index_is_in_memory(box->index))
+		return;
+
+	ctx->keys = mail_index_sort_keys_init(box->index,
+		t_strconcat(".", ctx->primary_sort_name, NULL));
+	mail_index_get_header_ext(ctx->program->t->view, ctx->ext_id,
+				  &data, &size);
+	if (size < sizeof(hdr) || ctx->highest_reset_id == 0)
+		return;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.keys_reset_id != ctx->highest_reset_id)
+		return;
+	if (mail_index_sort_keys_read(ctx->keys, ctx->program->t->view,
+				      hdr.keys_file_id) < 0)
+		mailbox_set_index_error(box);
+}
+
+static int
+sort_key_cmp(const struct mail_index_sort_key *k1,
+	     const struct mail_index_sort_key *k2)
+{
+	if (k1->sort_id < k2->sort_id)
+		return -1;
+	if (k1->sort_id > k2->sort_id)
+		return 1;
+	return 0;
+}
+
+static void
+index_sort_get_keys(struct sort_string_context *ctx, uint32_t lowest_failed_seq,
+		    bool only_new, ARRAY_TYPE(mail_index_sort_key) *keys)
+{
+	const struct mail_sort_node *node;
+	struct mail_index_sort_key key, *keyp;
+	unsigned int i, j, count;
+
+	array_foreach(&ctx->sorted_nodes, node) {
+		if (node->no_update)
+			continue;
+		if (node->sort_id_changed && node->seq >= lowest_failed_seq) {
+			/* the new sort ID isn't written */
+			continue;
+		}
+		key.sort_id = node->sort_id;
+		key.str = ctx->sort_strings[node->seq];
+		if (only_new) {
+			/* add only the keys that aren't already in the keys
+			   file */
+			if (key.str == NULL ||
+			    ctx->sort_string_from_keys[node->seq])
+				continue;
+		} else if (key.str == NULL) {
+			if (node->sort_id_changed)
+				continue;
+			key.str = mail_index_sort_keys_lookup(ctx->keys,
+							      node->sort_id);
+			if (key.str == NULL)
+				continue;
+		}
+		array_push_back(keys, &key);
+	}
+
+	/* sort by sort_id and drop duplicates */
+	array_sort(keys, sort_key_cmp);
+	keyp = array_get_modifiable(keys, &count);
+	for (i = j = 1; i < count; i++) {
+		if (keyp[j-1].sort_id != keyp[i].sort_id)
+			keyp[j++] = keyp[i];
+	}
+	if (j < count)
+		array_delete(keys, j, count - j);
+}
+
+static void
+index_sort_write_keys(struct sort_string_context *ctx, uint32_t lowest_failed_seq)
+{
+	struct mailbox *box = ctx->program->t->box;
+	struct mail_index_transaction *itrans = ctx->program->t->itrans;
+	ARRAY_TYPE(mail_index_sort_key) keys;
+	struct sort_string_ext_hdr hdr;
+	const void *data;
+	size_t size;
+	int ret = 0;
+
+	if (ctx->keys == NULL)
+		return;
+
+	i_zero(&hdr);
+	t_array_init(&keys, 128);
+	if (!mail_index_sort_keys_want_rewrite(ctx->keys)) {
+		index_sort_get_keys(ctx, lowest_failed_seq, TRUE, &keys);
+		ret = mail_index_sort_keys_append(ctx->keys, &keys,
+						  &hdr.keys_file_id);
+		array_clear(&keys);
+	}
+	if (ret == 0) {
+		index_sort_get_keys(ctx, lowest_failed_seq, FALSE, &keys);
+		ret = mail_index_sort_keys_rewrite(ctx->keys,
+						   ctx->program->t->view,
+						   &keys, &hdr.keys_file_id) < 0 ?
+			-1 : 1;
+	}
+	if (ret < 0) {
+		mailbox_set_index_error(box);
+		return;
+	}
+
+	/* the sort IDs are valid for the next reset_id */
+	hdr.keys_reset_id = ctx->highest_reset_id + 1;
+	mail_index_get_header_ext(ctx->program->t->view, ctx->ext_id,
+				  &data, &size);
+	if (size < sizeof(hdr))
+		mail_index_ext_resize_hdr(itrans, ctx->ext_id, sizeof(hdr));
+	mail_index_update_header_ext(itrans, ctx->ext_id, 0,
+				     &hdr, sizeof(hdr));
+}
+
 static void index_sort_write_changed_sort_ids(struct sort_string_context *ctx)
 {
 	struct mail_index_transaction *itrans = ctx->program->t->itrans;
@@ -784,6 +935,7 @@ static void index_sort_write_changed_sort_ids(struct sort_string_context *ctx)
 		mail_index_update_ext(itrans, nodes[i].seq, ext_id,
 				      &nodes[i].sort_id, NULL);
 	}
+	index_sort_write_keys(ctx, lowest_failed_seq);
 }
 
 static int sort_node_cmp(const struct mail_sort_node *n1,
@@ -887,6 +1039,7 @@ void index_sort_list_finish_string(struct mail_search_sort_program *program)
 		index_sort_generate_seqs(ctx);
 		/* add messages not in seqs list */
 		index_sort_add_missing(ctx);
+		index_sort_open_keys(ctx);
 		/* sort all messages with sort IDs */
 		array_sort(&ctx->nonzero_nodes, sort_node_cmp);
 		for (;;) {
@@ -929,8 +1082,11 @@ void index_sort_list_finish_string(struct mail_search_sort_program *program)
 				array_push_back(&program->seqs, &seq);
 			}
 		}
+		if (ctx->keys != NULL)
+			mail_index_sort_keys_deinit(&ctx->keys);
 		pool_unref(&ctx->sort_string_pool);
 		i_free(ctx->sort_strings);
+		i_free(ctx->sort_string_from_keys);
 		array_free(&ctx->sorted_nodes);
 		/* NOTE: we already freed nonzero_nodes and made it point to
 		   sorted_nodes. */
@@ -284,6 +284,7 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 			.max_size = set->mail_index_log_rotate_max_size,
 			.min_age_secs = set->mail_index_log_rotate_min_age,
 			.log2_max_age_secs = set->mail_index_log2_max_age,
+			.group_commit = set->mail_index_log_group_commit,
 		},
 		.cache = {
 			.unaccessed_field_drop_secs = set->mail_cache_unaccessed_field_drop,
@@ -293,6 +294,8 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 			.purge_delete_percentage = set->mail_cache_purge_delete_percentage,
 			.purge_continued_percentage = set->mail_cache_purge_continued_percentage,
 			.purge_header_continue_count = set->mail_cache_purge_header_continue_count,
+			.purge_incremental_min_size = set->mail_cache_purge_incremental_min_size,
+			.purge_incremental_step_size = set->mail_cache_purge_incremental_step_size,
 		},
 	};
 	mail_index_set_optimization_settings(box->index, &optimization_set);
@@ -953,6 +956,22 @@ bool index_storage_is_inconsistent(struct mailbox *box)
 		mail_index_view_is_inconsistent(box->view);
 }
 
+struct istream *
+index_storage_create_file_istream(struct mail_storage *storage, int *fd,
+				  size_t max_buffer_size)
+{
+	struct istream *input;
+
+	if (!storage->set->mail_read_async)
+		return i_stream_create_fd_autoclose(fd, max_buffer_size);
+
+	input = i_stream_create_fd_async_autoclose(fd, max_buffer_size);
+	/* the mail parsing code expects blocking streams. FETCH switches the
+	   stream to non-blocking mode while it's sending the mail. */
+	i_stream_set_blocking(input, TRUE);
+	return input;
+}
+
 void index_save_context_free(struct mail_save_context *ctx)
 {
 	index_mail_save_finish(ctx);
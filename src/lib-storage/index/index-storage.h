@@ -88,6 +88,12 @@ int index_mailbox_fix_inconsistent_existence(struct mailbox *box,
 bool index_storage_is_readonly(struct mailbox *box);
 bool index_storage_is_inconsistent(struct mailbox *box);
 
+/* Create an istream for reading a mail file. With mail_read_async=yes the
+   file is read ahead asynchronously. The returned stream is blocking. */
+struct istream *
+index_storage_create_file_istream(struct mail_storage *storage, int *fd,
+				  size_t max_buffer_size);
+
 enum mail_index_sync_flags index_storage_get_sync_flags(struct mailbox *box);
 bool index_mailbox_want_full_sync(struct mailbox *box,
 				  enum mailbox_sync_flags flags);
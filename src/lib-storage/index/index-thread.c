@@ -5,7 +5,6 @@
 #include "lib.h"
 #include "array.h"
 #include "bsearch-insert-pos.h"
-#include "hash2.h"
 #include "message-id.h"
 #include "mail-search.h"
 #include "mail-search-build.h"
@@ -42,7 +41,6 @@ struct mail_thread_mailbox {
 	struct mail_index_strmap_view *strmap_view;
 	/* sorted by UID, ref_index */
 	const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map;
-	const struct hash2_table *msgid_hash;
 
 	/* set only temporarily while needed */
 	struct mail_thread_context *ctx;
@@ -315,8 +313,7 @@ static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 						    mail_thread_hash_key_cmp,
 						    mail_thread_hash_rec_cmp,
 						    mail_thread_strmap_remap,
-						    tbox, &tbox->msgid_map,
-						    &tbox->msgid_hash);
+						    tbox, &tbox->msgid_map);
 	}
 
 	headers_ctx = mailbox_header_lookup_init(ctx->box, wanted_headers);
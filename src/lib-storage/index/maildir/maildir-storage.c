@@ -11,6 +11,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-keywords.h"
 #include "maildir-sync.h"
+#include "maildir-sync-journal.h"
 #include "index-mail.h"
 
 #include <sys/stat.h>
@@ -317,6 +318,10 @@ static int maildir_mailbox_open_existing(struct mailbox *box)
 	mbox->maildir_ext_id =
 		mail_index_ext_register(mbox->box.index, "maildir",
 					sizeof(mbox->maildir_hdr), 0, 0);
+	if (mbox->storage->set->maildir_sync_inotify) {
+		mbox->sync_journal = maildir_sync_journal_init(
+			t_strconcat(mailbox_get_path(box), "/cur", NULL));
+	}
 	return 0;
 }
 
@@ -580,6 +585,8 @@ static void maildir_mailbox_close(struct mailbox *box)
 
 	if (mbox->flags_view != NULL)
 		mail_index_view_close(&mbox->flags_view);
+	if (mbox->sync_journal != NULL)
+		maildir_sync_journal_deinit(&mbox->sync_journal);
 	if (mbox->keywords != NULL)
 		maildir_keywords_deinit(&mbox->keywords);
 	if (mbox->uidlist != NULL)
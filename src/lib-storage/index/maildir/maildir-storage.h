@@ -48,6 +48,7 @@
 struct timeval;
 struct maildir_save_context;
 struct maildir_copy_context;
+struct maildir_sync_journal;
 
 struct maildir_index_header {
 	uint32_t new_check_time, new_mtime, new_mtime_nsecs;
@@ -79,6 +80,8 @@ struct maildir_mailbox {
 	/* maildir sync: */
 	struct maildir_uidlist *uidlist;
 	struct maildir_keywords *keywords;
+	/* changes to cur/ since it was last fully scanned */
+	struct maildir_sync_journal *sync_journal;
 
 	struct maildir_index_header maildir_hdr;
 	uint32_t maildir_ext_id;
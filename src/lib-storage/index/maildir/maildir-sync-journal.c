@@ -0,0 +1,339 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "llist.h"
+#include "maildir-filename.h"
+#include "maildir-sync-journal.h"
+
+#ifdef IOLOOP_NOTIFY_INOTIFY
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define MAILDIR_SYNC_JOURNAL_BUFLEN (32*1024)
+/* Don't grow the journal forever if it's not being synced. The directory
+   is fully scanned instead. */
+#define MAILDIR_SYNC_JOURNAL_MAX_CHANGES 100000
+
+#define MAILDIR_SYNC_JOURNAL_WATCH_MASK \
+	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct maildir_sync_journal {
+	struct maildir_sync_journal *prev, *next;
+
+	char *dir;
+	int wd;
+
+	pool_t pool;
+	ARRAY_TYPE(maildir_sync_journal_change) changes;
+	/* base filename => index in changes + 1 */
+	HASH_TABLE(const char *, void *) files;
+
+	bool valid:1;
+};
+
+/* All the journals in this process share the same inotify instance, since
+   the number of instances per user is small. The same directory gets the
+   same watch descriptor, so there may be multiple journals with the same
+   wd. */
+static int journal_inotify_fd = -1;
+static struct maildir_sync_journal *journals = NULL;
+
+static bool maildir_sync_journal_inotify_init(void)
+{
+	journal_inotify_fd = inotify_init();
+	if (journal_inotify_fd == -1) {
+		if (errno != EMFILE)
+			i_error("inotify_init() failed: %m");
+		else {
+			i_warning("Inotify instance limit for user exceeded, "
+				  "not journaling maildir changes. Increase "
+				  "/proc/sys/fs/inotify/max_user_instances");
+		}
+		return FALSE;
+	}
+	fd_close_on_exec(journal_inotify_fd, TRUE);
+	fd_set_nonblock(journal_inotify_fd, TRUE);
+	return TRUE;
+}
+
+static bool maildir_sync_journal_add_watch(struct maildir_sync_journal *journal)
+{
+	journal->wd = inotify_add_watch(journal_inotify_fd, journal->dir,
+					MAILDIR_SYNC_JOURNAL_WATCH_MASK);
+	if (journal->wd != -1)
+		return TRUE;
+
+	if (errno == ENOSPC) {
+		i_warning("Inotify watch limit for user exceeded, "
+			  "not journaling maildir changes. Increase "
+			  "/proc/sys/fs/inotify/max_user_watches");
+	} else if (errno != ENOENT && errno != ESTALE) {
+		i_error("inotify_add_watch(%s) failed: %m", journal->dir);
+	}
+	return FALSE;
+}
+
+static bool maildir_sync_journal_wd_is_used(int wd)
+{
+	struct maildir_sync_journal *journal;
+
+	for (journal = journals; journal != NULL; journal = journal->next) {
+		if (journal->wd == wd)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+struct maildir_sync_journal *maildir_sync_journal_init(const char *dir)
+{
+	struct maildir_sync_journal *journal;
+
+	if (journal_inotify_fd == -1 && !maildir_sync_journal_inotify_init())
+		return NULL;
+
+	journal = i_new(struct maildir_sync_journal, 1);
+	journal->dir = i_strdup(dir);
+	journal->wd = -1;
+	journal->pool = pool_alloconly_create(MEMPOOL_GROWING
+					      "maildir sync journal", 1024);
+	i_array_init(&journal->changes, 64);
+	hash_table_create(&journal->files, default_pool, 0,
+			  maildir_filename_base_hash,
+			  maildir_filename_base_cmp);
+	DLLIST_PREPEND(&journals, journal);
+
+	if (!maildir_sync_journal_add_watch(journal)) {
+		maildir_sync_journal_deinit(&journal);
+		return NULL;
+	}
+	return journal;
+}
+
+void maildir_sync_journal_deinit(struct maildir_sync_journal **_journal)
+{
+	struct maildir_sync_journal *journal = *_journal;
+
+	*_journal = NULL;
+
+	DLLIST_REMOVE(&journals, journal);
+	if (journal->wd != -1 && !maildir_sync_journal_wd_is_used(journal->wd)) {
+		/* EINVAL = the watch was already removed by the kernel */
+		if (inotify_rm_watch(journal_inotify_fd, journal->wd) < 0 &&
+		    errno != EINVAL)
+			i_error("inotify_rm_watch(%s) failed: %m", journal->dir);
+	}
+	if (journals == NULL)
+		i_close_fd(&journal_inotify_fd);
+
+	hash_table_destroy(&journal->files);
+	array_free(&journal->changes);
+	pool_unref(&journal->pool);
+	i_free(journal->dir);
+	i_free(journal);
+}
+
+void maildir_sync_journal_clear(struct maildir_sync_journal *journal)
+{
+	hash_table_clear(journal->files, FALSE);
+	array_clear(&journal->changes);
+	p_clear(journal->pool);
+}
+
+void maildir_sync_journal_invalidate(struct maildir_sync_journal *journal)
+{
+	journal->valid = FALSE;
+	maildir_sync_journal_clear(journal);
+}
+
+static void
+maildir_sync_journal_add(struct maildir_sync_journal *journal,
+			 const char *filename, bool exists)
+{
+	struct maildir_sync_journal_change *change;
+	void *value;
+	unsigned int idx;
+
+	if (filename[0] == '.')
+		return;
+
+	value = hash_table_lookup(journal->files, filename);
+	if (value != NULL) {
+		idx = POINTER_CAST_TO(value, unsigned int) - 1;
+		change = array_idx_modifiable(&journal->changes, idx);
+	} else {
+		if (array_count(&journal->changes) >=
+		    MAILDIR_SYNC_JOURNAL_MAX_CHANGES) {
+			maildir_sync_journal_invalidate(journal);
+			return;
+		}
+		change = array_append_space(&journal->changes);
+		idx = array_count(&journal->changes);
+		change->filename = p_strdup(journal->pool, filename);
+		hash_table_insert(journal->files, change->filename,
+				  POINTER_CAST(idx));
+	}
+	if (exists && strcmp(change->filename, filename) != 0)
+		change->filename = p_strdup(journal->pool, filename);
+	change->exists = exists;
+}
+
+static void
+maildir_sync_journal_handle(struct maildir_sync_journal *journal,
+			    const struct inotify_event *event)
+{
+	if ((event->mask & (IN_IGNORED | IN_DELETE_SELF |
+			    IN_MOVE_SELF | IN_UNMOUNT)) != 0) {
+		/* the directory itself is gone */
+		if ((event->mask & IN_IGNORED) != 0)
+			journal->wd = -1;
+		maildir_sync_journal_invalidate(journal);
+		return;
+	}
+	if (!journal->valid || event->len == 0 ||
+	    (event->mask & IN_ISDIR) != 0)
+		return;
+
+	if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+		maildir_sync_journal_add(journal, event->name, TRUE);
+	else if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0)
+		maildir_sync_journal_add(journal, event->name, FALSE);
+}
+
+static void maildir_sync_journal_invalidate_all(void)
+{
+	struct maildir_sync_journal *journal;
+
+	for (journal = journals; journal != NULL; journal = journal->next)
+		maildir_sync_journal_invalidate(journal);
+}
+
+static void maildir_sync_journal_dispatch(const struct inotify_event *event)
+{
+	struct maildir_sync_journal *journal, *next;
+
+	if ((event->mask & IN_Q_OVERFLOW) != 0) {
+		/* lost some events - we don't know for which directories */
+		maildir_sync_journal_invalidate_all();
+		return;
+	}
+	for (journal = journals; journal != NULL; journal = next) {
+		next = journal->next;
+		if (journal->wd == event->wd)
+			maildir_sync_journal_handle(journal, event);
+	}
+}
+
+static void maildir_sync_journal_read(void)
+{
+	const struct inotify_event *event;
+	unsigned char event_buf[MAILDIR_SYNC_JOURNAL_BUFLEN];
+	ssize_t ret, pos;
+
+	/* this reads the events for all the journals */
+	for (;;) {
+		/* the kernel returns only full events */
+		ret = read(journal_inotify_fd, event_buf, sizeof(event_buf));
+		if (ret <= 0) {
+			if (ret < 0 && errno != EAGAIN) {
+				i_error("read(inotify) failed: %m");
+				maildir_sync_journal_invalidate_all();
+			}
+			break;
+		}
+
+		for (pos = 0; pos < ret; ) {
+			if ((size_t)(ret - pos) < sizeof(*event))
+				break;
+			event = (const void *)(event_buf + pos);
+			pos += sizeof(*event) + event->len;
+			maildir_sync_journal_dispatch(event);
+		}
+		if (pos != ret)
+			i_error("read(inotify) returned partial event");
+	}
+}
+
+void maildir_sync_journal_reset(struct maildir_sync_journal *journal)
+{
+	/* drop the old events - the following scan sees their results */
+	journal->valid = FALSE;
+	maildir_sync_journal_read();
+	maildir_sync_journal_clear(journal);
+
+	if (journal->wd == -1 && !maildir_sync_journal_add_watch(journal))
+		return;
+	journal->valid = TRUE;
+}
+
+void maildir_sync_journal_set_synced(struct maildir_sync_journal *journal)
+{
+	/* The events that are still unread happened after the watch was
+	   added. Applying the ones that are already visible in the directory
+	   again is harmless, so keep them all. If the watch is gone, the
+	   changes after it was removed are unknown. */
+	if (journal->wd != -1)
+		journal->valid = TRUE;
+}
+
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal)
+{
+	if (journal->valid)
+		maildir_sync_journal_read();
+	return journal->valid;
+}
+
+const ARRAY_TYPE(maildir_sync_journal_change) *
+maildir_sync_journal_get_changes(struct maildir_sync_journal *journal)
+{
+	return &journal->changes;
+}
+
+#else
+
+struct maildir_sync_journal *
+maildir_sync_journal_init(const char *dir ATTR_UNUSED)
+{
+	return NULL;
+}
+
+void maildir_sync_journal_deinit(struct maildir_sync_journal **journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_reset(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_set_synced(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_invalidate(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+const ARRAY_TYPE(maildir_sync_journal_change) *
+maildir_sync_journal_get_changes(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_clear(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef MAILDIR_SYNC_JOURNAL_H
+#define MAILDIR_SYNC_JOURNAL_H
+
+/* Sync journal records the filenames added to and removed from a maildir
+   directory (cur/) using inotify. This allows syncing only the changed
+   files instead of readdir()ing the whole directory.
+
+   The journal becomes usable once the directory has been fully scanned after
+   maildir_sync_journal_reset(), or once the directory is known to be
+   unchanged since the previous full scan. It's invalidated if the kernel's
+   event queue overflows, in which case the directory needs to be fully
+   scanned again. All the journals in the process share a single inotify
+   instance. */
+
+struct maildir_sync_journal_change {
+	/* The latest filename seen for the base filename */
+	const char *filename;
+	/* TRUE if the file exists, FALSE if it was removed */
+	bool exists;
+};
+ARRAY_DEFINE_TYPE(maildir_sync_journal_change,
+		  struct maildir_sync_journal_change);
+
+/* Returns NULL if journaling isn't supported or it couldn't be started. */
+struct maildir_sync_journal *maildir_sync_journal_init(const char *dir);
+void maildir_sync_journal_deinit(struct maildir_sync_journal **journal);
+
+/* Forget all the changes and start journaling from scratch. This must be
+   called right before the directory is fully scanned. */
+void maildir_sync_journal_reset(struct maildir_sync_journal *journal);
+/* The directory was found to be unchanged since it was last fully scanned
+   (possibly by another process). Start using the journal without scanning
+   the directory. The check must have been done after the journal was
+   initialized. */
+void maildir_sync_journal_set_synced(struct maildir_sync_journal *journal);
+/* Mark the journal unusable until the next reset. */
+void maildir_sync_journal_invalidate(struct maildir_sync_journal *journal);
+
+/* Read the pending changes. Returns TRUE if the journal contains all the
+   changes since the last reset, FALSE if the directory must be fully
+   scanned. */
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal);
+/* Returns the changes since the last reset or clear. There is only a single
+   change for each base filename. */
+const ARRAY_TYPE(maildir_sync_journal_change) *
+maildir_sync_journal_get_changes(struct maildir_sync_journal *journal);
+/* Forget the changes after they have been applied. */
+void maildir_sync_journal_clear(struct maildir_sync_journal *journal);
+
+#endif
@@ -182,6 +182,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
 #include "maildir-sync.h"
+#include "maildir-sync-journal.h"
 
 #include <stdio.h>
 #include <stddef.h>
@@ -229,6 +230,8 @@ struct maildir_sync_context {
 	bool partial:1;
 	bool locked:1;
 	bool racing:1;
+	/* cur/ changes are read from the sync journal */
+	bool journal:1;
 };
 
 void maildir_sync_set_racing(struct maildir_sync_context *ctx)
@@ -592,6 +595,88 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		(move_count <= MAILDIR_RENAME_RESCAN_COUNT || final ? 0 : 1);
 }
 
+static int maildir_sync_cur_journal(struct maildir_sync_context *ctx)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+	const ARRAY_TYPE(maildir_sync_journal_change) *changes;
+	const struct maildir_sync_journal_change *change;
+	enum maildir_uidlist_rec_flag flags;
+	struct stat st;
+	unsigned int count = 0;
+	uint32_t uid;
+	bool rescan = FALSE;
+	int ret;
+
+	/* stat() before reading the journal, so that the following changes
+	   will change the mtime */
+	if (maildir_stat(mbox, ctx->cur_dir, &st) < 0)
+		return -1;
+	if (!maildir_sync_journal_refresh(mbox->sync_journal)) {
+		/* lost some changes. add the new files now, but the expunged
+		   ones are noticed only by the full scan in the next sync. */
+		ret = maildir_scan_dir(ctx, FALSE, TRUE, WHY_CURCHANGED);
+		mbox->maildir_hdr.cur_mtime = 0;
+		return ret;
+	}
+	mbox->maildir_hdr.cur_check_time = time(NULL);
+	mbox->maildir_hdr.cur_mtime = st.st_mtime;
+	mbox->maildir_hdr.cur_mtime_nsecs = ST_MTIME_NSEC(st);
+
+	/* add the new files before removing the old ones, so the removed
+	   records are always before the newly added ones */
+	changes = maildir_sync_journal_get_changes(mbox->sync_journal);
+	array_foreach(changes, change) {
+		if (!change->exists)
+			continue;
+		if (change->filename[0] == MAILDIR_INFO_SEP) {
+			/* empty base filename - let the full scan fix it */
+			rescan = TRUE;
+			continue;
+		}
+
+		/* files that didn't exist in uidlist are recent, the same as
+		   when scanning the whole directory */
+		flags = maildir_uidlist_get_uid(mbox->uidlist,
+						change->filename, &uid) ? 0 :
+			MAILDIR_UIDLIST_REC_FLAG_RECENT;
+		if (maildir_uidlist_sync_next(ctx->uidlist_sync_ctx,
+					      change->filename, flags) < 0)
+			return -1;
+		if ((++count % MAILDIR_SLOW_CHECK_COUNT) == 0)
+			maildir_sync_notify(ctx);
+	}
+	array_foreach(changes, change) {
+		if (!change->exists &&
+		    maildir_uidlist_get_uid(mbox->uidlist, change->filename,
+					    &uid) && uid != (uint32_t)-1) {
+			maildir_uidlist_sync_remove(ctx->uidlist_sync_ctx,
+						    change->filename);
+		}
+	}
+
+	if (!rescan)
+		maildir_sync_journal_clear(mbox->sync_journal);
+	else {
+		maildir_sync_journal_invalidate(mbox->sync_journal);
+		mbox->maildir_hdr.cur_mtime = 0;
+	}
+	return 0;
+}
+
+static void
+maildir_sync_journal_set_synced_if_clean(struct maildir_mailbox *mbox)
+{
+	const struct maildir_index_header *hdr = &mbox->maildir_hdr;
+
+	/* cur/ mtime matches the last sync, so the uidlist already contains
+	   everything in it. This avoids scanning the directory after the
+	   mailbox is opened. The mtime isn't reliable if cur/ was changed
+	   within MAILDIR_SYNC_SECS of the check. */
+	if (mbox->sync_journal != NULL &&
+	    hdr->cur_check_time > hdr->cur_mtime + MAILDIR_SYNC_SECS)
+		maildir_sync_journal_set_synced(mbox->sync_journal);
+}
+
 static void maildir_sync_get_header(struct maildir_mailbox *mbox)
 {
 	const void *data;
@@ -809,6 +894,8 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 	} else {
 		ret = maildir_sync_get_changes(ctx, &new_changed, &cur_changed,
 					       &why);
+		if (ret >= 0 && !cur_changed)
+			maildir_sync_journal_set_synced_if_clean(ctx->mbox);
 		if (ret <= 0)
 			return ret;
 	}
@@ -868,6 +955,14 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 			sync_flags |= MAILDIR_UIDLIST_SYNC_FORCE;
 		if ((ctx->flags & MAILBOX_SYNC_FLAG_FAST) != 0)
 			sync_flags |= MAILDIR_UIDLIST_SYNC_TRYLOCK;
+		if (!forced && ctx->mbox->sync_journal != NULL &&
+		    maildir_sync_journal_refresh(ctx->mbox->sync_journal)) {
+			/* cur/ hasn't been changed since the last full scan
+			   except for the journaled changes. update only
+			   them on top of the existing uidlist. */
+			ctx->journal = TRUE;
+			sync_flags |= MAILDIR_UIDLIST_SYNC_PARTIAL;
+		}
 	}
 	ret = maildir_uidlist_sync_init(ctx->mbox->uidlist, sync_flags,
 					&ctx->uidlist_sync_ctx);
@@ -903,8 +998,11 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		}
 	}
 	ctx->locked = maildir_uidlist_is_locked(ctx->mbox->uidlist);
-	if (!ctx->locked)
+	if (!ctx->locked) {
 		ctx->partial = TRUE;
+		/* files can't be removed from uidlist without locking */
+		ctx->journal = FALSE;
+	}
 
 	if (!ctx->mbox->syncing_commit && (ctx->locked || lock_failure)) {
 		if (maildir_sync_index_begin(ctx->mbox, ctx,
@@ -928,7 +1026,12 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		if (ret < 0)
 			return -1;
 
-		if (cur_changed) {
+		if (cur_changed && ctx->journal) {
+			if (maildir_sync_cur_journal(ctx) < 0)
+				return -1;
+		} else if (cur_changed) {
+			if (!ctx->partial && ctx->mbox->sync_journal != NULL)
+				maildir_sync_journal_reset(ctx->mbox->sync_journal);
 			if (maildir_scan_dir(ctx, FALSE, TRUE, why) < 0)
 				return -1;
 		}
@@ -1036,6 +1139,11 @@ static int maildir_sync_run(struct maildir_mailbox *mbox,
 		ret = maildir_sync_context(ctx, TRUE, NULL, &lost_files);
 		maildir_sync_deinit(ctx);
 	} T_END;
+
+	if (ret < 0 && mbox->sync_journal != NULL) {
+		/* the journaled changes may not have been applied */
+		maildir_sync_journal_invalidate(mbox->sync_journal);
+	}
 	return ret;
 }
 
@@ -22,6 +22,23 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Version 4 format is a binary format written when maildir_uidlist_binary
+   setting is enabled. Older Dovecot versions can't read it. The file begins
+   with struct maildir_uidlist_bin_header, followed by the header extensions
+   in the same format as in version 3 header. It's followed by blocks of
+   records, each of which begins with struct maildir_uidlist_bin_block:
+
+   block: <block header> <record> [<record> ...] <heap>
+
+   Records have a fixed width and they point to the base filename and the
+   extensions stored in the block's heap. The extensions are in the same
+   <key><value>\0[<key><value>\0 ...]\0 format as used in memory, so the
+   file can be mmap()ed and used without parsing. New records are appended
+   as a new block, and the file is recreated with a single block whenever
+   the text format would be recreated. All numbers are in host byte order.
 */
 
 #include "lib.h"
@@ -30,9 +47,11 @@
 #include "istream.h"
 #include "ostream.h"
 #include "str.h"
+#include "mmap-util.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
 #include "eacces-error.h"
+#include "read-full.h"
 #include "maildir-storage.h"
 #include "maildir-filename.h"
 #include "maildir-uidlist.h"
@@ -45,11 +64,62 @@
 #define UIDLIST_ESTALE_RETRY_COUNT NFS_ESTALE_RETRY_COUNT
 
 #define UIDLIST_VERSION 3
+#define UIDLIST_VERSION_BINARY 4
 #define UIDLIST_COMPRESS_PERCENTAGE 75
 
+#define UIDLIST_BINARY_MAGIC "\0DUL"
+#define UIDLIST_BINARY_MAGIC_SIZE 4
+#define UIDLIST_BINARY_MAJOR_VERSION 1
+#define UIDLIST_BINARY_MINOR_VERSION 0
+#define UIDLIST_BINARY_NO_EXTENSIONS ((uint32_t)-1)
+
+#ifdef WORDS_BIGENDIAN
+#  define UIDLIST_BINARY_COMPAT_FLAGS 0
+#else
+#  define UIDLIST_BINARY_COMPAT_FLAGS UIDLIST_BINARY_COMPAT_LITTLE_ENDIAN
+#endif
+
 #define UIDLIST_IS_LOCKED(uidlist) \
 	((uidlist)->lock_count > 0)
 
+enum maildir_uidlist_bin_compat_flags {
+	UIDLIST_BINARY_COMPAT_LITTLE_ENDIAN	= 0x01
+};
+
+struct maildir_uidlist_bin_header {
+	uint8_t magic[UIDLIST_BINARY_MAGIC_SIZE];
+	uint8_t major_version;
+	uint8_t minor_version;
+	uint8_t compat_flags; /* enum maildir_uidlist_bin_compat_flags */
+	uint8_t unused;
+
+	/* size of this header and the following header extensions, aligned
+	   to 32 bits */
+	uint32_t header_size;
+	uint32_t uid_validity;
+	uint32_t next_uid;
+	guid_128_t mailbox_guid;
+	/* followed by \0-terminated header extensions */
+};
+
+struct maildir_uidlist_bin_block {
+	uint32_t records_count;
+	/* size of the heap following the records, aligned to 32 bits */
+	uint32_t heap_size;
+};
+
+struct maildir_uidlist_bin_record {
+	uint32_t uid;
+	/* offsets relative to the beginning of the block's heap */
+	uint32_t filename_offset;
+	uint32_t ext_offset; /* UIDLIST_BINARY_NO_EXTENSIONS if none */
+};
+
+struct maildir_uidlist_map {
+	void *data;
+	size_t size;
+};
+
 struct maildir_uidlist_rec {
 	uint32_t uid;
 	uint32_t flags;
@@ -80,6 +150,9 @@ struct maildir_uidlist {
 	ARRAY_TYPE(maildir_uidlist_rec_p) records;
 	HASH_TABLE_TYPE(path_to_maildir_uidlist_rec) files;
 	unsigned int change_counter;
+	/* mmap()ed parts of binary uidlist files. The records in record_pool
+	   may point to them, so they're kept as long as record_pool. */
+	ARRAY(struct maildir_uidlist_map) maps;
 
 	unsigned int version;
 	unsigned int uid_validity, next_uid, prev_read_uid, last_seen_uid;
@@ -99,6 +172,8 @@ struct maildir_uidlist {
 	bool unsorted:1;
 	bool have_mailbox_guid:1;
 	bool opened_readonly:1;
+	/* write version 4 binary format */
+	bool binary:1;
 };
 
 struct maildir_uidlist_sync_ctx {
@@ -275,6 +350,7 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 			  maildir_filename_base_cmp);
 	uidlist->next_uid = 1;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
+	uidlist->binary = mbox->storage->set->maildir_uidlist_binary;
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
 	uidlist->dotlock_settings.use_excl_lock =
@@ -317,6 +393,29 @@ static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
 	array_clear(&uidlist->records);
 }
 
+static unsigned int
+maildir_uidlist_get_wanted_version(struct maildir_uidlist *uidlist)
+{
+	return uidlist->binary ? UIDLIST_VERSION_BINARY : UIDLIST_VERSION;
+}
+
+static void maildir_uidlist_record_pool_unref(struct maildir_uidlist *uidlist)
+{
+	struct maildir_uidlist_map *map;
+
+	pool_unref(&uidlist->record_pool);
+	if (!array_is_created(&uidlist->maps))
+		return;
+
+	array_foreach_modifiable(&uidlist->maps, map) {
+		if (munmap(map->data, map->size) < 0) {
+			mailbox_set_critical(uidlist->box,
+				"munmap(%s) failed: %m", uidlist->path);
+		}
+	}
+	array_clear(&uidlist->maps);
+}
+
 void maildir_uidlist_deinit(struct maildir_uidlist **_uidlist)
 {
 	struct maildir_uidlist *uidlist = *_uidlist;
@@ -328,7 +427,9 @@ void maildir_uidlist_deinit(struct maildir_uidlist **_uidlist)
 	maildir_uidlist_close(uidlist);
 
 	hash_table_destroy(&uidlist->files);
-	pool_unref(&uidlist->record_pool);
+	maildir_uidlist_record_pool_unref(uidlist);
+	if (array_is_created(&uidlist->maps))
+		array_free(&uidlist->maps);
 
 	array_free(&uidlist->records);
 	str_free(&uidlist->hdr_extensions);
@@ -369,7 +470,8 @@ static void maildir_uidlist_update_hdr(struct maildir_uidlist *uidlist,
 {
 	struct maildir_index_header *mhdr = uidlist->mhdr;
 
-	if (mhdr->uidlist_mtime == 0 && uidlist->version != UIDLIST_VERSION) {
+	if (mhdr->uidlist_mtime == 0 &&
+	    uidlist->version != maildir_uidlist_get_wanted_version(uidlist)) {
 		/* upgrading from older version. don't update the
 		   uidlist times until it uses the new format */
 		uidlist->recreate = TRUE;
@@ -444,41 +546,25 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
-static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
-				 const char *line)
+static int maildir_uidlist_next_check_uid(struct maildir_uidlist *uidlist,
+					  uint32_t uid)
 {
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
-	uint32_t uid;
-
-	uid = 0;
-	while (*line >= '0' && *line <= '9') {
-		uid = uid*10 + (*line - '0');
-		line++;
-	}
-
-	if (uid == 0 || *line != ' ') {
-		/* invalid file */
-		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
-					      line);
-		return FALSE;
-	}
 	if (uid <= uidlist->prev_read_uid) {
 		maildir_uidlist_set_corrupted(uidlist, 
 					      "UIDs not ordered (%u >= %u)",
 					      uid, uidlist->prev_read_uid);
-		return FALSE;
+		return -1;
 	}
 	if (uid >= (uint32_t)-1) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UID too high (%u)", uid);
-		return FALSE;
+		return -1;
 	}
 	uidlist->prev_read_uid = uid;
 
 	if (uid <= uidlist->last_seen_uid) {
 		/* we already have this */
-		return TRUE;
+		return 0;
 	}
         uidlist->last_seen_uid = uid;
 
@@ -486,41 +572,28 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		maildir_uidlist_set_corrupted(uidlist, 
 			"UID larger than next_uid (%u >= %u)",
 			uid, uidlist->next_uid);
-		return FALSE;
+		return -1;
 	}
+	return 1;
+}
 
-	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
-	rec->uid = uid;
-	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
-
-	while (*line == ' ') line++;
-
-	if (uidlist->version == UIDLIST_VERSION) {
-		/* read extended fields */
-		bool ret;
-
-		T_BEGIN {
-			ret = maildir_uidlist_read_extended(uidlist, &line,
-							    rec);
-		} T_END;
-		if (!ret) {
-			maildir_uidlist_set_corrupted(uidlist, 
-				"Invalid extended fields: %s", line);
-			return FALSE;
-		}
-	}
+static bool maildir_uidlist_next_add(struct maildir_uidlist *uidlist,
+				     struct maildir_uidlist_rec *rec)
+{
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
 
-	if (strchr(line, '/') != NULL) {
+	if (strchr(rec->filename, '/') != NULL) {
 		maildir_uidlist_set_corrupted(uidlist, 
 			"%s: Broken filename at line %u: %s",
-			uidlist->path, uidlist->read_line_count, line);
+			uidlist->path, uidlist->read_line_count, rec->filename);
 		return FALSE;
 	}
 
-	old_rec = hash_table_lookup(uidlist->files, line);
+	old_rec = hash_table_lookup(uidlist->files, rec->filename);
 	if (old_rec == NULL) {
 		/* no conflicts */
-	} else if (old_rec->uid == uid) {
+	} else if (old_rec->uid == rec->uid) {
 		/* most likely this is a record we saved ourself, but couldn't
 		   update last_seen_uid because uidlist wasn't refreshed while
 		   it was locked.
@@ -541,8 +614,9 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		   was appended to uidlist. */
 		i_warning("%s: Duplicate file entry at line %u: "
 			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
-			  old_rec->uid, uid, uidlist->retry_rewind ?
+			  uidlist->path, uidlist->read_line_count,
+			  rec->filename, old_rec->uid, rec->uid,
+			  uidlist->retry_rewind ?
 			  " - retrying by re-reading from beginning" : "");
 		if (uidlist->retry_rewind)
 			return FALSE;
@@ -555,18 +629,64 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 	}
 
 	recs = array_get(&uidlist->records, &count);
-	if (count > 0 && recs[count-1]->uid > uid) {
+	if (count > 0 && recs[count-1]->uid > rec->uid) {
 		/* we most likely have some records in the array that we saved
 		   ourself without refreshing uidlist */
 		uidlist->unsorted = TRUE;
 	}
 
-	rec->filename = p_strdup(uidlist->record_pool, line);
 	hash_table_update(uidlist->files, rec->filename, rec);
 	array_push_back(&uidlist->records, &rec);
 	return TRUE;
 }
 
+static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
+				 const char *line)
+{
+	struct maildir_uidlist_rec *rec;
+	uint32_t uid;
+	int uid_ret;
+
+	uid = 0;
+	while (*line >= '0' && *line <= '9') {
+		uid = uid*10 + (*line - '0');
+		line++;
+	}
+
+	if (uid == 0 || *line != ' ') {
+		/* invalid file */
+		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
+					      line);
+		return FALSE;
+	}
+	if ((uid_ret = maildir_uidlist_next_check_uid(uidlist, uid)) <= 0)
+		return uid_ret == 0;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+	while (*line == ' ') line++;
+
+	if (uidlist->version == UIDLIST_VERSION) {
+		/* read extended fields */
+		bool ret;
+
+		T_BEGIN {
+			ret = maildir_uidlist_read_extended(uidlist, &line,
+							    rec);
+		} T_END;
+		if (!ret) {
+			maildir_uidlist_set_corrupted(uidlist, 
+				"Invalid extended fields: %s", line);
+			return FALSE;
+		}
+	}
+
+	rec->filename = p_strdup(uidlist->record_pool, line);
+	return maildir_uidlist_next_add(uidlist, rec);
+}
+
 static int
 maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 			       const char *line,
@@ -621,6 +741,31 @@ maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 	return 0;
 }
 
+static int
+maildir_uidlist_read_header_finish(struct maildir_uidlist *uidlist,
+				   uint32_t uid_validity, uint32_t next_uid)
+{
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	return 1;
+}
+
 static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 				       struct istream *input)
 {
@@ -666,26 +811,62 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 					      uidlist->version);
 		return 0;
 	}
+	return maildir_uidlist_read_header_finish(uidlist, uid_validity,
+						  next_uid);
+}
 
-	if (uid_validity == 0 || next_uid == 0) {
+static int
+maildir_uidlist_read_binary_header(struct maildir_uidlist *uidlist,
+				   const unsigned char *data, size_t size,
+				   size_t *header_size_r)
+{
+	const struct maildir_uidlist_bin_header *hdr = (const void *)data;
+	const char *hdr_ext;
+
+	uidlist->read_line_count = 1;
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, UIDLIST_BINARY_MAGIC,
+		   UIDLIST_BINARY_MAGIC_SIZE) != 0) {
 		maildir_uidlist_set_corrupted(uidlist,
-			"Broken header (uidvalidity = %u, next_uid=%u)",
-			uid_validity, next_uid);
+			"Corrupted header (invalid binary header)");
 		return 0;
 	}
-
-	if (uid_validity == uidlist->uid_validity &&
-	    next_uid < uidlist->hdr_next_uid) {
+	if (hdr->major_version != UIDLIST_BINARY_MAJOR_VERSION) {
 		maildir_uidlist_set_corrupted(uidlist,
-			"next_uid header was lowered (%u -> %u)",
-			uidlist->hdr_next_uid, next_uid);
+			"Unsupported binary version %u", hdr->major_version);
 		return 0;
 	}
+	if (hdr->compat_flags != UIDLIST_BINARY_COMPAT_FLAGS) {
+		/* most likely written by a different CPU architecture */
+		maildir_uidlist_set_corrupted(uidlist,
+			"Incompatible binary file (compat_flags=0x%x)",
+			hdr->compat_flags);
+		return 0;
+	}
+	if (hdr->header_size <= sizeof(*hdr) || hdr->header_size > size ||
+	    hdr->header_size % sizeof(uint32_t) != 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (header_size=%u)", hdr->header_size);
+		return 0;
+	}
+	hdr_ext = (const char *)data + sizeof(*hdr);
+	if (memchr(hdr_ext, '\0', hdr->header_size - sizeof(*hdr)) == NULL) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (unterminated extensions)");
+		return 0;
+	}
+	uidlist->version = UIDLIST_VERSION_BINARY;
 
-	uidlist->uid_validity = uid_validity;
-	uidlist->next_uid = next_uid;
-	uidlist->hdr_next_uid = next_uid;
-	return 1;
+	str_truncate(uidlist->hdr_extensions, 0);
+	str_append(uidlist->hdr_extensions, hdr_ext);
+	if (!guid_128_is_empty(hdr->mailbox_guid)) {
+		memcpy(uidlist->mailbox_guid, hdr->mailbox_guid,
+		       sizeof(uidlist->mailbox_guid));
+		uidlist->have_mailbox_guid = TRUE;
+	}
+	*header_size_r = hdr->header_size;
+	return maildir_uidlist_read_header_finish(uidlist, hdr->uid_validity,
+						  hdr->next_uid);
 }
 
 static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
@@ -694,17 +875,270 @@ static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
 	uidlist->unsorted = FALSE;
 }
 
+static int
+maildir_uidlist_read_text(struct maildir_uidlist *uidlist, int fd,
+			  uoff_t last_read_offset, bool try_retry,
+			  bool *retry_r, uoff_t *offset_r)
+{
+	struct istream *input;
+	const char *line;
+	int ret;
+
+	input = i_stream_create_fd(fd, SIZE_MAX);
+	i_stream_seek(input, last_read_offset);
+
+	ret = input->v_offset != 0 ? 1 :
+		maildir_uidlist_read_header(uidlist, input);
+	if (ret > 0) {
+		uidlist->prev_read_uid = 0;
+		uidlist->change_counter++;
+		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
+
+		ret = 1;
+		while ((line = i_stream_read_next_line(input)) != NULL) {
+			uidlist->read_records_count++;
+			uidlist->read_line_count++;
+			if (!maildir_uidlist_next(uidlist, line)) {
+				if (!uidlist->retry_rewind)
+					ret = 0;
+				else {
+					ret = -1;
+					*retry_r = TRUE;
+				}
+				break;
+			}
+                }
+		uidlist->retry_rewind = FALSE;
+		if (input->stream_errno != 0)
+                        ret = -1;
+	}
+
+	if (ret < 0 && !*retry_r) {
+                /* I/O error */
+                if (input->stream_errno == ESTALE && try_retry)
+			*retry_r = TRUE;
+		else {
+			mailbox_set_critical(uidlist->box,
+				"read(%s) failed: %s", uidlist->path,
+				i_stream_get_error(input));
+		}
+	}
+	*offset_r = input->v_offset;
+	i_stream_destroy(&input);
+	return ret;
+}
+
+static int
+maildir_uidlist_read_binary_ext(struct maildir_uidlist *uidlist,
+				const unsigned char *heap, uint32_t heap_size,
+				uint32_t offset, const unsigned char **ext_r)
+{
+	const unsigned char *p, *end, *nul;
+
+	if (offset == UIDLIST_BINARY_NO_EXTENSIONS) {
+		*ext_r = NULL;
+		return 1;
+	}
+	if (offset >= heap_size) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Extensions point outside heap (%u >= %u)",
+			offset, heap_size);
+		return 0;
+	}
+
+	/* <key><value>\0[<key><value>\0 ...]\0 */
+	end = heap + heap_size;
+	for (p = heap + offset; *p != '\0'; p = nul + 1) {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p)) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid extension record key 0x%x", *p);
+			return 0;
+		}
+		nul = memchr(p, '\0', end - p);
+		if (nul == NULL || nul + 1 == end) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Unterminated extension record");
+			return 0;
+		}
+	}
+	*ext_r = heap + offset;
+	return 1;
+}
+
+static int
+maildir_uidlist_read_binary_block(struct maildir_uidlist *uidlist,
+				  const struct maildir_uidlist_bin_block *block)
+{
+	const struct maildir_uidlist_bin_record *brecs = (const void *)(block + 1);
+	const unsigned char *heap =
+		(const unsigned char *)(brecs + block->records_count);
+	const unsigned char *ext;
+	struct maildir_uidlist_rec *rec;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < block->records_count; i++) {
+		uidlist->read_records_count++;
+		uidlist->read_line_count++;
+		if (brecs[i].uid == 0) {
+			maildir_uidlist_set_corrupted(uidlist, "UID 0");
+			return 0;
+		}
+		if ((ret = maildir_uidlist_next_check_uid(uidlist,
+							  brecs[i].uid)) <= 0) {
+			if (ret < 0)
+				return 0;
+			continue;
+		}
+
+		if (brecs[i].filename_offset >= block->heap_size ||
+		    heap[brecs[i].filename_offset] == '\0' ||
+		    memchr(heap + brecs[i].filename_offset, '\0',
+			   block->heap_size - brecs[i].filename_offset) == NULL) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid filename offset %u",
+				brecs[i].filename_offset);
+			return 0;
+		}
+		if (maildir_uidlist_read_binary_ext(uidlist, heap,
+				block->heap_size, brecs[i].ext_offset,
+				&ext) == 0)
+			return 0;
+
+		/* the strings are used directly from the mapped file. they're
+		   never modified in place, only replaced. */
+		rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+		rec->uid = brecs[i].uid;
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+		rec->filename = (char *)(heap + brecs[i].filename_offset);
+		rec->extensions = (unsigned char *)ext;
+		if (!maildir_uidlist_next_add(uidlist, rec))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+maildir_uidlist_read_binary_data(struct maildir_uidlist *uidlist,
+				 const unsigned char *data, size_t size,
+				 size_t *pos)
+{
+	const struct maildir_uidlist_bin_block *block;
+	size_t block_size;
+	int ret;
+
+	uidlist->prev_read_uid = 0;
+	uidlist->change_counter++;
+
+	while (size - *pos >= sizeof(*block)) {
+		block = (const void *)(data + *pos);
+		if (block->records_count >
+		    (size - *pos - sizeof(*block)) /
+		    sizeof(struct maildir_uidlist_bin_record)) {
+			/* a block that is still being written */
+			break;
+		}
+		if (block->heap_size % sizeof(uint32_t) != 0) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Corrupted block (heap_size=%u)",
+				block->heap_size);
+			return 0;
+		}
+		block_size = sizeof(*block) + block->records_count *
+			sizeof(struct maildir_uidlist_bin_record);
+		if (block->heap_size > size - *pos - block_size)
+			break;
+		block_size += block->heap_size;
+
+		T_BEGIN {
+			ret = maildir_uidlist_read_binary_block(uidlist, block);
+		} T_END;
+		if (ret <= 0)
+			return ret;
+		*pos += block_size;
+	}
+	return 1;
+}
+
+static int
+maildir_uidlist_read_binary(struct maildir_uidlist *uidlist, int fd,
+			    const struct stat *st, uoff_t last_read_offset,
+			    bool try_retry, bool *retry_r, uoff_t *offset_r)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	struct maildir_uidlist_map *map;
+	unsigned char *data;
+	uoff_t map_offset;
+	size_t size, pos, header_size;
+	int ret;
+
+	*offset_r = last_read_offset;
+	if ((uoff_t)st->st_size <= last_read_offset)
+		return 1;
+
+	/* map only the part that hasn't been read yet. the earlier records
+	   still point to the earlier maps. */
+	map_offset = last_read_offset -
+		last_read_offset % mmap_get_page_size();
+	size = st->st_size - map_offset;
+	if (!storage->set->mmap_disable) {
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, map_offset);
+		if (data == MAP_FAILED) {
+			mailbox_set_critical(uidlist->box,
+				"mmap(%s) failed: %m", uidlist->path);
+			return -1;
+		}
+		if (!array_is_created(&uidlist->maps))
+			i_array_init(&uidlist->maps, 4);
+		map = array_append_space(&uidlist->maps);
+		map->data = data;
+		map->size = size;
+	} else {
+		data = p_malloc(uidlist->record_pool, size);
+		if ((ret = pread_full(fd, data, size, map_offset)) <= 0) {
+			if (ret < 0 && errno == ESTALE && try_retry)
+				*retry_r = TRUE;
+			else if (ret < 0) {
+				mailbox_set_critical(uidlist->box,
+					"pread(%s) failed: %m", uidlist->path);
+			} else {
+				mailbox_set_critical(uidlist->box,
+					"pread(%s) failed: Unexpected EOF",
+					uidlist->path);
+			}
+			return -1;
+		}
+	}
+
+	pos = last_read_offset - map_offset;
+	if (last_read_offset == 0) {
+		ret = maildir_uidlist_read_binary_header(uidlist, data, size,
+							 &header_size);
+		if (ret <= 0)
+			return ret;
+		pos = header_size;
+	}
+	ret = maildir_uidlist_read_binary_data(uidlist, data, size, &pos);
+	*offset_r = map_offset + pos;
+	return ret;
+}
+
+static bool maildir_uidlist_fd_is_binary(int fd)
+{
+	char c;
+
+	return pread(fd, &c, 1, 0) == 1 && c == UIDLIST_BINARY_MAGIC[0];
+}
+
 static int
 maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 			    bool *retry_r, bool try_retry)
 {
-	const char *line;
 	uint32_t orig_next_uid, orig_uid_validity;
-	struct istream *input;
 	struct stat st;
-	uoff_t last_read_offset;
+	uoff_t last_read_offset, read_offset;
 	int fd, ret;
-	bool readonly = FALSE;
+	bool readonly = FALSE, binary;
 
 	*retry_r = FALSE;
 
@@ -760,53 +1194,38 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 							    st.st_size/8));
 	}
 
-	input = i_stream_create_fd(fd, SIZE_MAX);
-	i_stream_seek(input, last_read_offset);
+	binary = last_read_offset != 0 ?
+		uidlist->version == UIDLIST_VERSION_BINARY :
+		maildir_uidlist_fd_is_binary(fd);
 
 	orig_uid_validity = uidlist->uid_validity;
 	orig_next_uid = uidlist->next_uid;
-	ret = input->v_offset != 0 ? 1 :
-		maildir_uidlist_read_header(uidlist, input);
-	if (ret > 0) {
-		uidlist->prev_read_uid = 0;
-		uidlist->change_counter++;
-		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
-
-		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
-			uidlist->read_records_count++;
-			uidlist->read_line_count++;
-			if (!maildir_uidlist_next(uidlist, line)) {
-				if (!uidlist->retry_rewind)
-					ret = 0;
-				else {
-					ret = -1;
-					*retry_r = TRUE;
-				}
-				break;
-			}
-                }
-		uidlist->retry_rewind = FALSE;
-		if (input->stream_errno != 0)
-                        ret = -1;
+	if (binary) {
+		ret = maildir_uidlist_read_binary(uidlist, fd, &st,
+						  last_read_offset, try_retry,
+						  retry_r, &read_offset);
+	} else {
+		ret = maildir_uidlist_read_text(uidlist, fd, last_read_offset,
+						try_retry, retry_r,
+						&read_offset);
+	}
 
-		if (uidlist->unsorted) {
-			uidlist->recreate_on_change = TRUE;
-			maildir_uidlist_records_sort_by_uid(uidlist);
-		}
-		if (uidlist->next_uid <= uidlist->prev_read_uid)
-			uidlist->next_uid = uidlist->prev_read_uid + 1;
-		if (ret > 0 && uidlist->uid_validity != orig_uid_validity &&
-		    orig_uid_validity != 0) {
-			uidlist->recreate = TRUE;
-		} else if (ret > 0 && uidlist->next_uid < orig_next_uid) {
-			mailbox_set_critical(uidlist->box,
-				"%s: next_uid was lowered (%u -> %u, hdr=%u)",
-				uidlist->path, orig_next_uid,
-				uidlist->next_uid, uidlist->hdr_next_uid);
-			uidlist->recreate = TRUE;
-			uidlist->next_uid = orig_next_uid;
-		}
+	if (uidlist->unsorted) {
+		uidlist->recreate_on_change = TRUE;
+		maildir_uidlist_records_sort_by_uid(uidlist);
+	}
+	if (uidlist->next_uid <= uidlist->prev_read_uid)
+		uidlist->next_uid = uidlist->prev_read_uid + 1;
+	if (ret > 0 && uidlist->uid_validity != orig_uid_validity &&
+	    orig_uid_validity != 0) {
+		uidlist->recreate = TRUE;
+	} else if (ret > 0 && uidlist->next_uid < orig_next_uid) {
+		mailbox_set_critical(uidlist->box,
+			"%s: next_uid was lowered (%u -> %u, hdr=%u)",
+			uidlist->path, orig_next_uid,
+			uidlist->next_uid, uidlist->hdr_next_uid);
+		uidlist->recreate = TRUE;
+		uidlist->next_uid = orig_next_uid;
 	}
 
         if (ret == 0) {
@@ -820,21 +1239,12 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		uidlist->fd_dev = st.st_dev;
 		uidlist->fd_ino = st.st_ino;
 		uidlist->fd_size = st.st_size;
-		uidlist->last_read_offset = input->v_offset;
+		uidlist->last_read_offset = read_offset;
 		maildir_uidlist_update_hdr(uidlist, &st);
-        } else if (!*retry_r) {
-                /* I/O error */
-                if (input->stream_errno == ESTALE && try_retry)
-			*retry_r = TRUE;
-		else {
-			mailbox_set_critical(uidlist->box,
-				"read(%s) failed: %s", uidlist->path,
-				i_stream_get_error(input));
-		}
+        } else {
 		uidlist->last_read_offset = 0;
 	}
 
-	i_stream_destroy(&input);
 	if (ret <= 0) {
 		if (close(fd) < 0) {
 			mailbox_set_critical(uidlist->box,
@@ -1234,6 +1644,81 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
+static void
+maildir_uidlist_write_binary_header(struct maildir_uidlist *uidlist,
+				    struct ostream *output)
+{
+	static const unsigned char pad[sizeof(uint32_t)] = { 0, };
+	struct maildir_uidlist_bin_header hdr;
+	size_t ext_size = str_len(uidlist->hdr_extensions) + 1;
+
+	i_zero(&hdr);
+	memcpy(hdr.magic, UIDLIST_BINARY_MAGIC, UIDLIST_BINARY_MAGIC_SIZE);
+	hdr.major_version = UIDLIST_BINARY_MAJOR_VERSION;
+	hdr.minor_version = UIDLIST_BINARY_MINOR_VERSION;
+	hdr.compat_flags = UIDLIST_BINARY_COMPAT_FLAGS;
+	hdr.header_size = (sizeof(hdr) + ext_size + 3) & ~3U;
+	hdr.uid_validity = uidlist->uid_validity;
+	hdr.next_uid = uidlist->next_uid;
+	memcpy(hdr.mailbox_guid, uidlist->mailbox_guid,
+	       sizeof(hdr.mailbox_guid));
+
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, str_c(uidlist->hdr_extensions), ext_size);
+	o_stream_nsend(output, pad, hdr.header_size - sizeof(hdr) - ext_size);
+}
+
+static void
+maildir_uidlist_write_binary_block(struct maildir_uidlist *uidlist,
+				   struct maildir_uidlist_iter_ctx *iter,
+				   struct ostream *output)
+{
+	struct maildir_uidlist_bin_block block;
+	struct maildir_uidlist_bin_record brec;
+	struct maildir_uidlist_rec *rec;
+	buffer_t *recs_buf, *heap;
+	const unsigned char *p;
+	const char *strp;
+	size_t len;
+
+	recs_buf = t_buffer_create(1024);
+	heap = t_buffer_create(4096);
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
+		i_zero(&brec);
+		brec.uid = rec->uid;
+		brec.filename_offset = heap->used;
+		strp = strchr(rec->filename, *MAILDIR_INFO_SEP_S);
+		len = strp == NULL ? strlen(rec->filename) :
+			(size_t)(strp - rec->filename);
+		buffer_append(heap, rec->filename, len);
+		buffer_append_c(heap, '\0');
+
+		if (rec->extensions == NULL)
+			brec.ext_offset = UIDLIST_BINARY_NO_EXTENSIONS;
+		else {
+			brec.ext_offset = heap->used;
+			for (p = rec->extensions; *p != '\0'; ) {
+				i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+				p += strlen((const char *)p) + 1;
+			}
+			buffer_append(heap, rec->extensions,
+				      p - rec->extensions + 1);
+		}
+		buffer_append(recs_buf, &brec, sizeof(brec));
+	}
+	if (recs_buf->used == 0)
+		return;
+	buffer_append_zero(heap, ((heap->used + 3) & ~3U) - heap->used);
+
+	i_zero(&block);
+	block.records_count = recs_buf->used / sizeof(brec);
+	block.heap_size = heap->used;
+	o_stream_nsend(output, &block, sizeof(block));
+	o_stream_nsend(output, recs_buf->data, recs_buf->used);
+	o_stream_nsend(output, heap->data, heap->used);
+}
+
 static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 				    const char *path, unsigned int first_idx,
 				    uoff_t *file_size_r)
@@ -1246,6 +1731,7 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 	const unsigned char *p;
 	const char *strp;
 	size_t len;
+	bool binary;
 
 	i_assert(fd != -1);
 
@@ -1253,9 +1739,13 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 	o_stream_cork(output);
 	str = t_str_new(512);
 
+	/* append using the existing file's format */
+	binary = output->offset == 0 ? uidlist->binary :
+		maildir_uidlist_fd_is_binary(fd);
 	if (output->offset == 0) {
 		i_assert(first_idx == 0);
-		uidlist->version = UIDLIST_VERSION;
+		uidlist->version = binary ? UIDLIST_VERSION_BINARY :
+			UIDLIST_VERSION;
 
 		if (uidlist->uid_validity == 0)
 			maildir_uidlist_generate_uid_validity(uidlist);
@@ -1263,25 +1753,33 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 			guid_128_generate(uidlist->mailbox_guid);
 
 		i_assert(uidlist->next_uid > 0);
-		str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
-			    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
-			    uidlist->uid_validity,
-			    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
-			    uidlist->next_uid,
-			    MAILDIR_UIDLIST_HDR_EXT_GUID,
-			    guid_128_to_string(uidlist->mailbox_guid));
-		if (str_len(uidlist->hdr_extensions) > 0) {
-			str_append_c(str, ' ');
-			str_append_str(str, uidlist->hdr_extensions);
+		if (binary)
+			maildir_uidlist_write_binary_header(uidlist, output);
+		else {
+			str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
+				    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
+				    uidlist->uid_validity,
+				    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
+				    uidlist->next_uid,
+				    MAILDIR_UIDLIST_HDR_EXT_GUID,
+				    guid_128_to_string(uidlist->mailbox_guid));
+			if (str_len(uidlist->hdr_extensions) > 0) {
+				str_append_c(str, ' ');
+				str_append_str(str, uidlist->hdr_extensions);
+			}
+			str_append_c(str, '\n');
+			o_stream_nsend(output, str_data(str), str_len(str));
 		}
-		str_append_c(str, '\n');
-		o_stream_nsend(output, str_data(str), str_len(str));
 	}
 
 	iter = maildir_uidlist_iter_init(uidlist);
 	i_assert(first_idx <= array_count(&uidlist->records));
 	iter->next += first_idx;
 
+	if (binary) {
+		/* this writes all the remaining records */
+		maildir_uidlist_write_binary_block(uidlist, iter, output);
+	}
 	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
 		uidlist->read_records_count++;
 		str_truncate(str, 0);
@@ -1515,7 +2013,8 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
-	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
+	if (uidlist->fd == -1 ||
+	    uidlist->version != maildir_uidlist_get_wanted_version(uidlist) ||
 	    !uidlist->have_mailbox_guid)
 		return TRUE;
 	return maildir_uidlist_want_compress(ctx);
@@ -1540,6 +2039,20 @@ static int maildir_uidlist_sync_update(struct maildir_uidlist_sync_ctx *ctx)
 	}
 	i_assert(ctx->first_unwritten_pos != UINT_MAX);
 
+	if (uidlist->version == UIDLIST_VERSION_BINARY &&
+	    (uoff_t)uidlist->fd_size > uidlist->last_read_offset) {
+		/* the file hasn't changed since it was read while locked, so
+		   the trailing partial block was left by a writer that died.
+		   drop it so the new blocks don't get appended after it. */
+		i_assert(uidlist->locked_refresh);
+		if (ftruncate(uidlist->fd, uidlist->last_read_offset) < 0) {
+			mailbox_set_critical(uidlist->box,
+				"ftruncate(%s) failed: %m", uidlist->path);
+			return -1;
+		}
+		uidlist->fd_size = uidlist->last_read_offset;
+	}
+
 	if (lseek(uidlist->fd, 0, SEEK_END) < 0) {
 		mailbox_set_critical(uidlist->box,
 			"lseek(%s) failed: %m", uidlist->path);
@@ -1986,7 +2499,7 @@ static void maildir_uidlist_swap(struct maildir_uidlist_sync_ctx *ctx)
 	uidlist->files = ctx->files;
 	i_zero(&ctx->files);
 
-	pool_unref(&uidlist->record_pool);
+	maildir_uidlist_record_pool_unref(uidlist);
 	uidlist->record_pool = ctx->record_pool;
 	ctx->record_pool = NULL;
 
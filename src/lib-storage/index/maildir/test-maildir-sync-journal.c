@@ -0,0 +1,212 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "maildir-sync-journal.c"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef IOLOOP_NOTIFY_INOTIFY
+
+#define TEST_DIR ".test-maildir-sync-journal"
+
+static void test_dir_init(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", TEST_DIR, error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_dir_deinit(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", TEST_DIR, error);
+}
+
+static void test_file_create(const char *fname)
+{
+	const char *path = t_strconcat(TEST_DIR"/", fname, NULL);
+	int fd;
+
+	fd = creat(path, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_file_rename(const char *old_fname, const char *new_fname)
+{
+	const char *old_path = t_strconcat(TEST_DIR"/", old_fname, NULL);
+	const char *new_path = t_strconcat(TEST_DIR"/", new_fname, NULL);
+
+	if (rename(old_path, new_path) < 0)
+		i_fatal("rename(%s, %s) failed: %m", old_path, new_path);
+}
+
+static void test_file_unlink(const char *fname)
+{
+	i_unlink(t_strconcat(TEST_DIR"/", fname, NULL));
+}
+
+static const struct maildir_sync_journal_change *
+test_journal_find(struct maildir_sync_journal *journal, const char *fname)
+{
+	const struct maildir_sync_journal_change *change;
+
+	array_foreach(maildir_sync_journal_get_changes(journal), change) {
+		if (maildir_filename_base_cmp(change->filename, fname) == 0)
+			return change;
+	}
+	return NULL;
+}
+
+static void test_maildir_sync_journal_replay(void)
+{
+	struct maildir_sync_journal *journal, *journal2;
+	const struct maildir_sync_journal_change *change;
+
+	test_begin("maildir sync journal replay");
+	test_dir_init();
+	test_file_create("1.host:2,");
+
+	journal = maildir_sync_journal_init(TEST_DIR);
+	test_assert(journal != NULL);
+	/* not usable before the directory is scanned */
+	test_file_create("2.host:2,");
+	test_assert(!maildir_sync_journal_refresh(journal));
+
+	maildir_sync_journal_reset(journal);
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(array_count(maildir_sync_journal_get_changes(journal)) == 0);
+
+	/* a second journal for the same directory shares the watch */
+	journal2 = maildir_sync_journal_init(TEST_DIR);
+	test_assert(journal2 != NULL);
+	maildir_sync_journal_reset(journal2);
+
+	test_file_rename("1.host:2,", "1.host:2,S");
+	test_file_unlink("2.host:2,");
+	test_file_create("3.host:2,");
+	test_file_create(".tmpfile");
+	test_file_create("4.host:2,");
+	test_file_unlink("4.host:2,");
+
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(array_count(maildir_sync_journal_get_changes(journal)) == 4);
+	change = test_journal_find(journal, "1.host");
+	test_assert(change != NULL && change->exists &&
+		    strcmp(change->filename, "1.host:2,S") == 0);
+	change = test_journal_find(journal, "2.host");
+	test_assert(change != NULL && !change->exists);
+	change = test_journal_find(journal, "3.host");
+	test_assert(change != NULL && change->exists);
+	change = test_journal_find(journal, "4.host");
+	test_assert(change != NULL && !change->exists);
+	test_assert(test_journal_find(journal, ".tmpfile") == NULL);
+
+	/* the events were read into both journals */
+	test_assert(maildir_sync_journal_refresh(journal2));
+	test_assert(array_count(maildir_sync_journal_get_changes(journal2)) == 4);
+
+	maildir_sync_journal_clear(journal);
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(array_count(maildir_sync_journal_get_changes(journal)) == 0);
+	test_file_unlink("3.host:2,");
+	test_assert(maildir_sync_journal_refresh(journal));
+	change = test_journal_find(journal, "3.host");
+	test_assert(change != NULL && !change->exists);
+
+	maildir_sync_journal_deinit(&journal2);
+	/* the watch is still used by the first journal */
+	test_file_create("5.host:2,");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(test_journal_find(journal, "5.host") != NULL);
+
+	maildir_sync_journal_deinit(&journal);
+	test_assert(journal_inotify_fd == -1);
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_maildir_sync_journal_overflow(void)
+{
+	struct maildir_sync_journal *journal, *journal2;
+	struct inotify_event event;
+
+	test_begin("maildir sync journal overflow");
+	test_dir_init();
+	if (mkdir(TEST_DIR"/sub", 0700) < 0)
+		i_fatal("mkdir(%s/sub) failed: %m", TEST_DIR);
+
+	journal = maildir_sync_journal_init(TEST_DIR);
+	journal2 = maildir_sync_journal_init(TEST_DIR"/sub");
+	test_assert(journal != NULL && journal2 != NULL);
+	maildir_sync_journal_reset(journal);
+	maildir_sync_journal_reset(journal2);
+	test_file_create("1.host:2,");
+	test_assert(maildir_sync_journal_refresh(journal));
+
+	/* the overflow event has wd=-1, so it invalidates all journals */
+	i_zero(&event);
+	event.wd = -1;
+	event.mask = IN_Q_OVERFLOW;
+	maildir_sync_journal_dispatch(&event);
+	test_assert(!maildir_sync_journal_refresh(journal));
+	test_assert(!maildir_sync_journal_refresh(journal2));
+	test_assert(array_count(maildir_sync_journal_get_changes(journal)) == 0);
+
+	/* the lost changes aren't tracked until the directory is scanned */
+	test_file_create("2.host:2,");
+	test_assert(!maildir_sync_journal_refresh(journal));
+	maildir_sync_journal_reset(journal);
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_file_create("3.host:2,");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(array_count(maildir_sync_journal_get_changes(journal)) == 1);
+	test_assert(test_journal_find(journal, "3.host") != NULL);
+
+	/* or until the directory is known to be unchanged */
+	maildir_sync_journal_set_synced(journal2);
+	test_file_create("sub/1.host:2,");
+	test_assert(maildir_sync_journal_refresh(journal2));
+	test_assert(test_journal_find(journal2, "1.host") != NULL);
+
+	/* removing the directory invalidates the journal */
+	test_file_unlink("sub/1.host:2,");
+	if (rmdir(TEST_DIR"/sub") < 0)
+		i_fatal("rmdir(%s/sub) failed: %m", TEST_DIR);
+	test_assert(!maildir_sync_journal_refresh(journal2));
+	test_assert(journal2->wd == -1);
+	maildir_sync_journal_set_synced(journal2);
+	test_assert(!maildir_sync_journal_refresh(journal2));
+	test_assert(maildir_sync_journal_refresh(journal));
+
+	maildir_sync_journal_deinit(&journal);
+	maildir_sync_journal_deinit(&journal2);
+	test_dir_deinit();
+	test_end();
+}
+
+#endif
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+#ifdef IOLOOP_NOTIFY_INOTIFY
+		test_maildir_sync_journal_replay,
+		test_maildir_sync_journal_overflow,
+#endif
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,403 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "master-service.h"
+#include "test-mail-storage-common.h"
+#include "maildir-storage.h"
+#include "maildir-settings.h"
+#include "maildir-uidlist.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* offsets in the binary dovecot-uidlist file */
+#define TEST_BIN_HEADER_SIZE_OFFSET 8
+#define TEST_BIN_BLOCK_HDR_SIZE 8
+#define TEST_BIN_RECORD_SIZE 12
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static struct mailbox *test_mailbox_open(bool binary)
+{
+	const char *const binary_input[] = {
+		"maildir_uidlist_binary=yes",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.extra_input = binary ? binary_input : NULL,
+	};
+	struct mailbox *box;
+
+	test_ctx = test_mail_storage_init();
+	test_mail_storage_init_user(test_ctx, &set);
+	box = mailbox_alloc(test_ctx->user->namespaces->list, "INBOX", 0);
+	if (mailbox_open(box) < 0) {
+		i_fatal("mailbox_open(INBOX) failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	return box;
+}
+
+static void test_mailbox_close(struct mailbox **box)
+{
+	mailbox_free(box);
+	test_mail_storage_deinit_user(test_ctx);
+	test_mail_storage_deinit(&test_ctx);
+}
+
+static void test_uidlist_set_binary(struct mailbox *box, bool binary)
+{
+	struct maildir_mailbox *mbox = MAILDIR_MAILBOX(box);
+
+	((struct maildir_settings *)mbox->storage->set)->
+		maildir_uidlist_binary = binary;
+}
+
+static const char *test_uidlist_path(struct mailbox *box)
+{
+	const char *dir;
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_CONTROL, &dir) <= 0)
+		i_unreached();
+	return t_strconcat(dir, "/"MAILDIR_UIDLIST_NAME, NULL);
+}
+
+static void
+test_uidlist_sync(struct mailbox *box, enum maildir_uidlist_sync_flags flags,
+		  const char *const *fnames)
+{
+	struct maildir_uidlist *uidlist;
+	struct maildir_uidlist_sync_ctx *sync_ctx;
+
+	uidlist = maildir_uidlist_init(MAILDIR_MAILBOX(box));
+	test_assert(maildir_uidlist_sync_init(uidlist, flags, &sync_ctx) > 0);
+	for (; *fnames != NULL; fnames++)
+		test_assert(maildir_uidlist_sync_next(sync_ctx, *fnames, 0) >= 0);
+	maildir_uidlist_sync_finish(sync_ctx);
+	test_assert(maildir_uidlist_sync_deinit(&sync_ctx, TRUE) == 0);
+	maildir_uidlist_deinit(&uidlist);
+}
+
+static void
+test_uidlist_check(struct maildir_uidlist *uidlist, const char *const *fnames)
+{
+	uint32_t uid;
+	unsigned int i;
+
+	for (i = 0; fnames[i] != NULL; i++) {
+		test_assert_idx(maildir_uidlist_get_uid(uidlist, fnames[i],
+							&uid), i);
+		test_assert_idx(uid == i + 1, i);
+	}
+}
+
+static void
+test_uidlist_read_check(struct mailbox *box, int expected_ret,
+			const char *const *fnames)
+{
+	struct maildir_uidlist *uidlist;
+
+	uidlist = maildir_uidlist_init(MAILDIR_MAILBOX(box));
+	test_assert(maildir_uidlist_refresh(uidlist) == expected_ret);
+	test_uidlist_check(uidlist, fnames);
+	maildir_uidlist_deinit(&uidlist);
+}
+
+static char test_uidlist_first_byte(struct mailbox *box)
+{
+	const char *path = test_uidlist_path(box);
+	char c = '\0';
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (read(fd, &c, 1) != 1)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	return c;
+}
+
+static off_t test_uidlist_size(struct mailbox *box)
+{
+	const char *path = test_uidlist_path(box);
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	return st.st_size;
+}
+
+static void
+test_uidlist_pwrite(struct mailbox *box, const void *data, size_t size,
+		    off_t offset)
+{
+	const char *path = test_uidlist_path(box);
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pwrite(fd, data, size, offset) != (ssize_t)size)
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static uint32_t test_uidlist_header_size(struct mailbox *box)
+{
+	const char *path = test_uidlist_path(box);
+	uint32_t header_size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pread(fd, &header_size, sizeof(header_size),
+		  TEST_BIN_HEADER_SIZE_OFFSET) != sizeof(header_size))
+		i_fatal("pread(%s) failed: %m", path);
+	i_close_fd(&fd);
+	return header_size;
+}
+
+static void test_uidlist_truncate(struct mailbox *box, off_t size)
+{
+	const char *path = test_uidlist_path(box);
+
+	if (truncate(path, size) < 0)
+		i_fatal("truncate(%s) failed: %m", path);
+}
+
+static const char *const test_fnames1[] = {
+	"1.host:2,", "2.host:2,S", NULL
+};
+static const char *const test_fnames2[] = {
+	"3.host:2,", NULL
+};
+static const char *const test_fnames_all[] = {
+	"1.host:2,", "2.host:2,S", "3.host:2,", NULL
+};
+
+static void test_maildir_uidlist_binary_append(void)
+{
+	struct maildir_uidlist *reader;
+	struct mailbox *box;
+	off_t size;
+
+	test_begin("maildir uidlist binary append");
+	box = test_mailbox_open(TRUE);
+
+	test_uidlist_sync(box, 0, test_fnames1);
+	test_assert(test_uidlist_first_byte(box) == '\0');
+	size = test_uidlist_size(box);
+
+	reader = maildir_uidlist_init(MAILDIR_MAILBOX(box));
+	test_assert(maildir_uidlist_refresh(reader) == 1);
+	test_uidlist_check(reader, test_fnames1);
+
+	/* the new record is appended as a new block */
+	test_uidlist_sync(box, MAILDIR_UIDLIST_SYNC_PARTIAL, test_fnames2);
+	test_assert(test_uidlist_size(box) > size);
+	test_assert(test_uidlist_first_byte(box) == '\0');
+
+	/* the existing reader reads only the appended block */
+	test_assert(maildir_uidlist_refresh(reader) == 1);
+	test_uidlist_check(reader, test_fnames_all);
+	test_assert(maildir_uidlist_get_next_uid(reader) == 4);
+	maildir_uidlist_deinit(&reader);
+
+	test_uidlist_read_check(box, 1, test_fnames_all);
+	test_mailbox_close(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_binary_truncated(void)
+{
+	struct maildir_uidlist *uidlist;
+	struct mailbox *box;
+	uint32_t uid;
+	off_t size;
+
+	test_begin("maildir uidlist binary truncated");
+	box = test_mailbox_open(TRUE);
+	test_uidlist_sync(box, 0, test_fnames1);
+	size = test_uidlist_size(box);
+	test_uidlist_sync(box, MAILDIR_UIDLIST_SYNC_PARTIAL, test_fnames2);
+
+	/* a torn last block is treated as still being written */
+	test_uidlist_truncate(box, test_uidlist_size(box) - sizeof(uint32_t));
+	test_uidlist_read_check(box, 1, test_fnames1);
+
+	/* the block's records exist, but not the whole heap */
+	test_uidlist_truncate(box, size + TEST_BIN_BLOCK_HDR_SIZE +
+			      TEST_BIN_RECORD_SIZE);
+	test_uidlist_read_check(box, 1, test_fnames1);
+
+	/* only the block header exists */
+	test_uidlist_truncate(box, size + TEST_BIN_BLOCK_HDR_SIZE);
+	test_uidlist_read_check(box, 1, test_fnames1);
+
+	/* truncated in the middle of the file header */
+	test_expect_error_string("Corrupted header");
+	test_uidlist_truncate(box, TEST_BIN_HEADER_SIZE_OFFSET + 4);
+	uidlist = maildir_uidlist_init(MAILDIR_MAILBOX(box));
+	test_assert(maildir_uidlist_refresh(uidlist) == 0);
+	test_assert(!maildir_uidlist_get_uid(uidlist, "1.host", &uid));
+	maildir_uidlist_deinit(&uidlist);
+	test_expect_no_more_errors();
+
+	test_mailbox_close(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_binary_append_torn(void)
+{
+	static const char *const fnames_new[] = {
+		"4.host:2,", NULL
+	};
+	struct maildir_uidlist *uidlist;
+	struct mailbox *box;
+	uint32_t uid;
+	off_t size;
+
+	test_begin("maildir uidlist binary append after torn block");
+	box = test_mailbox_open(TRUE);
+	test_uidlist_sync(box, 0, test_fnames1);
+	size = test_uidlist_size(box);
+	test_uidlist_sync(box, MAILDIR_UIDLIST_SYNC_PARTIAL, test_fnames2);
+
+	/* the writer died in the middle of the block */
+	test_uidlist_truncate(box, test_uidlist_size(box) - sizeof(uint32_t));
+
+	/* the torn block is replaced by the new one */
+	test_uidlist_sync(box, MAILDIR_UIDLIST_SYNC_PARTIAL, fnames_new);
+	test_assert(test_uidlist_first_byte(box) == '\0');
+	test_assert(test_uidlist_size(box) > size);
+
+	uidlist = maildir_uidlist_init(MAILDIR_MAILBOX(box));
+	test_assert(maildir_uidlist_refresh(uidlist) == 1);
+	test_uidlist_check(uidlist, test_fnames1);
+	test_assert(maildir_uidlist_get_uid(uidlist, fnames_new[0], &uid));
+	test_assert(uid > 2);
+	test_assert(!maildir_uidlist_get_uid(uidlist, test_fnames2[0], &uid));
+	maildir_uidlist_deinit(&uidlist);
+
+	test_mailbox_close(&box);
+	test_end();
+}
+
+static void
+test_uidlist_corrupt(struct mailbox *box, off_t offset, uint32_t value,
+		     const char *error)
+{
+	struct maildir_uidlist *uidlist;
+	uint32_t uid;
+
+	test_uidlist_sync(box, 0, test_fnames1);
+	test_uidlist_pwrite(box, &value, sizeof(value), offset);
+
+	test_expect_error_string(error);
+	uidlist = maildir_uidlist_init(MAILDIR_MAILBOX(box));
+	test_assert(maildir_uidlist_refresh(uidlist) == 0);
+	/* the records before the broken one may have been read */
+	test_assert(!maildir_uidlist_get_uid(uidlist, "2.host", &uid));
+	maildir_uidlist_deinit(&uidlist);
+	test_expect_no_more_errors();
+}
+
+static void test_maildir_uidlist_binary_corrupted(void)
+{
+	struct mailbox *box;
+	uint32_t header_size;
+	off_t block, rec;
+
+	test_begin("maildir uidlist binary corrupted");
+	box = test_mailbox_open(TRUE);
+	test_uidlist_sync(box, 0, test_fnames1);
+	header_size = test_uidlist_header_size(box);
+	block = header_size;
+	rec = block + TEST_BIN_BLOCK_HDR_SIZE;
+
+	/* broken magic after the first byte */
+	test_uidlist_corrupt(box, 0, 0x12345600,
+			     "Corrupted header (invalid binary header)");
+	/* header_size larger than the file */
+	test_uidlist_corrupt(box, TEST_BIN_HEADER_SIZE_OFFSET, 0x10000000,
+			     "Corrupted header (header_size=");
+	/* heap_size not aligned */
+	test_uidlist_corrupt(box, block + sizeof(uint32_t), 3,
+			     "Corrupted block (heap_size=3)");
+	/* UID 0 */
+	test_uidlist_corrupt(box, rec, 0, "UID 0");
+	/* filename pointing outside the heap */
+	test_uidlist_corrupt(box, rec + sizeof(uint32_t), 0x10000000,
+			     "Invalid filename offset");
+	/* extensions pointing outside the heap */
+	test_uidlist_corrupt(box, rec + 2*sizeof(uint32_t), 0x10000000,
+			     "Extensions point outside heap");
+	/* UIDs not in ascending order */
+	test_uidlist_corrupt(box, rec + TEST_BIN_RECORD_SIZE, 1,
+			     "UIDs not ordered");
+
+	test_mailbox_close(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_binary_convert(void)
+{
+	static const char *const fnames_more[] = {
+		"1.host:2,", "2.host:2,S", "3.host:2,", "4.host:2,", NULL
+	};
+	struct mailbox *box;
+
+	test_begin("maildir uidlist binary convert");
+	box = test_mailbox_open(FALSE);
+	test_uidlist_sync(box, 0, test_fnames1);
+	test_assert(test_uidlist_first_byte(box) == '3');
+
+	/* v3 text -> v4 binary on the next change */
+	test_uidlist_set_binary(box, TRUE);
+	test_uidlist_read_check(box, 1, test_fnames1);
+	test_uidlist_sync(box, 0, test_fnames_all);
+	test_assert(test_uidlist_first_byte(box) == '\0');
+	test_uidlist_read_check(box, 1, test_fnames_all);
+
+	/* v4 binary -> v3 text */
+	test_uidlist_set_binary(box, FALSE);
+	test_uidlist_read_check(box, 1, test_fnames_all);
+	test_uidlist_sync(box, MAILDIR_UIDLIST_SYNC_PARTIAL, fnames_more);
+	test_assert(test_uidlist_first_byte(box) == '3');
+	test_uidlist_read_check(box, 1, fnames_more);
+
+	test_mailbox_close(&box);
+	test_end();
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_maildir_uidlist_binary_append,
+		test_maildir_uidlist_binary_truncated,
+		test_maildir_uidlist_binary_append_torn,
+		test_maildir_uidlist_binary_corrupted,
+		test_maildir_uidlist_binary_convert,
+		NULL
+	};
+
+	master_service = master_service_init("test-maildir-uidlist",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+
+	return ret;
+}
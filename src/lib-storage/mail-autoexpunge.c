@@ -7,6 +7,7 @@
 #include "mail-namespace.h"
 #include "mail-user.h"
 #include "mail-autoexpunge.h"
+#include "index/dbox-common/dbox-tiering.h"
 
 #define AUTOEXPUNGE_LOCK_FNAME "dovecot.autoexpunge.lock"
 #define AUTOEXPUNGE_BATCH_SIZE 1000
@@ -263,5 +264,7 @@ unsigned int mail_user_autoexpunge(struct mail_user *user)
 	}
 	event_reason_end(&reason);
 	file_lock_free(&lock);
+
+	(void)dbox_tiering_user(user);
 	return expunged_count;
 }
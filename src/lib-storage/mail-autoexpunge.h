@@ -2,7 +2,9 @@
 #define MAIL_AUTOEXPUNGE_H
 
 /* Perform autoexpunging for all the user's mailboxes that have autoexpunging
-   configured. Returns number of mails that were autoexpunged. */
+   configured. Returns number of mails that were autoexpunged. This is also
+   where the other background work is done after the user's session has
+   ended, i.e. moving mails between dbox primary and alt storages. */
 unsigned int mail_user_autoexpunge(struct mail_user *user);
 
 #endif
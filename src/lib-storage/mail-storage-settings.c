@@ -39,6 +39,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(STR, mail_attachment_detection_options),
 	DEF(STR_VARS, mail_attribute_dict),
 	DEF(UINT, mail_prefetch_count),
+	DEF(BOOL, mail_read_async),
 	DEF(STR, mail_cache_fields),
 	DEF(STR, mail_always_cache_fields),
 	DEF(STR, mail_never_cache_fields),
@@ -52,6 +53,8 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(UINT_HIDDEN, mail_cache_purge_delete_percentage),
 	DEF(UINT_HIDDEN, mail_cache_purge_continued_percentage),
 	DEF(UINT_HIDDEN, mail_cache_purge_header_continue_count),
+	DEF(SIZE_HIDDEN, mail_cache_purge_incremental_min_size),
+	DEF(SIZE_HIDDEN, mail_cache_purge_incremental_step_size),
 	DEF(SIZE_HIDDEN, mail_index_rewrite_min_log_bytes),
 	DEF(SIZE_HIDDEN, mail_index_rewrite_max_log_bytes),
 	DEF(SIZE_HIDDEN, mail_index_log_rotate_min_size),
@@ -64,6 +67,9 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(TIME, mail_temp_scan_interval),
 	DEF(UINT, mail_vsize_bg_after_count),
 	DEF(UINT, mail_sort_max_read_count),
+	DEF(TIME, mail_alt_tiering_cold_age),
+	DEF(UINT, mail_alt_tiering_hot_access_count),
+	DEF(TIME, mail_alt_tiering_interval),
 	DEF(BOOL, mail_save_crlf),
 	DEF(ENUM, mail_fsync),
 	DEF(BOOL, mmap_disable),
@@ -77,6 +83,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(BOOL, mail_full_filesystem_access),
 	DEF(BOOL, maildir_stat_dirs),
 	DEF(BOOL, mail_shared_explicit_inbox),
+	DEF(BOOL_HIDDEN, mail_index_log_group_commit),
 	DEF(ENUM, lock_method),
 	DEF(STR, pop3_uidl_format),
 
@@ -95,6 +102,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_attachment_detection_options = "",
 	.mail_attribute_dict = "",
 	.mail_prefetch_count = 0,
+	.mail_read_async = FALSE,
 	.mail_cache_fields = "flags",
 	.mail_always_cache_fields = "",
 	.mail_never_cache_fields = "imap.envelope",
@@ -108,6 +116,8 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_cache_purge_delete_percentage = 20,
 	.mail_cache_purge_continued_percentage = 200,
 	.mail_cache_purge_header_continue_count = 4,
+	.mail_cache_purge_incremental_min_size = 16 * 1024 * 1024,
+	.mail_cache_purge_incremental_step_size = 1024 * 1024,
 	.mail_index_rewrite_min_log_bytes = 8 * 1024,
 	.mail_index_rewrite_max_log_bytes = 128 * 1024,
 	.mail_index_log_rotate_min_size = 32 * 1024,
@@ -120,6 +130,9 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_temp_scan_interval = 7*24*60*60,
 	.mail_vsize_bg_after_count = 0,
 	.mail_sort_max_read_count = 0,
+	.mail_alt_tiering_cold_age = 0,
+	.mail_alt_tiering_hot_access_count = 3,
+	.mail_alt_tiering_interval = 24*60*60,
 	.mail_save_crlf = FALSE,
 	.mail_fsync = "optimized:never:always",
 	.mmap_disable = FALSE,
@@ -133,6 +146,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_full_filesystem_access = FALSE,
 	.maildir_stat_dirs = FALSE,
 	.mail_shared_explicit_inbox = FALSE,
+	.mail_index_log_group_commit = FALSE,
 	.lock_method = "fcntl:flock:dotlock",
 	.pop3_uidl_format = "%08Xu%08Xv",
 
@@ -20,6 +20,7 @@ struct mail_storage_settings {
 	uoff_t mail_attachment_min_size;
 	const char *mail_attribute_dict;
 	unsigned int mail_prefetch_count;
+	bool mail_read_async;
 	const char *mail_cache_fields;
 	const char *mail_always_cache_fields;
 	const char *mail_never_cache_fields;
@@ -33,6 +34,8 @@ struct mail_storage_settings {
 	unsigned int mail_cache_purge_delete_percentage;
 	unsigned int mail_cache_purge_continued_percentage;
 	unsigned int mail_cache_purge_header_continue_count;
+	uoff_t mail_cache_purge_incremental_min_size;
+	uoff_t mail_cache_purge_incremental_step_size;
 	uoff_t mail_index_rewrite_min_log_bytes;
 	uoff_t mail_index_rewrite_max_log_bytes;
 	uoff_t mail_index_log_rotate_min_size;
@@ -45,6 +48,9 @@ struct mail_storage_settings {
 	unsigned int mail_temp_scan_interval;
 	unsigned int mail_vsize_bg_after_count;
 	unsigned int mail_sort_max_read_count;
+	unsigned int mail_alt_tiering_cold_age;
+	unsigned int mail_alt_tiering_hot_access_count;
+	unsigned int mail_alt_tiering_interval;
 	bool mail_save_crlf;
 	const char *mail_fsync;
 	bool mmap_disable;
@@ -58,6 +64,7 @@ struct mail_storage_settings {
 	bool mail_full_filesystem_access;
 	bool maildir_stat_dirs;
 	bool mail_shared_explicit_inbox;
+	bool mail_index_log_group_commit;
 	const char *lock_method;
 	const char *pop3_uidl_format;
 
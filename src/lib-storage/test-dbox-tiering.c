@@ -0,0 +1,322 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "istream.h"
+#include "master-service.h"
+#include "mail-index.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+#include "mail-autoexpunge.h"
+#include "dbox-tiering.h"
+
+#include <dirent.h>
+
+#define TEST_MAIL(n) \
+	"From: <test@example.com>\n" \
+	"Subject: mail " n "\n" \
+	"\n" \
+	"body of mail " n "\n"
+
+static const char *const test_mails[] = {
+	TEST_MAIL("1"), TEST_MAIL("2")
+};
+
+struct test_dbox_tiering_driver {
+	const char *driver;
+	/* directories containing the mail files, relative to home */
+	const char *primary_dir, *alt_dir;
+	const char *file_prefix;
+};
+
+/* Read the mail's body, which counts as an access. */
+static void test_mail_read(struct mailbox *box, uint32_t seq)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *str = t_str_new(128);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	test_assert(mail_get_stream(mail, NULL, NULL, &input) == 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+	test_assert_strcmp(str_c(str), test_mails[seq-1]);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_mails_apply_moves(struct mailbox *box)
+{
+	/* sdbox moves the mails while syncing, mdbox while purging */
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+static unsigned int test_tiering_run(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	uint32_t seq, count = mail_index_view_get_messages_count(box->view);
+	unsigned int moved = 0;
+	int ret;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, MAIL_FETCH_SAVE_DATE, NULL);
+	for (seq = 1; seq <= count; seq++) {
+		mail_set_seq(mail, seq);
+		ret = dbox_tiering_mail_move(mail);
+		test_assert(ret >= 0);
+		if (ret > 0)
+			moved++;
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_mails_apply_moves(box);
+	return moved;
+}
+
+static void test_altmove(struct mailbox *box, uint32_t seq)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	mail_update_flags(mail, MODIFY_ADD,
+			  (enum mail_flags)MAIL_INDEX_MAIL_FLAG_BACKEND);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_mails_apply_moves(box);
+}
+
+static unsigned int
+test_count_files(struct mail_user *user, const char *dir, const char *prefix)
+{
+	const char *home, *path;
+	struct dirent *d;
+	DIR *dirp;
+	unsigned int count = 0;
+
+	test_assert(mail_user_get_home(user, &home) > 0);
+	path = t_strconcat(home, "/", dir, NULL);
+	dirp = opendir(path);
+	if (dirp == NULL) {
+		if (errno != ENOENT)
+			i_fatal("opendir(%s) failed: %m", path);
+		return 0;
+	}
+	while ((d = readdir(dirp)) != NULL) {
+		if (str_begins(d->d_name, prefix))
+			count++;
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", path);
+	return count;
+}
+
+static void test_dbox_tiering(const struct test_dbox_tiering_driver *driver)
+{
+	const char *const extra_input[] = {
+		"mail_alt_tiering_cold_age=1d",
+		"mail_alt_tiering_hot_access_count=2",
+		NULL
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = driver->driver,
+		.driver_opts = ":ALT=~/alt",
+		.extra_input = extra_input,
+	};
+	struct mailbox *box;
+	time_t orig_ioloop_time = ioloop_time;
+	unsigned int i;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	for (i = 0; i < N_ELEMENTS(test_mails); i++)
+		test_mail_save(box, test_mails[i], (time_t)-1);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_read(box, 1);
+
+	/* nothing is cold yet */
+	test_assert(test_tiering_run(box) == 0);
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) == 0);
+
+	/* mail 1 becomes cold, mail 2 was just accessed */
+	ioloop_time += 2*24*60*60;
+	test_mail_read(box, 2);
+	test_assert(test_tiering_run(box) == 1);
+	test_assert(test_count_files(ctx->user, driver->primary_dir,
+				     driver->file_prefix) == 1);
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) == 1);
+	test_assert(test_tiering_run(box) == 0);
+
+	/* mail 1 is accessed in two separate hours, so it becomes hot */
+	test_mail_read(box, 1);
+	test_assert(test_tiering_run(box) == 0);
+	ioloop_time += 2*60*60;
+	test_mail_read(box, 1);
+	test_assert(test_tiering_run(box) == 1);
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) == 0);
+
+	/* mail 2 is moved manually with altmove. tiering still sees that it's
+	   in alt storage, and moves it back once it becomes hot. */
+	test_altmove(box, 2);
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) == 1);
+	test_assert(test_tiering_run(box) == 0);
+	test_mail_read(box, 2);
+	test_assert(test_tiering_run(box) == 1);
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) == 0);
+
+	test_mail_read(box, 1);
+	test_mail_read(box, 2);
+
+	ioloop_time = orig_ioloop_time;
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+}
+
+static void
+test_dbox_tiering_user(const struct test_dbox_tiering_driver *driver)
+{
+	const char *const extra_input[] = {
+		"mail_alt_tiering_cold_age=1d",
+		"mail_alt_tiering_hot_access_count=2",
+		"mail_alt_tiering_interval=1d",
+		NULL
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = driver->driver,
+		.driver_opts = ":ALT=~/alt",
+		.extra_input = extra_input,
+	};
+	struct mailbox *box;
+	time_t orig_ioloop_time = ioloop_time;
+	unsigned int i;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	for (i = 0; i < N_ELEMENTS(test_mails); i++)
+		test_mail_save(box, test_mails[i], (time_t)-1);
+	test_assert(mailbox_sync(box, 0) == 0);
+
+	/* nothing is cold yet */
+	test_assert(dbox_tiering_user(ctx->user) == 0);
+
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) == 0);
+
+	/* the mails are moved in the background after the session */
+	ioloop_time += 2*24*60*60;
+	test_assert(mail_user_autoexpunge(ctx->user) == 0);
+	test_assert(test_count_files(ctx->user, driver->primary_dir,
+				     driver->file_prefix) == 0);
+	test_assert(test_count_files(ctx->user, driver->alt_dir,
+				     driver->file_prefix) > 0);
+
+	/* mail 2 becomes hot. it's moved back only after the interval has
+	   passed since the previous run. */
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_read(box, 2);
+	ioloop_time += 2*60*60;
+	test_mail_read(box, 2);
+	test_assert(dbox_tiering_user(ctx->user) == 0);
+	test_assert(test_count_files(ctx->user, driver->primary_dir,
+				     driver->file_prefix) == 0);
+	ioloop_time += 24*60*60;
+	test_assert(dbox_tiering_user(ctx->user) == 1);
+	test_assert(test_count_files(ctx->user, driver->primary_dir,
+				     driver->file_prefix) == 1);
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_read(box, 1);
+	test_mail_read(box, 2);
+
+	ioloop_time = orig_ioloop_time;
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+}
+
+static void test_dbox_tiering_sdbox(void)
+{
+	const struct test_dbox_tiering_driver driver = {
+		.driver = "sdbox",
+		.primary_dir = "mailboxes/INBOX/dbox-Mails",
+		.alt_dir = "alt/mailboxes/INBOX/dbox-Mails",
+		.file_prefix = "u.",
+	};
+
+	test_begin("dbox tiering sdbox");
+	test_dbox_tiering(&driver);
+	test_end();
+
+	test_begin("dbox tiering sdbox user");
+	test_dbox_tiering_user(&driver);
+	test_end();
+}
+
+static void test_dbox_tiering_mdbox(void)
+{
+	const struct test_dbox_tiering_driver driver = {
+		.driver = "mdbox",
+		.primary_dir = "storage",
+		.alt_dir = "alt/storage",
+		.file_prefix = "m.",
+	};
+
+	test_begin("dbox tiering mdbox");
+	test_dbox_tiering(&driver);
+	test_end();
+
+	test_begin("dbox tiering mdbox user");
+	test_dbox_tiering_user(&driver);
+	test_end();
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_dbox_tiering_sdbox,
+		test_dbox_tiering_mdbox,
+		NULL
+	};
+
+	master_service = master_service_init("test-dbox-tiering",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+
+	return ret;
+}
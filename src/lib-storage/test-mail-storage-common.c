@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "istream.h"
 #include "mkdir-parents.h"
 #include "unlink-directory.h"
 #include "path-util.h"
@@ -116,3 +117,71 @@ void test_mail_storage_deinit_user(struct test_mail_storage_ctx *ctx)
 	mail_user_deinit(&ctx->user);
 	mail_storage_service_user_unref(&ctx->service_user);
 }
+
+static int
+test_mail_save_trans(struct mailbox_transaction_context *trans,
+		     struct istream *input, time_t received_date)
+{
+	struct mail_save_context *save_ctx;
+	int ret;
+
+	save_ctx = mailbox_save_alloc(trans);
+	if (received_date != (time_t)-1)
+		mailbox_save_set_received_date(save_ctx, received_date, 0);
+	if (mailbox_save_begin(&save_ctx, input) < 0)
+		return -1;
+	do {
+		if (mailbox_save_continue(save_ctx) < 0) {
+			mailbox_save_cancel(&save_ctx);
+			return -1;
+		}
+	} while ((ret = i_stream_read(input)) > 0);
+	i_assert(ret == -1);
+	i_assert(input->stream_errno == 0);
+
+	return mailbox_save_finish(&save_ctx);
+}
+
+void test_mail_save(struct mailbox *box, const char *mail_input,
+		    time_t received_date)
+{
+	struct mailbox_transaction_context *trans;
+	struct istream *input;
+	int ret;
+
+	input = i_stream_create_from_data(mail_input, strlen(mail_input));
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	ret = test_mail_save_trans(trans, input, received_date);
+	i_stream_unref(&input);
+	if (ret < 0)
+		mailbox_transaction_rollback(&trans);
+	else
+		ret = mailbox_transaction_commit(&trans);
+	if (ret < 0) {
+		i_fatal("Failed to save mail: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("Failed to sync mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+}
+
+void test_mail_expunge(struct mailbox *box, uint32_t seq)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	mail_expunge(mail);
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&trans) < 0) {
+		i_fatal("Failed to expunge mail: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("Failed to sync mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+}
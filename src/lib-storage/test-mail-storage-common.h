@@ -27,4 +27,11 @@ void test_mail_storage_init_user(struct test_mail_storage_ctx *ctx,
 				 const struct test_mail_storage_settings *set);
 void test_mail_storage_deinit_user(struct test_mail_storage_ctx *ctx);
 
+/* Save the mail and sync the mailbox. received_date=(time_t)-1 uses the
+   default. Any failure is fatal. */
+void test_mail_save(struct mailbox *box, const char *mail_input,
+		    time_t received_date);
+/* Expunge the mail and sync the mailbox. Any failure is fatal. */
+void test_mail_expunge(struct mailbox *box, uint32_t seq);
+
 #endif
@@ -2,59 +2,16 @@
 
 #include "lib.h"
 #include "test-common.h"
+#include "buffer.h"
 #include "istream.h"
 #include "master-service.h"
 #include "message-size.h"
+#include "mail-cache.h"
+#include "mail-search-build.h"
 #include "test-mail-storage-common.h"
 
 static struct event *test_event;
 
-static int
-test_mail_save_trans(struct mailbox_transaction_context *trans,
-		     struct istream *input)
-{
-	struct mail_save_context *save_ctx;
-	int ret;
-
-	save_ctx = mailbox_save_alloc(trans);
-	if (mailbox_save_begin(&save_ctx, input) < 0)
-		return -1;
-	do {
-		if (mailbox_save_continue(save_ctx) < 0) {
-			mailbox_save_cancel(&save_ctx);
-			return -1;
-		}
-	} while ((ret = i_stream_read(input)) > 0);
-	i_assert(ret == -1);
-	i_assert(input->stream_errno == 0);
-
-	return mailbox_save_finish(&save_ctx);
-}
-
-static void test_mail_save(struct mailbox *box, const char *mail_input)
-{
-	struct mailbox_transaction_context *trans;
-	struct istream *input;
-	int ret;
-
-	input = i_stream_create_from_data(mail_input, strlen(mail_input));
-	trans = mailbox_transaction_begin(box,
-			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
-	ret = test_mail_save_trans(trans, input);
-	i_stream_unref(&input);
-	if (ret < 0)
-		mailbox_transaction_rollback(&trans);
-	else
-		ret = mailbox_transaction_commit(&trans);
-	if (ret < 0) {
-		i_fatal("Failed to save mail: %s",
-			mailbox_get_last_internal_error(box, NULL));
-	}
-	if (mailbox_sync(box, 0) < 0)
-		i_fatal("Failed to sync mailbox: %s",
-			mailbox_get_last_internal_error(box, NULL));
-}
-
 static void test_mail_remove_keywords(struct mailbox *box)
 {
 	struct mailbox_transaction_context *trans;
@@ -318,7 +275,7 @@ static void test_mail_random_access(void)
 			       "To: <test1-dest@example.com>\n"
 			       "Subject: test subject\n"
 			       "\n"
-			       "test body\n");
+			       "test body\n", (time_t)-1);
 		test_mail_remove_keywords(box);
 		e_debug(test_event, "--------------");
 		for (unsigned int j = 0; j < 3; j++)
@@ -357,7 +314,7 @@ static void test_attachment_flags_during_header_fetch(void)
 	test_mail_save(box,
 		       TEST_HDR_FROM
 		       "\r\n"
-		       "test body\n");
+		       "test body\n", (time_t)-1);
 	/* Remove the $HasNoAttachment keyword */
 	test_mail_remove_keywords(box);
 
@@ -417,7 +374,7 @@ static void test_bodystructure_reparsing(void)
 	test_mail_save(box,
 		       "From: <test1@example.com>\r\n"
 		       "\r\n"
-		       "test body\n");
+		       "test body\n", (time_t)-1);
 
 	struct mailbox_transaction_context *trans =
 		mailbox_transaction_begin(box, 0, __func__);
@@ -456,7 +413,7 @@ static void test_bodystructure_corruption_reparsing(void)
 	test_mail_save(box,
 		       "From: <test1@example.com>\r\n"
 		       "\r\n"
-		       "test body\n");
+		       "test body\n", (time_t)-1);
 
 	struct mailbox_transaction_context *trans =
 		mailbox_transaction_begin(box, 0, __func__);
@@ -477,6 +434,93 @@ static void test_bodystructure_corruption_reparsing(void)
 	test_end();
 }
 
+static bool test_mail_search_bloom_cached(struct mailbox *box, uint32_t seq)
+{
+	struct mail_cache_view *cache_view;
+	buffer_t *buf = t_buffer_create(64);
+	unsigned int field_idx;
+	int ret;
+
+	field_idx = mail_cache_register_lookup(box->cache, "search.bloom");
+	if (field_idx == UINT_MAX)
+		return FALSE;
+	cache_view = mail_cache_view_open(box->cache, box->view);
+	ret = mail_cache_lookup_field(cache_view, buf, seq, field_idx);
+	mail_cache_view_close(&cache_view);
+	return ret > 0;
+}
+
+static unsigned int
+test_mail_search_text_count(struct mailbox *box, const char *key)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+	struct mail *mail;
+	unsigned int count = 0;
+
+	args = mail_search_build_init();
+	arg = mail_search_build_add(args, SEARCH_TEXT);
+	arg->value.str = p_strdup(args->pool, key);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_ctx = mailbox_search_init(trans, args, NULL, 0, NULL);
+	while (mailbox_search_next(search_ctx, &mail))
+		count++;
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mail_search_args_unref(&args);
+	return count;
+}
+
+static void test_search_bloom_from_save_parsing(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = (const char *const[]) {
+			"mail_always_cache_fields=search.bloom",
+			NULL
+		},
+	};
+
+	test_begin("mail search bloom from save parsing");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+
+	struct mailbox *box =
+		mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	test_mail_save(box,
+		       "From: <test1@example.com>\r\n"
+		       "Subject: hello\r\n"
+		       "Content-Type: text/plain; charset=utf-8\r\n"
+		       "Content-Transfer-Encoding: quoted-printable\r\n"
+		       "\r\n"
+		       "encoded p=C3=A4iv=C3=A4=C3=A4 body\r\n", (time_t)-1);
+	test_mail_save(box,
+		       "From: <test2@example.com>\r\n"
+		       "\r\n"
+		       "other body\n", (time_t)-1);
+	T_BEGIN {
+		test_assert(test_mail_search_bloom_cached(box, 1));
+		test_assert(test_mail_search_bloom_cached(box, 2));
+	} T_END;
+
+	/* keys are found from both the header and the decoded body */
+	test_assert(test_mail_search_text_count(box, "hello") == 1);
+	test_assert(test_mail_search_text_count(box, "päivää") == 1);
+	test_assert(test_mail_search_text_count(box, "body") == 2);
+	test_assert(test_mail_search_text_count(box, "nonexistent") == 0);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
 int main(int argc, char **argv)
 {
 	void (*const tests[])(void) = {
@@ -484,6 +528,7 @@ int main(int argc, char **argv)
 		test_attachment_flags_during_header_fetch,
 		test_bodystructure_reparsing,
 		test_bodystructure_corruption_reparsing,
+		test_search_bloom_from_save_parsing,
 		NULL
 	};
 	int ret;
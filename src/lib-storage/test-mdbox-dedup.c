@@ -0,0 +1,405 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "istream.h"
+#include "mkdir-parents.h"
+#include "master-service.h"
+#include "mail-index.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* large enough that sharing the body is clearly visible in the file sizes */
+#define TEST_BODY_LINES 200
+
+struct test_storage_files {
+	unsigned int count;
+	uoff_t size;
+	/* contents of all the files */
+	string_t *data;
+};
+
+static const char *test_body(const char *name)
+{
+	string_t *str = t_str_new(TEST_BODY_LINES * 64);
+	unsigned int i;
+
+	for (i = 0; i < TEST_BODY_LINES; i++)
+		str_printfa(str, "body of mail %s, line %u\n", name, i);
+	return str_c(str);
+}
+
+static const char *test_mail(const char *name)
+{
+	return t_strdup_printf("From: <test@example.com>\n"
+			       "Subject: mail %s\n"
+			       "\n%s", name, test_body(name));
+}
+
+static const char *test_lmtp_mail(const char *rcpt, const char *mail)
+{
+	/* LMTP adds these headers separately for each recipient */
+	return t_strdup_printf("Return-Path: <sender@example.com>\n"
+			       "Delivered-To: <%s>\n%s", rcpt, mail);
+}
+
+static void
+test_mail_check(struct mailbox *box, uint32_t seq, const char *expected,
+		const char **guid_r)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	const char *guid;
+	uoff_t size;
+	size_t data_size;
+	string_t *str = t_str_new(strlen(expected));
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	test_assert(mail_get_stream(mail, NULL, NULL, &input) == 0);
+	while (i_stream_read_more(input, &data, &data_size) > 0) {
+		str_append_data(str, data, data_size);
+		i_stream_skip(input, data_size);
+	}
+	test_assert(input->stream_errno == 0);
+	test_assert_strcmp(str_c(str), expected);
+	test_assert(mail_get_physical_size(mail, &size) == 0);
+	test_assert(size == strlen(expected));
+	test_assert(mail_get_special(mail, MAIL_FETCH_GUID, &guid) == 0);
+	if (guid_r != NULL)
+		*guid_r = t_strdup(guid);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void
+test_storage_files_get(const char *dir, struct test_storage_files *files_r)
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dirp;
+
+	i_zero(files_r);
+	files_r->data = t_str_new(1024);
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	while ((d = readdir(dirp)) != NULL) {
+		if (!str_begins(d->d_name, "m."))
+			continue;
+		const char *path = t_strconcat(dir, "/", d->d_name, NULL);
+		int fd = open(path, O_RDONLY);
+		if (fd == -1)
+			i_fatal("open(%s) failed: %m", path);
+		if (fstat(fd, &st) < 0)
+			i_fatal("fstat(%s) failed: %m", path);
+		void *buf = buffer_append_space_unsafe(files_r->data,
+						       st.st_size);
+		if (read(fd, buf, st.st_size) != st.st_size)
+			i_fatal("read(%s) failed: %m", path);
+		i_close_fd(&fd);
+		files_r->size += st.st_size;
+		files_r->count++;
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", dir);
+}
+
+static void
+test_user_storage_files(struct mail_user *user,
+			struct test_storage_files *files_r)
+{
+	const char *home;
+
+	test_assert(mail_user_get_home(user, &home) > 0);
+	test_storage_files_get(t_strconcat(home, "/storage", NULL), files_r);
+}
+
+static struct mailbox *
+test_mailbox_open(struct test_mail_storage_ctx *ctx, const char *vname)
+{
+	struct mailbox *box;
+
+	box = mailbox_alloc(ctx->user->namespaces->list, vname, 0);
+	if (strcmp(vname, "INBOX") != 0)
+		test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	test_assert(mailbox_open(box) == 0);
+	return box;
+}
+
+static struct test_mail_storage_ctx *test_dedup_init(bool rotate_every_mail)
+{
+	const char *const extra_input[] = {
+		"mdbox_dedup=yes",
+		rotate_every_mail ? "mdbox_rotate_size=1" : NULL,
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.extra_input = extra_input,
+	};
+	struct test_mail_storage_ctx *ctx;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	return ctx;
+}
+
+static void test_dedup_deinit(struct test_mail_storage_ctx **_ctx)
+{
+	struct test_mail_storage_ctx *ctx = *_ctx;
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(_ctx);
+}
+
+static void test_mdbox_dedup_hit(bool rotate_every_mail)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_storage_files files, files2;
+	struct mailbox *box;
+	const char *mail1 = test_mail("1"), *mail2 = test_mail("2");
+	const char *guid1, *guid2;
+
+	ctx = test_dedup_init(rotate_every_mail);
+	box = test_mailbox_open(ctx, "INBOX");
+
+	test_mail_save(box, mail1, (time_t)-1);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.count == 1);
+
+	/* only the duplicate's header and metadata are kept */
+	test_mail_save(box, mail1, (time_t)-1);
+	test_user_storage_files(ctx->user, &files2);
+	test_assert(files2.count == (rotate_every_mail ? 2 : 1));
+	test_assert(files2.size > files.size);
+	test_assert(files2.size - files.size < strlen(test_body("1")));
+
+	/* a different body is written */
+	files = files2;
+	test_mail_save(box, mail2, (time_t)-1);
+	test_user_storage_files(ctx->user, &files2);
+	test_assert(files2.size - files.size > strlen(test_body("2")));
+
+	test_mail_check(box, 1, mail1, &guid1);
+	test_mail_check(box, 2, mail1, &guid2);
+	test_mail_check(box, 3, mail2, NULL);
+	/* each mail has its own GUID */
+	test_assert(strcmp(guid1, guid2) != 0);
+
+	mailbox_free(&box);
+	test_dedup_deinit(&ctx);
+}
+
+static void test_mdbox_dedup_hits(void)
+{
+	test_begin("mdbox dedup hit");
+	test_mdbox_dedup_hit(FALSE);
+	test_end();
+
+	test_begin("mdbox dedup hit with a new file");
+	test_mdbox_dedup_hit(TRUE);
+	test_end();
+}
+
+static void test_mdbox_dedup_metadata(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_storage_files files, files2;
+	struct mailbox *box, *box2;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	const char *mail1 = test_mail("1");
+	time_t date, received_date = ioloop_time - 3600;
+
+	test_begin("mdbox dedup metadata");
+	ctx = test_dedup_init(FALSE);
+	box = test_mailbox_open(ctx, "INBOX");
+	box2 = test_mailbox_open(ctx, "Other");
+
+	test_mail_save(box, mail1, received_date);
+	test_user_storage_files(ctx->user, &files);
+
+	/* the received date and the original mailbox differ, but the body
+	   is still shared */
+	test_mail_save(box2, mail1, (time_t)-1);
+	test_user_storage_files(ctx->user, &files2);
+	test_assert(files2.size - files.size < strlen(test_body("1")));
+
+	/* both are stored for each mail */
+	test_assert(strstr(str_c(files2.data), t_strdup_printf(
+		"\nR%"PRIxTIME_T"\n", received_date)) != NULL);
+	test_assert(strstr(str_c(files2.data), t_strdup_printf(
+		"\nR%"PRIxTIME_T"\n", ioloop_time)) != NULL);
+	test_assert(strstr(str_c(files2.data), "\nBINBOX\n") != NULL);
+	test_assert(strstr(str_c(files2.data), "\nBOther\n") != NULL);
+
+	trans = mailbox_transaction_begin(box2, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	test_assert(mail_get_received_date(mail, &date) == 0);
+	test_assert(date == ioloop_time);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+
+	test_mail_check(box, 1, mail1, NULL);
+	test_mail_check(box2, 1, mail1, NULL);
+
+	mailbox_free(&box);
+	mailbox_free(&box2);
+	test_dedup_deinit(&ctx);
+	test_end();
+}
+
+static const char *
+test_lmtp_deliver(struct test_mail_storage_ctx *ctx, const char *username,
+		  const char *shared_storage_dir, const char *mail_input)
+{
+	const char *const extra_input[] = {
+		"mdbox_dedup=yes",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.username = username,
+		.driver = "mdbox",
+		.extra_input = extra_input,
+	};
+	struct mailbox *box;
+	const char *home, *storage_dir;
+
+	test_mail_storage_init_user(ctx, &set);
+	test_assert(mail_user_get_home(ctx->user, &home) > 0);
+	storage_dir = t_strconcat(home, "/storage", NULL);
+	if (shared_storage_dir != NULL) {
+		/* the users have their own mailboxes, but share the
+		   storage */
+		if (mkdir_parents(home, 0700) < 0 && errno != EEXIST)
+			i_fatal("mkdir_parents(%s) failed: %m", home);
+		if (symlink(shared_storage_dir, storage_dir) < 0)
+			i_fatal("symlink(%s) failed: %m", storage_dir);
+	}
+
+	box = test_mailbox_open(ctx, "INBOX");
+	test_mail_save(box, mail_input, (time_t)-1);
+	test_mail_check(box, 1, mail_input, NULL);
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	return storage_dir;
+}
+
+static void test_mdbox_dedup_lmtp(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_storage_files files, files2;
+	const char *storage_dir, *mail1 = test_mail("1");
+	const char *mail_user1 = test_lmtp_mail("user1@example.com", mail1);
+	const char *mail_user2 = test_lmtp_mail("user2@example.com", mail1);
+
+	test_begin("mdbox dedup LMTP delivery to multiple users");
+	ctx = test_mail_storage_init();
+
+	storage_dir = test_lmtp_deliver(ctx, "user1", NULL, mail_user1);
+	test_storage_files_get(storage_dir, &files);
+
+	/* the headers differ, but the body is shared */
+	(void)test_lmtp_deliver(ctx, "user2", storage_dir, mail_user2);
+	test_storage_files_get(storage_dir, &files2);
+	test_assert(files2.size > files.size);
+	test_assert(files2.size - files.size < strlen(test_body("1")));
+	test_assert(strstr(str_c(files2.data),
+			   "Delivered-To: <user2@example.com>") != NULL);
+
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static void test_mdbox_dedup_refcount(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_storage_files files;
+	struct mailbox *box;
+	const char *mail1 = test_mail("1");
+
+	test_begin("mdbox dedup refcount");
+	ctx = test_dedup_init(TRUE);
+	box = test_mailbox_open(ctx, "INBOX");
+
+	test_mail_save(box, mail1, (time_t)-1);
+	test_mail_save(box, mail1, (time_t)-1);
+	test_mail_save(box, mail1, (time_t)-1);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.count == 3);
+
+	/* the body is kept while any mail refers to it */
+	test_mail_expunge(box, 1);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.count == 3);
+	test_mail_check(box, 1, mail1, NULL);
+	test_mail_check(box, 2, mail1, NULL);
+
+	/* the mails referring to the body are purged */
+	test_mail_expunge(box, 1);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.count == 2);
+	test_mail_check(box, 1, mail1, NULL);
+
+	/* a new duplicate refers to the same body again */
+	test_mail_save(box, mail1, (time_t)-1);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.count == 3);
+	test_assert(files.size < 2 * strlen(mail1));
+
+	/* the body is purged in the same run as the last mail using it */
+	test_mail_expunge(box, 2);
+	test_mail_expunge(box, 1);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.count == 0);
+
+	/* an expunged body isn't reused */
+	test_mail_save(box, mail1, (time_t)-1);
+	test_user_storage_files(ctx->user, &files);
+	test_assert(files.size > strlen(mail1));
+	test_mail_check(box, 1, mail1, NULL);
+
+	mailbox_free(&box);
+	test_dedup_deinit(&ctx);
+	test_end();
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_mdbox_dedup_hits,
+		test_mdbox_dedup_metadata,
+		test_mdbox_dedup_lmtp,
+		test_mdbox_dedup_refcount,
+		NULL
+	};
+
+	master_service = master_service_init("test-mdbox-dedup",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+
+	return ret;
+}
@@ -0,0 +1,221 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#define _GNU_SOURCE /* for copy_file_range() */
+#include "lib.h"
+#include "str.h"
+#include "ioloop.h"
+#include "time-util.h"
+#include "istream.h"
+#include "master-service.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <unistd.h>
+
+#define TEST_MAIL(n) \
+	"From: <test@example.com>\n" \
+	"Subject: mail " n "\n" \
+	"\n" \
+	"body of mail " n "\n"
+
+static const char *const test_mails[] = {
+	TEST_MAIL("1"), TEST_MAIL("2"), TEST_MAIL("3")
+};
+
+#ifdef HAVE_COPY_FILE_RANGE
+static unsigned int test_copy_file_range_calls;
+static int test_copy_file_range_errno;
+
+/* Override libc's copy_file_range() so both the successful path and the
+   fallback for filesystems that don't support it can be tested. */
+ssize_t copy_file_range(int in_fd, loff_t *in_offset, int out_fd,
+			loff_t *out_offset, size_t len,
+			unsigned int flags ATTR_UNUSED)
+{
+	unsigned char buf[1024];
+	ssize_t ret;
+
+	test_copy_file_range_calls++;
+	if (test_copy_file_range_errno != 0) {
+		errno = test_copy_file_range_errno;
+		return -1;
+	}
+
+	ret = pread(in_fd, buf, I_MIN(len, sizeof(buf)), *in_offset);
+	if (ret <= 0)
+		return ret;
+	if (pwrite(out_fd, buf, ret, *out_offset) != ret)
+		return -1;
+	*in_offset += ret;
+	*out_offset += ret;
+	return ret;
+}
+#endif
+
+static void test_mail_check(struct mailbox *box, uint32_t seq,
+			    const char *expected)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *str = t_str_new(128);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	test_assert(mail_get_stream(mail, NULL, NULL, &input) == 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+	test_assert_strcmp(str_c(str), expected);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_mdbox_purge_copy(int copy_errno)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+	};
+	struct mailbox *box;
+	unsigned int i;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	/* all the mails are in the same m.* file. expunging the second one
+	   makes purging copy the other two to a new file. */
+	for (i = 0; i < N_ELEMENTS(test_mails); i++)
+		test_mail_save(box, test_mails[i], (time_t)-1);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_expunge(box, 2);
+
+#ifdef HAVE_COPY_FILE_RANGE
+	test_copy_file_range_calls = 0;
+	test_copy_file_range_errno = copy_errno;
+#endif
+	test_assert(mail_storage_purge(box->storage) == 0);
+#ifdef HAVE_COPY_FILE_RANGE
+	if (copy_errno == 0)
+		test_assert(test_copy_file_range_calls >= 2);
+	else {
+		/* the first failure disables copy_file_range() */
+		test_assert(test_copy_file_range_calls == 1);
+	}
+#else
+	(void)copy_errno;
+#endif
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_check(box, 1, test_mails[0]);
+	test_mail_check(box, 2, test_mails[2]);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+}
+
+static void test_mdbox_purge_copy_file_range(void)
+{
+	test_begin("mdbox purge copy_file_range");
+	test_mdbox_purge_copy(0);
+	test_end();
+}
+
+static void test_mdbox_purge_copy_file_range_fallback(void)
+{
+	test_begin("mdbox purge copy_file_range fallback (EXDEV)");
+	test_mdbox_purge_copy(EXDEV);
+	test_end();
+
+	test_begin("mdbox purge copy_file_range fallback (ENOSYS)");
+	test_mdbox_purge_copy(ENOSYS);
+	test_end();
+}
+
+static void test_mdbox_purge_throttle_timeout(bool *fired)
+{
+	*fired = TRUE;
+}
+
+static void test_mdbox_purge_throttle(void)
+{
+	const char *const extra_input[] = {
+		"mdbox_purge_max_iops=50",
+		NULL
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.extra_input = extra_input,
+	};
+	struct mailbox *box;
+	struct timeout *to;
+	struct timeval start, end;
+	unsigned int i;
+	bool fired = FALSE;
+
+	test_begin("mdbox purge throttle");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	for (i = 0; i < N_ELEMENTS(test_mails); i++)
+		test_mail_save(box, test_mails[i], (time_t)-1);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_expunge(box, 2);
+
+	/* 3 messages + 1 file at 50 IOPS takes 80ms. the last wait may be
+	   skipped if it's too short. the caller's ioloop isn't run while
+	   waiting. */
+	to = timeout_add_short(1, test_mdbox_purge_throttle_timeout, &fired);
+	i_gettimeofday(&start);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	i_gettimeofday(&end);
+	timeout_remove(&to);
+	test_assert(timeval_diff_msecs(&end, &start) >= 80 - 10);
+	test_assert(!fired);
+	test_assert(current_ioloop == ctx->ioloop);
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_mail_check(box, 1, test_mails[0]);
+	test_mail_check(box, 2, test_mails[2]);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_mdbox_purge_copy_file_range,
+		test_mdbox_purge_copy_file_range_fallback,
+		test_mdbox_purge_throttle,
+		NULL
+	};
+
+	master_service = master_service_init("test-mdbox-purge",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+
+	return ret;
+}
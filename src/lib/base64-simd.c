@@ -0,0 +1,505 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "base64.h"
+#include "base64-simd.h"
+
+/* The x86 kernels are compiled with target attributes, so the rest of the
+   code doesn't need to be built with -mavx2 etc. The right kernel is picked
+   at runtime with __builtin_cpu_supports(). */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__))
+#  define BASE64_SIMD_X86
+#  include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  define BASE64_SIMD_NEON
+#  include <arm_neon.h>
+#endif
+
+typedef size_t
+base64_simd_func_t(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size);
+
+struct base64_simd_kernel {
+	const char *name;
+	/* The kernel computes the alphabet from ranges, so it works only with
+	   schemes that have the standard A-Z, a-z, 0-9 alphabet. The last two
+	   characters can differ. */
+	bool std_alphabet_only;
+	base64_simd_func_t *encode;
+	base64_simd_func_t *decode;
+};
+
+#ifdef BASE64_SIMD_X86
+
+/*
+ * SSE4.1 kernel
+ */
+
+#define BASE64_TARGET_SSE41 __attribute__((target("sse4.1")))
+
+static inline __m128i BASE64_TARGET_SSE41
+base64_sse41_enc_reshuffle(__m128i in)
+{
+	/* Spread the 12 input bytes to 16 bytes, so that each 32-bit lane
+	   contains the 3 bytes needed for 4 output characters. Then shift
+	   each 6-bit field into its own byte. */
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1));
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+static inline __m128i BASE64_TARGET_SSE41
+base64_sse41_enc_translate(__m128i idx, char c62, char c63)
+{
+	__m128i offset, out;
+
+	offset = _mm_set1_epi8('A');
+	offset = _mm_blendv_epi8(offset, _mm_set1_epi8('a' - 26),
+				 _mm_cmpgt_epi8(idx, _mm_set1_epi8(25)));
+	offset = _mm_blendv_epi8(offset, _mm_set1_epi8('0' - 52),
+				 _mm_cmpgt_epi8(idx, _mm_set1_epi8(51)));
+	out = _mm_add_epi8(idx, offset);
+	out = _mm_blendv_epi8(out, _mm_set1_epi8(c62),
+			      _mm_cmpeq_epi8(idx, _mm_set1_epi8(62)));
+	out = _mm_blendv_epi8(out, _mm_set1_epi8(c63),
+			      _mm_cmpeq_epi8(idx, _mm_set1_epi8(63)));
+	return out;
+}
+
+/* Translate characters to their 6-bit values. Returns FALSE if there are
+   any non-base64 characters. */
+static inline bool BASE64_TARGET_SSE41
+base64_sse41_dec_translate(__m128i in, char c62, char c63, __m128i *out_r)
+{
+	const __m128i upper =
+		_mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+			      _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+	const __m128i lower =
+		_mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+			      _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+	const __m128i digit =
+		_mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+			      _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+	const __m128i eq62 = _mm_cmpeq_epi8(in, _mm_set1_epi8(c62));
+	const __m128i eq63 = _mm_cmpeq_epi8(in, _mm_set1_epi8(c63));
+	__m128i valid, shift;
+
+	valid = _mm_or_si128(_mm_or_si128(upper, lower),
+			     _mm_or_si128(digit, _mm_or_si128(eq62, eq63)));
+	if (_mm_movemask_epi8(valid) != 0xffff)
+		return FALSE;
+
+	shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+	shift = _mm_or_si128(shift, _mm_and_si128(lower,
+		_mm_set1_epi8(26 - 'a')));
+	shift = _mm_or_si128(shift, _mm_and_si128(digit,
+		_mm_set1_epi8(52 - '0')));
+	shift = _mm_or_si128(shift, _mm_and_si128(eq62,
+		_mm_set1_epi8((char)(62 - c62))));
+	shift = _mm_or_si128(shift, _mm_and_si128(eq63,
+		_mm_set1_epi8((char)(63 - c63))));
+	*out_r = _mm_add_epi8(in, shift);
+	return TRUE;
+}
+
+static inline __m128i BASE64_TARGET_SSE41
+base64_sse41_dec_pack(__m128i values)
+{
+	/* combine the 6-bit values into 24-bit groups in each 32-bit lane,
+	   and then pack the 3-byte groups together */
+	const __m128i ab_bc =
+		_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	const __m128i abcd =
+		_mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4,
+						    10, 9, 8, 14, 13, 12,
+						    -1, -1, -1, -1));
+}
+
+static size_t BASE64_TARGET_SSE41
+base64_sse41_encode(const struct base64_scheme *b64,
+		    const unsigned char *src, size_t src_size,
+		    unsigned char *dest, size_t dest_size)
+{
+	const char c62 = b64->encmap[62], c63 = b64->encmap[63];
+	size_t src_pos = 0, dest_pos = 0;
+
+	/* each round reads 16 bytes, but consumes only 12 */
+	while (src_size - src_pos >= 16 && dest_size - dest_pos >= 16) {
+		__m128i in = _mm_loadu_si128((const void *)(src + src_pos));
+		__m128i out = base64_sse41_enc_translate(
+			base64_sse41_enc_reshuffle(in), c62, c63);
+		_mm_storeu_si128((void *)(dest + dest_pos), out);
+		src_pos += 12;
+		dest_pos += 16;
+	}
+	return src_pos;
+}
+
+static size_t BASE64_TARGET_SSE41
+base64_sse41_decode(const struct base64_scheme *b64,
+		    const unsigned char *src, size_t src_size,
+		    unsigned char *dest, size_t dest_size)
+{
+	const char c62 = b64->encmap[62], c63 = b64->encmap[63];
+	size_t src_pos = 0, dest_pos = 0;
+	__m128i values;
+
+	/* each round writes 16 bytes, but only 12 of them are used */
+	while (src_size - src_pos >= 16 && dest_size - dest_pos >= 16) {
+		__m128i in = _mm_loadu_si128((const void *)(src + src_pos));
+		if (!base64_sse41_dec_translate(in, c62, c63, &values))
+			break;
+		_mm_storeu_si128((void *)(dest + dest_pos),
+				 base64_sse41_dec_pack(values));
+		src_pos += 16;
+		dest_pos += 12;
+	}
+	return src_pos;
+}
+
+/*
+ * AVX2 kernel
+ */
+
+#define BASE64_TARGET_AVX2 __attribute__((target("avx2")))
+
+static inline __m256i BASE64_TARGET_AVX2
+base64_avx2_enc_reshuffle(__m256i in)
+{
+	/* same as base64_sse41_enc_reshuffle(), but for both 128-bit lanes */
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(t1, t3);
+}
+
+static inline __m256i BASE64_TARGET_AVX2
+base64_avx2_enc_translate(__m256i idx, char c62, char c63)
+{
+	__m256i offset, out;
+
+	offset = _mm256_set1_epi8('A');
+	offset = _mm256_blendv_epi8(offset, _mm256_set1_epi8('a' - 26),
+		_mm256_cmpgt_epi8(idx, _mm256_set1_epi8(25)));
+	offset = _mm256_blendv_epi8(offset, _mm256_set1_epi8('0' - 52),
+		_mm256_cmpgt_epi8(idx, _mm256_set1_epi8(51)));
+	out = _mm256_add_epi8(idx, offset);
+	out = _mm256_blendv_epi8(out, _mm256_set1_epi8(c62),
+		_mm256_cmpeq_epi8(idx, _mm256_set1_epi8(62)));
+	out = _mm256_blendv_epi8(out, _mm256_set1_epi8(c63),
+		_mm256_cmpeq_epi8(idx, _mm256_set1_epi8(63)));
+	return out;
+}
+
+static inline __m256i BASE64_TARGET_AVX2
+base64_avx2_in_range(__m256i in, char first, char last)
+{
+	return _mm256_and_si256(
+		_mm256_cmpgt_epi8(in, _mm256_set1_epi8(first - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8(last + 1), in));
+}
+
+static inline bool BASE64_TARGET_AVX2
+base64_avx2_dec_translate(__m256i in, char c62, char c63, __m256i *out_r)
+{
+	const __m256i upper = base64_avx2_in_range(in, 'A', 'Z');
+	const __m256i lower = base64_avx2_in_range(in, 'a', 'z');
+	const __m256i digit = base64_avx2_in_range(in, '0', '9');
+	const __m256i eq62 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(c62));
+	const __m256i eq63 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(c63));
+	__m256i valid, shift;
+
+	valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+		_mm256_or_si256(digit, _mm256_or_si256(eq62, eq63)));
+	if ((unsigned int)_mm256_movemask_epi8(valid) != 0xffffffffU)
+		return FALSE;
+
+	shift = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+	shift = _mm256_or_si256(shift, _mm256_and_si256(lower,
+		_mm256_set1_epi8(26 - 'a')));
+	shift = _mm256_or_si256(shift, _mm256_and_si256(digit,
+		_mm256_set1_epi8(52 - '0')));
+	shift = _mm256_or_si256(shift, _mm256_and_si256(eq62,
+		_mm256_set1_epi8((char)(62 - c62))));
+	shift = _mm256_or_si256(shift, _mm256_and_si256(eq63,
+		_mm256_set1_epi8((char)(63 - c63))));
+	*out_r = _mm256_add_epi8(in, shift);
+	return TRUE;
+}
+
+static inline __m256i BASE64_TARGET_AVX2
+base64_avx2_dec_pack(__m256i values)
+{
+	const __m256i ab_bc =
+		_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+	const __m256i abcd =
+		_mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+	const __m256i packed = _mm256_shuffle_epi8(abcd, _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	/* move the 12 bytes from the high lane right after the low lane's */
+	return _mm256_permutevar8x32_epi32(packed,
+		_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+}
+
+static size_t BASE64_TARGET_AVX2
+base64_avx2_encode(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size)
+{
+	const char c62 = b64->encmap[62], c63 = b64->encmap[63];
+	size_t src_pos = 0, dest_pos = 0;
+
+	/* each round reads 28 bytes, but consumes only 24 */
+	while (src_size - src_pos >= 28 && dest_size - dest_pos >= 32) {
+		__m128i lo = _mm_loadu_si128((const void *)(src + src_pos));
+		__m128i hi = _mm_loadu_si128((const void *)(src + src_pos + 12));
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(lo), hi, 1);
+		__m256i out = base64_avx2_enc_translate(
+			base64_avx2_enc_reshuffle(in), c62, c63);
+		_mm256_storeu_si256((void *)(dest + dest_pos), out);
+		src_pos += 24;
+		dest_pos += 32;
+	}
+	return src_pos + base64_sse41_encode(b64, src + src_pos,
+					     src_size - src_pos,
+					     dest + dest_pos,
+					     dest_size - dest_pos);
+}
+
+static size_t BASE64_TARGET_AVX2
+base64_avx2_decode(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size)
+{
+	const char c62 = b64->encmap[62], c63 = b64->encmap[63];
+	size_t src_pos = 0, dest_pos = 0;
+	__m256i values;
+
+	/* each round writes 32 bytes, but only 24 of them are used */
+	while (src_size - src_pos >= 32 && dest_size - dest_pos >= 32) {
+		__m256i in = _mm256_loadu_si256((const void *)(src + src_pos));
+		if (!base64_avx2_dec_translate(in, c62, c63, &values))
+			break;
+		_mm256_storeu_si256((void *)(dest + dest_pos),
+				    base64_avx2_dec_pack(values));
+		src_pos += 32;
+		dest_pos += 24;
+	}
+	/* handle the remaining 16 byte block, or the first half of the block
+	   that had non-base64 characters */
+	return src_pos + base64_sse41_decode(b64, src + src_pos,
+					     src_size - src_pos,
+					     dest + dest_pos,
+					     dest_size - dest_pos);
+}
+
+static const struct base64_simd_kernel base64_simd_avx2 = {
+	.name = "avx2",
+	.std_alphabet_only = TRUE,
+	.encode = base64_avx2_encode,
+	.decode = base64_avx2_decode,
+};
+
+static const struct base64_simd_kernel base64_simd_sse41 = {
+	.name = "sse4.1",
+	.std_alphabet_only = TRUE,
+	.encode = base64_sse41_encode,
+	.decode = base64_sse41_decode,
+};
+
+#endif
+
+#ifdef BASE64_SIMD_NEON
+
+/*
+ * NEON kernel
+ *
+ * NEON has 64 byte table lookups, so this works directly with the scheme's
+ * encmap and decmap.
+ */
+
+static inline uint8x16x4_t base64_neon_load_table(const unsigned char *table)
+{
+	uint8x16x4_t tbl;
+
+	tbl.val[0] = vld1q_u8(table);
+	tbl.val[1] = vld1q_u8(table + 16);
+	tbl.val[2] = vld1q_u8(table + 32);
+	tbl.val[3] = vld1q_u8(table + 48);
+	return tbl;
+}
+
+static size_t
+base64_neon_encode(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size)
+{
+	const uint8x16x4_t tbl =
+		base64_neon_load_table((const unsigned char *)b64->encmap);
+	const uint8x16_t mask = vdupq_n_u8(0x3f);
+	size_t src_pos = 0, dest_pos = 0;
+	uint8x16x3_t in;
+	uint8x16x4_t idx, out;
+
+	while (src_size - src_pos >= 48 && dest_size - dest_pos >= 64) {
+		in = vld3q_u8(src + src_pos);
+		idx.val[0] = vshrq_n_u8(in.val[0], 2);
+		idx.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4),
+					       vshrq_n_u8(in.val[1], 4)), mask);
+		idx.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2),
+					       vshrq_n_u8(in.val[2], 6)), mask);
+		idx.val[3] = vandq_u8(in.val[2], mask);
+
+		out.val[0] = vqtbl4q_u8(tbl, idx.val[0]);
+		out.val[1] = vqtbl4q_u8(tbl, idx.val[1]);
+		out.val[2] = vqtbl4q_u8(tbl, idx.val[2]);
+		out.val[3] = vqtbl4q_u8(tbl, idx.val[3]);
+		vst4q_u8(dest + dest_pos, out);
+		src_pos += 48;
+		dest_pos += 64;
+	}
+	return src_pos;
+}
+
+static inline uint8x16_t
+base64_neon_dec_lookup(const uint8x16x4_t *tbl_lo, const uint8x16x4_t *tbl_hi,
+		       uint8x16_t in)
+{
+	/* Out of range lookups return 0. Characters >= 128 are marked invalid
+	   by keeping their high bit. */
+	return vorrq_u8(vorrq_u8(vqtbl4q_u8(*tbl_lo, in),
+				 vqtbl4q_u8(*tbl_hi,
+					    vsubq_u8(in, vdupq_n_u8(64)))),
+			vandq_u8(in, vdupq_n_u8(0x80)));
+}
+
+static size_t
+base64_neon_decode(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size)
+{
+	const uint8x16x4_t tbl_lo = base64_neon_load_table(b64->decmap);
+	const uint8x16x4_t tbl_hi = base64_neon_load_table(b64->decmap + 64);
+	size_t src_pos = 0, dest_pos = 0;
+	uint8x16x4_t in, val;
+	uint8x16x3_t out;
+
+	while (src_size - src_pos >= 64 && dest_size - dest_pos >= 48) {
+		in = vld4q_u8(src + src_pos);
+		val.val[0] = base64_neon_dec_lookup(&tbl_lo, &tbl_hi, in.val[0]);
+		val.val[1] = base64_neon_dec_lookup(&tbl_lo, &tbl_hi, in.val[1]);
+		val.val[2] = base64_neon_dec_lookup(&tbl_lo, &tbl_hi, in.val[2]);
+		val.val[3] = base64_neon_dec_lookup(&tbl_lo, &tbl_hi, in.val[3]);
+		/* all valid values are < 64, invalid ones have high bit set */
+		if (vmaxvq_u8(vorrq_u8(vorrq_u8(val.val[0], val.val[1]),
+				       vorrq_u8(val.val[2], val.val[3]))) >= 64)
+			break;
+
+		out.val[0] = vorrq_u8(vshlq_n_u8(val.val[0], 2),
+				      vshrq_n_u8(val.val[1], 4));
+		out.val[1] = vorrq_u8(vshlq_n_u8(val.val[1], 4),
+				      vshrq_n_u8(val.val[2], 2));
+		out.val[2] = vorrq_u8(vshlq_n_u8(val.val[2], 6), val.val[3]);
+		vst3q_u8(dest + dest_pos, out);
+		src_pos += 64;
+		dest_pos += 48;
+	}
+	return src_pos;
+}
+
+static const struct base64_simd_kernel base64_simd_neon = {
+	.name = "neon",
+	.encode = base64_neon_encode,
+	.decode = base64_neon_decode,
+};
+
+#endif
+
+static const struct base64_simd_kernel base64_simd_none = {
+	.name = "none",
+	.encode = NULL,
+	.decode = NULL,
+};
+
+static const struct base64_simd_kernel *base64_simd_kernel = NULL;
+
+static const struct base64_simd_kernel *base64_simd_detect(void)
+{
+#ifdef BASE64_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &base64_simd_avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return &base64_simd_sse41;
+#endif
+#ifdef BASE64_SIMD_NEON
+	return &base64_simd_neon;
+#endif
+	return &base64_simd_none;
+}
+
+static inline const struct base64_simd_kernel *base64_simd_get(void)
+{
+	if (unlikely(base64_simd_kernel == NULL))
+		base64_simd_kernel = base64_simd_detect();
+	return base64_simd_kernel;
+}
+
+static inline const struct base64_simd_kernel *
+base64_simd_get_for(const struct base64_scheme *b64)
+{
+	const struct base64_simd_kernel *kernel = base64_simd_get();
+
+	if (kernel->std_alphabet_only &&
+	    b64 != &base64_scheme && b64 != &base64url_scheme)
+		return &base64_simd_none;
+	return kernel;
+}
+
+size_t base64_simd_encode(const struct base64_scheme *b64,
+			  const unsigned char *src, size_t src_size,
+			  unsigned char *dest, size_t dest_size)
+{
+	const struct base64_simd_kernel *kernel = base64_simd_get_for(b64);
+
+	if (kernel->encode == NULL)
+		return 0;
+	return kernel->encode(b64, src, src_size, dest, dest_size);
+}
+
+size_t base64_simd_decode(const struct base64_scheme *b64,
+			  const unsigned char *src, size_t src_size,
+			  unsigned char *dest, size_t dest_size)
+{
+	const struct base64_simd_kernel *kernel = base64_simd_get_for(b64);
+
+	if (kernel->decode == NULL)
+		return 0;
+	return kernel->decode(b64, src, src_size, dest, dest_size);
+}
+
+const char *base64_simd_get_name(void)
+{
+	return base64_simd_get()->name;
+}
+
+void base64_simd_set_enabled(bool enabled)
+{
+	base64_simd_kernel = enabled ? base64_simd_detect() :
+		&base64_simd_none;
+}
@@ -0,0 +1,32 @@
+#ifndef BASE64_SIMD_H
+#define BASE64_SIMD_H
+
+struct base64_scheme;
+
+/* SIMD kernels used internally by base64.c. The kernel is chosen at runtime
+   based on the CPU features. These functions only process whole blocks and
+   stop early whenever they can't continue (e.g. not enough space in dest or
+   non-base64 input). The rest must be handled by the scalar code. */
+
+/* Encode 3 byte groups from src to dest. Returns the number of source bytes
+   encoded, which is always a multiple of 3. The number of bytes written to
+   dest is (return value / 3 * 4). */
+size_t base64_simd_encode(const struct base64_scheme *b64,
+			  const unsigned char *src, size_t src_size,
+			  unsigned char *dest, size_t dest_size);
+/* Decode 4 byte groups from src to dest. Decoding stops at the first block
+   with any whitespace, padding or other non-base64 characters. Returns the
+   number of source bytes decoded, which is always a multiple of 4. The number
+   of bytes written to dest is (return value / 4 * 3), but the kernel may use
+   the rest of dest_size as scratch space. */
+size_t base64_simd_decode(const struct base64_scheme *b64,
+			  const unsigned char *src, size_t src_size,
+			  unsigned char *dest, size_t dest_size);
+
+/* Returns the name of the SIMD kernel being used, or "none". */
+const char *base64_simd_get_name(void);
+/* Enable/disable using the SIMD kernels. This is mainly useful for tests and
+   benchmarks. The kernels are enabled by default if the CPU supports them. */
+void base64_simd_set_enabled(bool enabled);
+
+#endif
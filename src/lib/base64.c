@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "base64.h"
+#include "base64-simd.h"
 #include "buffer.h"
 
 /*
@@ -221,7 +222,7 @@ base64_encode_more_data(struct base64_encoder *enc,
 {
 	const struct base64_scheme *b64 = enc->b64;
 	const char *b64enc = b64->encmap;
-	size_t res_size;
+	size_t res_size, bulk_size;
 	unsigned char *start, *ptr, *end;
 	size_t src_pos;
 
@@ -307,6 +308,10 @@ base64_encode_more_data(struct base64_encoder *enc,
 	}
 
 	/* Convert the bulk */
+	bulk_size = base64_simd_encode(b64, src_c + src_pos, src_size - src_pos,
+				       ptr, end - ptr);
+	src_pos += bulk_size;
+	ptr += bulk_size / 3 * 4;
 	for (; src_size - src_pos > 2 && &ptr[3] < end;
 	     src_pos += 3, ptr += 4) {
 		ptr[0] = b64enc[src_c[src_pos] >> 2];
@@ -599,6 +604,79 @@ base64_skip_whitespace(struct base64_decoder *dec, const unsigned char *src_c,
 		(*src_pos)++;
 }
 
+/* Maximum amount of output space reserved at once by base64_decode_bulk().
+   This avoids growing the destination buffer much beyond what is actually
+   written if the input turns out to be invalid. */
+#define BASE64_DECODE_BULK_MAX_SIZE 8192
+/* Don't bother with base64_decode_bulk() for less than this much input */
+#define BASE64_DECODE_BULK_MIN_SIZE 16
+
+/* Decode as much as possible in whole 4 character groups, starting with the
+   SIMD decoder. Whitespace is skipped only between the groups. This stops at
+   padding and invalid input, which are left for the byte-by-byte decoder. */
+static size_t
+base64_decode_bulk(struct base64_decoder *dec, const unsigned char *src,
+		   size_t src_size, size_t *dst_avail, buffer_t *dest)
+{
+	const unsigned char *decmap = dec->b64->decmap;
+	bool no_whitespace = HAS_ALL_BITS(
+		dec->flags, BASE64_DECODE_FLAG_NO_WHITESPACE);
+	size_t src_pos = 0, size, used, decoded, dst_pos, ws_start;
+	unsigned char *data, a, b, c, d;
+	bool stop = FALSE;
+
+	i_assert(dec->sub_pos == 0);
+
+	while (!stop && src_size - src_pos >= 4 && *dst_avail >= 3) {
+		size = I_MIN((src_size - src_pos) / 4 * 3, *dst_avail);
+		size = I_MIN(size, BASE64_DECODE_BULK_MAX_SIZE);
+		used = dest->used;
+		data = buffer_append_space_unsafe(dest, size);
+
+		dst_pos = 0;
+		for (;;) {
+			decoded = base64_simd_decode(dec->b64, src + src_pos,
+						     src_size - src_pos,
+						     data + dst_pos,
+						     size - dst_pos);
+			src_pos += decoded;
+			dst_pos += decoded / 4 * 3;
+			/* the groups that the SIMD decoder didn't handle */
+			while (src_size - src_pos >= 4 && size - dst_pos >= 3) {
+				a = decmap[src[src_pos]];
+				b = decmap[src[src_pos + 1]];
+				c = decmap[src[src_pos + 2]];
+				d = decmap[src[src_pos + 3]];
+				if (((a | b | c | d) & 0x80) != 0)
+					break;
+				data[dst_pos++] = (a << 2) | (b >> 4);
+				data[dst_pos++] = (b << 4) | (c >> 2);
+				data[dst_pos++] = (c << 6) | d;
+				src_pos += 4;
+			}
+			if (size - dst_pos < 3) {
+				/* reserved space ran out */
+				break;
+			}
+
+			/* skip whitespace, e.g. line feeds in MIME parts */
+			ws_start = src_pos;
+			if (!no_whitespace) {
+				while (src_pos < src_size &&
+				       IS_EMPTY(src[src_pos]))
+					src_pos++;
+			}
+			if (src_pos == ws_start) {
+				stop = TRUE;
+				break;
+			}
+		}
+		buffer_set_used_size(dest, used + dst_pos);
+		*dst_avail -= dst_pos;
+	}
+	return src_pos;
+}
+
 int base64_decode_more(struct base64_decoder *dec,
 		       const void *src, size_t src_size, size_t *src_pos_r,
 		       buffer_t *dest)
@@ -661,8 +739,18 @@ int base64_decode_more(struct base64_decoder *dec,
 	}
 
 	for (; !dec->seen_padding && src_pos < src_size; src_pos++) {
-		unsigned char in = src_c[src_pos];
-		unsigned char dm = b64->decmap[in];
+		unsigned char in, dm;
+
+		if (dec->sub_pos == 0 &&
+		    src_size - src_pos >= BASE64_DECODE_BULK_MIN_SIZE) {
+			src_pos += base64_decode_bulk(dec, src_c + src_pos,
+						      src_size - src_pos,
+						      &dst_avail, dest);
+			if (src_pos == src_size)
+				break;
+		}
+		in = src_c[src_pos];
+		dm = b64->decmap[in];
 
 		if (dm == 0xff) {
 			if (no_whitespace) {
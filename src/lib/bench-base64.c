@@ -0,0 +1,108 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "randgen.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "base64.h"
+#include "base64-simd.h"
+
+#include <stdio.h>
+
+/**
+ * Measures base64 encoding and decoding speed with and without the SIMD
+ * kernels. Encoding is done without line wrapping and with 76 character
+ * lines, as used in MIME parts. Decoding is done for both of these outputs.
+ */
+
+#define BENCH_BASE64_DEFAULT_SIZE (64*1024*1024)
+#define BENCH_BASE64_ROUNDS 5
+
+static double bench_gbps(size_t size, uint64_t ts_0, uint64_t ts_1)
+{
+	return (double)size * BENCH_BASE64_ROUNDS / (double)(ts_1 - ts_0);
+}
+
+static void
+bench_base64_run(const buffer_t *input, size_t line_len, buffer_t *encoded,
+		 buffer_t *decoded)
+{
+	uint64_t ts_0, ts_1;
+	double enc_speed, dec_speed;
+	unsigned int i;
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < BENCH_BASE64_ROUNDS; i++) {
+		buffer_set_used_size(encoded, 0);
+		base64_scheme_encode(&base64_scheme, 0, line_len,
+				     input->data, input->used, encoded);
+	}
+	ts_1 = i_nanoseconds();
+	enc_speed = bench_gbps(input->used, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < BENCH_BASE64_ROUNDS; i++) {
+		buffer_set_used_size(decoded, 0);
+		if (base64_decode(encoded->data, encoded->used, NULL,
+				  decoded) < 0)
+			i_fatal("base64_decode() failed");
+	}
+	ts_1 = i_nanoseconds();
+	dec_speed = bench_gbps(encoded->used, ts_0, ts_1);
+
+	if (!buffer_cmp(input, decoded))
+		i_fatal("base64 decoded output differs from the input");
+
+	printf("\tline length %-5s encode %6.02lf GB/s, decode %6.02lf GB/s\n",
+	       line_len == 0 ? "none" : dec2str(line_len),
+	       enc_speed, dec_speed);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [size]\n", prog);
+	fprintf(stderr, "Runs with 64 MB of input if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int size = BENCH_BASE64_DEFAULT_SIZE;
+	buffer_t *input, *encoded, *decoded;
+
+	lib_init();
+
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &size) < 0 || size == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+	}
+
+	input = buffer_create_dynamic(default_pool, size);
+	random_fill(buffer_append_space_unsafe(input, size), size);
+	encoded = buffer_create_dynamic(default_pool,
+					MAX_BASE64_ENCODED_SIZE(size) * 2);
+	decoded = buffer_create_dynamic(default_pool, size + 1);
+
+	printf("Input data is %u bytes\n\n", size);
+
+	printf("scalar\n");
+	base64_simd_set_enabled(FALSE);
+	bench_base64_run(input, 0, encoded, decoded);
+	bench_base64_run(input, 76, encoded, decoded);
+
+	base64_simd_set_enabled(TRUE);
+	printf("%s\n", base64_simd_get_name());
+	bench_base64_run(input, 0, encoded, decoded);
+	bench_base64_run(input, 76, encoded, decoded);
+
+	buffer_free(&input);
+	buffer_free(&encoded);
+	buffer_free(&decoded);
+	lib_deinit();
+	return 0;
+}
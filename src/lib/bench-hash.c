@@ -0,0 +1,174 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "time-util.h"
+#include "strnum.h"
+
+#include <stdio.h>
+
+/**
+ * Measures the speed of inserting, looking up, iterating and removing
+ * entries in hash tables of different sizes. Both direct (pointer) keys and
+ * string keys are tested. The keys are accessed in a different order than
+ * they were inserted in, so the lookups aren't just walking the memory
+ * linearly.
+ */
+
+#define BENCH_HASH_DEFAULT_MAX 10000000U
+
+static void bench_print(const char *op, unsigned int count,
+			uint64_t ts_0, uint64_t ts_1)
+{
+	printf("\t%-8s %8.02lf ns/op\n", op,
+	       (double)(ts_1 - ts_0) / (double)count);
+}
+
+static unsigned int bench_key_order(unsigned int i, unsigned int count)
+{
+	/* a permutation of [0..count) as long as count isn't a multiple
+	   of the prime */
+	return (unsigned int)(((uint64_t)i * 2654435761U) % count);
+}
+
+static void bench_hash_direct(unsigned int count)
+{
+	HASH_TABLE(void *, void *) hash;
+	struct hash_iterate_context *iter;
+	void *key, *value;
+	unsigned int i, found = 0;
+	uint64_t ts_0, ts_1;
+
+	printf("direct keys, %u entries\n", count);
+	hash_table_create_direct(&hash, default_pool, 0);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, POINTER_CAST(i + 1), POINTER_CAST(i));
+	ts_1 = i_nanoseconds();
+	bench_print("insert", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		key = POINTER_CAST(bench_key_order(i, count) + 1);
+		if (hash_table_lookup(hash, key) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("lookup", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		key = POINTER_CAST(count + i + 1);
+		if (hash_table_lookup(hash, key) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("miss", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value))
+		found++;
+	hash_table_iterate_deinit(&iter);
+	ts_1 = i_nanoseconds();
+	bench_print("iterate", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		key = POINTER_CAST(bench_key_order(i, count) + 1);
+		hash_table_remove(hash, key);
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("remove", count, ts_0, ts_1);
+
+	i_assert(hash_table_count(hash) == 0);
+	/* (count-1) lookups found, since value 0 is NULL */
+	i_assert(found == (count - 1) + count);
+	hash_table_destroy(&hash);
+}
+
+static void bench_hash_str(unsigned int count)
+{
+	HASH_TABLE(char *, void *) hash;
+	struct hash_iterate_context *iter;
+	char **keys, *key;
+	void *value;
+	unsigned int i, found = 0;
+	uint64_t ts_0, ts_1;
+	pool_t pool;
+
+	printf("string keys, %u entries\n", count);
+	pool = pool_alloconly_create("bench hash keys", count * 64);
+	keys = i_new(char *, count);
+	for (i = 0; i < count; i++)
+		keys[i] = p_strdup_printf(pool, "user%u@example.com", i);
+	hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, keys[i], POINTER_CAST(1));
+	ts_1 = i_nanoseconds();
+	bench_print("insert", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, keys[bench_key_order(i, count)]) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("lookup", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value))
+		found++;
+	hash_table_iterate_deinit(&iter);
+	ts_1 = i_nanoseconds();
+	bench_print("iterate", count, ts_0, ts_1);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, keys[bench_key_order(i, count)]);
+	ts_1 = i_nanoseconds();
+	bench_print("remove", count, ts_0, ts_1);
+
+	i_assert(hash_table_count(hash) == 0);
+	i_assert(found == count * 2);
+	hash_table_destroy(&hash);
+	i_free(keys);
+	pool_unref(&pool);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [max_count]\n", prog);
+	fprintf(stderr, "Runs with 10^3 .. 10^7 entries if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count, max_count = BENCH_HASH_DEFAULT_MAX;
+
+	lib_init();
+
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &max_count) < 0 || max_count < 1000) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+	}
+
+	for (count = 1000; count <= max_count; count *= 10) {
+		bench_hash_direct(count);
+		bench_hash_str(count);
+		if (count > UINT_MAX / 10)
+			break;
+	}
+
+	lib_deinit();
+	return 0;
+}
@@ -3,12 +3,15 @@
 /* @UNSAFE: whole file */
 
 #include "lib.h"
+#include "array.h"
 #include "hash.h"
-#include "primes.h"
 
 #include <ctype.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 
-#define HASH_TABLE_MIN_SIZE 67
+#define HASH_TABLE_MIN_SIZE 32
 
 #undef hash_table_create
 #undef hash_table_create_direct
@@ -26,8 +29,25 @@
 #undef hash_table_thaw
 #undef hash_table_copy
 
-struct hash_node {
-	struct hash_node *next;
+/* The table uses open addressing with SwissTable-style control bytes. Each
+   slot has a one byte control value, which is either EMPTY, DELETED or the
+   lowest 7 bits of the (mixed) hash for a used slot. The control bytes are
+   scanned a group at a time, so a lookup usually touches only one control
+   byte cache line and the one slot containing the key and the value.
+
+   Slots never move while the table is being iterated. If the table becomes
+   full while there are active iterators, the new nodes are added to a
+   separate overflow array, which gets merged back to the table when it's
+   thawed. */
+#define HASH_GROUP_SIZE 16
+#define HASH_CTRL_EMPTY 0x80
+#define HASH_CTRL_DELETED 0xfe
+#define HASH_CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+
+/* maximum load factor (including deleted slots) is 7/8 */
+#define HASH_TABLE_MAX_LOAD(size) ((size) - (size) / 8)
+
+struct hash_slot {
 	void *key;
 	void *value;
 };
@@ -36,11 +56,21 @@ struct hash_table {
 	pool_t node_pool;
 
 	int frozen;
+	unsigned int iterators;
 	unsigned int initial_size, nodes_count, removed_count;
+	/* number of EMPTY slots that can still be filled before the table
+	   needs to be resized */
+	unsigned int growth_left;
 
+	/* number of slots, always a power of 2 */
 	unsigned int size;
-	struct hash_node *nodes;
-	struct hash_node *free_nodes;
+	uint8_t *ctrl;
+	struct hash_slot *slots;
+
+	/* nodes added while the table was full and couldn't be resized.
+	   Removed nodes have key=NULL. */
+	ARRAY(struct hash_slot) overflow;
+	unsigned int overflow_count;
 
 	hash_callback_t *hash_cb;
 	hash_cmp_callback_t *key_compare_cb;
@@ -48,17 +78,113 @@ struct hash_table {
 
 struct hash_iterate_context {
 	struct hash_table *table;
-	struct hash_node *next;
 	unsigned int pos;
 };
 
-enum hash_table_operation{
-	HASH_TABLE_OP_INSERT,
-	HASH_TABLE_OP_UPDATE,
-	HASH_TABLE_OP_RESIZE
-};
+static void hash_table_rehash(struct hash_table *table, unsigned int size);
+
+static inline unsigned int ATTR_NO_SANITIZE_INTEGER
+hash_table_mix(unsigned int hash)
+{
+	/* The hash functions don't always distribute the low bits well
+	   (e.g. direct_hash() with aligned pointers), so mix them. This is
+	   the murmur3 finalizer. */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
 
-static bool hash_table_resize(struct hash_table *table, bool grow);
+static inline unsigned int hash_bits_first(unsigned int mask)
+{
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4)
+	return __builtin_ctz(mask);
+#else
+	unsigned int i = 0;
+
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+/* Returns a bitmask of the control bytes in the group that equal c. */
+static inline unsigned int
+hash_group_match(const uint8_t *group, uint8_t c)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const void *)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HASH_GROUP_SIZE; i++) {
+		if (group[i] == c)
+			mask |= 1U << i;
+	}
+	return mask;
+#endif
+}
+
+/* Returns a bitmask of the EMPTY or DELETED control bytes in the group. */
+static inline unsigned int hash_group_match_free(const uint8_t *group)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const void *)group));
+#else
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HASH_GROUP_SIZE; i++) {
+		if (!HASH_CTRL_IS_FULL(group[i]))
+			mask |= 1U << i;
+	}
+	return mask;
+#endif
+}
+
+/* Iterate the groups in triangular order. Since the number of groups is a
+   power of 2, this visits all of them. */
+#define HASH_PROBE_INIT(table, hash, group, step) \
+	(group) = ((hash) >> 7) & ((table)->size / HASH_GROUP_SIZE - 1); \
+	(step) = 0
+#define HASH_PROBE_NEXT(table, group, step) \
+	(group) = ((group) + ++(step)) & ((table)->size / HASH_GROUP_SIZE - 1)
+
+static unsigned int hash_table_size_for(unsigned int count)
+{
+	unsigned int size = HASH_TABLE_MIN_SIZE;
+
+	while (HASH_TABLE_MAX_LOAD(size) <= count) {
+		i_assert(size < (1U << 31));
+		size *= 2;
+	}
+	return size;
+}
+
+static unsigned int hash_table_grow_size(const struct hash_table *table)
+{
+	/* If the table is mostly filled with DELETED slots, rehashing them
+	   away is enough. */
+	return I_MAX(hash_table_size_for(table->nodes_count +
+					 table->nodes_count / 2 + 1),
+		     table->size);
+}
+
+static void hash_table_alloc_slots(struct hash_table *table, unsigned int size)
+{
+	i_assert(size % HASH_GROUP_SIZE == 0);
+
+	table->size = size;
+	table->ctrl = i_malloc(size);
+	memset(table->ctrl, HASH_CTRL_EMPTY, size);
+	table->slots = i_new(struct hash_slot, size);
+	table->growth_left = HASH_TABLE_MAX_LOAD(size);
+	table->removed_count = 0;
+}
 
 void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size, hash_callback_t *hash_cb,
@@ -69,14 +195,12 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 	pool_ref(node_pool);
 	table = i_new(struct hash_table, 1);
 	table->node_pool = node_pool;
-	table->initial_size =
-		I_MAX(primes_closest(initial_size), HASH_TABLE_MIN_SIZE);
+	table->initial_size = hash_table_size_for(initial_size);
 
 	table->hash_cb = hash_cb;
 	table->key_compare_cb = key_compare_cb;
 
-	table->size = table->initial_size;
-	table->nodes = i_new(struct hash_node, table->size);
+	hash_table_alloc_slots(table, table->initial_size);
 	*table_r = table;
 }
 
@@ -98,37 +222,6 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
-static void free_node(struct hash_table *table, struct hash_node *node)
-{
-	if (!table->node_pool->alloconly_pool)
-		p_free(table->node_pool, node);
-	else {
-		node->next = table->free_nodes;
-		table->free_nodes = node;
-	}
-}
-
-static void destroy_node_list(struct hash_table *table, struct hash_node *node)
-{
-	struct hash_node *next;
-
-	while (node != NULL) {
-		next = node->next;
-		p_free(table->node_pool, node);
-		node = next;
-	}
-}
-
-static void hash_table_destroy_nodes(struct hash_table *table)
-{
-	unsigned int i;
-
-	for (i = 0; i < table->size; i++) {
-		if (table->nodes[i].next != NULL)
-			destroy_node_list(table, table->nodes[i].next);
-	}
-}
-
 void hash_table_destroy(struct hash_table **_table)
 {
 	struct hash_table *table = *_table;
@@ -139,227 +232,243 @@ void hash_table_destroy(struct hash_table **_table)
 
 	i_assert(table->frozen == 0);
 
-	if (!table->node_pool->alloconly_pool) {
-		hash_table_destroy_nodes(table);
-		destroy_node_list(table, table->free_nodes);
-	}
-
 	pool_unref(&table->node_pool);
-	i_free(table->nodes);
+	array_free(&table->overflow);
+	i_free(table->ctrl);
+	i_free(table->slots);
 	i_free(table);
 }
 
-void hash_table_clear(struct hash_table *table, bool free_nodes)
+void hash_table_clear(struct hash_table *table, bool free_collisions)
 {
 	i_assert(table->frozen == 0);
 
-	if (!table->node_pool->alloconly_pool)
-		hash_table_destroy_nodes(table);
+	array_free(&table->overflow);
+	table->overflow_count = 0;
+	table->nodes_count = 0;
 
-	if (free_nodes) {
-		if (!table->node_pool->alloconly_pool)
-			destroy_node_list(table, table->free_nodes);
-                table->free_nodes = NULL;
+	if (free_collisions && table->size != table->initial_size) {
+		i_free(table->ctrl);
+		i_free(table->slots);
+		hash_table_alloc_slots(table, table->initial_size);
+	} else {
+		memset(table->ctrl, HASH_CTRL_EMPTY, table->size);
+		memset(table->slots, 0, sizeof(*table->slots) * table->size);
+		table->growth_left = HASH_TABLE_MAX_LOAD(table->size);
+		table->removed_count = 0;
 	}
-
-	memset(table->nodes, 0, sizeof(struct hash_node) * table->size);
-
-	table->nodes_count = 0;
-	table->removed_count = 0;
 }
 
-static struct hash_node *
-hash_table_lookup_node(const struct hash_table *table,
-		       const void *key, unsigned int hash)
+static inline bool
+hash_table_key_equals(const struct hash_table *table,
+		      const void *key1, const void *key2)
 {
-	struct hash_node *node;
-
-	node = &table->nodes[hash % table->size];
+	if (table->key_compare_cb == direct_cmp)
+		return key1 == key2;
+	return table->key_compare_cb(key1, key2) == 0;
+}
 
-	do {
-		if (node->key != NULL) {
-			if (table->key_compare_cb(node->key, key) == 0)
-				return node;
+/* Lookup the key. If free_idx_r isn't NULL, it's set to the first EMPTY or
+   DELETED slot in the key's probe sequence, which is where the key can be
+   inserted if it's not found. */
+static struct hash_slot *
+hash_table_lookup_slot(const struct hash_table *table,
+		       const void *key, unsigned int hash,
+		       unsigned int *free_idx_r)
+{
+	const uint8_t *group_ctrl;
+	struct hash_slot *slot;
+	unsigned int group, step, mask, idx;
+
+	HASH_PROBE_INIT(table, hash, group, step);
+	for (;;) {
+		group_ctrl = table->ctrl + group * HASH_GROUP_SIZE;
+		mask = hash_group_match(group_ctrl, hash & 0x7f);
+		while (mask != 0) {
+			idx = group * HASH_GROUP_SIZE + hash_bits_first(mask);
+			if (hash_table_key_equals(table, table->slots[idx].key,
+						  key))
+				return &table->slots[idx];
+			mask &= mask - 1;
+		}
+		if (free_idx_r != NULL) {
+			mask = hash_group_match_free(group_ctrl);
+			if (mask != 0) {
+				*free_idx_r = group * HASH_GROUP_SIZE +
+					hash_bits_first(mask);
+				free_idx_r = NULL;
+			}
 		}
-		node = node->next;
-	} while (node != NULL);
+		if (hash_group_match(group_ctrl, HASH_CTRL_EMPTY) != 0)
+			break;
+		HASH_PROBE_NEXT(table, group, step);
+	}
 
+	if (table->overflow_count > 0) {
+		array_foreach_modifiable(&table->overflow, slot) {
+			if (slot->key != NULL &&
+			    hash_table_key_equals(table, slot->key, key))
+				return slot;
+		}
+	}
 	return NULL;
 }
 
 void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
-	struct hash_node *node;
+	struct hash_slot *slot;
 
-	node = hash_table_lookup_node(table, key, table->hash_cb(key));
-	return node != NULL ? node->value : NULL;
+	slot = hash_table_lookup_slot(table, key,
+				      hash_table_mix(table->hash_cb(key)), NULL);
+	return slot != NULL ? slot->value : NULL;
 }
 
 bool hash_table_lookup_full(const struct hash_table *table,
 			    const void *lookup_key,
 			    void **orig_key, void **value)
 {
-	struct hash_node *node;
+	struct hash_slot *slot;
 
-	node = hash_table_lookup_node(table, lookup_key,
-				      table->hash_cb(lookup_key));
-	if (node == NULL)
+	slot = hash_table_lookup_slot(table, lookup_key,
+				      hash_table_mix(table->hash_cb(lookup_key)),
+				      NULL);
+	if (slot == NULL)
 		return FALSE;
 
-	*orig_key = node->key;
-	*value = node->value;
+	*orig_key = slot->key;
+	*value = slot->value;
 	return TRUE;
 }
 
-static void
-hash_table_insert_node(struct hash_table *table, void *key, void *value,
-			     enum hash_table_operation opcode)
+/* Returns the first EMPTY or DELETED slot in the key's probe sequence. */
+static unsigned int
+hash_table_find_free(const struct hash_table *table, unsigned int hash)
 {
-	struct hash_node *node, *prev;
-	unsigned int hash;
-	bool check_existing = TRUE;
-
-	i_assert(table->nodes_count < UINT_MAX);
-	i_assert(key != NULL);
-
-	if(opcode == HASH_TABLE_OP_RESIZE)
-		check_existing = FALSE;
-	hash = table->hash_cb(key);
-
-	if (check_existing && table->removed_count > 0) {
-		/* there may be holes, have to check everything */
-		node = hash_table_lookup_node(table, key, hash);
-		if (node != NULL) {
-			i_assert(opcode == HASH_TABLE_OP_UPDATE);
-			node->value = value;
-			return;
-		}
-
-		check_existing = FALSE;
+	unsigned int group, step, mask;
+
+	HASH_PROBE_INIT(table, hash, group, step);
+	for (;;) {
+		mask = hash_group_match_free(table->ctrl +
+					     group * HASH_GROUP_SIZE);
+		if (mask != 0)
+			return group * HASH_GROUP_SIZE + hash_bits_first(mask);
+		HASH_PROBE_NEXT(table, group, step);
 	}
+}
 
-	/* a) primary node */
-	node = &table->nodes[hash % table->size];
-	if (node->key == NULL) {
-		table->nodes_count++;
+static void
+hash_table_insert_at(struct hash_table *table, void *key, void *value,
+		     unsigned int hash, unsigned int idx)
+{
+	struct hash_slot *slot;
 
-		node->key = key;
-		node->value = value;
-		return;
-	}
-	if (check_existing) {
-		if (table->key_compare_cb(node->key, key) == 0) {
-			i_assert(opcode == HASH_TABLE_OP_UPDATE);
-			node->value = value;
+	if (table->ctrl[idx] == HASH_CTRL_EMPTY && table->growth_left == 0) {
+		if (table->iterators == 0) {
+			hash_table_rehash(table, hash_table_grow_size(table));
+			idx = hash_table_find_free(table, hash);
+		} else {
+			/* can't move the slots while iterating */
+			if (!array_is_created(&table->overflow))
+				i_array_init(&table->overflow, 16);
+			slot = array_append_space(&table->overflow);
+			slot->key = key;
+			slot->value = value;
+			table->overflow_count++;
+			table->nodes_count++;
 			return;
 		}
 	}
 
-	/* b) collisions list */
-	prev = node; node = node->next;
-	while (node != NULL) {
-		if (node->key == NULL)
-			break;
+	if (table->ctrl[idx] == HASH_CTRL_EMPTY)
+		table->growth_left--;
+	else
+		table->removed_count--;
+	table->ctrl[idx] = hash & 0x7f;
+	table->slots[idx].key = key;
+	table->slots[idx].value = value;
+	table->nodes_count++;
+}
 
-		if (check_existing) {
-			if (table->key_compare_cb(node->key, key) == 0) {
-				i_assert(opcode == HASH_TABLE_OP_UPDATE);
-				node->value = value;
-				return;
-			}
-		}
-		prev = node;
-		node = node->next;
-	}
+static void
+hash_table_insert_node(struct hash_table *table, void *key, void *value,
+		       bool update)
+{
+	struct hash_slot *slot;
+	unsigned int hash, idx;
 
-	if (node == NULL) {
-		if (table->frozen == 0 && hash_table_resize(table, TRUE)) {
-			/* resized table, try again */
-			hash_table_insert_node(table, key, value, HASH_TABLE_OP_RESIZE);
-			return;
-		}
+	i_assert(table->nodes_count < UINT_MAX);
+	i_assert(key != NULL);
 
-		if (table->free_nodes == NULL)
-			node = p_new(table->node_pool, struct hash_node, 1);
-		else {
-			node = table->free_nodes;
-			table->free_nodes = node->next;
-			node->next = NULL;
-		}
-		prev->next = node;
+	hash = hash_table_mix(table->hash_cb(key));
+	slot = hash_table_lookup_slot(table, key, hash, &idx);
+	if (slot != NULL) {
+		i_assert(update);
+		slot->value = value;
+		return;
 	}
-
-	node->key = key;
-	node->value = value;
-
-	table->nodes_count++;
+	hash_table_insert_at(table, key, value, hash, idx);
 }
 
 void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
+	hash_table_insert_node(table, key, value, FALSE);
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
+	hash_table_insert_node(table, key, value, TRUE);
 }
 
-static void
-hash_table_compress(struct hash_table *table, struct hash_node *root)
+static void hash_table_try_shrink(struct hash_table *table)
 {
-	struct hash_node *node, *next;
+	unsigned int size;
 
 	i_assert(table->frozen == 0);
 
-	/* remove deleted nodes from the list */
-	for (node = root; node->next != NULL; ) {
-		next = node->next;
-
-		if (next->key == NULL) {
-			node->next = next->next;
-			free_node(table, next);
-		} else {
-			node = next;
-		}
-	}
-
-	/* update root */
-	if (root->key == NULL && root->next != NULL) {
-		next = root->next;
-		*root = *next;
-		free_node(table, next);
-	}
-}
-
-static void hash_table_compress_removed(struct hash_table *table)
-{
-	unsigned int i;
-
-	for (i = 0; i < table->size; i++)
-		hash_table_compress(table, &table->nodes[i]);
+	if (table->size <= table->initial_size ||
+	    table->nodes_count >= table->size / 8)
+		return;
 
-        table->removed_count = 0;
+	size = I_MAX(hash_table_size_for(table->nodes_count * 2),
+		     table->initial_size);
+	if (size < table->size)
+		hash_table_rehash(table, size);
 }
 
 bool hash_table_try_remove(struct hash_table *table, const void *key)
 {
-	struct hash_node *node;
-	unsigned int hash;
+	struct hash_slot *slot;
+	unsigned int idx, group;
 
-	hash = table->hash_cb(key);
-
-	node = hash_table_lookup_node(table, key, hash);
-	if (unlikely(node == NULL))
+	slot = hash_table_lookup_slot(table, key,
+				      hash_table_mix(table->hash_cb(key)), NULL);
+	if (unlikely(slot == NULL))
 		return FALSE;
-
-	node->key = NULL;
 	table->nodes_count--;
 
-	if (table->frozen != 0)
+	if (slot < table->slots || slot >= table->slots + table->size) {
+		/* in the overflow array */
+		slot->key = NULL;
+		table->overflow_count--;
+		return TRUE;
+	}
+
+	idx = slot - table->slots;
+	group = idx / HASH_GROUP_SIZE;
+	slot->key = NULL;
+	if (hash_group_match(table->ctrl + group * HASH_GROUP_SIZE,
+			     HASH_CTRL_EMPTY) != 0) {
+		/* the group has never been full, so no lookup has continued
+		   past it and the slot can become EMPTY. */
+		table->ctrl[idx] = HASH_CTRL_EMPTY;
+		table->growth_left++;
+	} else {
+		table->ctrl[idx] = HASH_CTRL_DELETED;
 		table->removed_count++;
-	else if (!hash_table_resize(table, FALSE))
-		hash_table_compress(table, &table->nodes[hash % table->size]);
+	}
+
+	if (table->frozen == 0)
+		hash_table_try_shrink(table);
 	return TRUE;
 }
 
@@ -373,48 +482,41 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 	struct hash_iterate_context *ctx;
 
 	hash_table_freeze(table);
+	table->iterators++;
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
 	return ctx;
 }
 
-static struct hash_node *
-hash_table_iterate_next(struct hash_iterate_context *ctx,
-			struct hash_node *node)
-{
-	do {
-		node = node->next;
-		if (node == NULL) {
-			if (++ctx->pos == ctx->table->size) {
-				ctx->pos--;
-				return NULL;
-			}
-			node = &ctx->table->nodes[ctx->pos];
-		}
-	} while (node->key == NULL);
-
-	return node;
-}
-
 bool hash_table_iterate(struct hash_iterate_context *ctx,
 			void **key_r, void **value_r)
 {
-	struct hash_node *node;
-
-	node = ctx->next;
-	if (node != NULL && node->key == NULL)
-		node = hash_table_iterate_next(ctx, node);
-	if (node == NULL) {
-		*key_r = *value_r = NULL;
-		return FALSE;
+	struct hash_table *table = ctx->table;
+	const struct hash_slot *slot;
+	unsigned int count;
+
+	for (; ctx->pos < table->size; ctx->pos++) {
+		if (HASH_CTRL_IS_FULL(table->ctrl[ctx->pos])) {
+			slot = &table->slots[ctx->pos++];
+			*key_r = slot->key;
+			*value_r = slot->value;
+			return TRUE;
+		}
 	}
-	*key_r = node->key;
-	*value_r = node->value;
-
-	ctx->next = hash_table_iterate_next(ctx, node);
-	return TRUE;
+	count = array_is_created(&table->overflow) ?
+		array_count(&table->overflow) : 0;
+	for (; ctx->pos - table->size < count; ctx->pos++) {
+		slot = array_idx(&table->overflow, ctx->pos - table->size);
+		if (slot->key != NULL) {
+			ctx->pos++;
+			*key_r = slot->key;
+			*value_r = slot->value;
+			return TRUE;
+		}
+	}
+	*key_r = *value_r = NULL;
+	return FALSE;
 }
 
 void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
@@ -425,6 +527,8 @@ void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
 		return;
 
 	*_ctx = NULL;
+	i_assert(ctx->table->iterators > 0);
+	ctx->table->iterators--;
 	hash_table_thaw(ctx->table);
 	i_free(ctx);
 }
@@ -441,67 +545,57 @@ void hash_table_thaw(struct hash_table *table)
 	if (--table->frozen > 0)
 		return;
 
-	if (table->removed_count > 0) {
-		if (!hash_table_resize(table, FALSE))
-			hash_table_compress_removed(table);
+	if (array_is_created(&table->overflow)) {
+		/* move the overflowed nodes back to the table */
+		hash_table_rehash(table, hash_table_grow_size(table));
+	} else {
+		hash_table_try_shrink(table);
 	}
 }
 
-static bool hash_table_resize(struct hash_table *table, bool grow)
+static void
+hash_table_rehash_insert(struct hash_table *table,
+			 const struct hash_slot *old_slot)
 {
-	struct hash_node *old_nodes, *node, *next;
-	unsigned int next_size, old_size, i;
-	float nodes_per_list;
-
-	i_assert(table->frozen == 0);
+	unsigned int hash = hash_table_mix(table->hash_cb(old_slot->key));
+	unsigned int idx = hash_table_find_free(table, hash);
 
-        nodes_per_list = (float) table->nodes_count / (float) table->size;
-	if (nodes_per_list > 0.3 && nodes_per_list < 2.0)
-		return FALSE;
-
-	next_size = I_MAX(primes_closest(table->nodes_count+1),
-			  table->initial_size);
-	if (next_size == table->size)
-		return FALSE;
-
-	if (grow && table->size >= next_size)
-		return FALSE;
+	i_assert(table->ctrl[idx] == HASH_CTRL_EMPTY);
+	table->growth_left--;
+	table->ctrl[idx] = hash & 0x7f;
+	table->slots[idx] = *old_slot;
+	table->nodes_count++;
+}
 
-	/* recreate primary table */
-	old_size = table->size;
-	old_nodes = table->nodes;
+static void hash_table_rehash(struct hash_table *table, unsigned int size)
+{
+	uint8_t *old_ctrl = table->ctrl;
+	struct hash_slot *old_slots = table->slots;
+	const struct hash_slot *slot;
+	unsigned int i, old_size = table->size;
 
-	table->size = I_MAX(next_size, HASH_TABLE_MIN_SIZE);
-	table->nodes = i_new(struct hash_node, table->size);
+	i_assert(table->iterators == 0);
+	i_assert(size > table->nodes_count);
 
+	hash_table_alloc_slots(table, size);
 	table->nodes_count = 0;
-	table->removed_count = 0;
-
-	table->frozen++;
 
-	/* move the data */
 	for (i = 0; i < old_size; i++) {
-		node = &old_nodes[i];
-		if (node->key != NULL) {
-			hash_table_insert_node(table, node->key,
-					       node->value, HASH_TABLE_OP_RESIZE);
-		}
-
-		for (node = node->next; node != NULL; node = next) {
-			next = node->next;
-
-			if (node->key != NULL) {
-				hash_table_insert_node(table, node->key,
-						       node->value, HASH_TABLE_OP_RESIZE);
-			}
-			free_node(table, node);
+		if (HASH_CTRL_IS_FULL(old_ctrl[i]))
+			hash_table_rehash_insert(table, &old_slots[i]);
+	}
+	i_free(old_ctrl);
+	i_free(old_slots);
+
+	if (array_is_created(&table->overflow)) {
+		array_foreach(&table->overflow, slot) {
+			if (slot->key == NULL)
+				continue;
+			hash_table_rehash_insert(table, slot);
 		}
+		array_free(&table->overflow);
+		table->overflow_count = 0;
 	}
-
-	table->frozen--;
-
-	i_free(old_nodes);
-	return TRUE;
 }
 
 void hash_table_copy(struct hash_table *dest, struct hash_table *src)
@@ -15,9 +15,9 @@ typedef unsigned int hash_callback_t(const void *p);
 typedef int hash_cmp_callback_t(const void *p1, const void *p2);
 
 /* Create a new hash table. If initial_size is 0, the default value is used.
-   table_pool is used to allocate/free large hash tables, node_pool is used
-   for smaller allocations and can also be alloconly pool. The pools must not
-   be free'd before hash_table_destroy() is called. */
+   The keys and values are stored inline in the table, so node_pool isn't
+   currently used for any allocations. It can also be alloconly pool. The
+   pools must not be free'd before hash_table_destroy() is called. */
 void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size,
 		       hash_callback_t *hash_cb,
@@ -57,9 +57,8 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 void hash_table_destroy(struct hash_table **table);
 #define hash_table_destroy(table) \
 	hash_table_destroy(&(*table)._table)
-/* Remove all nodes from hash table. If free_collisions is TRUE, the
-   memory allocated from node_pool is freed, or discarded with alloconly pools.
-   WARNING: If you p_clear() the node_pool, the free_collisions must be TRUE. */
+/* Remove all nodes from hash table. If free_collisions is TRUE, the table is
+   also shrunk back to its initial size. */
 void hash_table_clear(struct hash_table *table, bool free_collisions);
 #define hash_table_clear(table, free_collisions) \
 	hash_table_clear((table)._table, free_collisions)
@@ -146,8 +145,8 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 
 void hash_table_iterate_deinit(struct hash_iterate_context **ctx);
 
-/* Hash table isn't resized, and removed nodes aren't removed from
-   the list while hash table is freezed. Supports nesting. */
+/* Hash table isn't shrunk while it's freezed, and it isn't resized at all
+   while it's being iterated. Supports nesting. */
 void hash_table_freeze(struct hash_table *table);
 void hash_table_thaw(struct hash_table *table);
 #define hash_table_freeze(table) \
@@ -11,6 +11,15 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 
+#ifdef IOLOOP_URING
+/* ioloop-uring.c falls back to epoll when io_uring can't be used */
+#  define io_loop_handler_init io_loop_epoll_handler_init
+#  define io_loop_handler_deinit io_loop_epoll_handler_deinit
+#  define io_loop_handle_add io_loop_epoll_handle_add
+#  define io_loop_handle_remove io_loop_epoll_handle_remove
+#  define io_loop_handler_run_internal io_loop_epoll_handler_run_internal
+#endif
+
 struct ioloop_handler_context {
 	int epfd;
 
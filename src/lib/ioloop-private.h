@@ -34,6 +34,10 @@ struct ioloop {
 	bool running:1;
 	bool iolooping:1;
 	bool stop_after_run_loop:1;
+#ifdef IOLOOP_URING
+	/* io_uring isn't available, handler_context is for epoll */
+	bool handler_uring_fallback:1;
+#endif
 };
 
 struct io {
@@ -120,6 +124,51 @@ void io_loop_handle_remove(struct io_file *io, bool closed);
 
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count);
 void io_loop_handler_deinit(struct ioloop *ioloop);
+/* Initialize the handler using the ioloop's max_fd_count. */
+void io_loop_initialize_handler(struct ioloop *ioloop);
+
+#ifdef IOLOOP_URING
+typedef void io_loop_file_read_callback_t(void *context);
+
+/* pread() submitted to the ioloop's io_uring */
+struct io_loop_file_read {
+	struct io_loop_file_read *prev, *next;
+	/* ioloop where the read is in progress, NULL after it's done */
+	struct ioloop *ioloop;
+
+	uoff_t offset;
+	size_t size;
+	/* pread() result (-errno on failure), valid after done=TRUE */
+	int result;
+	bool done;
+
+	io_loop_file_read_callback_t *callback;
+	void *context;
+
+	unsigned char data[];
+};
+
+/* Start reading size bytes from fd at offset. The callback is called by the
+   ioloop once the read is done. Returns NULL if the ioloop isn't using
+   io_uring. */
+struct io_loop_file_read *
+io_loop_file_read_submit(struct ioloop *ioloop, int fd, uoff_t offset,
+			 size_t size, io_loop_file_read_callback_t *callback,
+			 void *context);
+/* Wait until the read is done. */
+void io_loop_file_read_wait(struct io_loop_file_read *read);
+/* Free the read. If it's still in progress, it's freed only after the kernel
+   is finished with it. The callback isn't called anymore. */
+void io_loop_file_read_free(struct io_loop_file_read **read);
+
+/* epoll handler, used by the io_uring handler as a runtime fallback */
+void io_loop_epoll_handler_run_internal(struct ioloop *ioloop);
+void io_loop_epoll_handle_add(struct io_file *io);
+void io_loop_epoll_handle_remove(struct io_file *io, bool closed);
+void io_loop_epoll_handler_init(struct ioloop *ioloop,
+				unsigned int initial_fd_count);
+void io_loop_epoll_handler_deinit(struct ioloop *ioloop);
+#endif
 
 void io_loop_notify_remove(struct io *io);
 void io_loop_notify_handler_deinit(struct ioloop *ioloop);
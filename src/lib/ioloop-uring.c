@@ -0,0 +1,485 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "llist.h"
+#include "sleep.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include "uring-util.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+/* The ring is used for poll requests and async file istream reads, so it
+   doesn't need to be large. If it fills up, the queued requests are simply
+   submitted early. */
+#define IOLOOP_URING_MIN_ENTRIES 64
+
+/* user_data for requests whose completions are ignored */
+#define IOLOOP_URING_USER_DATA_IGNORE 0
+/* user_data flag for file reads. The rest of the bits are the
+   struct io_loop_file_read pointer. Poll requests never have it set. */
+#define IOLOOP_URING_USER_DATA_FILE_READ (1ULL << 63)
+
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+#define IO_URING_INPUT (POLLIN | POLLPRI | IO_URING_ERROR)
+#define IO_URING_OUTPUT (POLLOUT | IO_URING_ERROR)
+
+struct io_uring_fd {
+	struct io_list list;
+
+	/* Generation of the currently armed poll request. Completions for
+	   older generations are stale and get ignored. */
+	uint32_t gen;
+	/* Events that the armed poll request is waiting for,
+	   0 if there's no poll request armed. */
+	unsigned int armed_events;
+	/* fd is in pending_fds */
+	bool pending:1;
+	/* fd has at least one io registered */
+	bool registered:1;
+};
+
+struct ioloop_handler_context {
+	struct uring ring;
+
+	unsigned int registered_count;
+	ARRAY(struct io_uring_fd *) fd_index;
+	/* fds whose poll request needs to be (re)armed or changed */
+	ARRAY(int) pending_fds;
+	/* completions copied out of the CQ ring for the current run */
+	ARRAY(struct io_uring_cqe) events;
+
+	/* file reads still in progress */
+	struct io_loop_file_read *file_reads;
+	unsigned int file_reads_count;
+};
+
+static void io_loop_uring_wait(struct ioloop_handler_context *ctx);
+
+static bool io_loop_uring_wanted(void)
+{
+	const char *value = getenv("DOVECOT_IOLOOP");
+
+	return value == NULL || strcmp(value, "epoll") != 0;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+
+	ctx = i_new(struct ioloop_handler_context, 1);
+	if (!io_loop_uring_wanted() ||
+	    uring_init(&ctx->ring, I_MAX(initial_fd_count,
+					 IOLOOP_URING_MIN_ENTRIES)) < 0) {
+		i_free(ctx);
+		ioloop->handler_uring_fallback = TRUE;
+		io_loop_epoll_handler_init(ioloop, initial_fd_count);
+		return;
+	}
+	ioloop->handler_context = ctx;
+
+	i_array_init(&ctx->events, initial_fd_count);
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->pending_fds, initial_fd_count);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd **fds;
+	unsigned int i, count;
+
+	if (ioloop->handler_uring_fallback) {
+		io_loop_epoll_handler_deinit(ioloop);
+		return;
+	}
+
+	/* the kernel may still be writing to the file read buffers */
+	while (ctx->file_reads != NULL)
+		io_loop_uring_wait(ctx);
+
+	fds = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(fds[i]);
+
+	uring_deinit(&ctx->ring);
+	array_free(&ctx->fd_index);
+	array_free(&ctx->pending_fds);
+	array_free(&ctx->events);
+	i_free(ioloop->handler_context);
+}
+
+static void
+io_loop_uring_enter(struct ioloop_handler_context *ctx, bool wait, int msecs)
+{
+	if (uring_enter(&ctx->ring, wait ? 1 : 0, msecs) < 0)
+		i_fatal("io_uring_enter() failed: %m");
+}
+
+/* fd is stored +1 so that user_data never becomes
+   IOLOOP_URING_USER_DATA_IGNORE */
+static uint64_t io_loop_uring_user_data(int fd, uint32_t gen)
+{
+	return ((uint64_t)(unsigned int)fd + 1) << 32 | gen;
+}
+
+static int io_loop_uring_user_data_fd(uint64_t user_data)
+{
+	return (int)(user_data >> 32) - 1;
+}
+
+static unsigned int uring_poll_events(const struct io_list *list)
+{
+	unsigned int events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if ((io->io.condition & IO_READ) != 0)
+			events |= IO_URING_INPUT;
+		if ((io->io.condition & IO_WRITE) != 0)
+			events |= IO_URING_OUTPUT;
+		if ((io->io.condition & IO_ERROR) != 0)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+static void
+io_loop_uring_cancel(struct ioloop_handler_context *ctx, int fd,
+		     struct io_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ufd->armed_events == 0)
+		return;
+
+	sqe = uring_get_sqe(&ctx->ring);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = io_loop_uring_user_data(fd, ufd->gen);
+	sqe->user_data = IOLOOP_URING_USER_DATA_IGNORE;
+	uring_commit_sqe(&ctx->ring);
+
+	/* any completion still in flight for the old request is stale now */
+	ufd->gen++;
+	ufd->armed_events = 0;
+}
+
+static void
+io_loop_uring_arm(struct ioloop_handler_context *ctx, int fd,
+		  struct io_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int events = uring_poll_events(&ufd->list);
+
+	if (ufd->armed_events == events)
+		return;
+	io_loop_uring_cancel(ctx, fd, ufd);
+	if (events == 0)
+		return;
+
+	sqe = uring_get_sqe(&ctx->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = io_loop_uring_user_data(fd, ufd->gen);
+	uring_commit_sqe(&ctx->ring);
+	ufd->armed_events = events;
+}
+
+static void
+io_loop_uring_set_pending(struct ioloop_handler_context *ctx, int fd,
+			  struct io_uring_fd *ufd)
+{
+	if (!ufd->pending) {
+		ufd->pending = TRUE;
+		array_push_back(&ctx->pending_fds, &fd);
+	}
+}
+
+static void io_loop_uring_flush_pending(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_fd *ufd;
+	const int *fdp;
+
+	array_foreach(&ctx->pending_fds, fdp) {
+		ufd = array_idx_elem(&ctx->fd_index, *fdp);
+		ufd->pending = FALSE;
+		io_loop_uring_arm(ctx, *fdp, ufd);
+	}
+	array_clear(&ctx->pending_fds);
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp;
+
+	if (io->io.ioloop->handler_uring_fallback) {
+		io_loop_epoll_handle_add(io);
+		return;
+	}
+
+	ufdp = array_idx_get_space(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL)
+		*ufdp = i_new(struct io_uring_fd, 1);
+
+	if (ioloop_iolist_add(&(*ufdp)->list, io)) {
+		i_assert(!(*ufdp)->registered);
+		(*ufdp)->registered = TRUE;
+		ctx->registered_count++;
+		/* Submit new fds immediately, like EPOLL_CTL_ADD does. This
+		   way events get reported in the order in which the fds
+		   became ready, not in the order they were added. */
+		io_loop_uring_arm(ctx, io->fd, *ufdp);
+		io_loop_uring_enter(ctx, FALSE, 0);
+	} else {
+		/* changes to existing fds are submitted in the next run,
+		   together with all the rearming */
+		io_loop_uring_set_pending(ctx, io->fd, *ufdp);
+	}
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd *ufd;
+
+	if (io->io.ioloop->handler_uring_fallback) {
+		io_loop_epoll_handle_remove(io, closed);
+		return;
+	}
+
+	ufd = array_idx_elem(&ctx->fd_index, io->fd);
+	if (ioloop_iolist_del(&ufd->list, io)) {
+		/* Unlike epoll, an armed poll request keeps a reference to
+		   the file even after the fd is closed. Cancel it
+		   immediately, so e.g. a closed socket is really
+		   disconnected. */
+		io_loop_uring_cancel(ctx, io->fd, ufd);
+		if (ctx->ring.sq_unsubmitted > 0)
+			io_loop_uring_enter(ctx, FALSE, 0);
+		i_assert(ufd->registered);
+		ufd->registered = FALSE;
+		ctx->registered_count--;
+	} else {
+		io_loop_uring_set_pending(ctx, io->fd, ufd);
+	}
+	i_free(io);
+}
+
+static void
+io_loop_uring_file_read_done(struct ioloop_handler_context *ctx,
+			     const struct io_uring_cqe *cqe)
+{
+	struct io_loop_file_read *read = (struct io_loop_file_read *)
+		(uintptr_t)(cqe->user_data & ~IOLOOP_URING_USER_DATA_FILE_READ);
+
+	DLLIST_REMOVE(&ctx->file_reads, read);
+	ctx->file_reads_count--;
+	read->result = cqe->res;
+	read->done = TRUE;
+	read->ioloop = NULL;
+
+	if (read->callback == NULL) {
+		/* freed while the read was in progress */
+		i_free(read);
+	} else {
+		read->callback(read->context);
+	}
+}
+
+/* Handle the completions in the CQ ring. If save_events is FALSE, the poll
+   completions are only rearmed. Polls are level-triggered, so they are
+   reported again by the next run. */
+static void
+io_loop_uring_reap(struct ioloop_handler_context *ctx, bool save_events)
+{
+	const struct io_uring_cqe *cqe;
+	struct io_uring_fd *ufd;
+	int fd;
+
+	if (save_events)
+		array_clear(&ctx->events);
+	for (; (cqe = uring_peek_cqe(&ctx->ring)) != NULL;
+	     uring_cqe_seen(&ctx->ring)) {
+		if ((cqe->user_data & IOLOOP_URING_USER_DATA_FILE_READ) != 0) {
+			io_loop_uring_file_read_done(ctx, cqe);
+			continue;
+		}
+		if (cqe->user_data == IOLOOP_URING_USER_DATA_IGNORE ||
+		    cqe->res == -ECANCELED)
+			continue;
+		fd = io_loop_uring_user_data_fd(cqe->user_data);
+		if ((unsigned int)fd >= array_count(&ctx->fd_index))
+			continue;
+		ufd = array_idx_elem(&ctx->fd_index, fd);
+		if (ufd == NULL || (uint32_t)cqe->user_data != ufd->gen)
+			continue;
+
+		/* poll requests are one-shot, so it needs to be rearmed */
+		ufd->armed_events = 0;
+		ufd->gen++;
+		if (ufd->registered)
+			io_loop_uring_set_pending(ctx, fd, ufd);
+		if (save_events)
+			array_push_back(&ctx->events, cqe);
+	}
+}
+
+static void io_loop_uring_wait(struct ioloop_handler_context *ctx)
+{
+	io_loop_uring_enter(ctx, TRUE, -1);
+	io_loop_uring_reap(ctx, FALSE);
+}
+
+struct io_loop_file_read *
+io_loop_file_read_submit(struct ioloop *ioloop, int fd, uoff_t offset,
+			 size_t size, io_loop_file_read_callback_t *callback,
+			 void *context)
+{
+	struct ioloop_handler_context *ctx;
+	struct io_loop_file_read *read;
+	struct io_uring_sqe *sqe;
+
+	i_assert(callback != NULL);
+
+	if (ioloop->handler_context == NULL)
+		io_loop_initialize_handler(ioloop);
+	if (ioloop->handler_uring_fallback)
+		return NULL;
+	ctx = ioloop->handler_context;
+
+	read = i_malloc(sizeof(*read) + size);
+	i_assert(((uintptr_t)read & IOLOOP_URING_USER_DATA_FILE_READ) == 0);
+	read->ioloop = ioloop;
+	read->offset = offset;
+	read->size = size;
+	read->callback = callback;
+	read->context = context;
+
+	sqe = uring_get_sqe(&ctx->ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)read->data;
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)read | IOLOOP_URING_USER_DATA_FILE_READ;
+	uring_commit_sqe(&ctx->ring);
+	DLLIST_PREPEND(&ctx->file_reads, read);
+	ctx->file_reads_count++;
+
+	/* Submit immediately, so the read is in progress while the caller
+	   does something else. This also submits the pending poll changes. */
+	io_loop_uring_enter(ctx, FALSE, 0);
+	return read;
+}
+
+void io_loop_file_read_wait(struct io_loop_file_read *read)
+{
+	while (!read->done)
+		io_loop_uring_wait(read->ioloop->handler_context);
+}
+
+void io_loop_file_read_free(struct io_loop_file_read **_read)
+{
+	struct io_loop_file_read *read = *_read;
+
+	*_read = NULL;
+	if (read->done)
+		i_free(read);
+	else {
+		/* io_loop_uring_file_read_done() frees it */
+		read->callback = NULL;
+		read->context = NULL;
+	}
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	const struct io_uring_cqe *cqe;
+	struct io_uring_fd *ufd;
+	struct io_file *io;
+	struct timeval tv;
+	unsigned int i, events, events_count;
+	int msecs, j;
+	bool call;
+
+	if (ioloop->handler_uring_fallback) {
+		io_loop_epoll_handler_run_internal(ioloop);
+		return;
+	}
+
+	i_assert(ctx != NULL);
+
+	/* get the time left for next timeout task */
+	msecs = io_loop_run_get_wait_time(ioloop, &tv);
+
+	/* submit all the poll changes and wait for events with a single
+	   syscall */
+	io_loop_uring_flush_pending(ctx);
+	if ((ioloop->io_files != NULL && ctx->registered_count > 0) ||
+	    ctx->file_reads_count > 0)
+		io_loop_uring_enter(ctx, TRUE, msecs);
+	else {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. */
+		i_assert(msecs >= 0);
+		if (ctx->ring.sq_unsubmitted > 0)
+			io_loop_uring_enter(ctx, FALSE, 0);
+		i_sleep_intr_msecs(msecs);
+	}
+	io_loop_uring_reap(ctx, TRUE);
+
+	/* execute timeout handlers */
+	io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running)
+		return;
+
+	events_count = array_count(&ctx->events);
+	for (i = 0; i < events_count; i++) {
+		/* io_loop_handle_add() may cause fd_index reallocation,
+		   so we have to look the fd up again */
+		cqe = array_idx(&ctx->events, i);
+		ufd = array_idx_elem(&ctx->fd_index,
+				     io_loop_uring_user_data_fd(cqe->user_data));
+		events = cqe->res < 0 ? POLLERR : (unsigned int)cqe->res;
+
+		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
+			io = ufd->list.ios[j];
+			if (io == NULL)
+				continue;
+
+			call = FALSE;
+			if ((events & (POLLHUP | POLLERR | POLLNVAL)) != 0)
+				call = TRUE;
+			else if ((io->io.condition & IO_READ) != 0)
+				call = (events & (POLLIN | POLLPRI)) != 0;
+			else if ((io->io.condition & IO_WRITE) != 0)
+				call = (events & POLLOUT) != 0;
+			else if ((io->io.condition & IO_ERROR) != 0)
+				call = (events & IO_URING_ERROR) != 0;
+
+			if (call) {
+				io_loop_call_io(&io->io);
+				if (!ioloop->running)
+					return;
+			}
+		}
+	}
+}
+
+#endif	/* IOLOOP_URING */
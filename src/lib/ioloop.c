@@ -30,7 +30,7 @@ static bool panic_on_leak = FALSE, panic_on_leak_set = FALSE;
 
 static time_t data_stack_last_free_unused = 0;
 
-static void io_loop_initialize_handler(struct ioloop *ioloop)
+void io_loop_initialize_handler(struct ioloop *ioloop)
 {
 	unsigned int initial_fd_count;
 
@@ -0,0 +1,343 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop-private.h"
+#include "istream-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef IOLOOP_URING
+
+/* Maximum size of a single read request. Reads are done into a separate
+   buffer first, since the stream buffer may change while the read is in
+   progress. */
+#define FILE_ASYNC_MAX_REQUEST_SIZE (128*1024)
+
+struct file_async_istream {
+	struct istream_private istream;
+
+	int file_fd;
+	size_t request_size;
+
+	/* the read request for the current offset */
+	struct io_loop_file_read *read;
+	/* number of bytes already copied from read to the stream buffer */
+	size_t read_consumed;
+
+	bool autoclose_fd:1;
+};
+
+static void i_stream_file_async_read_done(void *context)
+{
+	struct file_async_istream *astream = context;
+
+	if (!astream->istream.istream.blocking)
+		i_stream_set_input_pending(&astream->istream.istream, TRUE);
+}
+
+static bool
+i_stream_file_async_submit(struct file_async_istream *astream,
+			   uoff_t offset)
+{
+	i_assert(astream->read == NULL);
+
+	if (current_ioloop == NULL)
+		return FALSE;
+	astream->read = io_loop_file_read_submit(current_ioloop,
+		astream->file_fd, offset, astream->request_size,
+		i_stream_file_async_read_done, astream);
+	astream->read_consumed = 0;
+	return astream->read != NULL;
+}
+
+static void i_stream_file_async_drop_read(struct file_async_istream *astream)
+{
+	if (astream->read != NULL)
+		io_loop_file_read_free(&astream->read);
+}
+
+static void
+i_stream_file_async_close(struct iostream_private *stream,
+			  bool close_parent ATTR_UNUSED)
+{
+	struct file_async_istream *astream =
+		container_of(stream, struct file_async_istream,
+			     istream.iostream);
+
+	/* the kernel keeps its own reference to the file until an in-progress
+	   read is finished, so the fd can be closed already */
+	i_stream_file_async_drop_read(astream);
+	if (astream->autoclose_fd && astream->file_fd != -1) {
+		if (close(astream->file_fd) < 0) {
+			i_error("file_istream.close(%s) failed: %m",
+				i_stream_get_name(&astream->istream.istream));
+		}
+	}
+	astream->file_fd = -1;
+}
+
+static int i_stream_file_async_open(struct file_async_istream *astream)
+{
+	struct istream_private *stream = &astream->istream;
+	const char *path = i_stream_get_name(&stream->istream);
+
+	astream->file_fd = open(path, O_RDONLY);
+	if (astream->file_fd == -1) {
+		io_stream_set_error(&stream->iostream,
+				    "open(%s) failed: %m", path);
+		stream->istream.stream_errno = errno;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t
+i_stream_file_async_pread(struct file_async_istream *astream, uoff_t offset,
+			  size_t size)
+{
+	struct istream_private *stream = &astream->istream;
+	ssize_t ret;
+
+	/* the ioloop can't read asynchronously */
+	ret = pread(astream->file_fd, stream->w_buffer + stream->pos,
+		    size, offset);
+	if (ret < 0) {
+		io_stream_set_error(&stream->iostream,
+			"pread(size=%zu offset=%"PRIuUOFF_T") failed: %m",
+			size, offset);
+		stream->istream.stream_errno = errno;
+		return -1;
+	}
+	if (ret == 0) {
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+	stream->pos += ret;
+	return ret;
+}
+
+static ssize_t i_stream_file_async_read(struct istream_private *stream)
+{
+	struct file_async_istream *astream =
+		container_of(stream, struct file_async_istream, istream);
+	struct io_loop_file_read *read;
+	uoff_t offset;
+	size_t size, avail;
+
+	if (!i_stream_try_alloc(stream, 1, &size))
+		return -2;
+
+	if (astream->file_fd == -1) {
+		if (i_stream_file_async_open(astream) < 0)
+			return -1;
+	}
+
+	offset = stream->istream.v_offset + (stream->pos - stream->skip);
+	if (astream->read != NULL &&
+	    astream->read->offset + astream->read_consumed != offset) {
+		/* seeked elsewhere */
+		i_stream_file_async_drop_read(astream);
+	}
+	if (astream->read == NULL) {
+		if (!i_stream_file_async_submit(astream, offset))
+			return i_stream_file_async_pread(astream, offset, size);
+	}
+
+	read = astream->read;
+	if (!read->done) {
+		if (!stream->istream.blocking) {
+			/* i_stream_set_input_pending() is called when the
+			   read is finished */
+			return 0;
+		}
+		io_loop_file_read_wait(read);
+	}
+
+	if (read->result < 0) {
+		errno = -read->result;
+		io_stream_set_error(&stream->iostream,
+			"pread(size=%zu offset=%"PRIuUOFF_T") failed: %m",
+			read->size, read->offset);
+		stream->istream.stream_errno = errno;
+		i_stream_file_async_drop_read(astream);
+		return -1;
+	}
+
+	avail = (size_t)read->result - astream->read_consumed;
+	if (avail == 0) {
+		/* EOF */
+		i_assert(read->result == 0);
+		i_stream_file_async_drop_read(astream);
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+
+	size = I_MIN(size, avail);
+	memcpy(stream->w_buffer + stream->pos,
+	       read->data + astream->read_consumed, size);
+	astream->read_consumed += size;
+	stream->pos += size;
+
+	if (astream->read_consumed == (size_t)read->result) {
+		/* start reading the next block already while the caller is
+		   processing this one */
+		offset = read->offset + astream->read_consumed;
+		i_stream_file_async_drop_read(astream);
+		(void)i_stream_file_async_submit(astream, offset);
+	}
+	return size;
+}
+
+static void
+i_stream_file_async_seek(struct istream_private *stream, uoff_t v_offset,
+			 bool mark ATTR_UNUSED)
+{
+	/* any pending read request for a different offset gets dropped by
+	   the next read() */
+	stream->istream.v_offset = v_offset;
+	stream->skip = stream->pos = 0;
+}
+
+static void i_stream_file_async_sync(struct istream_private *stream)
+{
+	struct file_async_istream *astream =
+		container_of(stream, struct file_async_istream, istream);
+
+	i_stream_file_async_drop_read(astream);
+	stream->skip = stream->pos = 0;
+	stream->istream.eof = FALSE;
+}
+
+static void
+i_stream_file_async_switch_ioloop_to(struct istream_private *stream,
+				     struct ioloop *ioloop)
+{
+	struct file_async_istream *astream =
+		container_of(stream, struct file_async_istream, istream);
+
+	/* the read's completion would be handled only by the old ioloop.
+	   read the data again in the new ioloop. */
+	if (astream->read != NULL && astream->read->ioloop != ioloop)
+		i_stream_file_async_drop_read(astream);
+}
+
+static int
+i_stream_file_async_stat(struct istream_private *stream,
+			 bool exact ATTR_UNUSED)
+{
+	struct file_async_istream *astream =
+		container_of(stream, struct file_async_istream, istream);
+	const char *name = i_stream_get_name(&stream->istream);
+
+	if (astream->file_fd != -1) {
+		if (fstat(astream->file_fd, &stream->statbuf) < 0) {
+			stream->istream.stream_errno = errno;
+			io_stream_set_error(&stream->iostream,
+				"file_istream.fstat(%s) failed: %m", name);
+			i_error("%s", i_stream_get_error(&stream->istream));
+			return -1;
+		}
+	} else {
+		if (stat(name, &stream->statbuf) < 0) {
+			stream->istream.stream_errno = errno;
+			io_stream_set_error(&stream->iostream,
+				"file_istream.stat(%s) failed: %m", name);
+			i_error("%s", i_stream_get_error(&stream->istream));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static struct istream *
+i_stream_create_file_async_common(int fd, size_t max_buffer_size,
+				  bool autoclose_fd)
+{
+	struct file_async_istream *astream;
+
+	astream = i_new(struct file_async_istream, 1);
+	astream->file_fd = fd;
+	astream->autoclose_fd = autoclose_fd;
+	astream->request_size = I_MIN(I_MAX(max_buffer_size, IO_BLOCK_SIZE),
+				      FILE_ASYNC_MAX_REQUEST_SIZE);
+
+	astream->istream.iostream.close = i_stream_file_async_close;
+	astream->istream.max_buffer_size = max_buffer_size;
+	astream->istream.read = i_stream_file_async_read;
+	astream->istream.seek = i_stream_file_async_seek;
+	astream->istream.sync = i_stream_file_async_sync;
+	astream->istream.stat = i_stream_file_async_stat;
+	astream->istream.switch_ioloop_to =
+		i_stream_file_async_switch_ioloop_to;
+
+	astream->istream.istream.blocking = FALSE;
+	astream->istream.istream.seekable = TRUE;
+	/* There's no fd to poll. The ioloop calls i_stream_set_input_pending()
+	   when a read is finished, which triggers io_add_istream(). */
+	return i_stream_create(&astream->istream, NULL, -1, 0);
+}
+
+static bool i_stream_file_async_available(void)
+{
+	/* the reads are done by the ioloop's io_uring */
+	if (current_ioloop == NULL)
+		return FALSE;
+	if (current_ioloop->handler_context == NULL)
+		io_loop_initialize_handler(current_ioloop);
+	return !current_ioloop->handler_uring_fallback;
+}
+
+struct istream *
+i_stream_create_fd_async_autoclose(int *fd, size_t max_buffer_size)
+{
+	struct istream *input;
+
+	i_assert(*fd != -1);
+
+	if (!i_stream_file_async_available())
+		return i_stream_create_fd_autoclose(fd, max_buffer_size);
+	input = i_stream_create_file_async_common(*fd, max_buffer_size, TRUE);
+	i_stream_set_name(input, "(file)");
+	*fd = -1;
+	return input;
+}
+
+struct istream *
+i_stream_create_file_async(const char *path, size_t max_buffer_size)
+{
+	struct istream *input;
+
+	if (!i_stream_file_async_available())
+		return i_stream_create_file(path, max_buffer_size);
+	input = i_stream_create_file_async_common(-1, max_buffer_size, TRUE);
+	i_stream_set_name(input, path);
+	return input;
+}
+
+bool i_stream_is_file_async(struct istream *input)
+{
+	input = i_stream_get_root_io(input);
+	return input->real_stream->read == i_stream_file_async_read;
+}
+
+#else
+
+struct istream *
+i_stream_create_fd_async_autoclose(int *fd, size_t max_buffer_size)
+{
+	return i_stream_create_fd_autoclose(fd, max_buffer_size);
+}
+
+struct istream *
+i_stream_create_file_async(const char *path, size_t max_buffer_size)
+{
+	return i_stream_create_file(path, max_buffer_size);
+}
+
+bool i_stream_is_file_async(struct istream *input ATTR_UNUSED)
+{
+	return FALSE;
+}
+
+#endif
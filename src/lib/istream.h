@@ -44,6 +44,19 @@ struct istream *i_stream_create_fd_autoclose(int *fd, size_t max_buffer_size);
 /* Open the given path only when something is actually tried to be read from
    the stream. */
 struct istream *i_stream_create_file(const char *path, size_t max_buffer_size);
+/* Create a non-blocking file istream. The reads are done asynchronously by
+   the current ioloop's io_uring, and read() returns 0 while waiting for the
+   data. The next block is already being read while the caller processes the
+   previous one. Use io_add_istream() to wait for more data. With
+   i_stream_set_blocking(TRUE) the reads wait for the data, but the next block
+   is still read ahead. If the ioloop doesn't use io_uring, these return a
+   normal blocking file istream instead. */
+struct istream *
+i_stream_create_file_async(const char *path, size_t max_buffer_size);
+struct istream *
+i_stream_create_fd_async_autoclose(int *fd, size_t max_buffer_size);
+/* Returns TRUE if the stream's root is an async file istream. */
+bool i_stream_is_file_async(struct istream *input);
 /* Create an input stream using the provided data block. That data block must
 remain allocated during the full lifetime of the stream. */
 struct istream *i_stream_create_from_data(const void *data, size_t size);
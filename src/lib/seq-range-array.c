@@ -409,30 +409,79 @@ void seq_range_array_remove_nth(ARRAY_TYPE(seq_range) *array,
 	seq_range_array_remove_range(array, seq1, seq2);
 }
 
+static unsigned int
+seq_range_gallop(const struct seq_range *range, unsigned int idx,
+		 unsigned int count, uint32_t seq)
+{
+	unsigned int low, high, mid, step;
+
+	/* find the first range starting from idx that ends at or after seq.
+	   the ranges are usually either close to each other or very far
+	   apart, so do an exponential search followed by a binary search. */
+	if (idx >= count || range[idx].seq2 >= seq)
+		return idx;
+
+	low = idx;
+	for (step = 1; step < count - low && range[low + step].seq2 < seq;
+	     step *= 2)
+		low += step;
+	high = step < count - low ? low + step : count;
+	low++;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (range[mid].seq2 < seq)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
 unsigned int seq_range_array_intersect(ARRAY_TYPE(seq_range) *dest,
 				       const ARRAY_TYPE(seq_range) *src)
 {
-	const struct seq_range *src_range;
-	unsigned int i, count, remove_count, full_count = 0;
-	uint32_t last_seq = 0;
-
-	src_range = array_get(src, &count);
-	for (i = 0; i < count; i++) {
-		if (last_seq + 1 < src_range[i].seq1) {
-			remove_count = seq_range_array_remove_range(dest,
-				last_seq + 1, src_range[i].seq1 - 1);
-			i_assert(UINT_MAX - full_count >= remove_count);
-			full_count += remove_count;
+	ARRAY_TYPE(seq_range) result;
+	const struct seq_range *dest_range, *src_range;
+	struct seq_range *new_range;
+	unsigned int i, j, dest_count, src_count, old_seq_count;
+
+	dest_range = array_get(dest, &dest_count);
+	src_range = array_get(src, &src_count);
+	if (dest_count == 0)
+		return 0;
+	old_seq_count = seq_range_count(dest);
+
+	/* merge the ranges into a new array. skip over the non-matching
+	   ranges by galloping, so intersecting a small array with a large one
+	   is O(small * log(large)) rather than O(small + large). */
+	i_array_init(&result, I_MIN(dest_count, src_count) + 1);
+	i = j = 0;
+	while (i < dest_count && j < src_count) {
+		if (dest_range[i].seq2 < src_range[j].seq1) {
+			i = seq_range_gallop(dest_range, i + 1, dest_count,
+					     src_range[j].seq1);
+			continue;
 		}
-		last_seq = src_range[i].seq2;
-	}
-	if (last_seq != (uint32_t)-1) {
-		remove_count = seq_range_array_remove_range(dest, last_seq + 1,
-							    (uint32_t)-1);
-		i_assert(UINT_MAX - full_count >= remove_count);
-		full_count += remove_count;
+		if (src_range[j].seq2 < dest_range[i].seq1) {
+			j = seq_range_gallop(src_range, j + 1, src_count,
+					     dest_range[i].seq1);
+			continue;
+		}
+
+		new_range = array_append_space(&result);
+		new_range->seq1 = I_MAX(dest_range[i].seq1, src_range[j].seq1);
+		new_range->seq2 = I_MIN(dest_range[i].seq2, src_range[j].seq2);
+		if (dest_range[i].seq2 == new_range->seq2)
+			i++;
+		if (src_range[j].seq2 == new_range->seq2)
+			j++;
 	}
-	return full_count;
+
+	array_clear(dest);
+	array_append_array(dest, &result);
+	array_free(&result);
+	return old_seq_count - seq_range_count(dest);
 }
 
 bool seq_range_exists(const ARRAY_TYPE(seq_range) *array, uint32_t seq)
@@ -2,7 +2,9 @@
 
 #include "test-lib.h"
 #include "str.h"
+#include "randgen.h"
 #include "base64.h"
+#include "base64-simd.h"
 
 static void test_base64_encode(void)
 {
@@ -1302,6 +1304,83 @@ static void test_base64_encode_lines(void)
 	test_end();
 }
 
+static int
+test_base64_simd_decode(const struct base64_scheme *b64, bool simd,
+			const string_t *in, size_t *src_pos_r, buffer_t *out)
+{
+	struct base64_decoder dec;
+	int ret;
+
+	base64_simd_set_enabled(simd);
+	buffer_set_used_size(out, 0);
+	base64_decode_init(&dec, b64, BASE64_DECODE_FLAG_EXPECT_BOUNDARY);
+	ret = base64_decode_more(&dec, str_data(in), str_len(in),
+				 src_pos_r, out);
+	if (base64_decode_finish(&dec) < 0)
+		ret = -1;
+	return ret;
+}
+
+static void test_base64_simd_scheme(const struct base64_scheme *b64)
+{
+	static const char junk[] = " \r\n\t=!\x80-_+/";
+	string_t *enc1, *enc2;
+	buffer_t *input, *dec1, *dec2;
+	size_t pos1, pos2, size, line_len;
+	unsigned int i, j, count;
+	int ret1, ret2;
+
+	input = t_buffer_create(1024);
+	enc1 = t_str_new(2048);
+	enc2 = t_str_new(2048);
+	dec1 = t_buffer_create(1024);
+	dec2 = t_buffer_create(1024);
+	for (i = 0; i < 1000; i++) {
+		size = i_rand_limit(1024);
+		buffer_set_used_size(input, 0);
+		random_fill(buffer_append_space_unsafe(input, size), size);
+
+		/* encoding must give the same result with and without SIMD */
+		line_len = i_rand_limit(2) == 0 ? 0 : 76;
+		str_truncate(enc1, 0);
+		str_truncate(enc2, 0);
+		base64_simd_set_enabled(FALSE);
+		base64_scheme_encode(b64, 0, line_len,
+				     input->data, input->used, enc1);
+		base64_simd_set_enabled(TRUE);
+		base64_scheme_encode(b64, 0, line_len,
+				     input->data, input->used, enc2);
+		test_assert_idx(str_equals(enc1, enc2), i);
+
+		/* add some whitespace or invalid characters */
+		count = i_rand_limit(4);
+		for (j = 0; j < count && str_len(enc1) > 0; j++) {
+			str_insert(enc1, i_rand_limit(str_len(enc1)),
+				   t_strndup(&junk[i_rand_limit(sizeof(junk)-1)], 1));
+		}
+
+		ret1 = test_base64_simd_decode(b64, FALSE, enc1, &pos1, dec1);
+		ret2 = test_base64_simd_decode(b64, TRUE, enc1, &pos2, dec2);
+		test_assert_idx(ret1 == ret2, i);
+		test_assert_idx(pos1 == pos2, i);
+		test_assert_idx(buffer_cmp(dec1, dec2), i);
+		if (count == 0) {
+			test_assert_idx(ret2 >= 0 &&
+					buffer_cmp(dec2, input), i);
+		}
+	}
+	base64_simd_set_enabled(TRUE);
+}
+
+static void test_base64_simd(void)
+{
+	test_begin(t_strdup_printf("base64 simd (%s)",
+				   base64_simd_get_name()));
+	test_base64_simd_scheme(&base64_scheme);
+	test_base64_simd_scheme(&base64url_scheme);
+	test_end();
+}
+
 void test_base64(void)
 {
 	test_base64_encode();
@@ -1314,4 +1393,5 @@ void test_base64(void)
 	test_base64_decode_lowlevel();
 	test_base64_random_lowlevel();
 	test_base64_encode_lines();
+	test_base64_simd();
 }
@@ -35,6 +35,91 @@ static void test_hash_random_pool(pool_t pool)
 	i_free(keys);
 }
 
+static void test_hash_iterate_modify(void)
+{
+#define ITER_KEYMAX 880
+#define ITER_EXTRA_COUNT 1000
+	HASH_TABLE(void *, void *) hash;
+	struct hash_iterate_context *iter;
+	void *key, *value;
+	unsigned int i, count = 0, seen[ITER_KEYMAX+1];
+
+	test_begin("hash iterate modify");
+	memset(seen, 0, sizeof(seen));
+	hash_table_create_direct(&hash, default_pool, 0);
+	for (i = 1; i <= ITER_KEYMAX; i += 2)
+		hash_table_insert(hash, POINTER_CAST(i), POINTER_CAST(i));
+
+	/* remove the current and the next node and add the following node.
+	   at the first node also add many more nodes than there are free
+	   slots left, so they will have to go to the overflow array. */
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		i = POINTER_CAST_TO(key, unsigned int);
+		test_assert(key == value);
+		if (i > ITER_KEYMAX) {
+			/* one of the extra nodes */
+			continue;
+		}
+		test_assert(seen[i]++ == 0);
+		if (count == 0) {
+			for (unsigned int j = 1; j <= ITER_EXTRA_COUNT; j++) {
+				hash_table_insert(hash,
+					POINTER_CAST(ITER_KEYMAX + j),
+					POINTER_CAST(ITER_KEYMAX + j));
+			}
+		}
+		if (i % 2 == 0) {
+			/* added during the iteration */
+			continue;
+		}
+		hash_table_remove(hash, key);
+		if (i + 2 <= ITER_KEYMAX &&
+		    hash_table_lookup(hash, POINTER_CAST(i + 2)) != NULL)
+			hash_table_remove(hash, POINTER_CAST(i + 2));
+		if (i + 1 <= ITER_KEYMAX)
+			hash_table_insert(hash, POINTER_CAST(i + 1),
+					  POINTER_CAST(i + 1));
+		count++;
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(count > 0);
+
+	/* all the odd keys were removed, and the even keys that were added
+	   are still there */
+	for (i = 1; i <= ITER_KEYMAX; i++) {
+		if (i % 2 != 0)
+			test_assert(hash_table_lookup(hash, POINTER_CAST(i)) == NULL);
+		else if (seen[i-1] != 0)
+			test_assert(hash_table_lookup(hash, POINTER_CAST(i)) != NULL);
+	}
+	/* the overflowed nodes were merged back to the table */
+	for (i = 1; i <= ITER_EXTRA_COUNT; i++) {
+		key = POINTER_CAST(ITER_KEYMAX + i);
+		test_assert(hash_table_lookup(hash, key) == key);
+		hash_table_remove(hash, key);
+	}
+	test_assert(hash_table_count(hash) == count);
+	for (i = 2; i <= ITER_KEYMAX; i += 2)
+		hash_table_update(hash, POINTER_CAST(i), POINTER_CAST(i));
+
+	count = 0;
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		test_assert(POINTER_CAST_TO(key, unsigned int) % 2 == 0);
+		count++;
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(count == ITER_KEYMAX / 2);
+	test_assert(hash_table_count(hash) == ITER_KEYMAX / 2);
+
+	hash_table_clear(hash, TRUE);
+	test_assert(hash_table_count(hash) == 0);
+	test_assert(hash_table_lookup(hash, POINTER_CAST(2)) == NULL);
+	hash_table_destroy(&hash);
+	test_end();
+}
+
 void test_hash(void)
 {
 	pool_t pool;
@@ -44,4 +129,6 @@ void test_hash(void)
 	pool = pool_alloconly_create("test hash", 1024);
 	test_hash_random_pool(pool);
 	pool_unref(&pool);
+
+	test_hash_iterate_modify();
 }
@@ -1,6 +1,7 @@
 /* Copyright (c) 2015-2018 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "env-util.h"
 #include "net.h"
 #include "time-util.h"
 #include "ioloop.h"
@@ -89,6 +90,76 @@ static void test_ioloop_fd(void)
 	test_end();
 }
 
+struct test_modify_ctx {
+	int fds[2];
+	struct io *io_read, *io_write;
+	unsigned int read_count, write_count;
+};
+
+static void test_ioloop_fd_modify_read(struct test_modify_ctx *ctx)
+{
+	char buf[3];
+
+	if (read(ctx->fds[0], buf, sizeof(buf)) != sizeof(buf))
+		i_fatal("read() failed: %m");
+	ctx->read_count++;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_fd_modify_write(struct test_modify_ctx *ctx)
+{
+	/* the socket stays writable - make sure removing the write io
+	   keeps the read io working on the same fd */
+	ctx->write_count++;
+	io_remove(&ctx->io_write);
+	if (write(ctx->fds[1], "abc", 3) != 3)
+		i_fatal("write() failed: %m");
+}
+
+static void test_ioloop_fd_modify_to(bool *got_to)
+{
+	*got_to = TRUE;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_fd_modify(void)
+{
+	struct test_modify_ctx ctx;
+	struct ioloop *ioloop;
+	struct timeout *to;
+	bool got_to = FALSE;
+	char buf[1];
+
+	test_begin("ioloop fd modify");
+
+	i_zero(&ctx);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.fds) < 0)
+		i_fatal("socketpair() failed: %m");
+
+	ioloop = io_loop_create();
+	to = timeout_add(2000, test_ioloop_fd_modify_to, &got_to);
+	ctx.io_read = io_add(ctx.fds[0], IO_READ,
+			     test_ioloop_fd_modify_read, &ctx);
+	ctx.io_write = io_add(ctx.fds[0], IO_WRITE,
+			      test_ioloop_fd_modify_write, &ctx);
+	io_loop_run(ioloop);
+	test_assert(ctx.write_count == 1);
+	test_assert(ctx.read_count == 1);
+	test_assert(ctx.io_write == NULL);
+
+	/* the peer must see the disconnection as soon as the fd is closed,
+	   even though it was still being watched */
+	io_remove(&ctx.io_read);
+	i_close_fd(&ctx.fds[0]);
+	test_assert(read(ctx.fds[1], buf, sizeof(buf)) == 0);
+
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+	i_close_fd(&ctx.fds[1]);
+	test_assert(!got_to);
+	test_end();
+}
+
 static void test_ioloop_timeout(void)
 {
 	struct ioloop *ioloop, *ioloop2;
@@ -391,7 +462,7 @@ static void test_ioloop_context_events(void)
 	test_end();
 }
 
-void test_ioloop(void)
+static void test_ioloop_run_all(void)
 {
 	test_ioloop_timeout();
 	test_ioloop_zero_timeout();
@@ -399,6 +470,18 @@ void test_ioloop(void)
 	test_ioloop_find_fd_conditions();
 	test_ioloop_pending_io();
 	test_ioloop_fd();
+	test_ioloop_fd_modify();
 	test_ioloop_context();
 	test_ioloop_context_events();
 }
+
+void test_ioloop(void)
+{
+	test_ioloop_run_all();
+#ifdef IOLOOP_URING
+	/* run the same tests with the epoll fallback */
+	env_put("DOVECOT_IOLOOP", "epoll");
+	test_ioloop_run_all();
+	env_remove("DOVECOT_IOLOOP");
+#endif
+}
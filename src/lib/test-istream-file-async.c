@@ -0,0 +1,194 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "ioloop.h"
+#include "istream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEST_FILENAME ".test_istream_file_async"
+#define TEST_FILE_SIZE (300*1024 + 17)
+
+struct test_async_ctx {
+	struct istream *input;
+	struct io *io;
+	uoff_t offset;
+	unsigned int wait_count;
+	bool corrupted;
+	bool finished;
+};
+
+static unsigned int test_async_running_count;
+
+static unsigned char test_byte(uoff_t offset)
+{
+	return (offset * 7 + offset / 251) & 0xff;
+}
+
+static void test_file_create(void)
+{
+	unsigned char buf[4096];
+	uoff_t offset = 0;
+	size_t i, size;
+	int fd;
+
+	fd = open(TEST_FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_FILENAME);
+	while (offset < TEST_FILE_SIZE) {
+		size = I_MIN(sizeof(buf), TEST_FILE_SIZE - offset);
+		for (i = 0; i < size; i++)
+			buf[i] = test_byte(offset + i);
+		if (write(fd, buf, size) != (ssize_t)size)
+			i_fatal("write(%s) failed: %m", TEST_FILENAME);
+		offset += size;
+	}
+	i_close_fd(&fd);
+}
+
+static bool test_verify(struct test_async_ctx *ctx)
+{
+	const unsigned char *data;
+	size_t i, size;
+
+	data = i_stream_get_data(ctx->input, &size);
+	for (i = 0; i < size; i++) {
+		if (data[i] != test_byte(ctx->offset + i))
+			ctx->corrupted = TRUE;
+	}
+	i_stream_skip(ctx->input, size);
+	ctx->offset += size;
+	return !ctx->corrupted;
+}
+
+static void test_async_input(struct test_async_ctx *ctx)
+{
+	ssize_t ret;
+
+	while ((ret = i_stream_read(ctx->input)) > 0) {
+		if (!test_verify(ctx))
+			break;
+	}
+	if (ret == 0) {
+		ctx->wait_count++;
+		return;
+	}
+	io_remove(&ctx->io);
+	ctx->finished = TRUE;
+	if (--test_async_running_count == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_istream_file_async_ioloop(void)
+{
+	struct test_async_ctx ctx[2];
+	struct ioloop *ioloop;
+	unsigned int i;
+
+	test_begin("istream file async ioloop");
+	i_zero(&ctx);
+	ioloop = io_loop_create();
+	/* both streams use the same ioloop concurrently */
+	for (i = 0; i < N_ELEMENTS(ctx); i++) {
+		ctx[i].input = i_stream_create_file_async(TEST_FILENAME,
+							  8192 << i);
+		ctx[i].io = io_add_istream(ctx[i].input, test_async_input,
+					   &ctx[i]);
+		io_set_pending(ctx[i].io);
+	}
+	test_async_running_count = N_ELEMENTS(ctx);
+	io_loop_run(ioloop);
+
+	for (i = 0; i < N_ELEMENTS(ctx); i++) {
+		test_assert_idx(ctx[i].finished, i);
+		test_assert_idx(!ctx[i].corrupted, i);
+		test_assert_idx(ctx[i].input->stream_errno == 0, i);
+		test_assert_idx(ctx[i].input->eof, i);
+		test_assert_idx(ctx[i].offset == TEST_FILE_SIZE, i);
+		i_stream_unref(&ctx[i].input);
+	}
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_istream_file_async_free_in_progress(void)
+{
+	struct istream *input;
+	struct ioloop *ioloop;
+
+	test_begin("istream file async free while reading");
+	ioloop = io_loop_create();
+	input = i_stream_create_file_async(TEST_FILENAME, 8192);
+	/* the read is still in progress while the stream is freed. the
+	   ioloop frees the read once it's finished. */
+	if (i_stream_is_file_async(input))
+		test_assert(i_stream_read(input) == 0);
+	i_stream_unref(&input);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_istream_file_async_blocking(void)
+{
+	struct test_async_ctx ctx;
+	struct ioloop *ioloop;
+	const unsigned char *data;
+	size_t size;
+	ssize_t ret;
+	int fd;
+
+	test_begin("istream file async blocking");
+	i_zero(&ctx);
+	ioloop = io_loop_create();
+	fd = open(TEST_FILENAME, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_FILENAME);
+	ctx.input = i_stream_create_fd_async_autoclose(&fd, 1024);
+	test_assert(fd == -1);
+	i_stream_set_blocking(ctx.input, TRUE);
+
+	while ((ret = i_stream_read(ctx.input)) > 0 && test_verify(&ctx)) ;
+	test_assert(ret == -1);
+	test_assert(ctx.input->stream_errno == 0);
+	test_assert(ctx.offset == TEST_FILE_SIZE);
+
+	/* seeking backwards drops the readahead */
+	i_stream_seek(ctx.input, 1000);
+	ctx.offset = 1000;
+	test_assert(i_stream_read_bytes(ctx.input, &data, &size, 100) > 0);
+	test_assert(test_verify(&ctx));
+
+	/* seeking forwards while the next read is still in progress */
+	i_stream_seek(ctx.input, TEST_FILE_SIZE - 10);
+	ctx.offset = TEST_FILE_SIZE - 10;
+	while ((ret = i_stream_read(ctx.input)) > 0 && test_verify(&ctx)) ;
+	test_assert(ret == -1);
+	test_assert(ctx.offset == TEST_FILE_SIZE);
+
+	i_stream_unref(&ctx.input);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_istream_file_async_error(void)
+{
+	struct istream *input;
+
+	test_begin("istream file async error");
+	input = i_stream_create_file_async(TEST_FILENAME".nonexistent", 1024);
+	test_assert(i_stream_read(input) == -1);
+	test_assert(input->stream_errno == ENOENT);
+	i_stream_unref(&input);
+	test_end();
+}
+
+void test_istream_file_async(void)
+{
+	test_file_create();
+	test_istream_file_async_ioloop();
+	test_istream_file_async_free_in_progress();
+	test_istream_file_async_blocking();
+	test_istream_file_async_error();
+	i_unlink(TEST_FILENAME);
+}
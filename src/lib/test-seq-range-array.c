@@ -231,6 +231,54 @@ fail:
 	array_free(&range);
 }
 
+static void test_seq_range_array_intersect_random(void)
+{
+#define SEQ_RANGE_INTERSECT_BUFSIZE 1000
+	bool buf1[SEQ_RANGE_INTERSECT_BUFSIZE], buf2[SEQ_RANGE_INTERSECT_BUFSIZE];
+	ARRAY_TYPE(seq_range) arr1, arr2;
+	const struct seq_range *range;
+	unsigned int i, j, seq, count, removed, expected_removed;
+	unsigned int density1, density2;
+	bool success = TRUE;
+
+	t_array_init(&arr1, 16);
+	t_array_init(&arr2, 16);
+	for (i = 0; i < 1000 && success; i++) {
+		/* mix dense and sparse arrays to test the galloping */
+		density1 = i_rand_minmax(1, 100);
+		density2 = i_rand_minmax(1, 100);
+		array_clear(&arr1);
+		array_clear(&arr2);
+		for (seq = 0; seq < SEQ_RANGE_INTERSECT_BUFSIZE; seq++) {
+			buf1[seq] = i_rand_limit(100) < density1;
+			buf2[seq] = i_rand_limit(100) < density2;
+			if (buf1[seq])
+				seq_range_array_add(&arr1, seq + 1);
+			if (buf2[seq])
+				seq_range_array_add(&arr2, seq + 1);
+		}
+
+		removed = seq_range_array_intersect(&arr1, &arr2);
+		expected_removed = 0;
+		for (seq = 0; seq < SEQ_RANGE_INTERSECT_BUFSIZE; seq++) {
+			if (buf1[seq] && !buf2[seq])
+				expected_removed++;
+			if (seq_range_exists(&arr1, seq + 1) !=
+			    (buf1[seq] && buf2[seq]))
+				success = FALSE;
+		}
+		if (removed != expected_removed)
+			success = FALSE;
+		/* the result must be properly merged */
+		range = array_get(&arr1, &count);
+		for (j = 1; j < count; j++) {
+			if (range[j-1].seq2 + 1 >= range[j].seq1)
+				success = FALSE;
+		}
+	}
+	test_out("seq_range_array_intersect() random", success);
+}
+
 static void test_seq_range_array_invert_minmax(uint32_t min, uint32_t max)
 {
 	ARRAY_TYPE(seq_range) range = ARRAY_INIT;
@@ -372,6 +420,7 @@ void test_seq_range_array(void)
 	test_seq_range_array_invert_edges();
 	test_seq_range_array_have_common();
 	test_seq_range_array_random();
+	test_seq_range_array_intersect_random();
 }
 
 enum fatal_test_state fatal_seq_range_array(unsigned int stage)
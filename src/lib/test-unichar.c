@@ -121,6 +121,53 @@ static void test_unichar_surrogates(void)
 	test_end();
 }
 
+static void test_unichar_ascii_runs(void)
+{
+	static const char *const tests[] = {
+		"\xc3\xb1", /* valid */
+		"\xff", /* invalid */
+		"\xe2\x82", /* partial */
+	};
+	unsigned char input[100];
+	buffer_t *output = t_buffer_create(128);
+	size_t i, j, pos, len, insert_len;
+
+	test_begin("unichar ascii runs");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		insert_len = strlen(tests[i]);
+		for (pos = 0; pos + insert_len <= sizeof(input); pos++) {
+			for (j = 0; j < sizeof(input); j++)
+				input[j] = 'a' + j % 26;
+			memcpy(input + pos, tests[i], insert_len);
+
+			test_assert_idx(uni_utf8_ascii_prefix_len(input, sizeof(input)) == pos, pos);
+			test_assert_idx(uni_utf8_ascii_prefix_len(input, pos) == pos, pos);
+			test_assert_idx(uni_utf8_data_is_valid(input, sizeof(input)) == (i == 0), pos);
+
+			buffer_set_used_size(output, 0);
+			test_assert_idx(uni_utf8_get_valid_data(input, sizeof(input), output) == (i == 0), pos);
+			if (i > 0) {
+				len = sizeof(input) - insert_len;
+				test_assert_idx(output->used == len + UTF8_REPLACEMENT_CHAR_LEN, pos);
+				test_assert_idx(memcmp(output->data, input, pos) == 0, pos);
+				test_assert_idx(memcmp(CONST_PTR_OFFSET(output->data, pos + UTF8_REPLACEMENT_CHAR_LEN),
+						       input + pos + insert_len, len - pos) == 0, pos);
+			}
+
+			uni_utf8_partial_strlen_n(input, sizeof(input), &len);
+			test_assert_idx(len == (i == 2 && pos + insert_len == sizeof(input) ?
+						pos : sizeof(input)), pos);
+
+			buffer_set_used_size(output, 0);
+			test_assert_idx(uni_utf8_to_decomposed_titlecase(input, pos, output) == 0, pos);
+			test_assert_idx(output->used == pos, pos);
+			for (j = 0; j < pos; j++)
+				test_assert_idx(((const unsigned char *)output->data)[j] == 'A' + j % 26, pos);
+		}
+	}
+	test_end();
+}
+
 void test_unichar(void)
 {
 	static const char overlong_utf8[] = "\xf8\x80\x95\x81\xa1";
@@ -182,4 +229,5 @@ void test_unichar(void)
 	test_unichar_uni_utf8_partial_strlen_n();
 	test_unichar_valid_unicode();
 	test_unichar_surrogates();
+	test_unichar_ascii_runs();
 }
@@ -7,6 +7,12 @@
 
 #include "unicodemap.c"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
 #define HANGUL_FIRST 0xac00
 #define HANGUL_LAST 0xd7a3
 
@@ -208,6 +214,12 @@ unsigned int uni_utf8_partial_strlen_n(const void *_input, size_t size,
 	size_t i;
 
 	for (i = 0; i < size; ) {
+		if (input[i] < 0x80) {
+			count = uni_utf8_ascii_prefix_len(input + i, size - i);
+			i += count;
+			len += count;
+			continue;
+		}
 		count = uni_utf8_char_bytes(input[i]);
 		if (i + count > size)
 			break;
@@ -218,6 +230,44 @@ unsigned int uni_utf8_partial_strlen_n(const void *_input, size_t size,
 	return len;
 }
 
+size_t uni_utf8_ascii_prefix_len(const void *_input, size_t size)
+{
+	const unsigned char *input = _input;
+	size_t i = 0;
+
+	/* check 32 bytes at a time. if there's a non-ASCII byte, the
+	   loops below find its exact position. */
+#ifdef __SSE2__
+	for (; i + 32 <= size; i += 32) {
+		__m128i a = _mm_loadu_si128((const void *)(input + i));
+		__m128i b = _mm_loadu_si128((const void *)(input + i + 16));
+
+		if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0)
+			break;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 32 <= size; i += 32) {
+		uint8x16_t a = vld1q_u8(input + i);
+		uint8x16_t b = vld1q_u8(input + i + 16);
+
+		if (vmaxvq_u8(vorrq_u8(a, b)) >= 0x80)
+			break;
+	}
+#endif
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+
+		memcpy(&word, input + i, sizeof(word));
+		if ((word & 0x8080808080808080ULL) != 0)
+			break;
+	}
+	for (; i < size; i++) {
+		if (input[i] >= 0x80)
+			break;
+	}
+	return i;
+}
+
 static bool uint16_find(const uint16_t *data, unsigned int count,
 			uint16_t value, unsigned int *idx_r)
 {
@@ -334,6 +384,20 @@ int uni_utf8_to_decomposed_titlecase(const void *_input, size_t size,
 	int ret = 0;
 
 	while (size > 0) {
+		if (*input < 0x80) {
+			/* ASCII characters titlecase to ASCII, and they never
+			   decompose. Convert the whole ASCII run at once. */
+			size_t i, len = uni_utf8_ascii_prefix_len(input, size);
+			unsigned char *dest =
+				buffer_append_space_unsafe(output, len);
+
+			for (i = 0; i < len; i++)
+				dest[i] = titlecase8_map[input[i]];
+			input += len;
+			size -= len;
+			continue;
+		}
+
 		int bytes = uni_utf8_get_char_n(input, size, &chr);
 		if (bytes <= 0) {
 			/* invalid input. try the next byte. */
@@ -371,7 +435,7 @@ static int uni_utf8_find_invalid_pos(const unsigned char *input, size_t size,
 	/* find the first invalid utf8 sequence */
 	for (i = 0; i < size;) {
 		if (input[i] < 0x80)
-			i++;
+			i += uni_utf8_ascii_prefix_len(input + i, size - i);
 		else {
 			len = is_valid_utf8_seq(input + i, size-i);
 			if (unlikely(len == 0)) {
@@ -398,7 +462,9 @@ bool uni_utf8_get_valid_data(const unsigned char *input, size_t size,
 	output_add_replacement_char(buf);
 	while (i < size) {
 		if (input[i] < 0x80) {
-			buffer_append_c(buf, input[i++]);
+			len = uni_utf8_ascii_prefix_len(input + i, size - i);
+			buffer_append(buf, input + i, len);
+			i += len;
 			continue;
 		}
 
@@ -86,6 +86,9 @@ unsigned int uni_utf8_strlen_n(const void *input, size_t size) ATTR_PURE;
    of the input. */
 unsigned int uni_utf8_partial_strlen_n(const void *input, size_t size,
 				       size_t *partial_pos_r);
+/* Returns the number of bytes at the beginning of input that are 7bit ASCII.
+   This is used as a fast path for skipping over ASCII text. */
+size_t uni_utf8_ascii_prefix_len(const void *input, size_t size) ATTR_PURE;
 
 /* Returns the number of bytes belonging to this UTF-8 character. The given
    parameter is the first byte of the UTF-8 sequence. Invalid input is
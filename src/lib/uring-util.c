@@ -0,0 +1,177 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "uring-util.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_MAX_ENTRIES 4096
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		   unsigned int flags, const void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, arg_size);
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	unsigned int pow2_entries = 1;
+
+	while (pow2_entries < entries && pow2_entries < URING_MAX_ENTRIES)
+		pow2_entries <<= 1;
+
+	i_zero(ring);
+	i_zero(&params);
+	ring->fd = sys_io_uring_setup(pow2_entries, &params);
+	if (ring->fd < 0) {
+		/* ENOSYS, or io_uring disabled by sysctl/seccomp */
+		return -1;
+	}
+	if ((params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0 ||
+	    (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+		/* kernel is too old (< 5.11) */
+		i_close_fd(&ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	fd_close_on_exec(ring->fd, TRUE);
+
+	/* with IORING_FEAT_SINGLE_MMAP both rings are in the same mmap */
+	ring->ring_size = I_MAX(params.sq_off.array +
+				params.sq_entries * sizeof(unsigned int),
+				params.cq_off.cqes +
+				params.cq_entries * sizeof(struct io_uring_cqe));
+	ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQ_RING);
+	if (ring->ring == MAP_FAILED)
+		i_fatal("mmap(io_uring ring) failed: %m");
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		i_fatal("mmap(io_uring sqes) failed: %m");
+
+	unsigned char *ptr = ring->ring;
+	ring->sq_khead = (void *)(ptr + params.sq_off.head);
+	ring->sq_ktail = (void *)(ptr + params.sq_off.tail);
+	ring->sq_kmask = (void *)(ptr + params.sq_off.ring_mask);
+	ring->cq_khead = (void *)(ptr + params.cq_off.head);
+	ring->cq_ktail = (void *)(ptr + params.cq_off.tail);
+	ring->cq_kmask = (void *)(ptr + params.cq_off.ring_mask);
+	ring->cqes = (void *)(ptr + params.cq_off.cqes);
+	ring->sq_entries = params.sq_entries;
+
+	/* SQE slots are always used in ring order, so the indirection
+	   array can be set up once. */
+	unsigned int *sq_array = (void *)(ptr + params.sq_off.array);
+	for (unsigned int i = 0; i < params.sq_entries; i++)
+		sq_array[i] = i;
+	return 0;
+}
+
+void uring_deinit(struct uring *ring)
+{
+	if (munmap(ring->sqes, ring->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (munmap(ring->ring, ring->ring_size) < 0)
+		i_error("munmap(io_uring ring) failed: %m");
+	if (close(ring->fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail;
+
+	tail = *ring->sq_ktail;
+	head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries) {
+		/* SQ ring is full - submit what we have so far */
+		if (uring_enter(ring, 0, 0) < 0)
+			i_fatal("io_uring_enter() failed: %m");
+		head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sq_entries)
+			i_panic("io_uring submission queue stuck full");
+	}
+	sqe = &ring->sqes[tail & *ring->sq_kmask];
+	i_zero(sqe);
+	return sqe;
+}
+
+void uring_commit_sqe(struct uring *ring)
+{
+	__atomic_store_n(ring->sq_ktail, *ring->sq_ktail + 1, __ATOMIC_RELEASE);
+	ring->sq_unsubmitted++;
+}
+
+int uring_enter(struct uring *ring, unsigned int wait_nr, int msecs)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	int ret;
+
+	if (wait_nr == 0 && ring->sq_unsubmitted == 0)
+		return 0;
+
+	i_zero(&arg);
+	if (wait_nr > 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (msecs >= 0) {
+			ts.tv_sec = msecs / 1000;
+			ts.tv_nsec = (msecs % 1000) * 1000000LL;
+			arg.ts = (uintptr_t)&ts;
+		}
+	}
+	ret = sys_io_uring_enter(ring->fd, ring->sq_unsubmitted, wait_nr, flags,
+				 wait_nr > 0 ? &arg : NULL,
+				 wait_nr > 0 ? sizeof(arg) : 0);
+	if (ret < 0) {
+		if (errno == ETIME || errno == EINTR)
+			return 0;
+		if (errno == EBUSY || errno == EAGAIN) {
+			/* CQ backlog needs to be reaped first, or the kernel
+			   is short on memory. The caller can try again. */
+			return 0;
+		}
+		return -1;
+	}
+	i_assert((unsigned int)ret <= ring->sq_unsubmitted);
+	ring->sq_unsubmitted -= ret;
+	return 0;
+}
+
+const struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_khead;
+
+	if (head == __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_kmask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_khead, *ring->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef URING_UTIL_H
+#define URING_UTIL_H
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper using the raw syscalls. Requires Linux v5.11+
+   (IORING_FEAT_EXT_ARG). */
+struct uring {
+	int fd;
+
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_khead, *sq_ktail, *sq_kmask;
+	unsigned int *cq_khead, *cq_ktail, *cq_kmask;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	/* SQEs filled but not yet submitted to kernel */
+	unsigned int sq_unsubmitted;
+};
+
+/* Create a new ring with space for at least the given number of SQEs.
+   Returns 0 on success, -1 if io_uring can't be used (kernel is too old,
+   or io_uring is disabled). The ring fd is close-on-exec. */
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_deinit(struct uring *ring);
+
+/* Returns the next free SQE, zeroed. If the submission queue is full, the
+   queued SQEs are submitted first. */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+/* Queue the SQE returned by uring_get_sqe(). */
+void uring_commit_sqe(struct uring *ring);
+
+/* Submit all the queued SQEs. If wait_nr > 0, wait until at least that
+   many completions are available or until msecs have passed (-1 = forever).
+   Returns 0 on success (including timeouts and signals), -1 on error. */
+int uring_enter(struct uring *ring, unsigned int wait_nr, int msecs);
+
+/* Returns the next completion or NULL if there are none. It stays valid
+   until uring_cqe_seen() is called. */
+const struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif
+
+#endif
@@ -0,0 +1,524 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "settings-parser.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "mail-search.h"
+#include "mailbox-list-iter.h"
+#include "fts-segment-index.h"
+#include "fts-segment-plugin.h"
+
+#define FTS_SEGMENT_FILE_PREFIX "dovecot.index.fts-segment"
+#define FTS_SEGMENT_DEFAULT_MAX_SEGMENTS 8
+/* Flush the in-memory segment to disk after it grows this large */
+#define FTS_SEGMENT_DEFAULT_BUILD_MEMORY (32*1024*1024)
+
+struct segment_fts_backend {
+	struct fts_backend backend;
+
+	struct mailbox *box;
+	struct fts_segment_index *index;
+
+	unsigned int max_segments;
+	size_t build_memory;
+	bool refresh;
+};
+
+struct segment_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+	struct fts_segment_writer *writer;
+	ARRAY_TYPE(seq_range) expunged_uids;
+
+	enum fts_segment_field field;
+	/* UID of the message currently being indexed */
+	uint32_t uid;
+	/* All messages up to this UID have been fully added to the writer */
+	uint32_t last_uid;
+
+	bool failed;
+};
+
+static struct fts_backend *fts_backend_segment_alloc(void)
+{
+	struct segment_fts_backend *backend;
+
+	backend = i_new(struct segment_fts_backend, 1);
+	backend->backend = fts_backend_segment;
+	return &backend->backend;
+}
+
+static int
+fts_backend_segment_init(struct fts_backend *_backend, const char **error_r)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)_backend;
+	const char *const *tmp, *env, *error;
+	unsigned int num;
+	uoff_t size;
+
+	backend->max_segments = FTS_SEGMENT_DEFAULT_MAX_SEGMENTS;
+	backend->build_memory = FTS_SEGMENT_DEFAULT_BUILD_MEMORY;
+
+	env = mail_user_plugin_getenv(_backend->ns->user, "fts_segment");
+	if (env == NULL)
+		return 0;
+
+	for (tmp = t_strsplit_spaces(env, " "); *tmp != NULL; tmp++) {
+		if (str_begins(*tmp, "max_segments=")) {
+			if (str_to_uint(*tmp + 13, &num) < 0 || num < 2) {
+				*error_r = t_strdup_printf(
+					"Invalid max_segments: %s", *tmp + 13);
+				return -1;
+			}
+			backend->max_segments = num;
+		} else if (str_begins(*tmp, "build_memory=")) {
+			if (settings_get_size(*tmp + 13, &size, &error) < 0 ||
+			    size == 0 || size > SSIZE_T_MAX) {
+				*error_r = t_strdup_printf(
+					"Invalid build_memory: %s", *tmp + 13);
+				return -1;
+			}
+			backend->build_memory = size;
+		} else {
+			*error_r = t_strdup_printf("Invalid setting: %s", *tmp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+fts_backend_segment_unset_box(struct segment_fts_backend *backend)
+{
+	if (backend->index != NULL)
+		fts_segment_index_deinit(&backend->index);
+	backend->box = NULL;
+}
+
+static void fts_backend_segment_deinit(struct fts_backend *_backend)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)_backend;
+
+	fts_backend_segment_unset_box(backend);
+	i_free(backend);
+}
+
+static int
+fts_backend_segment_set_box(struct segment_fts_backend *backend,
+			    struct mailbox *box)
+{
+	struct fts_segment_index_settings set;
+	const struct mailbox_permissions *perm;
+	struct mail_storage *storage;
+	const char *path, *error;
+
+	if (backend->box == box) {
+		if (backend->refresh && box != NULL) {
+			if (fts_segment_index_refresh(backend->index, &error) < 0) {
+				mailbox_set_critical(box, "fts-segment: %s",
+						     error);
+				return -1;
+			}
+			backend->refresh = FALSE;
+		}
+		return 0;
+	}
+	fts_backend_segment_unset_box(backend);
+	backend->refresh = FALSE;
+	if (box == NULL)
+		return 0;
+
+	perm = mailbox_get_permissions(box);
+	storage = mailbox_get_storage(box);
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0)
+		i_unreached(); /* fts already checked this */
+
+	i_zero(&set);
+	set.file.file_create_mode = perm->file_create_mode;
+	set.file.file_create_gid = perm->file_create_gid;
+	set.file.file_create_gid_origin = perm->file_create_gid_origin;
+	set.file.fsync = storage->set->parsed_fsync_mode != FSYNC_MODE_NEVER;
+	set.max_segments = backend->max_segments;
+	set.use_excl_lock = storage->set->dotlock_use_excl;
+	set.nfs_flush = storage->set->mail_nfs_index;
+
+	backend->index = fts_segment_index_init(
+		t_strconcat(path, "/"FTS_SEGMENT_FILE_PREFIX, NULL), &set);
+	backend->box = box;
+	if (fts_segment_index_refresh(backend->index, &error) < 0) {
+		mailbox_set_critical(box, "fts-segment: %s", error);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_backend_segment_get_last_uid(struct fts_backend *_backend,
+				 struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)_backend;
+
+	if (fts_backend_segment_set_box(backend, box) < 0)
+		return -1;
+	*last_uid_r = fts_segment_index_get_last_uid(backend->index);
+	return 0;
+}
+
+static struct fts_backend_update_context *
+fts_backend_segment_update_init(struct fts_backend *_backend)
+{
+	struct segment_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct segment_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	ctx->writer = fts_segment_writer_init();
+	i_array_init(&ctx->expunged_uids, 32);
+	return &ctx->ctx;
+}
+
+static int
+fts_backend_segment_commit(struct segment_fts_backend_update_context *ctx,
+			   uint32_t last_uid)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)ctx->ctx.backend;
+	const char *error;
+	int ret = 0;
+
+	if (backend->index == NULL)
+		return 0;
+
+	if (fts_segment_index_commit(backend->index, ctx->writer, last_uid,
+				     &ctx->expunged_uids, &error) < 0) {
+		mailbox_set_critical(backend->box, "fts-segment: %s", error);
+		ret = -1;
+	}
+	array_clear(&ctx->expunged_uids);
+	return ret;
+}
+
+static int
+fts_backend_segment_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct segment_fts_backend_update_context *ctx =
+		(struct segment_fts_backend_update_context *)_ctx;
+	int ret = ctx->failed ? -1 : 0;
+
+	if (!ctx->failed) {
+		if (fts_backend_segment_commit(ctx, ctx->uid) < 0)
+			ret = -1;
+	}
+	fts_segment_writer_deinit(&ctx->writer);
+	array_free(&ctx->expunged_uids);
+	i_free(ctx);
+	return ret;
+}
+
+static void
+fts_backend_segment_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				       struct mailbox *box)
+{
+	struct segment_fts_backend_update_context *ctx =
+		(struct segment_fts_backend_update_context *)_ctx;
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)ctx->ctx.backend;
+
+	if (!ctx->failed) {
+		if (fts_backend_segment_commit(ctx, ctx->uid) < 0)
+			ctx->failed = TRUE;
+	}
+	ctx->uid = 0;
+	ctx->last_uid = 0;
+	if (fts_backend_segment_set_box(backend, box) < 0)
+		ctx->failed = TRUE;
+}
+
+static void
+fts_backend_segment_update_expunge(struct fts_backend_update_context *_ctx,
+				   uint32_t uid)
+{
+	struct segment_fts_backend_update_context *ctx =
+		(struct segment_fts_backend_update_context *)_ctx;
+
+	seq_range_array_add(&ctx->expunged_uids, uid);
+}
+
+static bool
+fts_backend_segment_update_set_build_key(struct fts_backend_update_context *_ctx,
+					 const struct fts_backend_build_key *key)
+{
+	struct segment_fts_backend_update_context *ctx =
+		(struct segment_fts_backend_update_context *)_ctx;
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)ctx->ctx.backend;
+
+	if (ctx->failed)
+		return FALSE;
+
+	if (key->uid != ctx->uid) {
+		/* the previous message is now fully added. if the in-memory
+		   segment has grown too large, write it to disk. */
+		ctx->last_uid = ctx->uid;
+		if (ctx->last_uid != 0 &&
+		    fts_segment_writer_get_memory_usage(ctx->writer) >=
+		    backend->build_memory) {
+			if (fts_backend_segment_commit(ctx, ctx->last_uid) < 0) {
+				ctx->failed = TRUE;
+				return FALSE;
+			}
+		}
+	}
+
+	switch (key->type) {
+	case FTS_BACKEND_BUILD_KEY_HDR:
+	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+		ctx->field = FTS_SEGMENT_FIELD_HEADER;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART:
+		ctx->field = FTS_SEGMENT_FIELD_BODY;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY:
+		i_unreached();
+	}
+	ctx->uid = key->uid;
+	return TRUE;
+}
+
+static void
+fts_backend_segment_update_unset_build_key(struct fts_backend_update_context *_ctx ATTR_UNUSED)
+{
+}
+
+static int
+fts_backend_segment_update_build_more(struct fts_backend_update_context *_ctx,
+				      const unsigned char *data, size_t size)
+{
+	struct segment_fts_backend_update_context *ctx =
+		(struct segment_fts_backend_update_context *)_ctx;
+
+	i_assert(ctx->uid != 0);
+
+	if (size > FTS_SEGMENT_MAX_TERM_LEN)
+		return 0;
+	fts_segment_writer_add(ctx->writer, t_strndup(data, size),
+			       ctx->uid, ctx->field);
+	return 0;
+}
+
+static int fts_backend_segment_refresh(struct fts_backend *_backend)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)_backend;
+
+	backend->refresh = TRUE;
+	return 0;
+}
+
+static int
+fts_backend_segment_optimize_box(struct segment_fts_backend *backend,
+				 struct mailbox *box)
+{
+	const char *error;
+
+	if (fts_backend_segment_set_box(backend, box) < 0)
+		return -1;
+	if (fts_segment_index_optimize(backend->index, &error) < 0) {
+		mailbox_set_critical(box, "fts-segment: %s", error);
+		return -1;
+	}
+	return 0;
+}
+
+static int fts_backend_segment_optimize(struct fts_backend *_backend)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)_backend;
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	int ret = 0;
+
+	iter = mailbox_list_iter_init(_backend->ns->list, "*",
+				      MAILBOX_LIST_ITER_SKIP_ALIASES |
+				      MAILBOX_LIST_ITER_NO_AUTO_BOXES);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		if ((info->flags &
+		     (MAILBOX_NONEXISTENT | MAILBOX_NOSELECT)) != 0)
+			continue;
+
+		box = mailbox_alloc(info->ns->list, info->vname, 0);
+		if (mailbox_open(box) == 0 &&
+		    mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					NULL) > 0) {
+			if (fts_backend_segment_optimize_box(backend, box) < 0)
+				ret = -1;
+		}
+		(void)fts_backend_segment_set_box(backend, NULL);
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int segment_lookup_arg(struct segment_fts_backend *backend,
+			      const struct mail_search_arg *arg, bool and_args,
+			      enum fts_lookup_flags flags,
+			      ARRAY_TYPE(seq_range) *definite_uids,
+			      ARRAY_TYPE(seq_range) *maybe_uids)
+{
+	enum fts_segment_field fields;
+	ARRAY_TYPE(seq_range) tmp_definite_uids, tmp_maybe_uids;
+	const char *error;
+	bool prefix, maybe = FALSE;
+	uint32_t last_uid;
+	int ret = 1;
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		fields = FTS_SEGMENT_FIELD_HEADER | FTS_SEGMENT_FIELD_BODY;
+		break;
+	case SEARCH_BODY:
+		fields = FTS_SEGMENT_FIELD_BODY;
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		if (arg->value.str[0] == '\0') {
+			/* checking only for header existence */
+			return 0;
+		}
+		/* header names aren't indexed, so the match may have been
+		   in some other header */
+		fields = FTS_SEGMENT_FIELD_HEADER;
+		maybe = TRUE;
+		break;
+	default:
+		return 0;
+	}
+	/* IMAP SEARCH does substring matching. with tokenized input the
+	   closest we can do cheaply is prefix matching. */
+	prefix = arg->fuzzy || (flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) == 0;
+
+	i_array_init(&tmp_definite_uids, 128);
+	i_array_init(&tmp_maybe_uids, 128);
+
+	if (fts_segment_index_lookup(backend->index, arg->value.str, prefix,
+				     fields, maybe ? &tmp_maybe_uids :
+				     &tmp_definite_uids, &error) < 0) {
+		mailbox_set_critical(backend->box, "fts-segment: %s", error);
+		ret = -1;
+	}
+	if (arg->match_not) {
+		/* definite -> non-match
+		   maybe -> maybe
+		   non-match -> definite (or maybe if the lookup was maybe) */
+		last_uid = fts_segment_index_get_last_uid(backend->index);
+		if (maybe) {
+			array_clear(&tmp_maybe_uids);
+			if (last_uid > 0) {
+				seq_range_array_add_range(&tmp_maybe_uids,
+							  1, last_uid);
+			}
+		} else if (last_uid == 0) {
+			array_clear(&tmp_definite_uids);
+		} else {
+			seq_range_array_invert(&tmp_definite_uids, 1, last_uid);
+		}
+	}
+
+	if (and_args) {
+		/* AND:
+		   definite && definite -> definite
+		   definite && maybe -> maybe
+		   maybe && maybe -> maybe */
+
+		/* put definites among maybies, so they can be intersected */
+		seq_range_array_merge(maybe_uids, definite_uids);
+		seq_range_array_merge(&tmp_maybe_uids, &tmp_definite_uids);
+
+		seq_range_array_intersect(maybe_uids, &tmp_maybe_uids);
+		seq_range_array_intersect(definite_uids, &tmp_definite_uids);
+		/* remove duplicate maybies that are also definites */
+		seq_range_array_remove_seq_range(maybe_uids, definite_uids);
+	} else {
+		/* OR:
+		   definite || definite -> definite
+		   definite || maybe -> definite
+		   maybe || maybe -> maybe */
+
+		/* remove maybies that are now definites */
+		seq_range_array_remove_seq_range(&tmp_maybe_uids,
+						 definite_uids);
+		seq_range_array_remove_seq_range(maybe_uids,
+						 &tmp_definite_uids);
+
+		seq_range_array_merge(definite_uids, &tmp_definite_uids);
+		seq_range_array_merge(maybe_uids, &tmp_maybe_uids);
+	}
+
+	array_free(&tmp_definite_uids);
+	array_free(&tmp_maybe_uids);
+	return ret;
+}
+
+static int
+fts_backend_segment_lookup(struct fts_backend *_backend, struct mailbox *box,
+			   struct mail_search_arg *args,
+			   enum fts_lookup_flags flags,
+			   struct fts_result *result)
+{
+	struct segment_fts_backend *backend =
+		(struct segment_fts_backend *)_backend;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	bool first = TRUE;
+	int ret;
+
+	if (fts_backend_segment_set_box(backend, box) < 0)
+		return -1;
+
+	for (; args != NULL; args = args->next) {
+		ret = segment_lookup_arg(backend, args, first ? FALSE : and_args,
+					 flags, &result->definite_uids,
+					 &result->maybe_uids);
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			args->match_always = TRUE;
+			first = FALSE;
+		}
+	}
+	return 0;
+}
+
+struct fts_backend fts_backend_segment = {
+	.name = "segment",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+
+	{
+		fts_backend_segment_alloc,
+		fts_backend_segment_init,
+		fts_backend_segment_deinit,
+		fts_backend_segment_get_last_uid,
+		fts_backend_segment_update_init,
+		fts_backend_segment_update_deinit,
+		fts_backend_segment_update_set_mailbox,
+		fts_backend_segment_update_expunge,
+		fts_backend_segment_update_set_build_key,
+		fts_backend_segment_update_unset_build_key,
+		fts_backend_segment_update_build_more,
+		fts_backend_segment_refresh,
+		NULL,
+		fts_backend_segment_optimize,
+		fts_backend_default_can_lookup,
+		fts_backend_segment_lookup,
+		NULL,
+		NULL
+	}
+};
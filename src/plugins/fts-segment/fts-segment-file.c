@@ -0,0 +1,954 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "hash.h"
+#include "numpack.h"
+#include "mmap-util.h"
+#include "eacces-error.h"
+#include "ostream.h"
+#include "fts-segment-file.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct fts_segment_posting {
+	uint32_t uid;
+	uint8_t fields;
+};
+ARRAY_DEFINE_TYPE(fts_segment_posting, struct fts_segment_posting);
+
+struct fts_segment_term {
+	const char *term;
+	/* numpack-encoded postings. If unsorted=TRUE, each value contains the
+	   full UID instead of the difference to the previous UID. */
+	buffer_t *postings;
+	/* UID of the last encoded posting */
+	uint32_t encoded_uid;
+	/* the latest posting, which isn't encoded yet */
+	uint32_t last_uid;
+	uint8_t last_fields;
+	bool unsorted;
+};
+
+struct fts_segment_writer {
+	pool_t pool;
+	HASH_TABLE(const char *, struct fts_segment_term *) terms;
+	size_t memory_usage;
+};
+
+struct fts_segment {
+	char *path;
+	const unsigned char *data;
+	size_t size;
+	struct fts_segment_header hdr;
+};
+
+struct fts_segment_iter {
+	struct fts_segment *seg;
+	/* the next block that begins a new postings offset */
+	unsigned int block_idx;
+	const unsigned char *p, *end;
+
+	string_t *term;
+	const unsigned char *postings;
+	size_t postings_size;
+	uint64_t next_postings_offset;
+};
+
+struct fts_segment_output {
+	const char *path;
+	int fd;
+	struct ostream *output;
+
+	buffer_t *dict;
+	ARRAY(uint32_t) blocks;
+	string_t *prev_term;
+	unsigned int block_terms;
+
+	struct fts_segment_header hdr;
+	uint64_t postings_offset;
+};
+
+static void
+fts_segment_postings_encode(buffer_t *dest,
+			    const ARRAY_TYPE(fts_segment_posting) *postings)
+{
+	const struct fts_segment_posting *posting;
+	uint32_t prev_uid = 0;
+
+	array_foreach(postings, posting) {
+		i_assert(posting->uid > prev_uid);
+		numpack_encode(dest, ((uint64_t)(posting->uid - prev_uid) <<
+				      FTS_SEGMENT_FIELD_BITS) | posting->fields);
+		prev_uid = posting->uid;
+	}
+}
+
+static int
+fts_segment_posting_cmp(const struct fts_segment_posting *p1,
+			const struct fts_segment_posting *p2)
+{
+	if (p1->uid < p2->uid)
+		return -1;
+	if (p1->uid > p2->uid)
+		return 1;
+	return 0;
+}
+
+static void
+fts_segment_postings_sort(ARRAY_TYPE(fts_segment_posting) *postings)
+{
+	struct fts_segment_posting *p;
+	unsigned int i, j, count;
+
+	array_sort(postings, fts_segment_posting_cmp);
+
+	/* merge duplicate UIDs */
+	p = array_get_modifiable(postings, &count);
+	for (i = j = 0; i < count; i++) {
+		if (j > 0 && p[j-1].uid == p[i].uid)
+			p[j-1].fields |= p[i].fields;
+		else
+			p[j++] = p[i];
+	}
+	array_delete(postings, j, count - j);
+}
+
+static int
+fts_segment_posting_next(const unsigned char **p, const unsigned char *end,
+			 uint32_t *uid, uint8_t *fields_r)
+{
+	uint64_t num, delta;
+
+	if (numpack_decode(p, end, &num) < 0)
+		return -1;
+	delta = num >> FTS_SEGMENT_FIELD_BITS;
+	if (delta == 0 || delta > (uint32_t)-1 - *uid)
+		return -1;
+	*uid += delta;
+	*fields_r = num & FTS_SEGMENT_FIELD_MASK;
+	return 0;
+}
+
+struct fts_segment_writer *fts_segment_writer_init(void)
+{
+	struct fts_segment_writer *writer;
+
+	writer = i_new(struct fts_segment_writer, 1);
+	writer->pool = pool_alloconly_create("fts segment writer", 1024*64);
+	hash_table_create(&writer->terms, default_pool, 0, str_hash, strcmp);
+	return writer;
+}
+
+static void fts_segment_writer_clear(struct fts_segment_writer *writer)
+{
+	struct hash_iterate_context *iter;
+	const char *term;
+	struct fts_segment_term *t;
+
+	iter = hash_table_iterate_init(writer->terms);
+	while (hash_table_iterate(iter, writer->terms, &term, &t))
+		buffer_free(&t->postings);
+	hash_table_iterate_deinit(&iter);
+	hash_table_clear(writer->terms, TRUE);
+	p_clear(writer->pool);
+	writer->memory_usage = 0;
+}
+
+void fts_segment_writer_deinit(struct fts_segment_writer **_writer)
+{
+	struct fts_segment_writer *writer = *_writer;
+
+	*_writer = NULL;
+
+	fts_segment_writer_clear(writer);
+	hash_table_destroy(&writer->terms);
+	pool_unref(&writer->pool);
+	i_free(writer);
+}
+
+static void
+fts_segment_term_make_unsorted(struct fts_segment_term *t)
+{
+	const unsigned char *p = t->postings->data;
+	const unsigned char *end = p + t->postings->used;
+	buffer_t *buf;
+	uint32_t uid = 0;
+	uint8_t fields;
+
+	/* switch to storing full UIDs */
+	buf = buffer_create_dynamic(default_pool, t->postings->used + 16);
+	while (p < end) {
+		if (fts_segment_posting_next(&p, end, &uid, &fields) < 0)
+			i_unreached();
+		numpack_encode(buf, ((uint64_t)uid << FTS_SEGMENT_FIELD_BITS) |
+			       fields);
+	}
+	buffer_free(&t->postings);
+	t->postings = buf;
+	t->unsorted = TRUE;
+}
+
+static void
+fts_segment_term_flush(struct fts_segment_writer *writer,
+		       struct fts_segment_term *t)
+{
+	size_t old_used = t->postings->used;
+	uint32_t delta;
+
+	if (t->last_uid == 0)
+		return;
+
+	delta = t->unsorted ? t->last_uid : t->last_uid - t->encoded_uid;
+	numpack_encode(t->postings, ((uint64_t)delta << FTS_SEGMENT_FIELD_BITS) |
+		       t->last_fields);
+	t->encoded_uid = t->last_uid;
+	t->last_uid = 0;
+	writer->memory_usage += t->postings->used - old_used;
+}
+
+void fts_segment_writer_add(struct fts_segment_writer *writer,
+			    const char *term, uint32_t uid,
+			    enum fts_segment_field field)
+{
+	struct fts_segment_term *t;
+	size_t len = strlen(term);
+
+	i_assert(uid > 0);
+	i_assert((field & ~FTS_SEGMENT_FIELD_MASK) == 0);
+
+	if (len == 0 || len > FTS_SEGMENT_MAX_TERM_LEN)
+		return;
+
+	t = hash_table_lookup(writer->terms, term);
+	if (t == NULL) {
+		t = p_new(writer->pool, struct fts_segment_term, 1);
+		t->term = p_strndup(writer->pool, term, len);
+		t->postings = buffer_create_dynamic(default_pool, 16);
+		hash_table_insert(writer->terms, t->term, t);
+		writer->memory_usage += sizeof(*t) + len + 1 + 16 +
+			sizeof(void *) * 2;
+	}
+	if (t->last_uid == uid) {
+		t->last_fields |= field;
+		return;
+	}
+	if (t->last_uid != 0 || t->encoded_uid != 0) {
+		if (uid < I_MAX(t->last_uid, t->encoded_uid) && !t->unsorted)
+			fts_segment_term_make_unsorted(t);
+	}
+	fts_segment_term_flush(writer, t);
+	t->last_uid = uid;
+	t->last_fields = field;
+}
+
+unsigned int fts_segment_writer_get_term_count(struct fts_segment_writer *writer)
+{
+	return hash_table_count(writer->terms);
+}
+
+size_t fts_segment_writer_get_memory_usage(struct fts_segment_writer *writer)
+{
+	return writer->memory_usage;
+}
+
+static int
+fts_segment_output_init(const char *path, const struct fts_segment_settings *set,
+			struct fts_segment_output *out_r, const char **error_r)
+{
+	mode_t mode;
+	int fd;
+
+	i_zero(out_r);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, set->file_create_mode);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+	if (set->file_create_gid != (gid_t)-1 &&
+	    fchown(fd, (uid_t)-1, set->file_create_gid) < 0) {
+		if (errno == EPERM) {
+			i_error("%s", eperm_error_get_chgrp("fchown", path,
+				set->file_create_gid,
+				set->file_create_gid_origin));
+		} else {
+			i_error("fchown(%s) failed: %m", path);
+		}
+		/* continue, but use only the common subset of group and
+		   world permissions, so no one gets any extra permissions */
+		mode = ((set->file_create_mode & 0060) >> 3) &
+			(set->file_create_mode & 0006);
+		mode |= (mode << 3) | (set->file_create_mode & 0600);
+		if (fchmod(fd, mode) < 0) {
+			*error_r = t_strdup_printf("fchmod(%s) failed: %m",
+						   path);
+			i_close_fd(&fd);
+			i_unlink(path);
+			return -1;
+		}
+	}
+
+	out_r->path = path;
+	out_r->fd = fd;
+	out_r->output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(out_r->output);
+	out_r->dict = buffer_create_dynamic(default_pool, 1024);
+	i_array_init(&out_r->blocks, 128);
+	out_r->prev_term = str_new(default_pool, 128);
+
+	out_r->hdr.magic = FTS_SEGMENT_MAGIC;
+	out_r->hdr.version = FTS_SEGMENT_VERSION;
+	/* the header is written at the end */
+	o_stream_nsend(out_r->output, &out_r->hdr, sizeof(out_r->hdr));
+	return 0;
+}
+
+static void fts_segment_output_free(struct fts_segment_output *out)
+{
+	o_stream_destroy(&out->output);
+	i_close_fd(&out->fd);
+	buffer_free(&out->dict);
+	array_free(&out->blocks);
+	str_free(&out->prev_term);
+}
+
+static void
+fts_segment_output_term(struct fts_segment_output *out,
+			const char *term, size_t term_len,
+			const buffer_t *postings, uint32_t last_uid)
+{
+	const unsigned char *prev = str_data(out->prev_term);
+	size_t prefix_len = 0, max_prefix_len;
+	uint32_t block_offset;
+
+	i_assert(postings->used > 0);
+
+	if (out->hdr.term_count == 0 ||
+	    out->block_terms == FTS_SEGMENT_DICT_BLOCK_TERMS) {
+		/* begin a new block. the block offsets are relative to the
+		   beginning of the dictionary until the output is finished. */
+		block_offset = out->dict->used;
+		array_push_back(&out->blocks, &block_offset);
+		numpack_encode(out->dict, out->postings_offset);
+		out->block_terms = 0;
+	} else {
+		i_assert(strcmp(str_c(out->prev_term), term) < 0);
+		max_prefix_len = I_MIN(str_len(out->prev_term), term_len);
+		while (prefix_len < max_prefix_len &&
+		       prev[prefix_len] == (unsigned char)term[prefix_len])
+			prefix_len++;
+	}
+	numpack_encode(out->dict, prefix_len);
+	numpack_encode(out->dict, term_len - prefix_len);
+	buffer_append(out->dict, term + prefix_len, term_len - prefix_len);
+	numpack_encode(out->dict, postings->used);
+
+	o_stream_nsend(out->output, postings->data, postings->used);
+	out->postings_offset += postings->used;
+
+	str_truncate(out->prev_term, 0);
+	str_append_data(out->prev_term, term, term_len);
+	out->block_terms++;
+	out->hdr.term_count++;
+	if (out->hdr.last_uid < last_uid)
+		out->hdr.last_uid = last_uid;
+}
+
+static int
+fts_segment_output_finish(struct fts_segment_output *out,
+			  const struct fts_segment_settings *set,
+			  const char **error_r)
+{
+	uint32_t *block_offset;
+	uint64_t dict_offset, blocks_offset, file_size;
+	int ret = 0;
+
+	dict_offset = sizeof(out->hdr) + out->postings_offset;
+	blocks_offset = dict_offset + out->dict->used;
+	file_size = blocks_offset +
+		array_count(&out->blocks) * sizeof(uint32_t);
+	if (file_size > (uint32_t)-1) {
+		*error_r = t_strdup_printf(
+			"Segment %s would become too large (%"PRIu64" bytes)",
+			out->path, file_size);
+		ret = -1;
+	} else {
+		out->hdr.dict_offset = dict_offset;
+		out->hdr.blocks_offset = blocks_offset;
+		out->hdr.block_count = array_count(&out->blocks);
+		array_foreach_modifiable(&out->blocks, block_offset)
+			*block_offset += dict_offset;
+
+		o_stream_nsend(out->output, out->dict->data, out->dict->used);
+		o_stream_nsend(out->output, array_front(&out->blocks),
+			       array_count(&out->blocks) * sizeof(uint32_t));
+		if (o_stream_flush(out->output) < 0 ||
+		    o_stream_pwrite(out->output, &out->hdr,
+				    sizeof(out->hdr), 0) < 0 ||
+		    o_stream_finish(out->output) < 0) {
+			*error_r = t_strdup_printf("write(%s) failed: %s",
+				out->path, o_stream_get_error(out->output));
+			ret = -1;
+		} else if (set->fsync && fdatasync(out->fd) < 0) {
+			*error_r = t_strdup_printf("fdatasync(%s) failed: %m",
+						   out->path);
+			ret = -1;
+		}
+	}
+	if (ret < 0)
+		o_stream_abort(out->output);
+	fts_segment_output_free(out);
+	if (ret < 0)
+		i_unlink_if_exists(out->path);
+	return ret;
+}
+
+static int
+fts_segment_term_cmp(struct fts_segment_term *const *t1,
+		     struct fts_segment_term *const *t2)
+{
+	return strcmp((*t1)->term, (*t2)->term);
+}
+
+static void
+fts_segment_term_sort_postings(struct fts_segment_term *t)
+{
+	ARRAY_TYPE(fts_segment_posting) postings;
+	struct fts_segment_posting *posting;
+	const unsigned char *p = t->postings->data;
+	const unsigned char *end = p + t->postings->used;
+	uint32_t uid;
+	uint8_t fields;
+
+	i_array_init(&postings, 64);
+	while (p < end) {
+		uid = 0;
+		if (fts_segment_posting_next(&p, end, &uid, &fields) < 0)
+			i_unreached();
+		posting = array_append_space(&postings);
+		posting->uid = uid;
+		posting->fields = fields;
+	}
+	fts_segment_postings_sort(&postings);
+	buffer_set_used_size(t->postings, 0);
+	fts_segment_postings_encode(t->postings, &postings);
+	posting = array_back_modifiable(&postings);
+	t->encoded_uid = posting->uid;
+	t->unsorted = FALSE;
+	array_free(&postings);
+}
+
+int fts_segment_writer_write(struct fts_segment_writer *writer,
+			     const struct fts_segment_settings *set,
+			     const char *path, const char **error_r)
+{
+	struct fts_segment_output out;
+	ARRAY(struct fts_segment_term *) terms;
+	struct fts_segment_term *t;
+	struct hash_iterate_context *iter;
+	const char *term;
+	int ret;
+
+	if (fts_segment_output_init(path, set, &out, error_r) < 0) {
+		fts_segment_writer_clear(writer);
+		return -1;
+	}
+
+	i_array_init(&terms, hash_table_count(writer->terms) + 1);
+	iter = hash_table_iterate_init(writer->terms);
+	while (hash_table_iterate(iter, writer->terms, &term, &t))
+		array_push_back(&terms, &t);
+	hash_table_iterate_deinit(&iter);
+	array_sort(&terms, fts_segment_term_cmp);
+
+	array_foreach_elem(&terms, t) {
+		fts_segment_term_flush(writer, t);
+		if (t->unsorted)
+			fts_segment_term_sort_postings(t);
+		fts_segment_output_term(&out, t->term, strlen(t->term),
+					t->postings, t->encoded_uid);
+	}
+	array_free(&terms);
+
+	ret = fts_segment_output_finish(&out, set, error_r);
+	fts_segment_writer_clear(writer);
+	return ret;
+}
+
+static uint32_t
+fts_segment_get_block_offset(struct fts_segment *seg, unsigned int idx)
+{
+	uint32_t offset;
+
+	i_assert(idx < seg->hdr.block_count);
+	/* the offsets aren't necessarily 32bit aligned */
+	memcpy(&offset, seg->data + seg->hdr.blocks_offset +
+	       idx * sizeof(uint32_t), sizeof(offset));
+	return offset;
+}
+
+static int fts_segment_verify(struct fts_segment *seg, const char **error_r)
+{
+	const struct fts_segment_header *hdr = &seg->hdr;
+	uint32_t offset, prev_offset = 0;
+	unsigned int i;
+
+	if (seg->size < sizeof(*hdr)) {
+		*error_r = "File too small";
+		return -1;
+	}
+	memcpy(&seg->hdr, seg->data, sizeof(seg->hdr));
+	if (hdr->magic != FTS_SEGMENT_MAGIC) {
+		*error_r = "Invalid magic";
+		return -1;
+	}
+	if (hdr->version != FTS_SEGMENT_VERSION) {
+		*error_r = t_strdup_printf("Unsupported version %u",
+					   hdr->version);
+		return -1;
+	}
+	if (hdr->dict_offset < sizeof(*hdr) ||
+	    hdr->dict_offset > hdr->blocks_offset ||
+	    hdr->blocks_offset > seg->size ||
+	    (seg->size - hdr->blocks_offset) / sizeof(uint32_t) !=
+	    hdr->block_count ||
+	    (seg->size - hdr->blocks_offset) % sizeof(uint32_t) != 0) {
+		*error_r = "Invalid offsets in header";
+		return -1;
+	}
+	if (hdr->block_count > hdr->term_count ||
+	    (hdr->term_count > 0 && hdr->block_count == 0)) {
+		*error_r = "Invalid term/block count in header";
+		return -1;
+	}
+	for (i = 0; i < hdr->block_count; i++) {
+		offset = fts_segment_get_block_offset(seg, i);
+		if (offset < hdr->dict_offset || offset >= hdr->blocks_offset ||
+		    offset < prev_offset ||
+		    (i == 0 && offset != hdr->dict_offset)) {
+			*error_r = t_strdup_printf(
+				"Invalid offset for block %u", i);
+			return -1;
+		}
+		prev_offset = offset;
+	}
+	return 0;
+}
+
+int fts_segment_open(const char *path, struct fts_segment **seg_r,
+		     const char **error_r)
+{
+	struct fts_segment *seg;
+	const char *error;
+	void *data;
+	size_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+	data = mmap_ro_file(fd, &size);
+	if (data == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	seg = i_new(struct fts_segment, 1);
+	seg->path = i_strdup(path);
+	seg->data = data;
+	seg->size = size;
+	if (fts_segment_verify(seg, &error) < 0) {
+		*error_r = t_strdup_printf("Corrupted segment %s: %s",
+					   path, error);
+		fts_segment_close(&seg);
+		return -1;
+	}
+	*seg_r = seg;
+	return 1;
+}
+
+void fts_segment_close(struct fts_segment **_seg)
+{
+	struct fts_segment *seg = *_seg;
+
+	*_seg = NULL;
+	if (seg->data != NULL) {
+		if (munmap((void *)seg->data, seg->size) < 0)
+			i_error("munmap(%s) failed: %m", seg->path);
+	}
+	i_free(seg->path);
+	i_free(seg);
+}
+
+const char *fts_segment_get_path(struct fts_segment *seg)
+{
+	return seg->path;
+}
+
+uint32_t fts_segment_get_last_uid(struct fts_segment *seg)
+{
+	return seg->hdr.last_uid;
+}
+
+uint32_t fts_segment_get_term_count(struct fts_segment *seg)
+{
+	return seg->hdr.term_count;
+}
+
+size_t fts_segment_get_size(struct fts_segment *seg)
+{
+	return seg->size;
+}
+
+static void
+fts_segment_iter_init(struct fts_segment *seg, unsigned int block_idx,
+		      string_t *term, struct fts_segment_iter *iter_r)
+{
+	i_zero(iter_r);
+	iter_r->seg = seg;
+	iter_r->term = term;
+	iter_r->block_idx = block_idx;
+	iter_r->end = seg->data + seg->hdr.blocks_offset;
+	iter_r->p = block_idx < seg->hdr.block_count ?
+		seg->data + fts_segment_get_block_offset(seg, block_idx) :
+		iter_r->end;
+	str_truncate(term, 0);
+}
+
+/* Returns 1 if the next term was read, 0 if there are no more terms,
+   -1 if the segment is corrupted. */
+static int
+fts_segment_iter_next(struct fts_segment_iter *iter, const char **error_r)
+{
+	struct fts_segment *seg = iter->seg;
+	uint64_t prefix_len, suffix_len, postings_size;
+	uint64_t postings_area_size = seg->hdr.dict_offset - sizeof(seg->hdr);
+
+	if (iter->p == iter->end)
+		return 0;
+
+	if (iter->block_idx < seg->hdr.block_count &&
+	    iter->p == seg->data +
+	    fts_segment_get_block_offset(seg, iter->block_idx)) {
+		/* beginning of a block */
+		if (numpack_decode(&iter->p, iter->end,
+				   &iter->next_postings_offset) < 0) {
+			*error_r = "Truncated block header";
+			return -1;
+		}
+		iter->block_idx++;
+		str_truncate(iter->term, 0);
+	}
+
+	if (numpack_decode(&iter->p, iter->end, &prefix_len) < 0 ||
+	    numpack_decode(&iter->p, iter->end, &suffix_len) < 0) {
+		*error_r = "Truncated term";
+		return -1;
+	}
+	if (prefix_len > str_len(iter->term) ||
+	    suffix_len > (size_t)(iter->end - iter->p)) {
+		*error_r = "Invalid term length";
+		return -1;
+	}
+	str_truncate(iter->term, prefix_len);
+	str_append_data(iter->term, iter->p, suffix_len);
+	iter->p += suffix_len;
+
+	if (numpack_decode(&iter->p, iter->end, &postings_size) < 0) {
+		*error_r = "Truncated postings size";
+		return -1;
+	}
+	if (iter->next_postings_offset > postings_area_size ||
+	    postings_size > postings_area_size - iter->next_postings_offset) {
+		*error_r = "Invalid postings offset";
+		return -1;
+	}
+	iter->postings = seg->data + sizeof(seg->hdr) +
+		iter->next_postings_offset;
+	iter->postings_size = postings_size;
+	iter->next_postings_offset += postings_size;
+	return 1;
+}
+
+static int
+fts_segment_term_cmp_data(const unsigned char *data1, size_t size1,
+			  const unsigned char *data2, size_t size2)
+{
+	int ret;
+
+	ret = memcmp(data1, data2, I_MIN(size1, size2));
+	if (ret != 0)
+		return ret;
+	return size1 < size2 ? -1 : (size1 > size2 ? 1 : 0);
+}
+
+static int
+fts_segment_find_block(struct fts_segment *seg, const char *term,
+		       unsigned int *block_idx_r, const char **error_r)
+{
+	struct fts_segment_iter iter;
+	string_t *block_term = t_str_new(128);
+	unsigned int idx, left_idx = 0, right_idx = seg->hdr.block_count;
+	size_t term_len = strlen(term);
+	int ret;
+
+	/* find the last block whose first term <= term */
+	*block_idx_r = 0;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		fts_segment_iter_init(seg, idx, block_term, &iter);
+		if ((ret = fts_segment_iter_next(&iter, error_r)) <= 0) {
+			if (ret == 0)
+				*error_r = "Empty block";
+			return -1;
+		}
+		ret = fts_segment_term_cmp_data(str_data(block_term),
+						str_len(block_term),
+						(const void *)term, term_len);
+		if (ret <= 0) {
+			*block_idx_r = idx;
+			left_idx = idx + 1;
+		} else {
+			right_idx = idx;
+		}
+	}
+	return 0;
+}
+
+static int
+fts_segment_postings_lookup(const unsigned char *p, size_t size,
+			    enum fts_segment_field fields,
+			    ARRAY_TYPE(seq_range) *uids)
+{
+	const unsigned char *end = p + size;
+	uint32_t uid = 0, range_start = 0, range_end = 0;
+	uint8_t posting_fields;
+
+	while (p < end) {
+		if (fts_segment_posting_next(&p, end, &uid,
+					     &posting_fields) < 0)
+			return -1;
+		if ((posting_fields & fields) == 0)
+			continue;
+		/* collect consecutive UIDs to ranges */
+		if (range_end != 0 && range_end + 1 == uid)
+			range_end = uid;
+		else {
+			if (range_end != 0) {
+				seq_range_array_add_range(uids, range_start,
+							  range_end);
+			}
+			range_start = range_end = uid;
+		}
+	}
+	if (range_end != 0)
+		seq_range_array_add_range(uids, range_start, range_end);
+	return 0;
+}
+
+int fts_segment_lookup(struct fts_segment *seg, const char *term, bool prefix,
+		       enum fts_segment_field fields,
+		       ARRAY_TYPE(seq_range) *uids, const char **error_r)
+{
+	struct fts_segment_iter iter;
+	size_t term_len = strlen(term);
+	unsigned int block_idx;
+	const char *error;
+	int ret;
+
+	if (seg->hdr.term_count == 0)
+		return 0;
+
+	/* uids may be allocated from data stack, so no T_BEGIN here */
+	ret = fts_segment_find_block(seg, term, &block_idx, &error);
+	if (ret == 0)
+		fts_segment_iter_init(seg, block_idx, t_str_new(128), &iter);
+	while (ret == 0 && (ret = fts_segment_iter_next(&iter, &error)) > 0) {
+		bool match;
+
+		ret = fts_segment_term_cmp_data(str_data(iter.term),
+						str_len(iter.term),
+						(const void *)term, term_len);
+		if (ret < 0) {
+			ret = 0;
+			continue;
+		}
+		match = ret == 0 || (prefix && str_len(iter.term) > term_len &&
+				     memcmp(str_data(iter.term), term,
+					    term_len) == 0);
+		if (!match) {
+			/* all the following terms are larger */
+			ret = 0;
+			break;
+		}
+		ret = fts_segment_postings_lookup(iter.postings,
+						  iter.postings_size,
+						  fields, uids);
+		if (ret < 0)
+			error = "Invalid postings";
+		else if (!prefix)
+			break;
+	}
+	if (ret < 0) {
+		*error_r = t_strdup_printf("Corrupted segment %s: %s",
+					   seg->path, error);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_segment_merge_postings(struct fts_segment_iter *iter,
+			   const ARRAY_TYPE(seq_range) *expunged_uids,
+			   ARRAY_TYPE(fts_segment_posting) *postings,
+			   bool *sorted)
+{
+	struct fts_segment_posting *posting;
+	const unsigned char *p = iter->postings;
+	const unsigned char *end = p + iter->postings_size;
+	uint32_t uid = 0, prev_uid = 0;
+	uint8_t fields;
+
+	if (array_count(postings) > 0) {
+		posting = array_back_modifiable(postings);
+		prev_uid = posting->uid;
+	}
+	while (p < end) {
+		if (fts_segment_posting_next(&p, end, &uid, &fields) < 0)
+			return -1;
+		if (expunged_uids != NULL && seq_range_exists(expunged_uids, uid))
+			continue;
+		if (uid <= prev_uid)
+			*sorted = FALSE;
+		posting = array_append_space(postings);
+		posting->uid = uid;
+		posting->fields = fields;
+		prev_uid = uid;
+	}
+	return 0;
+}
+
+static int
+fts_segment_merge_real(struct fts_segment *const *segs, unsigned int count,
+		       const ARRAY_TYPE(seq_range) *expunged_uids,
+		       struct fts_segment_output *out, const char **error_r)
+{
+	struct fts_segment_iter *iters;
+	ARRAY_TYPE(fts_segment_posting) postings;
+	const struct fts_segment_posting *last;
+	buffer_t *encoded;
+	string_t *min_term;
+	unsigned int i, active_count = count;
+	const char *error;
+	bool *have_term, sorted;
+	int ret = 0;
+
+	iters = t_new(struct fts_segment_iter, count);
+	have_term = t_new(bool, count);
+	for (i = 0; i < count; i++) {
+		fts_segment_iter_init(segs[i], 0, t_str_new(128), &iters[i]);
+		if ((ret = fts_segment_iter_next(&iters[i], &error)) < 0)
+			break;
+		have_term[i] = ret > 0;
+		if (ret == 0)
+			active_count--;
+	}
+	if (ret < 0) {
+		*error_r = t_strdup_printf("Corrupted segment %s: %s",
+					   segs[i]->path, error);
+		return -1;
+	}
+
+	t_array_init(&postings, 128);
+	encoded = t_buffer_create(256);
+	min_term = t_str_new(128);
+	while (active_count > 0) {
+		/* find the smallest term */
+		str_truncate(min_term, 0);
+		for (i = 0; i < count; i++) {
+			if (!have_term[i])
+				continue;
+			if (str_len(min_term) == 0 ||
+			    fts_segment_term_cmp_data(str_data(iters[i].term),
+						      str_len(iters[i].term),
+						      str_data(min_term),
+						      str_len(min_term)) < 0) {
+				str_truncate(min_term, 0);
+				str_append_str(min_term, iters[i].term);
+			}
+		}
+
+		/* merge the postings for the term from all segments */
+		array_clear(&postings);
+		sorted = TRUE;
+		for (i = 0; i < count; i++) {
+			if (!have_term[i] || !str_equals(iters[i].term, min_term))
+				continue;
+			if (fts_segment_merge_postings(&iters[i], expunged_uids,
+						       &postings, &sorted) < 0) {
+				*error_r = t_strdup_printf(
+					"Corrupted segment %s: Invalid postings",
+					segs[i]->path);
+				return -1;
+			}
+			if ((ret = fts_segment_iter_next(&iters[i], &error)) < 0) {
+				*error_r = t_strdup_printf(
+					"Corrupted segment %s: %s",
+					segs[i]->path, error);
+				return -1;
+			}
+			if (ret == 0) {
+				have_term[i] = FALSE;
+				active_count--;
+			}
+		}
+		if (array_count(&postings) == 0) {
+			/* all expunged */
+			continue;
+		}
+		if (!sorted)
+			fts_segment_postings_sort(&postings);
+		buffer_set_used_size(encoded, 0);
+		fts_segment_postings_encode(encoded, &postings);
+		last = array_back(&postings);
+		fts_segment_output_term(out, str_c(min_term), str_len(min_term),
+					encoded, last->uid);
+	}
+	return 0;
+}
+
+int fts_segment_merge(struct fts_segment *const *segs, unsigned int count,
+		      const ARRAY_TYPE(seq_range) *expunged_uids,
+		      const struct fts_segment_settings *set,
+		      const char *path, const char **error_r)
+{
+	struct fts_segment_output out;
+	const char *error;
+	int ret;
+
+	if (fts_segment_output_init(path, set, &out, error_r) < 0)
+		return -1;
+
+	T_BEGIN {
+		ret = fts_segment_merge_real(segs, count, expunged_uids,
+					     &out, &error);
+	} T_END_PASS_STR_IF(ret < 0, &error);
+	if (ret < 0) {
+		*error_r = error;
+		o_stream_abort(out.output);
+		fts_segment_output_free(&out);
+		i_unlink_if_exists(path);
+		return -1;
+	}
+	return fts_segment_output_finish(&out, set, error_r);
+}
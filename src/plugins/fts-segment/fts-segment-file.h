@@ -0,0 +1,99 @@
+#ifndef FTS_SEGMENT_FILE_H
+#define FTS_SEGMENT_FILE_H
+
+#include "seq-range-array.h"
+
+/* A segment file is an immutable inverted index for a set of UIDs:
+
+   [header][posting lists][term dictionary][dictionary block offsets]
+
+   The term dictionary is sorted and split into blocks of
+   FTS_SEGMENT_DICT_BLOCK_TERMS terms. Each term is prefix-compressed against
+   the previous term in the same block, so the first term of each block is
+   stored in full and can be binary searched using the block offsets.
+   Posting lists are sequences of numpack-encoded
+   (uid - prev_uid) << 2 | fields values. */
+
+#define FTS_SEGMENT_MAGIC 0x47455346 /* "FSEG" */
+#define FTS_SEGMENT_VERSION 1
+#define FTS_SEGMENT_DICT_BLOCK_TERMS 16
+/* Longer terms are silently dropped */
+#define FTS_SEGMENT_MAX_TERM_LEN 255
+
+enum fts_segment_field {
+	FTS_SEGMENT_FIELD_HEADER	= 0x01,
+	FTS_SEGMENT_FIELD_BODY		= 0x02,
+};
+#define FTS_SEGMENT_FIELD_MASK 0x03
+#define FTS_SEGMENT_FIELD_BITS 2
+
+struct fts_segment_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t term_count;
+	uint32_t block_count;
+	/* Highest UID in the segment */
+	uint32_t last_uid;
+	/* Offset to the term dictionary. The posting lists are between the
+	   header and the dictionary. */
+	uint32_t dict_offset;
+	/* Offset to the uint32_t dictionary block offsets */
+	uint32_t blocks_offset;
+	uint32_t unused;
+};
+
+struct fts_segment_settings {
+	mode_t file_create_mode;
+	gid_t file_create_gid;
+	const char *file_create_gid_origin;
+	/* fdatasync() the written files */
+	bool fsync;
+};
+
+struct fts_segment_writer;
+struct fts_segment;
+
+/* Create a new in-memory segment. Terms can be added in any UID order,
+   but adding them in ascending UID order is the most efficient. */
+struct fts_segment_writer *fts_segment_writer_init(void);
+void fts_segment_writer_deinit(struct fts_segment_writer **writer);
+
+void fts_segment_writer_add(struct fts_segment_writer *writer,
+			    const char *term, uint32_t uid,
+			    enum fts_segment_field field);
+unsigned int fts_segment_writer_get_term_count(struct fts_segment_writer *writer);
+/* Returns the approximate amount of memory used by the writer. */
+size_t fts_segment_writer_get_memory_usage(struct fts_segment_writer *writer);
+/* Write the segment to the given path. The writer can be reused afterwards
+   for building a new segment. Returns 0 on success, -1 on error. */
+int fts_segment_writer_write(struct fts_segment_writer *writer,
+			     const struct fts_segment_settings *set,
+			     const char *path, const char **error_r);
+
+/* Open and mmap() the segment. Returns 1 if opened, 0 if the file doesn't
+   exist, -1 if error (e.g. corrupted). */
+int fts_segment_open(const char *path, struct fts_segment **seg_r,
+		     const char **error_r);
+void fts_segment_close(struct fts_segment **seg);
+
+const char *fts_segment_get_path(struct fts_segment *seg);
+uint32_t fts_segment_get_last_uid(struct fts_segment *seg);
+uint32_t fts_segment_get_term_count(struct fts_segment *seg);
+size_t fts_segment_get_size(struct fts_segment *seg);
+
+/* Add UIDs of messages containing the term in any of the given fields to
+   uids. If prefix=TRUE, all terms beginning with the term match.
+   Returns 0 on success, -1 if the segment is corrupted. */
+int fts_segment_lookup(struct fts_segment *seg, const char *term, bool prefix,
+		       enum fts_segment_field fields,
+		       ARRAY_TYPE(seq_range) *uids, const char **error_r);
+
+/* Merge the segments into a new segment file in path. Postings for UIDs in
+   expunged_uids (may be NULL) are dropped. Returns 0 on success,
+   -1 on error. */
+int fts_segment_merge(struct fts_segment *const *segs, unsigned int count,
+		      const ARRAY_TYPE(seq_range) *expunged_uids,
+		      const struct fts_segment_settings *set,
+		      const char *path, const char **error_r);
+
+#endif
@@ -0,0 +1,643 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "strnum.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "file-dotlock.h"
+#include "fts-segment-index.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#define FTS_SEGMENT_MANIFEST_HEADER "FTS-SEGMENTS 1"
+#define FTS_SEGMENT_LOCK_TIMEOUT_SECS 120
+#define FTS_SEGMENT_LOCK_STALE_TIMEOUT_SECS 600
+/* How many times to retry reading the manifest if a segment listed in it
+   was just deleted by a merge. */
+#define FTS_SEGMENT_REFRESH_MAX_RETRIES 3
+
+struct fts_segment_index_segment {
+	uint32_t id;
+	struct fts_segment *seg;
+};
+ARRAY_DEFINE_TYPE(fts_segment_index_segment, struct fts_segment_index_segment);
+
+struct fts_segment_index {
+	char *prefix;
+	struct fts_segment_index_settings set;
+	char *gid_origin;
+	struct dotlock_settings dotlock_set;
+
+	/* contents of the manifest when it was last read */
+	buffer_t *manifest;
+
+	uint32_t last_uid, next_id;
+	ARRAY_TYPE(fts_segment_index_segment) segments;
+	ARRAY_TYPE(seq_range) expunged_uids;
+};
+
+struct fts_segment_index *
+fts_segment_index_init(const char *prefix,
+		       const struct fts_segment_index_settings *set)
+{
+	struct fts_segment_index *index;
+
+	index = i_new(struct fts_segment_index, 1);
+	index->prefix = i_strdup(prefix);
+	index->set = *set;
+	index->gid_origin = i_strdup(set->file.file_create_gid_origin);
+	index->set.file.file_create_gid_origin = index->gid_origin;
+	if (index->set.max_segments < 2)
+		index->set.max_segments = 2;
+
+	index->dotlock_set.timeout = FTS_SEGMENT_LOCK_TIMEOUT_SECS;
+	index->dotlock_set.stale_timeout = FTS_SEGMENT_LOCK_STALE_TIMEOUT_SECS;
+	index->dotlock_set.use_excl_lock = set->use_excl_lock;
+	index->dotlock_set.nfs_flush = set->nfs_flush;
+
+	index->manifest = buffer_create_dynamic(default_pool, 256);
+	index->next_id = 1;
+	i_array_init(&index->segments, 8);
+	i_array_init(&index->expunged_uids, 8);
+	return index;
+}
+
+static void fts_segment_index_close_segments(struct fts_segment_index *index)
+{
+	struct fts_segment_index_segment *segment;
+
+	array_foreach_modifiable(&index->segments, segment)
+		fts_segment_close(&segment->seg);
+	array_clear(&index->segments);
+}
+
+void fts_segment_index_deinit(struct fts_segment_index **_index)
+{
+	struct fts_segment_index *index = *_index;
+
+	*_index = NULL;
+
+	fts_segment_index_close_segments(index);
+	array_free(&index->segments);
+	array_free(&index->expunged_uids);
+	buffer_free(&index->manifest);
+	i_free(index->gid_origin);
+	i_free(index->prefix);
+	i_free(index);
+}
+
+static const char *
+fts_segment_index_get_path(struct fts_segment_index *index, uint32_t id)
+{
+	return t_strdup_printf("%s.%u", index->prefix, id);
+}
+
+static void fts_segment_index_forget(struct fts_segment_index *index)
+{
+	/* make sure the manifest is fully re-read on the next refresh */
+	buffer_set_used_size(index->manifest, 0);
+	fts_segment_index_close_segments(index);
+	array_clear(&index->expunged_uids);
+	index->last_uid = 0;
+	index->next_id = 1;
+}
+
+static int
+fts_segment_index_read_manifest(struct fts_segment_index *index,
+				buffer_t *buf, const char **error_r)
+{
+	unsigned char data[1024];
+	ssize_t ret;
+	int fd;
+
+	fd = open(index->prefix, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m",
+					   index->prefix);
+		return -1;
+	}
+	while ((ret = read(fd, data, sizeof(data))) > 0)
+		buffer_append(buf, data, ret);
+	if (ret < 0)
+		*error_r = t_strdup_printf("read(%s) failed: %m", index->prefix);
+	i_close_fd(&fd);
+	return ret < 0 ? -1 : 1;
+}
+
+static int
+fts_segment_index_parse_expunged(const char *value,
+				 ARRAY_TYPE(seq_range) *expunged_uids)
+{
+	const char *const *ranges = t_strsplit(value, ",");
+	const char *p;
+	uint32_t uid1, uid2;
+
+	for (; *ranges != NULL; ranges++) {
+		if (**ranges == '\0')
+			continue;
+		if (str_parse_uint32(*ranges, &uid1, &p) < 0 || *p != '-' ||
+		    str_to_uint32(p + 1, &uid2) < 0 || uid1 == 0 || uid1 > uid2)
+			return -1;
+		seq_range_array_add_range(expunged_uids, uid1, uid2);
+	}
+	return 0;
+}
+
+static struct fts_segment *
+fts_segment_index_find_open(struct fts_segment_index *index, uint32_t id)
+{
+	const struct fts_segment_index_segment *segment;
+
+	array_foreach(&index->segments, segment) {
+		if (segment->id == id)
+			return segment->seg;
+	}
+	return NULL;
+}
+
+/* Returns 1 if the manifest was parsed, 0 if a segment listed in it doesn't
+   exist (anymore), -1 on error. */
+static int
+fts_segment_index_parse_manifest(struct fts_segment_index *index,
+				 const buffer_t *buf, const char **error_r)
+{
+	ARRAY_TYPE(fts_segment_index_segment) segments;
+	ARRAY_TYPE(seq_range) expunged_uids;
+	struct fts_segment_index_segment *segment;
+	const char *const *lines, *line, *value, *error = NULL;
+	uint32_t last_uid = 0, next_id = 1, id;
+	unsigned int i;
+	int ret = 1;
+
+	lines = t_strsplit(t_strndup(buf->data, buf->used), "\n");
+	if (lines[0] == NULL || strcmp(lines[0], FTS_SEGMENT_MANIFEST_HEADER) != 0) {
+		*error_r = t_strdup_printf("Corrupted manifest %s: "
+					   "Invalid header", index->prefix);
+		return -1;
+	}
+
+	t_array_init(&segments, 8);
+	t_array_init(&expunged_uids, 8);
+	for (i = 1; lines[i] != NULL && error == NULL; i++) {
+		line = lines[i];
+		if (line[0] == '\0')
+			continue;
+		value = strchr(line, '=');
+		if (value == NULL) {
+			error = t_strdup_printf("Invalid line: %s", line);
+			break;
+		}
+		line = t_strdup_until(line, value++);
+		if (strcmp(line, "last_uid") == 0) {
+			if (str_to_uint32(value, &last_uid) < 0)
+				error = "Invalid last_uid";
+		} else if (strcmp(line, "next_id") == 0) {
+			if (str_to_uint32(value, &next_id) < 0 || next_id == 0)
+				error = "Invalid next_id";
+		} else if (strcmp(line, "expunged") == 0) {
+			if (fts_segment_index_parse_expunged(value,
+							     &expunged_uids) < 0)
+				error = "Invalid expunged";
+		} else if (strcmp(line, "segment") == 0) {
+			if (str_to_uint32(value, &id) < 0 || id == 0)
+				error = "Invalid segment";
+			else {
+				segment = array_append_space(&segments);
+				segment->id = id;
+			}
+		} else {
+			/* ignore unknown fields for forward compatibility */
+		}
+	}
+	if (error != NULL) {
+		*error_r = t_strdup_printf("Corrupted manifest %s: %s",
+					   index->prefix, error);
+		return -1;
+	}
+
+	/* open the segments, reusing the already opened ones */
+	array_foreach_modifiable(&segments, segment) {
+		if (segment->id >= next_id) {
+			*error_r = t_strdup_printf("Corrupted manifest %s: "
+				"segment %u >= next_id %u", index->prefix,
+				segment->id, next_id);
+			ret = -1;
+			break;
+		}
+		segment->seg = fts_segment_index_find_open(index, segment->id);
+		if (segment->seg != NULL)
+			continue;
+		ret = fts_segment_open(fts_segment_index_get_path(index, segment->id),
+				       &segment->seg, error_r);
+		if (ret <= 0)
+			break;
+	}
+	if (ret <= 0) {
+		/* close the segments we just opened */
+		array_foreach_modifiable(&segments, segment) {
+			if (segment->seg != NULL &&
+			    fts_segment_index_find_open(index, segment->id) == NULL)
+				fts_segment_close(&segment->seg);
+		}
+		return ret;
+	}
+
+	/* close the segments that no longer exist */
+	array_foreach_modifiable(&index->segments, segment) {
+		if (segment->seg != NULL) {
+			bool found = FALSE;
+			const struct fts_segment_index_segment *new_segment;
+
+			array_foreach(&segments, new_segment) {
+				if (new_segment->seg == segment->seg)
+					found = TRUE;
+			}
+			if (!found)
+				fts_segment_close(&segment->seg);
+		}
+	}
+	array_clear(&index->segments);
+	array_append_array(&index->segments, &segments);
+	array_clear(&index->expunged_uids);
+	array_append_array(&index->expunged_uids, &expunged_uids);
+	index->last_uid = last_uid;
+	index->next_id = next_id;
+	return 1;
+}
+
+static int
+fts_segment_index_refresh_real(struct fts_segment_index *index,
+			       const char **error_r)
+{
+	buffer_t *buf = t_buffer_create(256);
+	unsigned int retries;
+	int ret;
+
+	for (retries = 0;; retries++) {
+		buffer_set_used_size(buf, 0);
+		if ((ret = fts_segment_index_read_manifest(index, buf, error_r)) < 0)
+			return -1;
+		if (ret == 0) {
+			/* no index yet */
+			fts_segment_index_forget(index);
+			return 0;
+		}
+		if (buffer_cmp(buf, index->manifest))
+			return 0;
+
+		ret = fts_segment_index_parse_manifest(index, buf, error_r);
+		if (ret > 0)
+			break;
+		if (ret < 0)
+			return -1;
+		if (retries == FTS_SEGMENT_REFRESH_MAX_RETRIES) {
+			*error_r = t_strdup_printf(
+				"Manifest %s keeps referring to deleted segments",
+				index->prefix);
+			return -1;
+		}
+	}
+	buffer_set_used_size(index->manifest, 0);
+	buffer_append_buf(index->manifest, buf, 0, SIZE_MAX);
+	return 0;
+}
+
+int fts_segment_index_refresh(struct fts_segment_index *index,
+			      const char **error_r)
+{
+	const char *error;
+	int ret;
+
+	T_BEGIN {
+		ret = fts_segment_index_refresh_real(index, &error);
+	} T_END_PASS_STR_IF(ret < 0, &error);
+	if (ret < 0)
+		*error_r = error;
+	return ret;
+}
+
+uint32_t fts_segment_index_get_last_uid(struct fts_segment_index *index)
+{
+	return index->last_uid;
+}
+
+unsigned int fts_segment_index_get_segment_count(struct fts_segment_index *index)
+{
+	return array_count(&index->segments);
+}
+
+int fts_segment_index_lookup(struct fts_segment_index *index,
+			     const char *term, bool prefix,
+			     enum fts_segment_field fields,
+			     ARRAY_TYPE(seq_range) *uids, const char **error_r)
+{
+	const struct fts_segment_index_segment *segment;
+	ARRAY_TYPE(seq_range) seg_uids;
+	int ret = 0;
+
+	if (array_count(&index->segments) == 0)
+		return 0;
+
+	i_array_init(&seg_uids, 64);
+	array_foreach(&index->segments, segment) {
+		if (fts_segment_lookup(segment->seg, term, prefix, fields,
+				       &seg_uids, error_r) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (ret == 0) {
+		seq_range_array_remove_seq_range(&seg_uids,
+						 &index->expunged_uids);
+		seq_range_array_merge(uids, &seg_uids);
+	}
+	array_free(&seg_uids);
+	return ret;
+}
+
+static int
+fts_segment_index_lock(struct fts_segment_index *index,
+		       struct dotlock **dotlock_r, const char **error_r)
+{
+	int fd;
+
+	fd = file_dotlock_open_group(&index->dotlock_set, index->prefix, 0,
+				     index->set.file.file_create_mode,
+				     index->set.file.file_create_gid,
+				     index->set.file.file_create_gid_origin,
+				     dotlock_r);
+	if (fd == -1) {
+		if (errno == EAGAIN) {
+			*error_r = t_strdup_printf(
+				"Timeout while waiting for lock %s.lock",
+				index->prefix);
+		} else {
+			*error_r = t_strdup_printf(
+				"file_dotlock_open(%s) failed: %m",
+				index->prefix);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+static int
+fts_segment_index_write_manifest(struct fts_segment_index *index, int fd,
+				 struct dotlock **dotlock, const char **error_r)
+{
+	const struct fts_segment_index_segment *segment;
+	const struct seq_range *range;
+	string_t *str = t_str_new(256);
+
+	str_append(str, FTS_SEGMENT_MANIFEST_HEADER"\n");
+	str_printfa(str, "last_uid=%u\n", index->last_uid);
+	str_printfa(str, "next_id=%u\n", index->next_id);
+	if (array_count(&index->expunged_uids) > 0) {
+		str_append(str, "expunged=");
+		array_foreach(&index->expunged_uids, range)
+			str_printfa(str, "%u-%u,", range->seq1, range->seq2);
+		str_truncate(str, str_len(str) - 1);
+		str_append_c(str, '\n');
+	}
+	array_foreach(&index->segments, segment)
+		str_printfa(str, "segment=%u\n", segment->id);
+
+	if (write_full(fd, str_data(str), str_len(str)) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m",
+					   file_dotlock_get_lock_path(*dotlock));
+		file_dotlock_delete(dotlock);
+		return -1;
+	}
+	if (index->set.file.fsync && fdatasync(fd) < 0) {
+		*error_r = t_strdup_printf("fdatasync(%s) failed: %m",
+					   file_dotlock_get_lock_path(*dotlock));
+		file_dotlock_delete(dotlock);
+		return -1;
+	}
+	if (file_dotlock_replace(dotlock, 0) < 0) {
+		*error_r = t_strdup_printf("file_dotlock_replace(%s) failed: %m",
+					   index->prefix);
+		file_dotlock_delete(dotlock);
+		return -1;
+	}
+	buffer_set_used_size(index->manifest, 0);
+	buffer_append(index->manifest, str_data(str), str_len(str));
+	return 0;
+}
+
+static int
+fts_segment_index_segment_size_cmp(const struct fts_segment_index_segment *s1,
+				   const struct fts_segment_index_segment *s2)
+{
+	size_t size1 = fts_segment_get_size(s1->seg);
+	size_t size2 = fts_segment_get_size(s2->seg);
+
+	if (size1 < size2)
+		return -1;
+	if (size1 > size2)
+		return 1;
+	return 0;
+}
+
+static int
+fts_segment_index_merge(struct fts_segment_index *index, bool all,
+			ARRAY_TYPE(const_string) *old_paths,
+			ARRAY_TYPE(const_string) *new_paths,
+			const char **error_r)
+{
+	struct fts_segment_index_segment *segments, new_segment;
+	struct fts_segment **segs;
+	unsigned int i, count, merge_count;
+	const char *path;
+	int ret;
+
+	segments = array_get_modifiable(&index->segments, &count);
+	if (all) {
+		if (count == 0)
+			array_clear(&index->expunged_uids);
+		if (count == 0 ||
+		    (count == 1 && array_count(&index->expunged_uids) == 0))
+			return 0;
+		merge_count = count;
+	} else {
+		if (count <= index->set.max_segments)
+			return 0;
+		/* merge the smallest segments, which are usually the newest
+		   ones. this keeps the amount of rewritten data small. */
+		merge_count = count - index->set.max_segments + 1;
+		array_sort(&index->segments, fts_segment_index_segment_size_cmp);
+		segments = array_get_modifiable(&index->segments, &count);
+	}
+
+	segs = t_new(struct fts_segment *, merge_count);
+	for (i = 0; i < merge_count; i++)
+		segs[i] = segments[i].seg;
+
+	i_zero(&new_segment);
+	new_segment.id = index->next_id++;
+	path = fts_segment_index_get_path(index, new_segment.id);
+	array_push_back(new_paths, &path);
+	if (fts_segment_merge(segs, merge_count, &index->expunged_uids,
+			      &index->set.file, path, error_r) < 0)
+		return -1;
+	if ((ret = fts_segment_open(path, &new_segment.seg, error_r)) <= 0) {
+		if (ret == 0)
+			*error_r = t_strdup_printf("Merged segment %s was lost", path);
+		return -1;
+	}
+
+	for (i = 0; i < merge_count; i++) {
+		path = t_strdup(fts_segment_get_path(segments[i].seg));
+		array_push_back(old_paths, &path);
+		fts_segment_close(&segments[i].seg);
+	}
+	array_delete(&index->segments, 0, merge_count);
+	array_push_back(&index->segments, &new_segment);
+	if (all)
+		array_clear(&index->expunged_uids);
+	return 0;
+}
+
+enum fts_segment_index_update {
+	FTS_SEGMENT_INDEX_UPDATE_COMMIT,
+	FTS_SEGMENT_INDEX_UPDATE_OPTIMIZE,
+	FTS_SEGMENT_INDEX_UPDATE_RESET,
+};
+
+static int
+fts_segment_index_update(struct fts_segment_index *index,
+			 enum fts_segment_index_update update,
+			 struct fts_segment_writer *writer, uint32_t last_uid,
+			 const ARRAY_TYPE(seq_range) *expunged_uids,
+			 const char **error_r)
+{
+	struct fts_segment_index_segment *segment, new_segment;
+	struct dotlock *dotlock;
+	ARRAY_TYPE(const_string) old_paths, new_paths;
+	const char *path;
+	int fd, ret = 0;
+
+	if ((fd = fts_segment_index_lock(index, &dotlock, error_r)) == -1)
+		return -1;
+	if (fts_segment_index_refresh_real(index, error_r) < 0) {
+		file_dotlock_delete(&dotlock);
+		return -1;
+	}
+
+	t_array_init(&old_paths, 8);
+	t_array_init(&new_paths, 2);
+	switch (update) {
+	case FTS_SEGMENT_INDEX_UPDATE_COMMIT:
+		if (writer != NULL &&
+		    fts_segment_writer_get_term_count(writer) > 0) {
+			i_zero(&new_segment);
+			new_segment.id = index->next_id++;
+			path = fts_segment_index_get_path(index, new_segment.id);
+			array_push_back(&new_paths, &path);
+			if (fts_segment_writer_write(writer, &index->set.file,
+						     path, error_r) < 0 ||
+			    fts_segment_open(path, &new_segment.seg, error_r) <= 0)
+				ret = -1;
+			else
+				array_push_back(&index->segments, &new_segment);
+		}
+		if (index->last_uid < last_uid)
+			index->last_uid = last_uid;
+		if (expunged_uids != NULL)
+			seq_range_array_merge(&index->expunged_uids, expunged_uids);
+		if (ret == 0) {
+			ret = fts_segment_index_merge(index, FALSE, &old_paths,
+						      &new_paths, error_r);
+		}
+		break;
+	case FTS_SEGMENT_INDEX_UPDATE_OPTIMIZE:
+		ret = fts_segment_index_merge(index, TRUE, &old_paths,
+					      &new_paths, error_r);
+		break;
+	case FTS_SEGMENT_INDEX_UPDATE_RESET:
+		array_foreach_modifiable(&index->segments, segment) {
+			path = t_strdup(fts_segment_get_path(segment->seg));
+			array_push_back(&old_paths, &path);
+		}
+		fts_segment_index_close_segments(index);
+		array_clear(&index->expunged_uids);
+		index->last_uid = 0;
+		break;
+	}
+
+	if (ret == 0)
+		ret = fts_segment_index_write_manifest(index, fd, &dotlock, error_r);
+	else
+		file_dotlock_delete(&dotlock);
+
+	if (ret < 0) {
+		/* the manifest wasn't changed. delete the new files and
+		   forget the in-memory changes. */
+		array_foreach_elem(&new_paths, path)
+			i_unlink_if_exists(path);
+		fts_segment_index_forget(index);
+	} else {
+		/* the old segments can be deleted now. processes that still
+		   have them mmap()ed can continue using them until they
+		   refresh. */
+		array_foreach_elem(&old_paths, path)
+			i_unlink_if_exists(path);
+	}
+	return ret;
+}
+
+int fts_segment_index_commit(struct fts_segment_index *index,
+			     struct fts_segment_writer *writer,
+			     uint32_t last_uid,
+			     const ARRAY_TYPE(seq_range) *expunged_uids,
+			     const char **error_r)
+{
+	const char *error;
+	int ret;
+
+	T_BEGIN {
+		ret = fts_segment_index_update(index,
+			FTS_SEGMENT_INDEX_UPDATE_COMMIT, writer, last_uid,
+			expunged_uids, &error);
+	} T_END_PASS_STR_IF(ret < 0, &error);
+	if (ret < 0)
+		*error_r = error;
+	return ret;
+}
+
+int fts_segment_index_optimize(struct fts_segment_index *index,
+			       const char **error_r)
+{
+	const char *error;
+	int ret;
+
+	T_BEGIN {
+		ret = fts_segment_index_update(index,
+			FTS_SEGMENT_INDEX_UPDATE_OPTIMIZE, NULL, 0, NULL,
+			&error);
+	} T_END_PASS_STR_IF(ret < 0, &error);
+	if (ret < 0)
+		*error_r = error;
+	return ret;
+}
+
+int fts_segment_index_reset(struct fts_segment_index *index,
+			    const char **error_r)
+{
+	const char *error;
+	int ret;
+
+	T_BEGIN {
+		ret = fts_segment_index_update(index,
+			FTS_SEGMENT_INDEX_UPDATE_RESET, NULL, 0, NULL, &error);
+	} T_END_PASS_STR_IF(ret < 0, &error);
+	if (ret < 0)
+		*error_r = error;
+	return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef FTS_SEGMENT_INDEX_H
+#define FTS_SEGMENT_INDEX_H
+
+#include "fts-segment-file.h"
+
+/* A segment index is a set of segment files listed in a manifest file.
+   The manifest is replaced atomically while holding its dotlock, so readers
+   don't need any locking. Segments are never modified after they've been
+   written. Once there are too many of them, the smallest ones are merged
+   together. */
+
+struct fts_segment_index_settings {
+	struct fts_segment_settings file;
+
+	/* Merge segments when there are more than this many of them. */
+	unsigned int max_segments;
+	/* dotlock settings */
+	bool use_excl_lock;
+	bool nfs_flush;
+};
+
+struct fts_segment_index;
+
+/* The manifest file is prefix, and the segment files are prefix.<id>. */
+struct fts_segment_index *
+fts_segment_index_init(const char *prefix,
+		       const struct fts_segment_index_settings *set);
+void fts_segment_index_deinit(struct fts_segment_index **index);
+
+/* Re-read the manifest if it has changed. Returns 0 on success,
+   -1 on error. */
+int fts_segment_index_refresh(struct fts_segment_index *index,
+			      const char **error_r);
+
+/* Returns the highest UID that has been indexed. */
+uint32_t fts_segment_index_get_last_uid(struct fts_segment_index *index);
+unsigned int fts_segment_index_get_segment_count(struct fts_segment_index *index);
+
+/* Add UIDs of the non-expunged messages containing the term to uids. */
+int fts_segment_index_lookup(struct fts_segment_index *index,
+			     const char *term, bool prefix,
+			     enum fts_segment_field fields,
+			     ARRAY_TYPE(seq_range) *uids, const char **error_r);
+
+/* Write the writer's contents (if any) as a new segment, mark the
+   expunged_uids (may be NULL) expunged and update last_uid if it's higher
+   than the current one. Returns 0 on success, -1 on error. */
+int fts_segment_index_commit(struct fts_segment_index *index,
+			     struct fts_segment_writer *writer,
+			     uint32_t last_uid,
+			     const ARRAY_TYPE(seq_range) *expunged_uids,
+			     const char **error_r);
+/* Merge all segments into one and drop the expunged messages. */
+int fts_segment_index_optimize(struct fts_segment_index *index,
+			       const char **error_r);
+/* Delete all segments, so everything is reindexed. */
+int fts_segment_index_reset(struct fts_segment_index *index,
+			    const char **error_r);
+
+#endif
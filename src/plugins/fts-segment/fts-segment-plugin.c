@@ -0,0 +1,18 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "fts-segment-plugin.h"
+
+const char *fts_segment_plugin_version = DOVECOT_ABI_VERSION;
+
+void fts_segment_plugin_init(struct module *module ATTR_UNUSED)
+{
+	fts_backend_register(&fts_backend_segment);
+}
+
+void fts_segment_plugin_deinit(void)
+{
+	fts_backend_unregister(fts_backend_segment.name);
+}
+
+const char *fts_segment_plugin_dependencies[] = { "fts", NULL };
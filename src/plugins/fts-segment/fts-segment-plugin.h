@@ -0,0 +1,14 @@
+#ifndef FTS_SEGMENT_PLUGIN_H
+#define FTS_SEGMENT_PLUGIN_H
+
+#include "fts-api-private.h"
+
+struct module;
+
+extern const char *fts_segment_plugin_dependencies[];
+extern struct fts_backend fts_backend_segment;
+
+void fts_segment_plugin_init(struct module *module);
+void fts_segment_plugin_deinit(void);
+
+#endif
@@ -0,0 +1,335 @@
+/* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "fts-segment-index.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fts-segment"
+
+static const struct fts_segment_settings test_file_set = {
+	.file_create_mode = 0600,
+	.file_create_gid = (gid_t)-1,
+};
+
+static void test_dir_init(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", TEST_DIR, error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_dir_deinit(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", TEST_DIR, error);
+}
+
+static const char *test_uids_to_str(const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+
+	array_foreach(uids, range) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		if (range->seq1 == range->seq2)
+			str_printfa(str, "%u", range->seq1);
+		else
+			str_printfa(str, "%u-%u", range->seq1, range->seq2);
+	}
+	return str_c(str);
+}
+
+static const char *
+test_seg_lookup(struct fts_segment *seg, const char *term, bool prefix,
+		enum fts_segment_field fields)
+{
+	ARRAY_TYPE(seq_range) uids;
+	const char *error;
+
+	t_array_init(&uids, 8);
+	test_assert(fts_segment_lookup(seg, term, prefix, fields,
+				       &uids, &error) == 0);
+	return test_uids_to_str(&uids);
+}
+
+static const char *
+test_index_lookup(struct fts_segment_index *index, const char *term,
+		  bool prefix)
+{
+	ARRAY_TYPE(seq_range) uids;
+	const char *error;
+
+	t_array_init(&uids, 8);
+	test_assert(fts_segment_index_lookup(index, term, prefix,
+					     FTS_SEGMENT_FIELD_MASK,
+					     &uids, &error) == 0);
+	return test_uids_to_str(&uids);
+}
+
+static void test_fts_segment_file(void)
+{
+	struct fts_segment_writer *writer;
+	struct fts_segment *seg;
+	const char *path = TEST_DIR"/seg", *error;
+
+	test_begin("fts segment file");
+	test_dir_init();
+
+	writer = fts_segment_writer_init();
+	fts_segment_writer_add(writer, "hello", 1, FTS_SEGMENT_FIELD_HEADER);
+	fts_segment_writer_add(writer, "hello", 1, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "hello", 2, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "hello", 3, FTS_SEGMENT_FIELD_HEADER);
+	fts_segment_writer_add(writer, "help", 3, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "world", 5, FTS_SEGMENT_FIELD_BODY);
+	test_assert(fts_segment_writer_get_term_count(writer) == 3);
+	test_assert(fts_segment_writer_write(writer, &test_file_set,
+					     path, &error) == 0);
+	/* the writer is empty after writing */
+	test_assert(fts_segment_writer_get_term_count(writer) == 0);
+	fts_segment_writer_deinit(&writer);
+
+	test_assert(fts_segment_open(TEST_DIR"/nonexistent", &seg, &error) == 0);
+	test_assert(fts_segment_open(path, &seg, &error) == 1);
+	test_assert(fts_segment_get_term_count(seg) == 3);
+	test_assert(fts_segment_get_last_uid(seg) == 5);
+
+	test_assert_strcmp(test_seg_lookup(seg, "hello", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "1-3");
+	test_assert_strcmp(test_seg_lookup(seg, "hello", FALSE,
+					   FTS_SEGMENT_FIELD_BODY), "1-2");
+	test_assert_strcmp(test_seg_lookup(seg, "hello", FALSE,
+					   FTS_SEGMENT_FIELD_HEADER), "1,3");
+	test_assert_strcmp(test_seg_lookup(seg, "hel", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "");
+	test_assert_strcmp(test_seg_lookup(seg, "hel", TRUE,
+					   FTS_SEGMENT_FIELD_MASK), "1-3");
+	test_assert_strcmp(test_seg_lookup(seg, "hel", TRUE,
+					   FTS_SEGMENT_FIELD_HEADER), "1,3");
+	test_assert_strcmp(test_seg_lookup(seg, "w", TRUE,
+					   FTS_SEGMENT_FIELD_MASK), "5");
+	test_assert_strcmp(test_seg_lookup(seg, "a", TRUE,
+					   FTS_SEGMENT_FIELD_MASK), "");
+	test_assert_strcmp(test_seg_lookup(seg, "zzz", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "");
+	fts_segment_close(&seg);
+
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_segment_file_many_terms(void)
+{
+	struct fts_segment_writer *writer;
+	struct fts_segment *seg;
+	const char *path = TEST_DIR"/seg", *error;
+	unsigned int i, uid;
+	bool success = TRUE;
+
+	test_begin("fts segment file many terms");
+	test_dir_init();
+
+	/* add the UIDs in descending order to test unsorted postings */
+	writer = fts_segment_writer_init();
+	for (uid = 100; uid > 0; uid--) {
+		for (i = 0; i < 1000; i += uid) {
+			fts_segment_writer_add(writer,
+				t_strdup_printf("term%04u", i), uid,
+				FTS_SEGMENT_FIELD_BODY);
+		}
+	}
+	test_assert(fts_segment_writer_write(writer, &test_file_set,
+					     path, &error) == 0);
+	fts_segment_writer_deinit(&writer);
+
+	test_assert(fts_segment_open(path, &seg, &error) == 1);
+	test_assert(fts_segment_get_term_count(seg) == 1000);
+	test_assert(fts_segment_get_last_uid(seg) == 100);
+	for (i = 0; i < 1000 && success; i++) {
+		ARRAY_TYPE(seq_range) uids;
+		uint32_t uid_count = 0;
+
+		t_array_init(&uids, 8);
+		if (fts_segment_lookup(seg, t_strdup_printf("term%04u", i),
+				       FALSE, FTS_SEGMENT_FIELD_BODY,
+				       &uids, &error) < 0)
+			success = FALSE;
+		/* term i is in every UID that divides it */
+		for (uid = 1; uid <= 100; uid++) {
+			if (i % uid != 0)
+				continue;
+			uid_count++;
+			if (!seq_range_exists(&uids, uid))
+				success = FALSE;
+		}
+		if (seq_range_count(&uids) != uid_count)
+			success = FALSE;
+	}
+	test_assert(success);
+	/* term0000 is in all messages */
+	test_assert_strcmp(test_seg_lookup(seg, "term000", TRUE,
+					   FTS_SEGMENT_FIELD_MASK), "1-100");
+	test_assert_strcmp(test_seg_lookup(seg, "term0998", TRUE,
+					   FTS_SEGMENT_FIELD_MASK), "1-2");
+	fts_segment_close(&seg);
+
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_segment_merge(void)
+{
+	struct fts_segment_writer *writer;
+	struct fts_segment *segs[2], *seg;
+	ARRAY_TYPE(seq_range) expunged;
+	const char *error;
+
+	test_begin("fts segment merge");
+	test_dir_init();
+
+	writer = fts_segment_writer_init();
+	fts_segment_writer_add(writer, "apple", 1, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "banana", 2, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "cherry", 3, FTS_SEGMENT_FIELD_HEADER);
+	test_assert(fts_segment_writer_write(writer, &test_file_set,
+					     TEST_DIR"/seg1", &error) == 0);
+	fts_segment_writer_add(writer, "banana", 4, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "cherry", 5, FTS_SEGMENT_FIELD_BODY);
+	fts_segment_writer_add(writer, "date", 6, FTS_SEGMENT_FIELD_BODY);
+	test_assert(fts_segment_writer_write(writer, &test_file_set,
+					     TEST_DIR"/seg2", &error) == 0);
+	fts_segment_writer_deinit(&writer);
+
+	test_assert(fts_segment_open(TEST_DIR"/seg1", &segs[0], &error) == 1);
+	test_assert(fts_segment_open(TEST_DIR"/seg2", &segs[1], &error) == 1);
+
+	t_array_init(&expunged, 4);
+	seq_range_array_add(&expunged, 2);
+	seq_range_array_add(&expunged, 6);
+	test_assert(fts_segment_merge(segs, 2, &expunged, &test_file_set,
+				      TEST_DIR"/merged", &error) == 0);
+	fts_segment_close(&segs[0]);
+	fts_segment_close(&segs[1]);
+
+	test_assert(fts_segment_open(TEST_DIR"/merged", &seg, &error) == 1);
+	/* "date" only existed in an expunged message */
+	test_assert(fts_segment_get_term_count(seg) == 3);
+	test_assert(fts_segment_get_last_uid(seg) == 5);
+	test_assert_strcmp(test_seg_lookup(seg, "apple", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "1");
+	test_assert_strcmp(test_seg_lookup(seg, "banana", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "4");
+	test_assert_strcmp(test_seg_lookup(seg, "cherry", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "3,5");
+	test_assert_strcmp(test_seg_lookup(seg, "cherry", FALSE,
+					   FTS_SEGMENT_FIELD_BODY), "5");
+	test_assert_strcmp(test_seg_lookup(seg, "date", FALSE,
+					   FTS_SEGMENT_FIELD_MASK), "");
+	fts_segment_close(&seg);
+
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_segment_index(void)
+{
+	struct fts_segment_index_settings set = {
+		.file = test_file_set,
+		.max_segments = 3,
+	};
+	struct fts_segment_index *index, *index2;
+	struct fts_segment_writer *writer;
+	ARRAY_TYPE(seq_range) expunged;
+	const char *prefix = TEST_DIR"/index", *error;
+	uint32_t uid;
+
+	test_begin("fts segment index");
+	test_dir_init();
+
+	index = fts_segment_index_init(prefix, &set);
+	test_assert(fts_segment_index_refresh(index, &error) == 0);
+	test_assert(fts_segment_index_get_last_uid(index) == 0);
+	test_assert_strcmp(test_index_lookup(index, "foo", FALSE), "");
+
+	/* each commit creates a new segment until they get merged */
+	writer = fts_segment_writer_init();
+	for (uid = 1; uid <= 5; uid++) {
+		fts_segment_writer_add(writer, "foo", uid,
+				       FTS_SEGMENT_FIELD_BODY);
+		fts_segment_writer_add(writer, t_strdup_printf("bar%u", uid),
+				       uid, FTS_SEGMENT_FIELD_HEADER);
+		test_assert(fts_segment_index_commit(index, writer, uid,
+						     NULL, &error) == 0);
+		test_assert(fts_segment_index_get_segment_count(index) ==
+			    (uid <= 3 ? uid : 3));
+	}
+	test_assert(fts_segment_index_get_last_uid(index) == 5);
+	test_assert_strcmp(test_index_lookup(index, "foo", FALSE), "1-5");
+	test_assert_strcmp(test_index_lookup(index, "bar", TRUE), "1-5");
+	test_assert_strcmp(test_index_lookup(index, "bar3", FALSE), "3");
+
+	/* expunges are visible immediately */
+	t_array_init(&expunged, 4);
+	seq_range_array_add_range(&expunged, 2, 3);
+	test_assert(fts_segment_index_commit(index, NULL, 0, &expunged,
+					     &error) == 0);
+	test_assert(fts_segment_index_get_last_uid(index) == 5);
+	test_assert_strcmp(test_index_lookup(index, "foo", FALSE), "1,4-5");
+
+	/* another process sees the same state */
+	index2 = fts_segment_index_init(prefix, &set);
+	test_assert(fts_segment_index_refresh(index2, &error) == 0);
+	test_assert(fts_segment_index_get_last_uid(index2) == 5);
+	test_assert(fts_segment_index_get_segment_count(index2) == 3);
+	test_assert_strcmp(test_index_lookup(index2, "foo", FALSE), "1,4-5");
+
+	/* optimizing merges everything and deletes the old segments */
+	test_assert(fts_segment_index_optimize(index, &error) == 0);
+	test_assert(fts_segment_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_index_lookup(index, "foo", FALSE), "1,4-5");
+	test_assert_strcmp(test_index_lookup(index, "bar2", FALSE), "");
+	/* the old process keeps working with its mmaped old segments until
+	   it refreshes */
+	test_assert_strcmp(test_index_lookup(index2, "foo", FALSE), "1,4-5");
+	test_assert(fts_segment_index_refresh(index2, &error) == 0);
+	test_assert(fts_segment_index_get_segment_count(index2) == 1);
+	test_assert_strcmp(test_index_lookup(index2, "bar", TRUE), "1,4-5");
+
+	/* reset everything */
+	test_assert(fts_segment_index_reset(index2, &error) == 0);
+	test_assert(fts_segment_index_get_last_uid(index2) == 0);
+	test_assert(fts_segment_index_refresh(index, &error) == 0);
+	test_assert(fts_segment_index_get_last_uid(index) == 0);
+	test_assert(fts_segment_index_get_segment_count(index) == 0);
+	test_assert_strcmp(test_index_lookup(index, "foo", FALSE), "");
+
+	fts_segment_writer_deinit(&writer);
+	fts_segment_index_deinit(&index);
+	fts_segment_index_deinit(&index2);
+
+	test_dir_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_segment_file,
+		test_fts_segment_file_many_terms,
+		test_fts_segment_merge,
+		test_fts_segment_index,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -4,7 +4,11 @@
 #include "file-dotlock.h"
 #include "squat-trie.h"
 
-#define SQUAT_TRIE_VERSION 2
+/* Version 3 allows blocked uidlists, which need an extra flag bit in the
+   uidlist sizes. Version 2 files are still read and they're upgraded when
+   the uidlist file is rebuilt the next time. */
+#define SQUAT_TRIE_VERSION 3
+#define SQUAT_TRIE_VERSION_V2 2
 #define SQUAT_TRIE_LOCK_TIMEOUT 60
 #define SQUAT_TRIE_DOTLOCK_STALE_TIMEOUT (15*60)
 
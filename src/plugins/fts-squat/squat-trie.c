@@ -1417,7 +1417,8 @@ squat_trie_renumber_uidlists(struct squat_trie_build_context *ctx,
 
 static bool squat_trie_check_header(struct squat_trie *trie)
 {
-	if (trie->hdr.version != SQUAT_TRIE_VERSION ||
+	if ((trie->hdr.version != SQUAT_TRIE_VERSION &&
+	     trie->hdr.version != SQUAT_TRIE_VERSION_V2) ||
 	    trie->hdr.uidvalidity != trie->uidvalidity)
 		return FALSE;
 
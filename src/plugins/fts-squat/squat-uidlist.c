@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "bits.h"
 #include "sort.h"
 #include "bsearch-insert-pos.h"
 #include "file-cache.h"
@@ -25,6 +26,22 @@
 
 #define UIDLIST_PACKED_FLAG_BITMASK 1
 #define UIDLIST_PACKED_FLAG_BEGINS_WITH_POINTER 2
+/* only in version 3 files */
+#define UIDLIST_PACKED_FLAG_BLOCKED 4
+
+/* how much the uidlist size is shifted left to make room for the flags */
+#define UIDLIST_PACKED_SIZE_SHIFT 3
+#define UIDLIST_PACKED_SIZE_SHIFT_V2 2
+
+/* Blocked uidlists contain the UID count and the first UID, followed by the
+   UID deltas in blocks of UIDLIST_BLOCK_UID_COUNT. Each block begins with a
+   byte containing the number of bits used for each (delta-1) in the block. */
+#define UIDLIST_BLOCK_UID_COUNT 128
+/* Don't even try the blocked format for short lists */
+#define UIDLIST_BLOCKED_MIN_COUNT 8
+/* Ranges are expanded into individual UIDs in the blocked format. Don't use
+   it if that would grow the number of UIDs more than this many times. */
+#define UIDLIST_BLOCKED_MAX_EXPANSION 16
 
 struct uidlist_list {
 	unsigned int uid_count:31;
@@ -107,15 +124,146 @@ static void squat_uidlist_set_corrupted(struct squat_uidlist *uidlist,
 	squat_trie_delete(uidlist->trie);
 }
 
+static unsigned int squat_uidlist_size_shift(struct squat_uidlist *uidlist)
+{
+	return uidlist->trie->hdr.version == SQUAT_TRIE_VERSION_V2 ?
+		UIDLIST_PACKED_SIZE_SHIFT_V2 : UIDLIST_PACKED_SIZE_SHIFT;
+}
+
+static uint8_t *
+uidlist_pack_bits(uint8_t *p, const uint32_t *values, unsigned int count,
+		  unsigned int bits)
+{
+	uint64_t acc = 0;
+	unsigned int i, acc_bits = 0;
+
+	for (i = 0; i < count; i++) {
+		acc |= (uint64_t)values[i] << acc_bits;
+		for (acc_bits += bits; acc_bits >= 8; acc_bits -= 8) {
+			*p++ = acc & 0xff;
+			acc >>= 8;
+		}
+	}
+	if (acc_bits > 0)
+		*p++ = acc & 0xff;
+	return p;
+}
+
+static void
+uidlist_unpack_bits(const uint8_t *p, unsigned int bits, unsigned int count,
+		    uint32_t *values)
+{
+	const uint64_t mask = ((uint64_t)1 << bits) - 1;
+	uint64_t acc = 0;
+	unsigned int i, acc_bits = 0;
+
+	for (i = 0; i < count; i++) {
+		for (; acc_bits < bits; acc_bits += 8)
+			acc |= (uint64_t)*p++ << acc_bits;
+		values[i] = acc & mask;
+		acc >>= bits;
+		acc_bits -= bits;
+	}
+}
+
+static size_t
+uidlist_write_blocked_deltas(uint8_t *dest, size_t size,
+			     const uint32_t *deltas, unsigned int count)
+{
+	uint32_t mask = 0;
+	unsigned int i, bits;
+
+	for (i = 0; i < count; i++)
+		mask |= deltas[i];
+	bits = mask == 0 ? 0 : bits_required32(mask);
+
+	if (dest != NULL) {
+		dest[size] = bits;
+		(void)uidlist_pack_bits(dest + size + 1, deltas, count, bits);
+	}
+	return size + 1 + (count * bits + 7) / 8;
+}
+
+/* Write the uid_list in blocked format to dest, or if dest is NULL just
+   return how large it would be. */
+static size_t
+uidlist_write_blocked(uint8_t *dest, const uint32_t *uid_list,
+		      unsigned int uid_count, uint32_t expanded_count)
+{
+	uint32_t deltas[UIDLIST_BLOCK_UID_COUNT];
+	uint8_t buf[SQUAT_PACK_MAX_SIZE*2], *bufp = buf;
+	uint32_t uid, uid2, prev;
+	unsigned int i, count = 0;
+	bool first = TRUE;
+	size_t size;
+
+	prev = uid_list[0] & ~UID_LIST_MASK_RANGE;
+	squat_pack_num(&bufp, expanded_count);
+	squat_pack_num(&bufp, prev);
+	size = bufp - buf;
+	if (dest != NULL)
+		memcpy(dest, buf, size);
+
+	for (i = 0; i < uid_count; i++) {
+		uid = uid_list[i];
+		if ((uid & UID_LIST_MASK_RANGE) == 0)
+			uid2 = uid;
+		else {
+			uid &= ~UID_LIST_MASK_RANGE;
+			uid2 = uid_list[++i];
+		}
+		if (first) {
+			/* the first UID was already written */
+			uid++;
+			first = FALSE;
+		}
+		for (; uid <= uid2; uid++) {
+			deltas[count++] = uid - prev - 1;
+			prev = uid;
+			if (count == UIDLIST_BLOCK_UID_COUNT) {
+				size = uidlist_write_blocked_deltas(dest, size,
+								    deltas,
+								    count);
+				count = 0;
+			}
+		}
+	}
+	if (count > 0)
+		size = uidlist_write_blocked_deltas(dest, size, deltas, count);
+	return size;
+}
+
+static uint32_t
+uidlist_get_expanded_count(const uint32_t *uid_list, unsigned int uid_count)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < uid_count; i++) {
+		if ((uid_list[i] & UID_LIST_MASK_RANGE) == 0)
+			count++;
+		else {
+			count += uid_list[i+1] -
+				(uid_list[i] & ~UID_LIST_MASK_RANGE) + 1;
+			i++;
+		}
+		if (count > (uint64_t)uid_count * UIDLIST_BLOCKED_MAX_EXPANSION)
+			return 0;
+	}
+	return count;
+}
+
 static int
 uidlist_write_array(struct ostream *output, const uint32_t *uid_list,
 		    unsigned int uid_count, uint32_t packed_flags,
-		    uint32_t offset, bool write_size, uint32_t *size_r)
+		    uint32_t offset, bool write_size, unsigned int size_shift,
+		    uint32_t *size_r)
 {
 	uint8_t *uidbuf, *bufp, sizebuf[SQUAT_PACK_MAX_SIZE], *sizebufp;
 	uint8_t listbuf[SQUAT_PACK_MAX_SIZE], *listbufp = listbuf;
-	uint32_t uid, uid2, prev, base_uid, size_value;
-	unsigned int i, bitmask_len, uid_list_len;
+	uint8_t *blockbuf;
+	uint32_t uid, uid2, prev, base_uid, size_value, expanded_count;
+	unsigned int i, bitmask_len, uid_list_len, blocked_len;
 	unsigned int idx, max_idx, mask;
 	bool datastack;
 	int num;
@@ -219,8 +367,32 @@ uidlist_write_array(struct ostream *output, const uint32_t *uid_list,
 		}
 	}
 
+	if (size_shift == UIDLIST_PACKED_SIZE_SHIFT &&
+	    (packed_flags & UIDLIST_PACKED_FLAG_BEGINS_WITH_POINTER) == 0 &&
+	    uid_count >= UIDLIST_BLOCKED_MIN_COUNT &&
+	    (expanded_count = uidlist_get_expanded_count(uid_list,
+							 uid_count)) > 0) {
+		blocked_len = uidlist_write_blocked(NULL, uid_list, uid_count,
+						    expanded_count);
+		if (blocked_len < uid_list_len) {
+			if (datastack)
+				blockbuf = t_malloc_no0(blocked_len);
+			else {
+				i_free(uidbuf);
+				blockbuf = i_malloc(blocked_len);
+			}
+			(void)uidlist_write_blocked(blockbuf, uid_list,
+						    uid_count, expanded_count);
+			uidbuf = blockbuf;
+			uid_list_len = blocked_len;
+			packed_flags = (packed_flags &
+					~UIDLIST_PACKED_FLAG_BITMASK) |
+				UIDLIST_PACKED_FLAG_BLOCKED;
+		}
+	}
+
 	size_value = ((uid_list_len +
-		       (listbufp - listbuf)) << 2) | packed_flags;
+		       (listbufp - listbuf)) << size_shift) | packed_flags;
 	if (write_size) {
 		sizebufp = sizebuf;
 		squat_pack_num(&sizebufp, size_value);
@@ -237,7 +409,7 @@ uidlist_write_array(struct ostream *output, const uint32_t *uid_list,
 
 static int
 uidlist_write(struct ostream *output, const struct uidlist_list *list,
-	      bool write_size, uint32_t *size_r)
+	      bool write_size, unsigned int size_shift, uint32_t *size_r)
 {
 	const uint32_t *uid_list = list->uid_list;
 	uint8_t buf[SQUAT_PACK_MAX_SIZE], *bufp;
@@ -255,7 +427,8 @@ uidlist_write(struct ostream *output, const struct uidlist_list *list,
 				bufp = buf;
 				squat_pack_num(&bufp, offset);
 				o_stream_nsend(output, buf, bufp - buf);
-				*size_r = (bufp - buf) << 2 | packed_flags;
+				*size_r = (bufp - buf) << size_shift |
+					packed_flags;
 				return 0;
 			}
 		} else if (unlikely(output->offset <= uid_list[0])) {
@@ -271,8 +444,8 @@ uidlist_write(struct ostream *output, const struct uidlist_list *list,
 
 	T_BEGIN {
 		ret = uidlist_write_array(output, uid_list, uid_count,
-					  packed_flags, offset,
-					  write_size, size_r);
+					  packed_flags, offset, write_size,
+					  size_shift, size_r);
 	} T_END;
 	return ret;
 }
@@ -809,8 +982,9 @@ void squat_uidlist_build_flush(struct squat_uidlist_build_context *ctx)
 		start_offset = ctx->output->offset;
 		max = I_MIN(count - i, UIDLIST_BLOCK_LIST_COUNT);
 		for (j = 0; j < max; j++) {
-			if (uidlist_write(ctx->output, &lists[i+j],
-					  FALSE, &list_sizes[j]) < 0) {
+			if (uidlist_write(ctx->output, &lists[i+j], FALSE,
+					  squat_uidlist_size_shift(ctx->uidlist),
+					  &list_sizes[j]) < 0) {
 				squat_uidlist_set_corrupted(ctx->uidlist,
 							    "Broken uidlists");
 				return;
@@ -909,10 +1083,12 @@ int squat_uidlist_rebuild_init(struct squat_uidlist_build_context *build_ctx,
 	const char *temp_path;
 	int fd;
 
-	if (build_ctx->build_hdr.link_count == 0)
+	if (build_ctx->uidlist->trie->hdr.version == SQUAT_TRIE_VERSION_V2 &&
+	    build_ctx->build_hdr.count > 0) {
+		/* rebuild to upgrade the file to the latest version */
+	} else if (build_ctx->build_hdr.link_count == 0) {
 		return 0;
-
-	if (!compress) {
+	} else if (!compress) {
 		if (build_ctx->build_hdr.link_count <
 		    build_ctx->build_hdr.count*2/3)
 			return 0;
@@ -984,8 +1160,11 @@ uint32_t squat_uidlist_rebuild_next(struct squat_uidlist_rebuild_context *ctx,
 	int ret;
 
 	T_BEGIN {
+		/* the rebuilt file is always written with the latest
+		   version */
 		ret = uidlist_write_array(ctx->output, array_front(uids),
 					  array_count(uids), 0, 0, FALSE,
+					  UIDLIST_PACKED_SIZE_SHIFT,
 					  &ctx->list_sizes[ctx->list_idx]);
 	} T_END;
 	if (ret < 0)
@@ -1078,6 +1257,10 @@ int squat_uidlist_rebuild_finish(struct squat_uidlist_rebuild_context *ctx,
 			i_error("rename(%s, %s) failed: %m",
 				temp_path, ctx->uidlist->path);
 			ret = -1;
+		} else {
+			/* the trie header is written after this with the
+			   new indexid */
+			ctx->uidlist->trie->hdr.version = SQUAT_TRIE_VERSION;
 		}
 		ctx->build_ctx->need_reopen = TRUE;
 	} else {
@@ -1107,7 +1290,8 @@ uidlist_flush(struct squat_uidlist_build_context *ctx,
 	uint32_t size, offset = ctx->output->offset;
 
 	ctx->build_hdr.link_count++;
-	if (uidlist_write(ctx->output, list, TRUE, &size) < 0)
+	if (uidlist_write(ctx->output, list, TRUE,
+			  squat_uidlist_size_shift(ctx->uidlist), &size) < 0)
 		squat_uidlist_set_corrupted(ctx->uidlist, "Broken uidlists");
 
 	list->uid_count = 2;
@@ -1291,6 +1475,76 @@ static void uidlist_array_append_range(ARRAY_TYPE(uint32_t) *uids,
 	array_push_back(uids, &uid2);
 }
 
+static int
+squat_uidlist_get_blocked(struct squat_uidlist *uidlist,
+			  const uint8_t *p, const uint8_t *end,
+			  uint32_t next_uid, ARRAY_TYPE(uint32_t) *uids)
+{
+	uint32_t deltas[UIDLIST_BLOCK_UID_COUNT];
+	uint32_t uid, count;
+	unsigned int i, n, bits;
+	size_t size;
+
+	count = squat_unpack_num(&p, end);
+	uid = squat_unpack_num(&p, end);
+	if (count == 0 || uid < next_uid ||
+	    (uid & UID_LIST_MASK_RANGE) != 0) {
+		squat_uidlist_set_corrupted(uidlist, "broken blocked uidlist");
+		return -1;
+	}
+	uidlist_array_append(uids, uid);
+
+	for (count--; count > 0; count -= n) {
+		n = I_MIN(count, UIDLIST_BLOCK_UID_COUNT);
+		if (p == end || *p > 32) {
+			squat_uidlist_set_corrupted(uidlist,
+						    "broken uidlist block");
+			return -1;
+		}
+		bits = *p++;
+		size = (n * bits + 7) / 8;
+		if (size > (size_t)(end - p)) {
+			squat_uidlist_set_corrupted(uidlist,
+				"uidlist block points outside uidlist");
+			return -1;
+		}
+
+		if (bits == 0) {
+			/* all UIDs are consecutive */
+			if (n >= UID_LIST_MASK_RANGE - 1 - uid) {
+				squat_uidlist_set_corrupted(uidlist,
+					"uidlist block UIDs overflow");
+				return -1;
+			}
+			if (n == 1)
+				uidlist_array_append(uids, uid + 1);
+			else
+				uidlist_array_append_range(uids, uid + 1,
+							   uid + n);
+			uid += n;
+			continue;
+		}
+
+		uidlist_unpack_bits(p, bits, n, deltas);
+		for (i = 0; i < n; i++) {
+			if (deltas[i] >= UID_LIST_MASK_RANGE - 1 - uid) {
+				squat_uidlist_set_corrupted(uidlist,
+					"uidlist block UIDs overflow");
+				return -1;
+			}
+			uid += deltas[i] + 1;
+			uidlist_array_append(uids, uid);
+		}
+		p += size;
+	}
+	if (p != end) {
+		squat_uidlist_set_corrupted(uidlist,
+					    "blocked uidlist has trailing data");
+		return -1;
+	}
+	return 0;
+}
+
 static int
 squat_uidlist_get_at_offset(struct squat_uidlist *uidlist, uoff_t offset,
 			    uint32_t num, ARRAY_TYPE(uint32_t) *uids)
@@ -1314,7 +1568,7 @@ squat_uidlist_get_at_offset(struct squat_uidlist *uidlist, uoff_t offset,
 		num = squat_unpack_num(&p, end);
 		uidlist_data_offset = p - (const uint8_t *)uidlist->data;
 	}
-	size = num >> 2;
+	size = num >> squat_uidlist_size_shift(uidlist);
 
 	if (uidlist_file_cache_read(uidlist, uidlist_data_offset, size) < 0)
 		return -1;
@@ -1327,7 +1581,7 @@ squat_uidlist_get_at_offset(struct squat_uidlist *uidlist, uoff_t offset,
 	p = CONST_PTR_OFFSET(uidlist->data, uidlist_data_offset);
 	end = p + size;
 
-	flags = num;
+	flags = num & ((1U << squat_uidlist_size_shift(uidlist)) - 1);
 	if ((flags & UIDLIST_PACKED_FLAG_BEGINS_WITH_POINTER) != 0) {
 		/* link to the file */
 		prev = squat_unpack_num(&p, end);
@@ -1349,6 +1603,9 @@ squat_uidlist_get_at_offset(struct squat_uidlist *uidlist, uoff_t offset,
 		next_uid = 0;
 	}
 
+	if ((flags & UIDLIST_PACKED_FLAG_BLOCKED) != 0)
+		return squat_uidlist_get_blocked(uidlist, p, end, next_uid, uids);
+
 	num = base_uid = squat_unpack_num(&p, end);
 	if ((flags & UIDLIST_PACKED_FLAG_BITMASK) == 0)
 		base_uid >>= 1;
@@ -1396,7 +1653,7 @@ squat_uidlist_get_offset(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 			 uint32_t *offset_r, uint32_t *num_r)
 {
 	const uint8_t *p, *end;
-	unsigned int idx;
+	unsigned int idx, size_shift;
 	uint32_t num, skip_bytes, uidlists_offset;
 	size_t max_map_size;
 
@@ -1434,9 +1691,10 @@ squat_uidlist_get_offset(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 
 	uidlists_offset = uidlist->cur_block_offsets[idx] -
 		squat_unpack_num(&p, end);
+	size_shift = squat_uidlist_size_shift(uidlist);
 	for (skip_bytes = 0; uid_list_idx > 0; uid_list_idx--) {
 		num = squat_unpack_num(&p, end);
-		skip_bytes += num >> 2;
+		skip_bytes += num >> size_shift;
 	}
 	*offset_r = uidlists_offset + skip_bytes;
 	*num_r = squat_unpack_num(&p, end);
@@ -1537,8 +1795,9 @@ int squat_uidlist_filter(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 	ARRAY_TYPE(seq_range) dest_uids;
 	ARRAY_TYPE(uint32_t) relative_uids;
 	const uint32_t *rel_range;
-	unsigned int i, rel_count, parent_idx, parent_count, diff, parent_uid;
-	uint32_t prev_seq, seq1, seq2;
+	unsigned int i, rel_count, parent_idx, parent_count;
+	uint32_t prev_seq, seq1, seq2, uid1;
+	uint64_t rank_base, parent_len, n;
 	int ret = 0;
 
 	parent_range = array_get(uids, &parent_count);
@@ -1550,15 +1809,12 @@ int squat_uidlist_filter(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 	if (squat_uidlist_get(uidlist, uid_list_idx, &relative_uids) < 0)
 		ret = -1;
 
-	parent_idx = 0;
+	/* the relative UIDs are indexes to the parent UIDs. rank_base is the
+	   index of parent_range[parent_idx].seq1. */
+	parent_idx = 0; rank_base = 0;
 	rel_range = array_get(&relative_uids, &rel_count);
-	prev_seq = 0; parent_uid = parent_range[0].seq1;
-	for (i = 0; i < rel_count; i++) {
-		if (unlikely(parent_uid == (uint32_t)-1)) {
-			i_error("broken UID ranges");
-			ret = -1;
-			break;
-		}
+	prev_seq = 0;
+	for (i = 0; i < rel_count && parent_idx < parent_count; i++) {
 		if ((rel_range[i] & UID_LIST_MASK_RANGE) == 0)
 			seq1 = seq2 = rel_range[i];
 		else {
@@ -1566,46 +1822,24 @@ int squat_uidlist_filter(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 			seq2 = rel_range[++i];
 		}
 		i_assert(seq1 >= prev_seq);
-		diff = seq1 - prev_seq;
-		while (diff > 0) {
-			if (unlikely(parent_uid == (uint32_t)-1)) {
-				i_error("broken UID ranges");
-				ret = -1;
-				break;
-			}
+		prev_seq = seq2 + 1;
 
-			for (; parent_idx < parent_count; parent_idx++) {
-				if (parent_range[parent_idx].seq2 <= parent_uid)
-					continue;
-				if (parent_uid < parent_range[parent_idx].seq1)
-					parent_uid = parent_range[parent_idx].seq1;
-				else
-					parent_uid++;
-				break;
+		while (parent_idx < parent_count) {
+			parent_len = (uint64_t)parent_range[parent_idx].seq2 -
+				parent_range[parent_idx].seq1 + 1;
+			if (seq1 >= rank_base + parent_len) {
+				/* skip over the whole parent range */
+				rank_base += parent_len;
+				parent_idx++;
+				continue;
 			}
-			diff--;
-		}
-		diff = seq2 - seq1 + 1;
-		while (diff > 0) {
-			if (unlikely(parent_uid == (uint32_t)-1)) {
-				i_error("broken UID ranges");
-				ret = -1;
+			uid1 = parent_range[parent_idx].seq1 + (seq1 - rank_base);
+			n = I_MIN(seq2, rank_base + parent_len - 1) - seq1;
+			seq_range_array_add_range(&dest_uids, uid1, uid1 + n);
+			if (seq1 + n == seq2)
 				break;
-			}
-			seq_range_array_add(&dest_uids, parent_uid);
-			for (; parent_idx < parent_count; parent_idx++) {
-				if (parent_range[parent_idx].seq2 <= parent_uid)
-					continue;
-				if (parent_uid < parent_range[parent_idx].seq1)
-					parent_uid = parent_range[parent_idx].seq1;
-				else
-					parent_uid++;
-				break;
-			}
-			diff--;
+			seq1 += n + 1;
 		}
-
-		prev_seq = seq2 + 1;
 	}
 
 	buffer_set_used_size(uids->arr.buffer, 0);
@@ -7,6 +7,7 @@
 #include "ostream.h"
 #include "str.h"
 #include "mail-user.h"
+#include "mail-cache.h"
 #include "index-storage.h"
 #include "index-mail.h"
 #include "compression.h"
@@ -29,6 +30,12 @@ struct zlib_mail {
 	bool verifying_save;
 };
 
+struct zlib_mailbox {
+	union mailbox_module_context module_ctx;
+	/* The cache that mail_cache_set_compression() was called for */
+	struct mail_cache *compression_cache;
+};
+
 struct zlib_mail_cache {
 	struct timeout *to;
 	struct mailbox *box;
@@ -44,6 +51,9 @@ struct zlib_user {
 
 	const struct compression_handler *save_handler;
 	int save_level;
+
+	/* Used for compressing dovecot.index.cache fields */
+	struct mail_cache_compression cache_compression;
 };
 
 const char *zlib_plugin_version = DOVECOT_ABI_VERSION;
@@ -196,13 +206,13 @@ static void zlib_mail_allocated(struct mail *_mail)
 static int zlib_mail_save_finish(struct mail_save_context *ctx)
 {
 	struct mailbox *box = ctx->transaction->box;
-	union mailbox_module_context *zbox = ZLIB_CONTEXT(box);
+	struct zlib_mailbox *zbox = ZLIB_CONTEXT(box);
 	struct mail_private *mail = (struct mail_private *)ctx->dest_mail;
 	struct zlib_mail *zmail = ZLIB_MAIL_CONTEXT(mail);
 	struct istream *input;
 	int ret;
 
-	if (zbox->super.save_finish(ctx) < 0)
+	if (zbox->module_ctx.super.save_finish(ctx) < 0)
 		return -1;
 
 	zmail->verifying_save = TRUE;
@@ -225,10 +235,10 @@ zlib_mail_save_compress_begin(struct mail_save_context *ctx,
 {
 	struct mailbox *box = ctx->transaction->box;
 	struct zlib_user *zuser = ZLIB_USER_CONTEXT(box->storage->user);
-	union mailbox_module_context *zbox = ZLIB_CONTEXT(box);
+	struct zlib_mailbox *zbox = ZLIB_CONTEXT(box);
 	struct ostream *output;
 
-	if (zbox->super.save_begin(ctx, input) < 0)
+	if (zbox->module_ctx.super.save_begin(ctx, input) < 0)
 		return -1;
 
 	output = zuser->save_handler->create_ostream(ctx->data.output,
@@ -284,40 +294,102 @@ static void zlib_mailbox_open_input(struct mailbox *box)
 	}
 }
 
+static int
+zlib_index_cache_compress(const void *data, size_t size, buffer_t *dest,
+			  void *context)
+{
+	const struct compression_handler *handler = context;
+	struct ostream *output, *zoutput;
+	int ret = 0;
+
+	output = o_stream_create_buffer(dest);
+	zoutput = handler->create_ostream(output, handler->get_default_level());
+	o_stream_nsend(zoutput, data, size);
+	if (o_stream_finish(zoutput) < 0) {
+		i_error("zlib_cache_compress: Failed to compress: %s",
+			o_stream_get_error(zoutput));
+		ret = -1;
+	}
+	o_stream_unref(&zoutput);
+	o_stream_unref(&output);
+	return ret;
+}
+
+static int
+zlib_index_cache_decompress(const void *data, size_t size, buffer_t *dest,
+			    void *context ATTR_UNUSED, const char **error_r)
+{
+	struct istream *input, *zinput;
+	const unsigned char *zdata;
+	size_t zsize;
+	int ret;
+
+	input = i_stream_create_from_data(data, size);
+	zinput = i_stream_create_decompress(input, 0);
+	i_stream_unref(&input);
+
+	while ((ret = i_stream_read_more(zinput, &zdata, &zsize)) > 0) {
+		buffer_append(dest, zdata, zsize);
+		i_stream_skip(zinput, zsize);
+	}
+	i_assert(ret == -1);
+	if (zinput->stream_errno != 0) {
+		*error_r = t_strdup(i_stream_get_error(zinput));
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+	i_stream_unref(&zinput);
+	return ret;
+}
+
 static int zlib_mailbox_open(struct mailbox *box)
 {
-	union mailbox_module_context *zbox = ZLIB_CONTEXT(box);
+	struct zlib_mailbox *zbox = ZLIB_CONTEXT(box);
+	struct zlib_user *zuser = ZLIB_USER_CONTEXT(box->storage->user);
 
 	if (box->input == NULL &&
 	    (box->storage->class_flags &
 	     MAIL_STORAGE_CLASS_FLAG_OPEN_STREAMS) != 0)
 		zlib_mailbox_open_input(box);
 
-	return zbox->super.open(box);
+	if (zbox->module_ctx.super.open(box) < 0)
+		return -1;
+	if (box->cache != NULL) {
+		/* the cache may be shared with other opened instances of
+		   the same mailbox, so it's reference counted */
+		mail_cache_set_compression(box->cache, &zuser->cache_compression);
+		zbox->compression_cache = box->cache;
+	}
+	return 0;
 }
 
 static void zlib_mailbox_close(struct mailbox *box)
 {
-	union mailbox_module_context *zbox = ZLIB_CONTEXT(box);
+	struct zlib_mailbox *zbox = ZLIB_CONTEXT(box);
 	struct zlib_user *zuser = ZLIB_USER_CONTEXT(box->storage->user);
 
 	if (zuser->cache.box == box)
 		zlib_mail_cache_close(zuser);
-	zbox->super.close(box);
+	if (zbox->compression_cache != NULL) {
+		mail_cache_unset_compression(zbox->compression_cache);
+		zbox->compression_cache = NULL;
+	}
+	zbox->module_ctx.super.close(box);
 }
 
 static void zlib_mailbox_allocated(struct mailbox *box)
 {
 	struct mailbox_vfuncs *v = box->vlast;
-	union mailbox_module_context *zbox;
+	struct zlib_mailbox *zbox;
 
-	zbox = p_new(box->pool, union mailbox_module_context, 1);
-	zbox->super = *v;
-	box->vlast = &zbox->super;
+	zbox = p_new(box->pool, struct zlib_mailbox, 1);
+	zbox->module_ctx.super = *v;
+	box->vlast = &zbox->module_ctx.super;
 	v->open = zlib_mailbox_open;
 	v->close = zlib_mailbox_close;
 
-	MODULE_CONTEXT_SET_SELF(box, zlib_storage_module, zbox);
+	MODULE_CONTEXT_SET(box, zlib_storage_module, zbox);
 
 	if (zlib_mailbox_is_permail(box))
 		zlib_permail_alloc_init(box, v);
@@ -368,6 +440,26 @@ static void zlib_mail_user_created(struct mail_user *user)
 	} else if (zuser->save_handler != NULL) {
 		zuser->save_level = zuser->save_handler->get_default_level();
 	}
+
+	/* compressed cache fields can always be read, but they're written
+	   only when zlib_cache_compress is set */
+	zuser->cache_compression.decompress = zlib_index_cache_decompress;
+	name = mail_user_plugin_getenv(user, "zlib_cache_compress");
+	if (name != NULL && *name != '\0') {
+		const struct compression_handler *handler;
+
+		ret = compression_lookup_handler(name, &handler);
+		if (ret <= 0) {
+			i_error("zlib_cache_compress: %s: %s", ret == 0 ?
+				"Support not compiled in for handler" :
+				"Unknown handler", name);
+		} else {
+			zuser->cache_compression.compress =
+				zlib_index_cache_compress;
+			zuser->cache_compression.context =
+				(void *)handler;
+		}
+	}
 	MODULE_CONTEXT_SET(user, zlib_user_module, zuser);
 }
 